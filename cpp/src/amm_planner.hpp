@@ -0,0 +1,341 @@
+//
+//  amm_planner.hpp
+//  Bolt
+//
+//  Picks the fastest approximate matrix multiply method (exact GEMM, Bolt,
+//  mithral, or an OSNAP sketch) for a given (N, D, M) and error tolerance.
+//
+//  Run times come from a per-method linear cost model whose coefficients
+//  are fit to timings measured on this host (see the "amm planner
+//  calibrate" profile test); errors come from a table of expected
+//  relative errors that callers should populate for their data.
+//
+
+#ifndef amm_planner_hpp
+#define amm_planner_hpp
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/utils/eigen_utils.hpp"
+    #include "src/utils/timing_utils.hpp"
+#else
+    #include "eigen_utils.hpp"
+    #include "timing_utils.hpp"
+#endif
+
+namespace {
+
+enum class AmmMethod { ExactGemm = 0, Bolt = 1, Mithral = 2, Osnap = 3 };
+static constexpr int kNumAmmMethods = 4;
+static constexpr int kAmmMaxNumFeatures = 4;
+static const char* amm_method_names[kNumAmmMethods] = {
+    "gemm", "bolt", "mithral", "osnap"};
+// predicted time / error for things we know nothing about; not infinity,
+// since we build with -ffast-math
+static constexpr double kAmmUnknown = std::numeric_limits<double>::max();
+
+// a method plus its one tuning knob: the number of codebooks for
+// bolt and mithral, the sketch size d for osnap, and nothing for gemm
+struct AmmVariant {
+    AmmMethod method;
+    int param;
+};
+
+static inline bool operator<(const AmmVariant& a, const AmmVariant& b) {
+    return std::make_pair(static_cast<int>(a.method), a.param) <
+        std::make_pair(static_cast<int>(b.method), b.param);
+}
+
+static inline std::string amm_variant_name(const AmmVariant& v) {
+    auto name = std::string(amm_method_names[static_cast<int>(v.method)]);
+    if (v.method == AmmMethod::ExactGemm) { return name; }
+    auto knob = v.method == AmmMethod::Osnap ? "d" : "C";
+    return name + "(" + knob + "=" + std::to_string(v.param) + ")";
+}
+
+/** work terms each method's time is assumed to be linear in, for an
+ * [N x D] by [D x M] product:
+ *  gemm:    1, NDM
+ *  bolt:    1, MD (encode the M side), ND (N luts), NMC (scan)
+ *  mithral: 1, NC (encode), MD (sparse luts), NMC (scan)
+ *  osnap:   1, ND (sketch X), NdM (small gemm)
+ */
+static inline std::array<double, kAmmMaxNumFeatures> amm_cost_features(
+    const AmmVariant& v, double N, double D, double M)
+{
+    double C = v.param;
+    switch (v.method) {
+        case AmmMethod::ExactGemm: return {{1, N * D * M, 0, 0}};
+        case AmmMethod::Bolt:      return {{1, M * D, N * D, N * M * C}};
+        case AmmMethod::Mithral:   return {{1, N * C, M * D, N * M * C}};
+        case AmmMethod::Osnap:     return {{1, N * D, N * C * M, 0}};
+    }
+    return {{0, 0, 0, 0}};
+}
+
+// whether the variant can multiply [N x D] by [D x M] matrices; only D
+// matters, since each method's param (codebooks or sketch size) can be at
+// most D, while any N or M works
+static inline bool amm_variant_supports_shape(const AmmVariant& v, int D) {
+    switch (v.method) {
+        case AmmMethod::ExactGemm: return true;
+        case AmmMethod::Bolt: return v.param <= D;
+        case AmmMethod::Mithral: return v.param <= D;
+        case AmmMethod::Osnap: return v.param <= D;
+    }
+    return false;
+}
+
+struct AmmCostModel {
+    struct Sample { AmmVariant variant; int N, D, M; double t_ms; };
+
+    void add_sample(const AmmVariant& v, int N, int D, int M, double t_ms) {
+        samples.push_back(Sample{v, N, D, M, t_ms});
+    }
+
+    // nonnegative least squares, one model per method; we drop features
+    // with negative coefficients and refit until none are left, which is
+    // plenty for at most 4 features
+    void fit() {
+        for (int m = 0; m < kNumAmmMethods; m++) {
+            std::vector<const Sample*> method_samples;
+            for (const auto& s : samples) {
+                if (static_cast<int>(s.variant.method) == m) {
+                    method_samples.push_back(&s);
+                }
+            }
+            if (method_samples.empty()) { continue; }
+            auto nsamples = static_cast<int>(method_samples.size());
+            ColMatrix<double> A(nsamples, kAmmMaxNumFeatures);
+            ColVector<double> y(nsamples);
+            for (int i = 0; i < nsamples; i++) {
+                const auto& s = *method_samples[i];
+                auto feats = amm_cost_features(s.variant, s.N, s.D, s.M);
+                // weight rows by 1/t so that we fit relative error; shapes
+                // span orders of magnitude, and otherwise the big ones
+                // would swamp the small ones. Times under 10us are mostly
+                // timer noise, so we don't trust them to more than that.
+                auto w = 1. / std::max(s.t_ms, .01);
+                for (int j = 0; j < kAmmMaxNumFeatures; j++) {
+                    A(i, j) = feats[j] * w;
+                }
+                y(i) = s.t_ms * w;
+            }
+            // rescale columns so that the solve is well-conditioned
+            ColVector<double> col_scales(kAmmMaxNumFeatures);
+            for (int j = 0; j < kAmmMaxNumFeatures; j++) {
+                auto mx = A.col(j).cwiseAbs().maxCoeff();
+                col_scales(j) = mx > 0 ? mx : 1;
+                A.col(j) /= col_scales(j);
+            }
+            std::vector<bool> active(kAmmMaxNumFeatures);
+            for (int j = 0; j < kAmmMaxNumFeatures; j++) {
+                active[j] = A.col(j).cwiseAbs().maxCoeff() > 0;
+            }
+            ColVector<double> w = ColVector<double>::Zero(kAmmMaxNumFeatures);
+            for (int iter = 0; iter < kAmmMaxNumFeatures; iter++) {
+                std::vector<int> idxs;
+                for (int j = 0; j < kAmmMaxNumFeatures; j++) {
+                    if (active[j]) { idxs.push_back(j); }
+                }
+                if (idxs.empty()) { break; }
+                ColMatrix<double> A_active(nsamples, idxs.size());
+                for (size_t j = 0; j < idxs.size(); j++) {
+                    A_active.col(j) = A.col(idxs[j]);
+                }
+                ColVector<double> w_active =
+                    A_active.colPivHouseholderQr().solve(y);
+                w.setZero();
+                bool any_negative = false;
+                for (size_t j = 0; j < idxs.size(); j++) {
+                    if (w_active(j) < 0) {
+                        active[idxs[j]] = false;
+                        any_negative = true;
+                    } else {
+                        w(idxs[j]) = w_active(j);
+                    }
+                }
+                if (!any_negative) { break; }
+            }
+            for (int j = 0; j < kAmmMaxNumFeatures; j++) {
+                coeffs[m][j] = w(j) / col_scales(j);
+            }
+            have_coeffs[m] = true;
+        }
+    }
+
+    // returns kAmmUnknown if this method was never calibrated
+    double predict_ms(const AmmVariant& v, int N, int D, int M) const {
+        auto m = static_cast<int>(v.method);
+        if (!have_coeffs[m]) { return kAmmUnknown; }
+        auto feats = amm_cost_features(v, N, D, M);
+        double t = 0;
+        for (int j = 0; j < kAmmMaxNumFeatures; j++) {
+            t += coeffs[m][j] * feats[j];
+        }
+        return t;
+    }
+
+    bool save(const std::string& path) const {
+        std::ofstream f(path);
+        if (!f) { return false; }
+        f.precision(10);
+        for (int m = 0; m < kNumAmmMethods; m++) {
+            if (!have_coeffs[m]) { continue; }
+            f << amm_method_names[m];
+            for (int j = 0; j < kAmmMaxNumFeatures; j++) {
+                f << " " << coeffs[m][j];
+            }
+            f << "\n";
+        }
+        return static_cast<bool>(f);
+    }
+
+    bool load(const std::string& path) {
+        std::ifstream f(path);
+        if (!f) { return false; }
+        std::string name;
+        while (f >> name) {
+            int m = 0;
+            while (m < kNumAmmMethods && name != amm_method_names[m]) { m++; }
+            if (m == kNumAmmMethods) { return false; }
+            for (int j = 0; j < kAmmMaxNumFeatures; j++) {
+                f >> coeffs[m][j];
+            }
+            have_coeffs[m] = static_cast<bool>(f);
+        }
+        return true;
+    }
+
+    std::vector<Sample> samples;
+    double coeffs[kNumAmmMethods][kAmmMaxNumFeatures] = {};
+    bool have_coeffs[kNumAmmMethods] = {};
+};
+
+struct AmmPlan {
+    AmmVariant variant;
+    double predicted_ms = 0;
+    double expected_rel_err = 0;
+};
+
+// callable that computes the product with the given variant; the planner
+// only times it, so it owns the operands and any learned parameters
+using AmmExecutor = std::function<void(const AmmVariant&)>;
+
+class AmmPlanner {
+public:
+    // copies the model, so the planner can outlive it
+    AmmPlanner(const AmmCostModel& model): _model(model) {
+        set_rel_error(AmmVariant{AmmMethod::ExactGemm, 0}, 0);
+    }
+
+    // variants we're allowed to choose from, along with the relative
+    // error each one is expected to have; osnap defaults to the usual
+    // JL-style sqrt(2 / d) bound if no error is given
+    void add_variant(const AmmVariant& v, double rel_err=-1) {
+        if (rel_err < 0 && v.method == AmmMethod::Osnap) {
+            rel_err = std::sqrt(2. / v.param);
+        }
+        if (rel_err >= 0) {
+            set_rel_error(v, rel_err);
+        }
+        if (std::find_if(_variants.begin(), _variants.end(),
+                [&v](const AmmVariant& u) {
+                    return !(u < v) && !(v < u);
+                }) == _variants.end())
+        {
+            _variants.push_back(v);
+        }
+    }
+
+    void set_rel_error(const AmmVariant& v, double rel_err) {
+        _rel_errs[v] = rel_err;
+    }
+
+    double rel_error(const AmmVariant& v) const {
+        auto it = _rel_errs.find(v);
+        return it == _rel_errs.end() ? kAmmUnknown : it->second;
+    }
+
+    // all feasible candidates meeting the tolerance, fastest first; exact
+    // gemm is always a candidate so that this is never empty
+    std::vector<AmmPlan> candidates(int N, int D, int M, double tol) const {
+        std::vector<AmmPlan> plans;
+        auto gemm = AmmVariant{AmmMethod::ExactGemm, 0};
+        plans.push_back(AmmPlan{gemm, _model.predict_ms(gemm, N, D, M), 0});
+        for (const auto& v : _variants) {
+            if (v.method == AmmMethod::ExactGemm) { continue; }
+            auto err = rel_error(v);
+            if (err > tol || !amm_variant_supports_shape(v, D)) {
+                continue;
+            }
+            plans.push_back(AmmPlan{v, _model.predict_ms(v, N, D, M), err});
+        }
+        std::stable_sort(plans.begin(), plans.end(),
+            [](const AmmPlan& a, const AmmPlan& b) {
+                return a.predicted_ms < b.predicted_ms;
+            });
+        return plans;
+    }
+
+    AmmPlan plan(int N, int D, int M, double tol) const {
+        return candidates(N, D, M, tol)[0];
+    }
+
+    // plans, then runs the chosen variant with the executor for its method;
+    // with explain=true, prints every candidate considered along with
+    // predicted vs actual time for the one that ran. Returns actual time.
+    double run(int N, int D, int M, double tol,
+               const std::array<AmmExecutor, kNumAmmMethods>& executors,
+               bool explain=false, AmmPlan* plan_out=nullptr) const
+    {
+        auto plans = candidates(N, D, M, tol);
+        // skip methods the caller can't execute
+        auto it = std::find_if(plans.begin(), plans.end(),
+            [&executors](const AmmPlan& p) {
+                return static_cast<bool>(
+                    executors[static_cast<int>(p.variant.method)]);
+            });
+        if (it == plans.end()) { return -1; }
+        auto chosen = *it;
+        double t_ms = 0;
+        {
+            EasyTimer _(t_ms);
+            executors[static_cast<int>(chosen.variant.method)](chosen.variant);
+        }
+        if (explain) {
+            printf("amm plan N D M tol:, %6d, %4d, %4d, %5.3f\n", N, D, M, tol);
+            for (const auto& p : plans) {
+                printf("    candidate %-16s predicted %9.4f ms, err %5.3f%s\n",
+                    amm_variant_name(p.variant).c_str(), p.predicted_ms,
+                    p.expected_rel_err, (&p == &*it) ? "  <- chosen" : "");
+            }
+            printf("    chosen %s: predicted %.4f ms, actual %.4f ms\n",
+                amm_variant_name(chosen.variant).c_str(),
+                chosen.predicted_ms, t_ms);
+        }
+        if (plan_out != nullptr) {
+            *plan_out = chosen;
+        }
+        return t_ms;
+    }
+
+private:
+    AmmCostModel _model;
+    std::vector<AmmVariant> _variants;
+    std::map<AmmVariant, double> _rel_errs;
+};
+
+} // anon namespace
+#endif /* amm_planner_hpp */
@@ -58,11 +58,23 @@ public:
 
     RowVector<uint16_t> dists_sq(const float* q, int len);
     RowVector<uint16_t> dot_prods(const float* q, int len);
+    RowVector<uint16_t> dists_l1(const float* q, int len);
+    // uses the norms of the rows passed to set_data(), so the data needn't
+    // be normalized; rows passed to set_codes() are assumed unit length
+    RowVector<float> cosine_sims(const float* q, int len);
     // vector<uint16_t> dists_sq(const float* q, int len);
     // vector<uint16_t> dot_prods(const float* q, int len);
 
     vector<int64_t> knn_l2(const float* q, int len, int k);
     vector<int64_t> knn_mips(const float* q, int len, int k);
+    vector<int64_t> knn_l1(const float* q, int len, int k);
+    vector<int64_t> knn_cosine(const float* q, int len, int k);
+
+    // indices of all codes with dists_sq <= max_dist_sq (or dot_prods >=
+    // min_dot), in increasing order; thresholds are in the same units as
+    // the query and centroids, before scaling and offsets
+    vector<int64_t> radius_l2(const float* q, int len, float max_dist_sq);
+    vector<int64_t> radius_mips(const float* q, int len, float min_dot);
 
     // for testing
     bool set_codes(const RowMatrix<uint8_t>& codes);
@@ -85,6 +97,7 @@ private:
     // ColMatrix<float> _centroids;
 	RowMatrix<float> _centroids;
 	RowMatrix<uint8_t> _codes;
+    RowVector<float> _inv_norms;  // 1 / ||row|| for each row of the data
     RowVector<float> _offsets;
     ColMatrix<uint8_t> _lut;
     int64_t _ncodes;
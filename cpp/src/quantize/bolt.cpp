@@ -1,4 +1,5 @@
 
+#include <algorithm>
 #include <cstring> // for memcpy
 
 #ifdef BLAZE
@@ -115,6 +116,9 @@ bool BoltEncoder::set_data(const float* X, int m, int n) {
     int64_t nblocks = ceil(m / 32.0);
     _codes.resize(nblocks * 32, _nbytes);
     _codes.bottomRows(32).setZero(); // ensure mem initialized past end of X
+    _inv_norms.resize(nblocks * 32);  // for cosine similarity
+    _inv_norms.setZero();
+    bolt_inv_row_norms(X, m, n, _inv_norms.data());
 
     switch (_nbytes) {
         case 2:
@@ -151,6 +155,10 @@ bool BoltEncoder::set_codes(const uint8_t* codes, int m, int n) {
     _codes.resize(nblocks * 32, 2 * _nbytes);
     _codes.bottomRows(32).setZero(); // ensure mem initialized past end of X
     _codes.topRows(m) = buff_wrapper;
+    // no original rows, so cosine similarities assume they're unit length
+    _inv_norms.resize(nblocks * 32);
+    _inv_norms.setZero();
+    _inv_norms.head(m).setOnes();
 
     return true;
 }
@@ -389,6 +397,124 @@ vector<int64_t> BoltEncoder::knn_mips(const float* q, int len, int k) {
         k, _lut, smaller_better);
 }
 
+template<int Reduction=Reductions::DistL2>
+vector<int64_t> query_radius(const float* q, int len, int nbytes,
+    const RowMatrix<float>& centroids,
+    const RowVector<float>& offsets, float scaleby,
+    const RowMatrix<uint8_t>& codes, int64_t ncodes,
+    float threshold, ColMatrix<uint8_t>& lut_tmp)
+{
+    static constexpr bool smaller_better = Reduction == Reductions::DistL2;
+    lut<Reduction>(q, len, nbytes, centroids, offsets, scaleby, lut_tmp);
+    auto ncodebooks = 2 * nbytes;
+    auto thresh = bolt_quantize_threshold(
+        threshold, offsets.data(), ncodebooks, scaleby);
+
+    vector<int64_t> ret;
+    int64_t nblocks = ceil(codes.rows() / 32.0);
+    bolt_scan_radius<smaller_better>(codes.data(), nblocks, ncodebooks,
+        lut_tmp.data(), thresh, ncodes, ret);
+    return ret;
+}
+
+vector<int64_t> BoltEncoder::radius_l2(const float* q, int len,
+    float max_dist_sq)
+{
+    return query_radius<Reductions::DistL2>(
+        q, len, _nbytes, _centroids, _offsets, _scaleby, _codes, _ncodes,
+        max_dist_sq, _lut);
+}
+vector<int64_t> BoltEncoder::radius_mips(const float* q, int len,
+    float min_dot)
+{
+    return query_radius<Reductions::DotProd>(
+        q, len, _nbytes, _centroids, _offsets, _scaleby, _codes, _ncodes,
+        min_dot, _lut);
+}
+// like query_all(), but folds in 1 / row norms to get cosine similarities
+RowVector<float> query_cosine(const float* q, int len, int nbytes,
+    const RowMatrix<float>& centroids,
+    const RowVector<float>& offsets, float scaleby,
+    const RowMatrix<uint8_t>& codes, const RowVector<float>& inv_norms,
+    ColMatrix<uint8_t>& lut_tmp)
+{
+    lut<Reductions::CosineSim>(q, len, nbytes, centroids, offsets, scaleby,
+        lut_tmp);
+    int64_t nblocks = ceil(codes.rows() / 32.0);
+    RowVector<float> sims(nblocks * 32);
+    bolt_scan_cosine(codes.data(), nblocks, 2 * nbytes, lut_tmp.data(),
+        inv_norms.data(), offsets.sum(), scaleby, sims.data());
+    return sims;
+}
+
+vector<int64_t> query_knn_cosine(const float* q, int len, int nbytes,
+    const RowMatrix<float>& centroids,
+    const RowVector<float>& offsets, float scaleby,
+    const RowMatrix<uint8_t>& codes, const RowVector<float>& inv_norms,
+    int64_t ncodes, int k, ColMatrix<uint8_t>& lut_tmp)
+{
+    static constexpr int tile_nblocks = 64;
+    static constexpr int block_nrows = 32;
+    k = static_cast<int>(std::min<int64_t>(k, ncodes));
+    if (k <= 0) { return vector<int64_t>(); }
+    lut<Reductions::CosineSim>(q, len, nbytes, centroids, offsets, scaleby,
+        lut_tmp);
+    auto ncodebooks = 2 * nbytes;
+    auto block_nbytes = block_nrows * nbytes;
+    auto total_offset = offsets.sum();
+    int64_t nblocks = ceil(codes.rows() / 32.0);
+
+    // min-heap of the k best (sim, idx) pairs so far; similarities can be
+    // negative, so we can't use knn_from_dists, which treats dists <= 0 as
+    // invalid
+    using pair_t = std::pair<float, int64_t>;
+    auto worse = [](const pair_t& a, const pair_t& b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+    std::vector<pair_t> heap;
+    float sims[tile_nblocks * block_nrows];
+    for (int64_t b = 0; b < nblocks; b += tile_nblocks) {
+        auto use_nblocks = std::min<int64_t>(tile_nblocks, nblocks - b);
+        bolt_scan_cosine(codes.data() + b * block_nbytes, use_nblocks,
+            ncodebooks, lut_tmp.data(), inv_norms.data() + b * block_nrows,
+            total_offset, scaleby, sims);
+        auto first_row = b * block_nrows;
+        auto nrows = std::min(use_nblocks * block_nrows, ncodes - first_row);
+        for (int64_t i = 0; i < nrows; i++) {
+            if ((int)heap.size() < k) {
+                heap.emplace_back(sims[i], first_row + i);
+                std::push_heap(heap.begin(), heap.end(), worse);
+            } else if (sims[i] > heap.front().first) {
+                std::pop_heap(heap.begin(), heap.end(), worse);
+                heap.back() = pair_t(sims[i], first_row + i);
+                std::push_heap(heap.begin(), heap.end(), worse);
+            }
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), worse);
+    vector<int64_t> ret;
+    for (const auto& p : heap) { ret.push_back(p.second); }
+    return ret;
+}
+
+RowVector<uint16_t> BoltEncoder::dists_l1(const float* q, int len) {
+    return query_all<Reductions::DistL1>(
+        q, len, _nbytes, _centroids, _offsets, _scaleby, _codes, _ncodes, _lut);
+}
+RowVector<float> BoltEncoder::cosine_sims(const float* q, int len) {
+    return query_cosine(q, len, _nbytes, _centroids, _offsets, _scaleby,
+        _codes, _inv_norms, _lut);
+}
+
+vector<int64_t> BoltEncoder::knn_l1(const float* q, int len, int k) {
+    return query_knn<Reductions::DistL1>(
+        q, len, _nbytes, _centroids, _offsets, _scaleby, _codes, _ncodes,
+        k, _lut);
+}
+vector<int64_t> BoltEncoder::knn_cosine(const float* q, int len, int k) {
+    return query_knn_cosine(q, len, _nbytes, _centroids, _offsets, _scaleby,
+        _codes, _inv_norms, _ncodes, k, _lut);
+}
 
 // simple getters
 ColMatrix<uint8_t> BoltEncoder::get_lut() { return _lut; }
@@ -0,0 +1,305 @@
+//
+//  bolt_decode.hpp
+//  Bolt
+//
+//  Reconstructing approximate rows from Bolt or PQ codes, e.g., to serve
+//  rows of a compressed embedding table. A row is the concatenation of the
+//  centroids its codes point to, so decoding is a copy of one contiguous
+//  subvector per codebook. The encoders want centroids in a transposed,
+//  per-codebook column-major layout instead, so decoding first converts
+//  them (once) into a decode table with each subvector contiguous.
+//
+//  Codes can be in Bolt's 32-row block layout, Bolt's row-major layout
+//  (bolt_encode<NBytes, true>), or PQ's row-major layout. Rows can be
+//  decoded in bulk, gathered by index, or dotted with a dense vector
+//  without ever being written out.
+//
+
+#ifndef __BOLT_DECODE_HPP
+#define __BOLT_DECODE_HPP
+
+#include <assert.h>
+#include <stdint.h>
+#include <vector>
+#include "immintrin.h"
+
+#ifdef BLAZE
+    #include "src/utils/avx_utils.hpp"
+#else
+    #include "avx_utils.hpp"
+#endif
+
+namespace {
+
+enum class CodeLayout { BoltBlocks, BoltRowMajor, PQ8b };
+
+static constexpr int kDecodeMaxNcodebooks = 256;
+
+// ------------------------------------------------ decode tables
+
+/**
+ * @brief Converts centroids from the encoders' layout into a decode table.
+ *
+ * @param centroids Centroids as from bolt_encode_centroids() (ncentroids =
+ *  16) or pq_encode_centroids_8b() (ncentroids = 256)
+ * @param out Row-major [(ncodebooks * ncentroids) x subvect_len] table,
+ *  where row (m * ncentroids + a) is centroid a of codebook m. This is
+ *  the same as the row-major centroids the encoder layouts were made from.
+ */
+static inline void decode_table_from_centroids(const float* centroids,
+    int ncols, int ncodebooks, int ncentroids, float* out)
+{
+    int subvect_len = ncols / ncodebooks;
+    assert(ncols % ncodebooks == 0);
+    for (int m = 0; m < ncodebooks; m++) {
+        auto codebook = centroids + m * subvect_len * ncentroids;
+        auto out_codebook = out + m * ncentroids * subvect_len;
+        for (int a = 0; a < ncentroids; a++) {
+            for (int j = 0; j < subvect_len; j++) {
+                out_codebook[a * subvect_len + j] = codebook[j * ncentroids + a];
+            }
+        }
+    }
+}
+static inline void bolt_decode_table(const float* centroids, int ncols,
+    int ncodebooks, float* out)
+{
+    decode_table_from_centroids(centroids, ncols, ncodebooks, 16, out);
+}
+static inline void pq_decode_table_8b(const float* centroids, int ncols,
+    int ncodebooks, float* out)
+{
+    decode_table_from_centroids(centroids, ncols, ncodebooks, 256, out);
+}
+
+// ------------------------------------------------ per-row kernels
+
+// writes the code in each codebook for one row
+template<CodeLayout Layout>
+inline void _decode_row_codes(const uint8_t* codes, int ncodebooks,
+    int64_t row, uint8_t* out)
+{
+    static constexpr int block_nrows = 32;
+    if (Layout == CodeLayout::PQ8b) {
+        auto row_codes = codes + row * ncodebooks;
+        for (int m = 0; m < ncodebooks; m++) { out[m] = row_codes[m]; }
+        return;
+    }
+    int nbytes = ncodebooks / 2;
+    const uint8_t* ptr;
+    int64_t stride;
+    if (Layout == CodeLayout::BoltBlocks) {
+        ptr = codes + (row / block_nrows) * block_nrows * nbytes +
+            row % block_nrows;
+        stride = block_nrows;
+    } else {
+        ptr = codes + row * nbytes;
+        stride = 1;
+    }
+    for (int j = 0; j < nbytes; j++) {
+        auto byte = ptr[j * stride];
+        out[2 * j] = byte & 0x0F;
+        out[2 * j + 1] = byte >> 4;
+    }
+}
+
+// copies one subvector; SubvectLen = 0 means it's only known at runtime
+template<int SubvectLen>
+inline void _decode_copy_subvect(const float* src, float* dst, int len) {
+    if (SubvectLen > 0) { len = SubvectLen; }
+    int j = 0;
+    for (; j + 8 <= len; j += 8) {
+        _mm256_storeu_ps(dst + j, _mm256_loadu_ps(src + j));
+    }
+    for (; j < len; j++) { dst[j] = src[j]; }
+}
+
+template<int SubvectLen>
+inline float _decode_dot_subvect(const float* src, const float* v, int len) {
+    if (SubvectLen > 0) { len = SubvectLen; }
+    int j = 0;
+    float sum = 0;
+    if (len >= 8) {
+        auto acc = _mm256_setzero_ps();
+        for (; j + 8 <= len; j += 8) {
+            acc = fma(_mm256_loadu_ps(src + j), _mm256_loadu_ps(v + j), acc);
+        }
+        sum = pfirst(broadcast_sum(acc));
+    }
+    for (; j < len; j++) { sum += src[j] * v[j]; }
+    return sum;
+}
+
+template<CodeLayout Layout, int SubvectLen>
+inline void _decode_rows(const uint8_t* codes, int ncodebooks,
+    int ncentroids, const float* table, int subvect_len, const int64_t* idxs,
+    int64_t nrows, float* out)
+{
+    uint8_t row_codes[kDecodeMaxNcodebooks];
+    int ncols = ncodebooks * subvect_len;
+    int64_t codebook_stride = ncentroids * subvect_len;
+    for (int64_t i = 0; i < nrows; i++) {
+        auto row = idxs != nullptr ? idxs[i] : i;
+        _decode_row_codes<Layout>(codes, ncodebooks, row, row_codes);
+        auto out_row = out + i * ncols;
+        for (int m = 0; m < ncodebooks; m++) {
+            auto src = table + m * codebook_stride + row_codes[m] * subvect_len;
+            _decode_copy_subvect<SubvectLen>(
+                src, out_row + m * subvect_len, subvect_len);
+        }
+    }
+}
+
+template<CodeLayout Layout, int SubvectLen>
+inline void _decode_dot_rows(const uint8_t* codes, int ncodebooks,
+    int ncentroids, const float* table, int subvect_len, const int64_t* idxs,
+    int64_t nrows, const float* v, float* out)
+{
+    uint8_t row_codes[kDecodeMaxNcodebooks];
+    int64_t codebook_stride = ncentroids * subvect_len;
+    for (int64_t i = 0; i < nrows; i++) {
+        auto row = idxs != nullptr ? idxs[i] : i;
+        _decode_row_codes<Layout>(codes, ncodebooks, row, row_codes);
+        float sum = 0;
+        for (int m = 0; m < ncodebooks; m++) {
+            auto src = table + m * codebook_stride + row_codes[m] * subvect_len;
+            sum += _decode_dot_subvect<SubvectLen>(
+                src, v + m * subvect_len, subvect_len);
+        }
+        out[i] = sum;
+    }
+}
+
+// dispatches on the subvector length, so common ones get unrolled
+template<CodeLayout Layout>
+inline void _decode_dispatch(const uint8_t* codes, int ncodebooks,
+    int ncentroids, const float* table, int ncols, const int64_t* idxs,
+    int64_t nrows, float* out)
+{
+    assert(ncodebooks <= kDecodeMaxNcodebooks);
+    int subvect_len = ncols / ncodebooks;
+    #define DECODE_CASE(LEN) case LEN: _decode_rows<Layout, LEN>(codes, \
+        ncodebooks, ncentroids, table, subvect_len, idxs, nrows, out); break;
+    switch (subvect_len) {
+        DECODE_CASE(1); DECODE_CASE(2); DECODE_CASE(4); DECODE_CASE(8);
+        DECODE_CASE(16); DECODE_CASE(32);
+        default: _decode_rows<Layout, 0>(codes, ncodebooks, ncentroids,
+            table, subvect_len, idxs, nrows, out);
+    }
+    #undef DECODE_CASE
+}
+
+template<CodeLayout Layout>
+inline void _decode_dot_dispatch(const uint8_t* codes, int ncodebooks,
+    int ncentroids, const float* table, int ncols, const int64_t* idxs,
+    int64_t nrows, const float* v, float* out)
+{
+    assert(ncodebooks <= kDecodeMaxNcodebooks);
+    int subvect_len = ncols / ncodebooks;
+    // once there are more rows than centroids per codebook, it's cheaper to
+    // dot v with every centroid up front and then just sum one table entry
+    // per codebook for each row (a float version of a bolt_lut() + scan)
+    if (nrows >= ncentroids) {
+        std::vector<float> dots(ncodebooks * ncentroids);
+        for (int m = 0; m < ncodebooks; m++) {
+            for (int a = 0; a < ncentroids; a++) {
+                auto src = table + (m * ncentroids + a) * subvect_len;
+                dots[m * ncentroids + a] = _decode_dot_subvect<0>(
+                    src, v + m * subvect_len, subvect_len);
+            }
+        }
+        uint8_t row_codes[kDecodeMaxNcodebooks];
+        for (int64_t i = 0; i < nrows; i++) {
+            auto row = idxs != nullptr ? idxs[i] : i;
+            _decode_row_codes<Layout>(codes, ncodebooks, row, row_codes);
+            float sum = 0;
+            for (int m = 0; m < ncodebooks; m++) {
+                sum += dots[m * ncentroids + row_codes[m]];
+            }
+            out[i] = sum;
+        }
+        return;
+    }
+    #define DECODE_CASE(LEN) case LEN: _decode_dot_rows<Layout, LEN>(codes, \
+        ncodebooks, ncentroids, table, subvect_len, idxs, nrows, v, out); break;
+    switch (subvect_len) {
+        DECODE_CASE(1); DECODE_CASE(2); DECODE_CASE(4); DECODE_CASE(8);
+        DECODE_CASE(16); DECODE_CASE(32);
+        default: _decode_dot_rows<Layout, 0>(codes, ncodebooks, ncentroids,
+            table, subvect_len, idxs, nrows, v, out);
+    }
+    #undef DECODE_CASE
+}
+
+// ------------------------------------------------ bolt
+
+/**
+ * @brief Reconstructs rows from Bolt codes.
+ *
+ * @param codes Codes as from bolt_encode<NBytes, RowMajor>()
+ * @param table Decode table from bolt_decode_table()
+ * @param nrows Number of rows to decode, starting from the first
+ * @param out Row-major [nrows x ncols] reconstructions
+ */
+template<bool RowMajor=false>
+void bolt_decode(const uint8_t* codes, int64_t nrows, int ncodebooks,
+    const float* table, int ncols, float* out)
+{
+    static constexpr auto layout = RowMajor ?
+        CodeLayout::BoltRowMajor : CodeLayout::BoltBlocks;
+    _decode_dispatch<layout>(codes, ncodebooks, 16, table, ncols, nullptr,
+        nrows, out);
+}
+
+// reconstructs rows idxs[0], ..., idxs[nidxs - 1] into rows of out
+template<bool RowMajor=false>
+void bolt_decode_rows(const uint8_t* codes, int ncodebooks,
+    const float* table, int ncols, const int64_t* idxs, int64_t nidxs,
+    float* out)
+{
+    static constexpr auto layout = RowMajor ?
+        CodeLayout::BoltRowMajor : CodeLayout::BoltBlocks;
+    _decode_dispatch<layout>(codes, ncodebooks, 16, table, ncols, idxs,
+        nidxs, out);
+}
+
+// out[i] = dot(reconstruction of row idxs[i], v), without storing rows
+template<bool RowMajor=false>
+void bolt_decode_dot(const uint8_t* codes, int ncodebooks,
+    const float* table, int ncols, const int64_t* idxs, int64_t nidxs,
+    const float* v, float* out)
+{
+    static constexpr auto layout = RowMajor ?
+        CodeLayout::BoltRowMajor : CodeLayout::BoltBlocks;
+    _decode_dot_dispatch<layout>(codes, ncodebooks, 16, table, ncols, idxs,
+        nidxs, v, out);
+}
+
+// ------------------------------------------------ pq
+
+// as bolt_decode(), for row-major codes from pq_encode_8b()
+static inline void pq_decode_8b(const uint8_t* codes, int64_t nrows,
+    int ncodebooks, const float* table, int ncols, float* out)
+{
+    _decode_dispatch<CodeLayout::PQ8b>(codes, ncodebooks, 256, table, ncols,
+        nullptr, nrows, out);
+}
+
+static inline void pq_decode_rows_8b(const uint8_t* codes, int ncodebooks,
+    const float* table, int ncols, const int64_t* idxs, int64_t nidxs,
+    float* out)
+{
+    _decode_dispatch<CodeLayout::PQ8b>(codes, ncodebooks, 256, table, ncols,
+        idxs, nidxs, out);
+}
+
+static inline void pq_decode_dot_8b(const uint8_t* codes, int ncodebooks,
+    const float* table, int ncols, const int64_t* idxs, int64_t nidxs,
+    const float* v, float* out)
+{
+    _decode_dot_dispatch<CodeLayout::PQ8b>(codes, ncodebooks, 256, table,
+        ncols, idxs, nidxs, v, out);
+}
+
+} // anon namespace
+#endif // __BOLT_DECODE_HPP
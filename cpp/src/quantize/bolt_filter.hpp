@@ -0,0 +1,307 @@
+//
+//  bolt_filter.hpp
+//  Bolt
+//
+//  Filtered Bolt search: find the k nearest codes among only those rows
+//  whose attributes satisfy some predicates. Attributes live in small
+//  integer columns in the same row order as the codes, and predicates are
+//  evaluated into a bitmap with one 32-bit word per 32-row code block, so
+//  the scan can skip blocks where no row passes and mask out failing lanes
+//  in the rest. When very few rows pass, it's cheaper to skip the scan
+//  kernel entirely and sum LUT entries for just the passing rows.
+//
+
+#ifndef __BOLT_FILTER_HPP
+#define __BOLT_FILTER_HPP
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "immintrin.h"
+
+#ifdef BLAZE
+    #include "src/quantize/bolt.hpp"
+    #include "src/quantize/bolt_stream.hpp"
+#else
+    #include "bolt.hpp"
+    #include "bolt_stream.hpp"
+#endif
+
+namespace {
+
+// rows pass if lo <= attribute col <= hi
+struct BoltPredicate {
+    int col;
+    int lo;
+    int hi;
+};
+
+/**
+ * @brief Small integer attribute columns stored alongside Bolt codes, with
+ * SIMD predicate evaluation into per-block bitmaps.
+ *
+ * @details Columns are padded to a multiple of 32 rows; padding rows never
+ * pass any predicate, so bitmaps are safe to use on the padded last block
+ * of codes.
+ */
+class BoltAttributeTable {
+public:
+    explicit BoltAttributeTable(int64_t nrows):
+        _nrows(nrows), _nblocks((nrows + 31) / 32) {}
+
+    int64_t nrows() const { return _nrows; }
+    int64_t nblocks() const { return _nblocks; }
+    int ncols() const { return static_cast<int>(_cols.size()); }
+
+    // returns the index of the new column
+    int add_column_u8(const uint8_t* values) {
+        Column col;
+        col.is_u16 = false;
+        col.u8.resize(_nblocks * 32, 0);
+        memcpy(col.u8.data(), values, _nrows);
+        _cols.push_back(std::move(col));
+        return ncols() - 1;
+    }
+    int add_column_u16(const uint16_t* values) {
+        Column col;
+        col.is_u16 = true;
+        col.u16.resize(_nblocks * 32, 0);
+        memcpy(col.u16.data(), values, _nrows * sizeof(uint16_t));
+        _cols.push_back(std::move(col));
+        return ncols() - 1;
+    }
+
+    // one word per block; bit r of word b is set iff row 32 * b + r
+    // satisfies every predicate
+    std::vector<uint32_t> bitmap(const std::vector<BoltPredicate>& preds) const {
+        std::vector<uint32_t> ret(_nblocks, 0xffffffff);
+        for (const auto& pred : preds) {
+            const auto& col = _cols[pred.col];
+            if (col.is_u16) {
+                _and_bitmap_u16(col.u16.data(), pred, ret.data());
+            } else {
+                _and_bitmap_u8(col.u8.data(), pred, ret.data());
+            }
+        }
+        auto tail_nrows = _nrows % 32;
+        if (_nblocks > 0 && tail_nrows > 0) {
+            ret[_nblocks - 1] &= (1u << tail_nrows) - 1;
+        }
+        return ret;
+    }
+
+private:
+    struct Column {
+        bool is_u16;
+        std::vector<uint8_t> u8;
+        std::vector<uint16_t> u16;
+    };
+
+    // lo <= x <= hi iff (x - lo) <= (hi - lo) in unsigned arithmetic;
+    // unsigned compare is min(x, y) == x since there's no cmple_epu8
+    void _and_bitmap_u8(const uint8_t* values, const BoltPredicate& pred,
+                        uint32_t* masks) const
+    {
+        if (pred.hi < pred.lo || pred.hi < 0 || pred.lo > 255) {
+            std::fill(masks, masks + _nblocks, 0);
+            return;
+        }
+        auto lo = static_cast<uint8_t>(std::max(pred.lo, 0));
+        auto hi = static_cast<uint8_t>(std::min(pred.hi, 255));
+        auto lo_v = _mm256_set1_epi8(lo);
+        auto width_v = _mm256_set1_epi8(hi - lo);
+        for (int64_t b = 0; b < _nblocks; b++) {
+            auto x = _mm256_loadu_si256((const __m256i*)(values + 32 * b));
+            auto shifted = _mm256_sub_epi8(x, lo_v);
+            auto pass = _mm256_cmpeq_epi8(
+                _mm256_min_epu8(shifted, width_v), shifted);
+            masks[b] &= static_cast<uint32_t>(_mm256_movemask_epi8(pass));
+        }
+    }
+
+    void _and_bitmap_u16(const uint16_t* values, const BoltPredicate& pred,
+                         uint32_t* masks) const
+    {
+        if (pred.hi < pred.lo || pred.hi < 0 || pred.lo > 65535) {
+            std::fill(masks, masks + _nblocks, 0);
+            return;
+        }
+        auto lo = static_cast<uint16_t>(std::max(pred.lo, 0));
+        auto hi = static_cast<uint16_t>(std::min(pred.hi, 65535));
+        auto lo_v = _mm256_set1_epi16(lo);
+        auto width_v = _mm256_set1_epi16(hi - lo);
+        for (int64_t b = 0; b < _nblocks; b++) {
+            auto ptr = values + 32 * b;
+            auto x0 = _mm256_sub_epi16(
+                _mm256_loadu_si256((const __m256i*)ptr), lo_v);
+            auto x1 = _mm256_sub_epi16(
+                _mm256_loadu_si256((const __m256i*)(ptr + 16)), lo_v);
+            auto pass0 = _mm256_cmpeq_epi16(_mm256_min_epu16(x0, width_v), x0);
+            auto pass1 = _mm256_cmpeq_epi16(_mm256_min_epu16(x1, width_v), x1);
+            // 2 mask bits per u16; keep every other one
+            auto m0 = static_cast<uint32_t>(_mm256_movemask_epi8(pass0));
+            auto m1 = static_cast<uint32_t>(_mm256_movemask_epi8(pass1));
+            masks[b] &= _pext_u32(m0, 0x55555555) |
+                (_pext_u32(m1, 0x55555555) << 16);
+        }
+    }
+
+    int64_t _nrows;
+    int64_t _nblocks;
+    std::vector<Column> _cols;
+};
+
+enum class BoltFilterStrategy {
+    Auto = 0,
+    Scan,        // scan every block, masking out failing rows
+    SkipBlocks,  // scan only blocks with at least one passing row
+    Gather       // sum LUT entries for each passing row individually
+};
+
+static inline const char* bolt_filter_strategy_name(BoltFilterStrategy s) {
+    switch (s) {
+        case BoltFilterStrategy::Auto: return "auto";
+        case BoltFilterStrategy::Scan: return "scan";
+        case BoltFilterStrategy::SkipBlocks: return "skip";
+        case BoltFilterStrategy::Gather: return "gather";
+    }
+    return "?";
+}
+
+// exact (u16) distance for row r of a block; same as the scan computes
+template<int NBytes>
+static inline uint16_t _bolt_row_dist(const uint8_t* block, int r,
+                                      const uint8_t* lut)
+{
+    static constexpr int lut_sz = 16;
+    uint16_t dist = 0;
+    for (int j = 0; j < NBytes; j++) {
+        uint8_t code = block[32 * j + r];
+        dist += lut[lut_sz * (2 * j) + (code & 0x0f)];
+        dist += lut[lut_sz * (2 * j + 1) + (code >> 4)];
+    }
+    return dist;
+}
+
+template<int NBytes>
+static inline void _bolt_gather_topk(const uint8_t* codes, int64_t nblocks,
+    const uint8_t* lut, const uint32_t* block_masks, BoltStreamTopk& topk)
+{
+    static constexpr int block_nrows = 32;
+    static constexpr int block_nbytes = block_nrows * NBytes;
+    uint16_t dists[block_nrows];
+    for (int64_t b = 0; b < nblocks; b++) {
+        auto mask = block_masks[b];
+        if (mask == 0) { continue; }
+        auto block = codes + b * block_nbytes;
+        // compute only the passing lanes; the rest are masked out anyway
+        auto m = mask;
+        while (m) {
+            auto r = __builtin_ctz(m);
+            m &= m - 1;
+            dists[r] = _bolt_row_dist<NBytes>(block, r, lut);
+        }
+        topk.add(dists, block_nrows, b * block_nrows, &mask);
+    }
+}
+
+static inline void _bolt_gather_topk(const uint8_t* codes, int64_t nblocks,
+    int ncodebooks, const uint8_t* lut, const uint32_t* block_masks,
+    BoltStreamTopk& topk)
+{
+    switch (ncodebooks) {
+        case 2: _bolt_gather_topk<1>(codes, nblocks, lut, block_masks, topk); break;
+        case 4: _bolt_gather_topk<2>(codes, nblocks, lut, block_masks, topk); break;
+        case 8: _bolt_gather_topk<4>(codes, nblocks, lut, block_masks, topk); break;
+        case 16: _bolt_gather_topk<8>(codes, nblocks, lut, block_masks, topk); break;
+        case 32: _bolt_gather_topk<16>(codes, nblocks, lut, block_masks, topk); break;
+        case 48: _bolt_gather_topk<24>(codes, nblocks, lut, block_masks, topk); break;
+        case 64: _bolt_gather_topk<32>(codes, nblocks, lut, block_masks, topk); break;
+        case 128: _bolt_gather_topk<64>(codes, nblocks, lut, block_masks, topk); break;
+        default: assert(false);  // unsupported ncodebooks
+    }
+}
+
+/**
+ * @brief Choose how to answer a filtered query given its bitmap.
+ *
+ * @details Gathering costs roughly one LUT lookup per codebook per passing
+ * row, while scanning a block costs about as much as gathering ~2 rows
+ * (the scan does 32 rows x 2 codebooks per shuffle), so we gather if
+ * there are fewer than ~2 passing rows per non-empty block. Otherwise we
+ * skip empty blocks if there are enough of them to matter.
+ */
+static inline BoltFilterStrategy bolt_filter_choose_strategy(
+    const uint32_t* block_masks, int64_t nblocks)
+{
+    int64_t npassing = 0;
+    int64_t nonempty_nblocks = 0;
+    for (int64_t b = 0; b < nblocks; b++) {
+        npassing += __builtin_popcount(block_masks[b]);
+        nonempty_nblocks += block_masks[b] != 0;
+    }
+    if (npassing < 2 * nonempty_nblocks) {
+        return BoltFilterStrategy::Gather;
+    }
+    if (nonempty_nblocks < (nblocks * 7) / 8) {
+        return BoltFilterStrategy::SkipBlocks;
+    }
+    return BoltFilterStrategy::Scan;
+}
+
+/**
+ * @brief Find the k nearest codes among rows whose bit is set in
+ * block_masks.
+ *
+ * @param codes Codes as output by bolt_encode()
+ * @param lut Lookup table from bolt_lut(); must be 32B-aligned
+ * @param block_masks One word per block, as from BoltAttributeTable::bitmap;
+ *  padding rows past the real codes must have their bits cleared
+ * @param used If not null, set to the strategy actually used
+ */
+static inline BoltStreamNeighbors bolt_filtered_knn(const uint8_t* codes,
+    int64_t nblocks, int ncodebooks, const uint8_t* lut,
+    const uint32_t* block_masks, int k, bool smaller_better=true,
+    BoltFilterStrategy strategy=BoltFilterStrategy::Auto,
+    BoltFilterStrategy* used=nullptr)
+{
+    static constexpr int block_nrows = 32;
+    if (strategy == BoltFilterStrategy::Auto) {
+        strategy = bolt_filter_choose_strategy(block_masks, nblocks);
+    }
+    if (used != nullptr) { *used = strategy; }
+
+    BoltStreamTopk topk(k, smaller_better);
+    if (strategy == BoltFilterStrategy::Gather) {
+        _bolt_gather_topk(codes, nblocks, ncodebooks, lut, block_masks, topk);
+        return topk.finish();
+    }
+
+    int block_nbytes = block_nrows * (ncodebooks / 2);
+    auto tile_nblocks = bolt_scan_tile_nblocks(ncodebooks);
+    RowVector<uint16_t> dists(tile_nblocks * block_nrows);
+    bool skip = strategy == BoltFilterStrategy::SkipBlocks;
+    int64_t b = 0;
+    while (b < nblocks) {
+        if (skip) {  // find the next run of non-empty blocks
+            while (b < nblocks && block_masks[b] == 0) { b++; }
+            if (b == nblocks) { break; }
+        }
+        auto end = std::min(b + tile_nblocks, nblocks);
+        if (skip) {
+            auto run_end = b + 1;
+            while (run_end < end && block_masks[run_end] != 0) { run_end++; }
+            end = run_end;
+        }
+        bolt_scan<true, false, false>(codes + b * block_nbytes, end - b,
+                                      ncodebooks, lut, dists.data());
+        topk.add(dists.data(), (end - b) * block_nrows, b * block_nrows,
+                 block_masks + b);
+        b = end;
+    }
+    return topk.finish();
+}
+
+} // anon namespace
+#endif // __BOLT_FILTER_HPP
@@ -0,0 +1,303 @@
+//
+//  bolt_join.hpp
+//  Bolt
+//
+//  All-pairs joins of a set of Bolt codes against itself, entirely in the
+//  compressed domain. With symmetric distance tables (the distance between
+//  every pair of centroids in each codebook), the 16-entry LUT for a row
+//  that's already encoded is just one row of each codebook's table, so it
+//  costs a few memcpys instead of a bolt_lut() call, and the join is then
+//  an ordinary multi-query Bolt scan: a block of 32 code rows acts as 32
+//  queries against each tile of code blocks while that tile is in cache.
+//
+//  Distances are between two quantized vectors, not a query and a
+//  quantized vector, so they're noisier than bolt_scan() distances (as with
+//  symmetric distance computation in PQ).
+//
+
+#ifndef __BOLT_JOIN_HPP
+#define __BOLT_JOIN_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/quantize/bolt.hpp"
+    #include "src/quantize/bolt_stream.hpp"
+    #include "src/utils/eigen_utils.hpp"
+#else
+    #include "bolt.hpp"
+    #include "bolt_stream.hpp"
+    #include "eigen_utils.hpp"
+#endif
+
+namespace {
+
+/**
+ * @brief Quantized centroid-to-centroid distances (or dot products) for
+ * each codebook.
+ *
+ * @details Entries are quantized like bolt_lut() output: raw * scaleby +
+ * offsets[m], with scaleby chosen so that the codebook with the widest
+ * range of values spans [0, 255] and each offset shifting its codebook's
+ * minimum to 0.
+ */
+class BoltSymmetricTables {
+public:
+    /**
+     * @param centroids Centroids in the layout from bolt_encode_centroids()
+     * @param mips Tables of dot products instead of squared L2 distances
+     */
+    BoltSymmetricTables(const float* centroids, int ncols, int ncodebooks,
+                        bool mips=false):
+        _ncodebooks(ncodebooks), _mips(mips),
+        _tables(ncodebooks * lut_sz * lut_sz), _offsets(ncodebooks)
+    {
+        int subvect_len = ncols / ncodebooks;
+        std::vector<float> raw(ncodebooks * lut_sz * lut_sz);
+        float max_range = 0;
+        for (int m = 0; m < ncodebooks; m++) {
+            // centroid c's dim j is at column (m * subvect_len + j), row c
+            auto codebook = centroids + m * subvect_len * lut_sz;
+            auto table = raw.data() + m * lut_sz * lut_sz;
+            float lo = std::numeric_limits<float>::max();
+            float hi = -std::numeric_limits<float>::max();
+            for (int a = 0; a < lut_sz; a++) {
+                for (int b = 0; b < lut_sz; b++) {
+                    float val = 0;
+                    for (int j = 0; j < subvect_len; j++) {
+                        auto ca = codebook[j * lut_sz + a];
+                        auto cb = codebook[j * lut_sz + b];
+                        val += mips ? ca * cb : (ca - cb) * (ca - cb);
+                    }
+                    table[a * lut_sz + b] = val;
+                    lo = std::min(lo, val);
+                    hi = std::max(hi, val);
+                }
+            }
+            _offsets[m] = lo;  // raw min for now; scaled below
+            max_range = std::max(max_range, hi - lo);
+        }
+        _scaleby = max_range > 0 ? 255.f / max_range : 1.f;
+        for (int m = 0; m < ncodebooks; m++) {
+            _offsets[m] = -_offsets[m] * _scaleby;
+            for (int i = 0; i < lut_sz * lut_sz; i++) {
+                auto idx = m * lut_sz * lut_sz + i;
+                auto val = raw[idx] * _scaleby + _offsets[m];
+                _tables[idx] = static_cast<uint8_t>(
+                    std::max(0.f, std::min(255.f, roundf(val))));
+            }
+        }
+    }
+
+    int ncodebooks() const { return _ncodebooks; }
+    bool mips() const { return _mips; }
+    float scaleby() const { return _scaleby; }
+    const float* offsets() const { return _offsets.data(); }
+    // row a of codebook m's table; entry b is the distance from a to b
+    const uint8_t* table_row(int m, int a) const {
+        return _tables.data() + (m * lut_sz + a) * lut_sz;
+    }
+
+    // threshold on raw distances -> threshold on summed table entries
+    double quantize_threshold(float threshold) const {
+        return bolt_quantize_threshold(threshold, _offsets.data(),
+            _ncodebooks, _scaleby);
+    }
+
+    // writes the LUT (as from bolt_lut()) for row r of a block of codes
+    void lut_for_code(const uint8_t* block, int r, uint8_t* lut) const {
+        for (int j = 0; j < _ncodebooks / 2; j++) {
+            auto byte = block[32 * j + r];
+            memcpy(lut + lut_sz * (2 * j), table_row(2 * j, byte & 0x0F),
+                   lut_sz);
+            memcpy(lut + lut_sz * (2 * j + 1), table_row(2 * j + 1, byte >> 4),
+                   lut_sz);
+        }
+    }
+
+private:
+    static constexpr int lut_sz = 16;
+    int _ncodebooks;
+    bool _mips;
+    float _scaleby;
+    std::vector<uint8_t> _tables;
+    std::vector<float> _offsets;
+};
+
+struct BoltJoinPair {
+    int64_t i;
+    int64_t j;
+    uint16_t dist;  // summed table entries; see BoltSymmetricTables
+};
+
+// runs fn(query_block) for every block of query rows, handing out blocks
+// to nthreads threads as they finish earlier ones
+template<class F>
+static inline void _bolt_join_parallel(int64_t nblocks, int nthreads, F fn) {
+    if (nthreads <= 0) {
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    nthreads = static_cast<int>(std::min<int64_t>(nthreads, nblocks));
+    std::atomic<int64_t> next_block(0);
+    auto work = [&]() {
+        int64_t b;
+        while ((b = next_block.fetch_add(1)) < nblocks) { fn(b); }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nthreads; t++) { threads.emplace_back(work); }
+    work();
+    for (auto& thread : threads) { thread.join(); }
+}
+
+/**
+ * @brief Finds each code's k nearest other codes.
+ *
+ * @param codes Codes as output by bolt_encode()
+ * @param ncodes Number of real codes; padding rows in the last block are
+ *  ignored. Pass -1 to use every row.
+ * @param nthreads Defaults to the number of hardware threads
+ * @return Neighbors of each code, best first; a code is never its own
+ *  neighbor
+ */
+static inline std::vector<BoltStreamNeighbors> bolt_knn_graph(
+    const uint8_t* codes, int64_t nblocks, int64_t ncodes,
+    const BoltSymmetricTables& tables, int k, int nthreads=-1)
+{
+    static constexpr int block_nrows = 32;
+    static constexpr int lut_sz = 16;
+    auto ncodebooks = tables.ncodebooks();
+    auto block_nbytes = block_nrows * (ncodebooks / 2);
+    auto lut_nbytes = lut_sz * ncodebooks;
+    if (ncodes < 0) { ncodes = nblocks * block_nrows; }
+    bool smaller_better = !tables.mips();
+
+    std::vector<BoltStreamNeighbors> ret(ncodes);
+    _bolt_join_parallel(nblocks, nthreads, [&](int64_t qb) {
+        auto query_block = codes + qb * block_nbytes;
+        auto nqueries = static_cast<int>(
+            std::min<int64_t>(block_nrows, ncodes - qb * block_nrows));
+        if (nqueries <= 0) { return; }
+        // Eigen storage, since bolt_scan needs the luts 32B-aligned
+        RowVector<uint8_t> luts(nqueries * lut_nbytes);
+        for (int r = 0; r < nqueries; r++) {
+            tables.lut_for_code(query_block, r, luts.data() + r * lut_nbytes);
+        }
+        RowVector<uint16_t> dists(bolt_scan_tile_nblocks(ncodebooks) * 32);
+        // one extra neighbor, since each code will find itself
+        std::vector<BoltStreamTopk> topks;
+        for (int r = 0; r < nqueries; r++) {
+            topks.emplace_back(k + 1, smaller_better);
+        }
+        bolt_scan_topk(codes, nblocks, 0, ncodes, ncodebooks, luts.data(),
+            nqueries, topks, dists.data());
+        for (int r = 0; r < nqueries; r++) {
+            auto idx = qb * block_nrows + r;
+            auto found = topks[r].finish();
+            auto& out = ret[idx];
+            for (size_t n = 0; n < found.idxs.size(); n++) {
+                if (found.idxs[n] == idx) { continue; }
+                if (static_cast<int>(out.idxs.size()) == k) { break; }
+                out.idxs.push_back(found.idxs[n]);
+                out.dists.push_back(found.dists[n]);
+            }
+        }
+    });
+    return ret;
+}
+
+/**
+ * @brief Finds all pairs of distinct codes whose distance is within a
+ * threshold; i.e., <= threshold for L2 tables, or >= for dot products.
+ *
+ * @details Since the tables are symmetric, each query block only scans
+ * blocks at or after itself, which halves the work.
+ *
+ * @param threshold Threshold on raw (unquantized) distances
+ * @return Pairs with i < j, sorted by i and then j
+ */
+static inline std::vector<BoltJoinPair> bolt_self_join(
+    const uint8_t* codes, int64_t nblocks, int64_t ncodes,
+    const BoltSymmetricTables& tables, float threshold, int nthreads=-1)
+{
+    static constexpr int block_nrows = 32;
+    static constexpr int lut_sz = 16;
+    auto ncodebooks = tables.ncodebooks();
+    auto block_nbytes = block_nrows * (ncodebooks / 2);
+    auto lut_nbytes = lut_sz * ncodebooks;
+    if (ncodes < 0) { ncodes = nblocks * block_nrows; }
+    auto thresh = tables.quantize_threshold(threshold);
+    auto tile_nblocks = bolt_scan_tile_nblocks(ncodebooks);
+
+    // one output per query block so that no locking is needed
+    std::vector<std::vector<BoltJoinPair> > block_pairs(nblocks);
+    _bolt_join_parallel(nblocks, nthreads, [&](int64_t qb) {
+        auto query_block = codes + qb * block_nbytes;
+        auto first_query = qb * block_nrows;
+        auto nqueries = static_cast<int>(
+            std::min<int64_t>(block_nrows, ncodes - first_query));
+        if (nqueries <= 0) { return; }
+        RowVector<uint8_t> luts(nqueries * lut_nbytes);
+        for (int r = 0; r < nqueries; r++) {
+            tables.lut_for_code(query_block, r, luts.data() + r * lut_nbytes);
+        }
+        // matches found for each query, in increasing order of j
+        std::vector<std::vector<int64_t> > matches(nqueries);
+        std::vector<int64_t> tile_matches;
+        for (int64_t b = qb; b < nblocks; b += tile_nblocks) {
+            auto use_nblocks = std::min(tile_nblocks, nblocks - b);
+            auto tile_first_row = b * block_nrows;
+            auto tile_ncodes = ncodes - tile_first_row;
+            auto tile_codes = codes + b * block_nbytes;
+            for (int r = 0; r < nqueries; r++) {
+                tile_matches.clear();
+                auto lut = luts.data() + r * lut_nbytes;
+                if (tables.mips()) {
+                    bolt_scan_radius<false>(tile_codes, use_nblocks,
+                        ncodebooks, lut, thresh, tile_ncodes, tile_matches);
+                } else {
+                    bolt_scan_radius<true>(tile_codes, use_nblocks,
+                        ncodebooks, lut, thresh, tile_ncodes, tile_matches);
+                }
+                auto i = first_query + r;
+                for (auto j : tile_matches) {
+                    j += tile_first_row;
+                    if (j > i) { matches[r].push_back(j); }
+                }
+            }
+        }
+        // recompute the dists of just the matches; far cheaper than
+        // keeping every dist around during the scan
+        auto& out = block_pairs[qb];
+        for (int r = 0; r < nqueries; r++) {
+            auto lut = luts.data() + r * lut_nbytes;
+            for (auto j : matches[r]) {
+                auto block = codes + (j / block_nrows) * block_nbytes;
+                int row = j % block_nrows;
+                uint16_t dist = 0;
+                for (int c = 0; c < ncodebooks / 2; c++) {
+                    auto byte = block[32 * c + row];
+                    dist += lut[lut_sz * (2 * c) + (byte & 0x0F)];
+                    dist += lut[lut_sz * (2 * c + 1) + (byte >> 4)];
+                }
+                out.push_back(BoltJoinPair{first_query + r, j, dist});
+            }
+        }
+    });
+
+    std::vector<BoltJoinPair> ret;
+    for (auto& pairs : block_pairs) {
+        ret.insert(ret.end(), pairs.begin(), pairs.end());
+    }
+    return ret;
+}
+
+} // anon namespace
+#endif // __BOLT_JOIN_HPP
@@ -0,0 +1,352 @@
+//
+//  bolt_kmeans.hpp
+//  Bolt
+//
+//  k-means over Bolt or PQ codes without reconstructing the data. Both
+//  steps of each iteration run on the codes:
+//
+//  - Assignment: each cluster center is a query, so we build one LUT per
+//    center and scan each L1-sized tile of codes with every center's LUT
+//    before moving on to the next tile, keeping a running argmin per row.
+//  - Update: the mean of the reconstructions of a cluster's rows is, in
+//    each codebook, the mean of the centroids those rows' codes point to.
+//    So we only need a histogram of codes per (cluster, codebook), and the
+//    new center is each histogram times that codebook's centroids.
+//
+//  An iteration therefore costs one pass over the codes (plus k LUTs),
+//  rather than a pass over the float data. The result is k-means on the
+//  quantized data, which is what the codes can represent anyway.
+//
+
+#ifndef __BOLT_KMEANS_HPP
+#define __BOLT_KMEANS_HPP
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <random>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "immintrin.h"
+
+#ifdef BLAZE
+    #include "src/quantize/bolt.hpp"
+    #include "src/quantize/bolt_stream.hpp"
+    #include "src/quantize/product_quantize.hpp"
+    #include "src/utils/eigen_utils.hpp"
+#else
+    #include "bolt.hpp"
+    #include "bolt_stream.hpp"
+    #include "product_quantize.hpp"
+    #include "eigen_utils.hpp"
+#endif
+
+namespace {
+
+struct CodeKmeansResult {
+    RowMatrix<float> centers;      // k x ncols
+    std::vector<int> assignments;  // cluster of each code
+    std::vector<int64_t> counts;   // number of codes in each cluster
+    // sum of each row's distance to its center, before each update; for
+    // Bolt, this is dequantized from the LUT sums, so it's approximate
+    std::vector<double> inertia;
+    int niters;
+};
+
+// ------------------------------------------------ shared helpers
+
+// picks k distinct rows, reconstructs them, and uses them as centers; with
+// no codes, the centers are all zeros
+static inline void _kmeans_init_centers(int64_t ncodes, int k, int seed,
+    const std::function<void(int64_t, float*)>& reconstruct,
+    RowMatrix<float>& centers)
+{
+    if (ncodes <= 0) {
+        centers.setZero();
+        return;
+    }
+    auto nrows = static_cast<int>(std::min<int64_t>(k, ncodes));
+    std::vector<int64_t> rows;
+    if (nrows == ncodes) {
+        // every row gets used, so no need to sample
+        for (int64_t r = 0; r < ncodes; r++) { rows.push_back(r); }
+    } else {
+        // rejection sampling, with a cap on the number of draws so that an
+        // unlucky rng can't keep us here; any rows still missing after that
+        // are the lowest ones not yet picked
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<int64_t> dist(0, ncodes - 1);
+        int64_t max_ndraws = 16 * static_cast<int64_t>(nrows) + 64;
+        for (int64_t i = 0; i < max_ndraws &&
+                static_cast<int>(rows.size()) < nrows; i++) {
+            auto r = dist(rng);
+            if (std::find(rows.begin(), rows.end(), r) == rows.end()) {
+                rows.push_back(r);
+            }
+        }
+        for (int64_t r = 0; static_cast<int>(rows.size()) < nrows; r++) {
+            if (std::find(rows.begin(), rows.end(), r) == rows.end()) {
+                rows.push_back(r);
+            }
+        }
+    }
+    for (int c = 0; c < k; c++) {
+        // if there are fewer codes than clusters, repeat some
+        reconstruct(rows[c % rows.size()], centers.row(c).data());
+    }
+}
+
+// subvector m of centers[c] = hist[c][m] * centroids[m] / counts[c];
+// centers of empty clusters are left as they were
+static inline void _kmeans_update_centers(const int64_t* hists,
+    const std::vector<int64_t>& counts, const float* centroids,
+    int ncodebooks, int lut_sz, RowMatrix<float>& centers)
+{
+    int ncols = static_cast<int>(centers.cols());
+    int subvect_len = ncols / ncodebooks;
+    for (int c = 0; c < centers.rows(); c++) {
+        if (counts[c] == 0) { continue; }
+        float inv_count = 1.f / counts[c];
+        for (int m = 0; m < ncodebooks; m++) {
+            auto hist = hists + (c * ncodebooks + m) * lut_sz;
+            // centroid a's dim j is at (m * subvect_len + j) * lut_sz + a
+            auto codebook = centroids + m * subvect_len * lut_sz;
+            for (int j = 0; j < subvect_len; j++) {
+                auto col = codebook + j * lut_sz;
+                double sum = 0;
+                for (int a = 0; a < lut_sz; a++) {
+                    sum += hist[a] * col[a];
+                }
+                centers(c, m * subvect_len + j) = sum * inv_count;
+            }
+        }
+    }
+}
+
+// where dists[i] < best_dists[i], replaces best_dists[i] with dists[i]
+// and best_idxs[i] with idx; n must be a multiple of 16
+static inline void _kmeans_argmin_update(const uint16_t* dists,
+    uint16_t* best_dists, uint16_t* best_idxs, int64_t n, uint16_t idx)
+{
+    auto idx_vect = _mm256_set1_epi16(idx);
+    for (int64_t i = 0; i < n; i += 16) {
+        auto d = load_si256i(dists + i);
+        auto best = load_si256i(best_dists + i);
+        auto idxs = load_si256i(best_idxs + i);
+        // ties keep the old (lower) index, so d must be strictly smaller
+        auto not_smaller = _mm256_cmpeq_epi16(_mm256_max_epu16(d, best), d);
+        auto new_best = _mm256_min_epu16(d, best);
+        auto new_idxs = _mm256_blendv_epi8(idx_vect, idxs, not_smaller);
+        _mm256_store_si256((__m256i*)(best_dists + i), new_best);
+        _mm256_store_si256((__m256i*)(best_idxs + i), new_idxs);
+    }
+}
+
+// ------------------------------------------------ bolt
+
+/**
+ * @brief k-means clustering of Bolt codes, computed from the codes alone.
+ *
+ * @param centroids Centroids in the layout from bolt_encode_centroids()
+ * @param codes Codes as produced by bolt_encode()
+ * @param ncodes Number of real codes; padding rows in the last block are
+ *  ignored
+ * @param offsets, scaleby LUT quantization parameters, as for bolt_lut();
+ *  these should be the ones used for L2 queries against the same codes
+ * @param k Number of clusters; at most 65535
+ * @param niters Maximum number of iterations; stops early if no
+ *  assignment changes
+ * @param init_centers Optional k x ncols row-major initial centers; if
+ *  null, k random codes are reconstructed and used instead
+ */
+static inline CodeKmeansResult bolt_kmeans(const float* centroids,
+    int ncols, const uint8_t* codes, int64_t nblocks, int ncodebooks,
+    int64_t ncodes, const float* offsets, float scaleby, int k,
+    int niters=16, const float* init_centers=nullptr, int seed=123)
+{
+    static constexpr int block_nrows = 32;
+    static constexpr int lut_sz = 16;
+    assert(k > 0 && k <= 65535);
+    int block_nbytes = block_nrows * (ncodebooks / 2);
+    int subvect_len = ncols / ncodebooks;
+
+    CodeKmeansResult ret;
+    ret.centers = RowMatrix<float>(k, ncols);
+    if (init_centers != nullptr) {
+        memcpy(ret.centers.data(), init_centers, k * ncols * sizeof(float));
+    } else {
+        _kmeans_init_centers(ncodes, k, seed, [&](int64_t r, float* out) {
+            auto block = codes + (r / block_nrows) * block_nbytes;
+            for (int m = 0; m < ncodebooks; m++) {
+                auto byte = block[block_nrows * (m / 2) + r % block_nrows];
+                auto code = (m % 2) ? byte >> 4 : byte & 0x0F;
+                auto codebook = centroids + m * subvect_len * lut_sz;
+                for (int j = 0; j < subvect_len; j++) {
+                    out[m * subvect_len + j] = codebook[j * lut_sz + code];
+                }
+            }
+        }, ret.centers);
+    }
+    ret.assignments.assign(ncodes, -1);
+    ret.counts.resize(k);
+    ret.niters = 0;
+
+    auto tile_nblocks = bolt_scan_tile_nblocks(ncodebooks);
+    int64_t tile_nrows = tile_nblocks * block_nrows;
+    ColMatrix<uint8_t> luts(lut_sz * ncodebooks, k);
+    RowVector<uint16_t> dists(tile_nrows);
+    RowVector<uint16_t> best_dists(tile_nrows);
+    RowVector<uint16_t> best_idxs(tile_nrows);
+    std::vector<int64_t> hists(k * ncodebooks * lut_sz);
+    double offset_sum = bolt_quantize_threshold(0, offsets, ncodebooks, 1);
+
+    for (int it = 0; it < niters; it++) {
+        bolt_lut(ret.centers.data(), k, ncols, centroids, ncodebooks,
+            offsets, scaleby, luts.data());
+        std::fill(hists.begin(), hists.end(), 0);
+        std::fill(ret.counts.begin(), ret.counts.end(), 0);
+        int64_t nchanged = 0;
+        double total_dist = 0;
+
+        for (int64_t b = 0; b < nblocks; b += tile_nblocks) {
+            auto use_nblocks = std::min(tile_nblocks, nblocks - b);
+            auto first_row = b * block_nrows;
+            auto nrows = std::min(use_nblocks * block_nrows,
+                                  ncodes - first_row);
+            if (nrows <= 0) { break; }
+            auto tile_codes = codes + b * block_nbytes;
+            auto tile_padded_nrows = use_nblocks * block_nrows;
+
+            // codes stay in L1 while we scan them with every center's LUT
+            best_dists.setConstant(0xFFFF);
+            best_idxs.setZero();
+            for (int c = 0; c < k; c++) {
+                bolt_scan<true, false, false>(tile_codes, use_nblocks,
+                    ncodebooks, luts.col(c).data(), dists.data());
+                _kmeans_argmin_update(dists.data(), best_dists.data(),
+                    best_idxs.data(), tile_padded_nrows, c);
+            }
+
+            for (int64_t i = 0; i < nrows; i++) {
+                int c = best_idxs(i);
+                auto row = first_row + i;
+                nchanged += ret.assignments[row] != c;
+                ret.assignments[row] = c;
+                ret.counts[c]++;
+                total_dist += best_dists(i);
+                auto block = tile_codes + (i / block_nrows) * block_nbytes;
+                auto hist = hists.data() + c * ncodebooks * lut_sz;
+                for (int j = 0; j < ncodebooks / 2; j++) {
+                    auto byte = block[block_nrows * j + i % block_nrows];
+                    hist[(2 * j) * lut_sz + (byte & 0x0F)]++;
+                    hist[(2 * j + 1) * lut_sz + (byte >> 4)]++;
+                }
+            }
+        }
+        ret.inertia.push_back((total_dist - ncodes * offset_sum) / scaleby);
+        ret.niters++;
+        if (nchanged == 0) { break; }  // centers wouldn't change either
+        _kmeans_update_centers(hists.data(), ret.counts, centroids,
+            ncodebooks, lut_sz, ret.centers);
+    }
+    return ret;
+}
+
+// ------------------------------------------------ pq
+
+/**
+ * @brief k-means clustering of 8-bit PQ codes, computed from the codes
+ * alone.
+ *
+ * @details As bolt_kmeans(), but for row-major [ncodes x ncodebooks] codes
+ * from pq_encode_8b() and centroids from pq_encode_centroids_8b(). LUTs
+ * are floats, so distances (and thus assignments) are exact for the
+ * quantized data.
+ */
+static inline CodeKmeansResult pq_kmeans(const float* centroids, int ncols,
+    const uint8_t* codes, int64_t ncodes, int ncodebooks, int k,
+    int niters=16, const float* init_centers=nullptr, int seed=123)
+{
+    static constexpr int lut_sz = 256;
+    static constexpr int target_tile_nbytes = 24 * 1024;
+    int subvect_len = ncols / ncodebooks;
+
+    CodeKmeansResult ret;
+    ret.centers = RowMatrix<float>(k, ncols);
+    if (init_centers != nullptr) {
+        memcpy(ret.centers.data(), init_centers, k * ncols * sizeof(float));
+    } else {
+        _kmeans_init_centers(ncodes, k, seed, [&](int64_t r, float* out) {
+            for (int m = 0; m < ncodebooks; m++) {
+                auto code = codes[r * ncodebooks + m];
+                auto codebook = centroids + m * subvect_len * lut_sz;
+                for (int j = 0; j < subvect_len; j++) {
+                    out[m * subvect_len + j] = codebook[j * lut_sz + code];
+                }
+            }
+        }, ret.centers);
+    }
+    ret.assignments.assign(ncodes, -1);
+    ret.counts.resize(k);
+    ret.niters = 0;
+
+    int64_t tile_nrows = std::max(target_tile_nbytes / ncodebooks, 1);
+    ColMatrix<float> luts(lut_sz * ncodebooks, k);
+    RowVector<float> dists(tile_nrows);
+    RowVector<float> best_dists(tile_nrows);
+    std::vector<int> best_idxs(tile_nrows);
+    std::vector<int64_t> hists(k * ncodebooks * lut_sz);
+
+    for (int it = 0; it < niters; it++) {
+        pq_lut_8b(ret.centers.data(), k, ncols, ncodebooks, centroids,
+            luts.data());
+        std::fill(hists.begin(), hists.end(), 0);
+        std::fill(ret.counts.begin(), ret.counts.end(), 0);
+        int64_t nchanged = 0;
+        double total_dist = 0;
+
+        for (int64_t first_row = 0; first_row < ncodes;
+             first_row += tile_nrows)
+        {
+            int nrows = static_cast<int>(
+                std::min(tile_nrows, ncodes - first_row));
+            auto tile_codes = codes + first_row * ncodebooks;
+
+            best_dists.setConstant(std::numeric_limits<float>::max());
+            for (int c = 0; c < k; c++) {
+                pq_scan_8b(tile_codes, nrows, ncodebooks, luts.col(c).data(),
+                           dists.data());
+                for (int i = 0; i < nrows; i++) {
+                    if (dists(i) < best_dists(i)) {
+                        best_dists(i) = dists(i);
+                        best_idxs[i] = c;
+                    }
+                }
+            }
+
+            for (int i = 0; i < nrows; i++) {
+                int c = best_idxs[i];
+                auto row = first_row + i;
+                nchanged += ret.assignments[row] != c;
+                ret.assignments[row] = c;
+                ret.counts[c]++;
+                total_dist += best_dists(i);
+                auto hist = hists.data() + c * ncodebooks * lut_sz;
+                auto row_codes = tile_codes + i * ncodebooks;
+                for (int m = 0; m < ncodebooks; m++) {
+                    hist[m * lut_sz + row_codes[m]]++;
+                }
+            }
+        }
+        ret.inertia.push_back(total_dist);
+        ret.niters++;
+        if (nchanged == 0) { break; }
+        _kmeans_update_centers(hists.data(), ret.counts, centroids,
+            ncodebooks, lut_sz, ret.centers);
+    }
+    return ret;
+}
+
+} // anon namespace
+#endif // __BOLT_KMEANS_HPP
@@ -0,0 +1,144 @@
+//
+//  bolt_pipeline.hpp
+//  Bolt
+//
+//  Asynchronous Bolt queries, pipelined so that building LUTs for upcoming
+//  queries happens on one set of threads while scans for earlier queries
+//  run on another. In steady state, the time to build each LUT is hidden
+//  behind the time to scan, instead of adding to it like in query().
+//
+
+#ifndef __BOLT_PIPELINE_HPP
+#define __BOLT_PIPELINE_HPP
+
+#include <future>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/quantize/bolt.hpp"
+    #include "src/quantize/bolt_stream.hpp"
+    #include "src/utils/eigen_utils.hpp"
+    #include "src/utils/thread_utils.hpp"
+#else
+    #include "bolt.hpp"
+    #include "bolt_stream.hpp"
+    #include "eigen_utils.hpp"
+    #include "thread_utils.hpp"
+#endif
+
+namespace {
+
+struct BoltPipelineConfig {
+    int k = 10;
+    int nlut_threads = 1;
+    int nscan_threads = 1;
+    // LUTs built but not yet scanned; bounds memory and how far ahead
+    // the LUT threads can run
+    int max_pending_luts = 16;
+    bool mips = false;  // max inner product instead of min L2 distance
+};
+
+/**
+ * @brief Answers kNN queries against a fixed set of Bolt codes via a
+ * two-stage LUT -> scan pipeline.
+ *
+ * @details The centroids, codes, and offsets are borrowed, not copied, and
+ * must outlive the pipeline. Arguments are as for BoltQueryService.
+ */
+class BoltQueryPipeline {
+public:
+    BoltQueryPipeline(const float* centroids, int ncols,
+                      const uint8_t* codes, int64_t nblocks, int ncodebooks,
+                      int64_t ncodes, const float* offsets, float scaleby,
+                      const BoltPipelineConfig& config=BoltPipelineConfig()):
+        _centroids(centroids), _ncols(ncols), _codes(codes),
+        _nblocks(nblocks), _ncodebooks(ncodebooks), _ncodes(ncodes),
+        _offsets(offsets), _scaleby(scaleby), _config(config),
+        _scan_queue(config.max_pending_luts)
+    {
+        for (int i = 0; i < config.nlut_threads; i++) {
+            _lut_threads.emplace_back([this]() { _lut_loop(); });
+        }
+        for (int i = 0; i < config.nscan_threads; i++) {
+            _scan_threads.emplace_back([this]() { _scan_loop(); });
+        }
+    }
+
+    // answers every query already submitted before returning
+    ~BoltQueryPipeline() {
+        _lut_queue.close();
+        for (auto& t : _lut_threads) { t.join(); }
+        _scan_queue.close();
+        for (auto& t : _scan_threads) { t.join(); }
+    }
+    BoltQueryPipeline(const BoltQueryPipeline&) = delete;
+    BoltQueryPipeline& operator=(const BoltQueryPipeline&) = delete;
+
+    // q is copied, so it needn't outlive the call
+    std::future<BoltStreamNeighbors> submit(const float* q) {
+        std::unique_ptr<Job> job(new Job());
+        job->q = RowVector<float>(_ncols);
+        memcpy(job->q.data(), q, _ncols * sizeof(float));
+        auto ret = job->promise.get_future();
+        _lut_queue.push(std::move(job));
+        return ret;
+    }
+
+private:
+    struct Job {
+        RowVector<float> q;
+        RowVector<uint8_t> lut;  // Eigen storage, so it's 32B-aligned
+        std::promise<BoltStreamNeighbors> promise;
+    };
+
+    void _lut_loop() {
+        std::unique_ptr<Job> job;
+        while (_lut_queue.pop(job)) {
+            job->lut = RowVector<uint8_t>(16 * _ncodebooks);
+            if (_config.mips) {
+                bolt_lut<Reductions::DotProd>(job->q.data(), _ncols,
+                    _centroids, _ncodebooks, _offsets, _scaleby,
+                    job->lut.data());
+            } else {
+                bolt_lut<Reductions::DistL2>(job->q.data(), _ncols,
+                    _centroids, _ncodebooks, _offsets, _scaleby,
+                    job->lut.data());
+            }
+            _scan_queue.push(std::move(job));  // blocks if scans are behind
+        }
+    }
+
+    void _scan_loop() {
+        RowVector<uint16_t> dists(bolt_scan_tile_nblocks(_ncodebooks) * 32);
+        std::unique_ptr<Job> job;
+        while (_scan_queue.pop(job)) {
+            std::vector<BoltStreamTopk> topks(
+                1, BoltStreamTopk(_config.k, !_config.mips));
+            bolt_scan_topk(_codes, _nblocks, 0, _ncodes, _ncodebooks,
+                job->lut.data(), 1, topks, dists.data());
+            job->promise.set_value(topks[0].finish());
+        }
+    }
+
+    const float* _centroids;
+    int _ncols;
+    const uint8_t* _codes;
+    int64_t _nblocks;
+    int _ncodebooks;
+    int64_t _ncodes;
+    const float* _offsets;
+    float _scaleby;
+    BoltPipelineConfig _config;
+
+    BlockingQueue<std::unique_ptr<Job> > _lut_queue;
+    BlockingQueue<std::unique_ptr<Job> > _scan_queue;
+    std::vector<std::thread> _lut_threads;
+    std::vector<std::thread> _scan_threads;
+};
+
+} // anon namespace
+#endif // __BOLT_PIPELINE_HPP
@@ -0,0 +1,461 @@
+//
+//  bolt_service.hpp
+//  Bolt
+//
+//  Reference query service for Bolt codes that batches requests. Single-
+//  vector queries are queued and grouped into micro-batches, either when
+//  a batch fills up or when its oldest request has waited out the latency
+//  budget. Each batch gets its LUTs built together and then makes a single
+//  pass over the codes, so under load the codes are read once per batch
+//  rather than once per request.
+//
+//  BoltQueryService is the in-process interface. BoltSocketServer serves
+//  it over a Unix domain socket, and bolt_service_load_test() is an
+//  open-loop load generator that reports latency percentiles and QPS.
+//
+
+#ifndef __BOLT_SERVICE_HPP
+#define __BOLT_SERVICE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/quantize/bolt.hpp"
+    #include "src/quantize/bolt_stream.hpp"
+    #include "src/utils/eigen_utils.hpp"
+#else
+    #include "bolt.hpp"
+    #include "bolt_stream.hpp"
+    #include "eigen_utils.hpp"
+#endif
+
+namespace {
+
+struct BoltServiceConfig {
+    int k = 10;
+    int max_batch_size = 32;
+    int64_t max_wait_us = 500;  // latency budget for forming a batch
+    bool mips = false;  // max inner product instead of min L2 distance
+};
+
+/**
+ * @brief Answers kNN queries against a fixed set of Bolt codes on a
+ * background thread, batching whatever requests arrive close together.
+ *
+ * @details The centroids, codes, and offsets are borrowed, not copied, and
+ * must outlive the service.
+ *
+ * @param centroids Centroids in the layout from bolt_encode_centroids()
+ * @param codes Codes as output by bolt_encode()
+ * @param ncodes Number of real codes; rows past this are block padding
+ * @param offsets, scaleby LUT quantization params, as for bolt_lut()
+ */
+class BoltQueryService {
+public:
+    using Callback = std::function<void(BoltStreamNeighbors&&)>;
+    using clock = std::chrono::steady_clock;
+
+    BoltQueryService(const float* centroids, int ncols,
+                     const uint8_t* codes, int64_t nblocks, int ncodebooks,
+                     int64_t ncodes, const float* offsets, float scaleby,
+                     const BoltServiceConfig& config=BoltServiceConfig()):
+        _centroids(centroids), _ncols(ncols), _codes(codes),
+        _nblocks(nblocks), _ncodebooks(ncodebooks), _ncodes(ncodes),
+        _offsets(offsets), _scaleby(scaleby), _config(config)
+    {
+        _worker = std::thread([this]() { _worker_loop(); });
+    }
+
+    // answers every request already submitted before returning
+    ~BoltQueryService() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_all();
+        _worker.join();
+    }
+    BoltQueryService(const BoltQueryService&) = delete;
+    BoltQueryService& operator=(const BoltQueryService&) = delete;
+
+    int ncols() const { return _ncols; }
+    int k() const { return _config.k; }
+
+    // q is copied, so it needn't outlive the call; cb runs on the worker
+    void submit(const float* q, Callback cb) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queue.push_back(Request{
+                std::vector<float>(q, q + _ncols), std::move(cb), clock::now()});
+        }
+        _cv.notify_one();
+    }
+
+    std::future<BoltStreamNeighbors> submit(const float* q) {
+        auto promise = std::make_shared<std::promise<BoltStreamNeighbors> >();
+        auto ret = promise->get_future();
+        submit(q, [promise](BoltStreamNeighbors&& neighbors) {
+            promise->set_value(std::move(neighbors));
+        });
+        return ret;
+    }
+
+    int64_t nbatches() const { return _nbatches; }
+    int64_t nqueries() const { return _nqueries; }
+
+private:
+    struct Request {
+        std::vector<float> q;
+        Callback cb;
+        clock::time_point arrival;
+    };
+
+    void _worker_loop() {
+        std::vector<Request> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.wait(lock, [this]() { return _stop || !_queue.empty(); });
+                if (_queue.empty()) { return; }  // stopped and drained
+                // wait for the batch to fill, but only as long as the oldest
+                // request's budget allows
+                auto deadline = _queue.front().arrival +
+                    std::chrono::microseconds(_config.max_wait_us);
+                _cv.wait_until(lock, deadline, [this]() {
+                    return _stop ||
+                        _queue.size() >= (size_t)_config.max_batch_size;
+                });
+                auto nq = std::min(_queue.size(),
+                                   (size_t)_config.max_batch_size);
+                for (size_t i = 0; i < nq; i++) {
+                    batch.push_back(std::move(_queue.front()));
+                    _queue.pop_front();
+                }
+            }
+            _run_batch(batch);
+            batch.clear();
+        }
+    }
+
+    void _run_batch(std::vector<Request>& batch) {
+        static constexpr int lut_sz = 16;
+        int nq = static_cast<int>(batch.size());
+        RowMatrix<float> Q(nq, _ncols);
+        for (int i = 0; i < nq; i++) {
+            memcpy(Q.row(i).data(), batch[i].q.data(), _ncols * sizeof(float));
+        }
+        _luts.resize(nq * _ncodebooks * lut_sz);
+        if (_config.mips) {
+            bolt_lut<Reductions::DotProd>(Q.data(), nq, _ncols, _centroids,
+                _ncodebooks, _offsets, _scaleby, _luts.data());
+        } else {
+            bolt_lut<Reductions::DistL2>(Q.data(), nq, _ncols, _centroids,
+                _ncodebooks, _offsets, _scaleby, _luts.data());
+        }
+        std::vector<BoltStreamTopk> topks;
+        for (int i = 0; i < nq; i++) {
+            topks.emplace_back(_config.k, !_config.mips);
+        }
+        _dists.resize(bolt_scan_tile_nblocks(_ncodebooks) * 32);
+        bolt_scan_topk(_codes, _nblocks, 0, _ncodes, _ncodebooks,
+            _luts.data(), nq, topks, _dists.data());
+        _nbatches++;
+        _nqueries += nq;
+        for (int i = 0; i < nq; i++) {
+            batch[i].cb(topks[i].finish());
+        }
+    }
+
+    const float* _centroids;
+    int _ncols;
+    const uint8_t* _codes;
+    int64_t _nblocks;
+    int _ncodebooks;
+    int64_t _ncodes;
+    const float* _offsets;
+    float _scaleby;
+    BoltServiceConfig _config;
+
+    RowVector<uint8_t> _luts;  // Eigen storage, so they're 32B-aligned
+    RowVector<uint16_t> _dists;
+    std::atomic<int64_t> _nbatches{0};
+    std::atomic<int64_t> _nqueries{0};
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Request> _queue;
+    bool _stop = false;
+    std::thread _worker;  // last, so everything else exists when it starts
+};
+
+// ------------------------------------------------ unix domain socket
+
+// send / receive exactly nbytes, or fail; retries if interrupted. Sends
+// use MSG_NOSIGNAL so that a peer that hung up is an EPIPE for this
+// connection rather than a SIGPIPE that kills the process
+static inline bool _socket_io_all(int fd, void* buff, size_t nbytes,
+                                  bool write_not_read)
+{
+    auto ptr = static_cast<uint8_t*>(buff);
+    while (nbytes > 0) {
+        auto n = write_not_read ? send(fd, ptr, nbytes, MSG_NOSIGNAL) :
+            recv(fd, ptr, nbytes, 0);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return false; }
+        ptr += n;
+        nbytes -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Serves a BoltQueryService over a Unix domain socket.
+ *
+ * @details Protocol: each request is ncols float32s; each response is k
+ * int64 indices, padded with -1 if there are fewer than k codes. A
+ * connection can send any number of requests, one at a time.
+ *
+ * Each connection gets a thread, which the accept loop joins once the
+ * connection closes. If accept() runs out of file descriptors or memory,
+ * the loop backs off before trying again; on any other error it stops
+ * accepting.
+ */
+class BoltSocketServer {
+public:
+    BoltSocketServer(BoltQueryService& service, const std::string& path):
+        _service(service), _path(path)
+    {
+        _listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path.c_str());
+        if (_listen_fd < 0 ||
+            bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(_listen_fd, 64) != 0)
+        {
+            fprintf(stderr, "ERROR: could not listen on socket '%s'\n",
+                path.c_str());
+            if (_listen_fd >= 0) { close(_listen_fd); }
+            _listen_fd = -1;
+            return;
+        }
+        _accept_thread = std::thread([this]() { _accept_loop(); });
+    }
+
+    ~BoltSocketServer() {
+        if (_listen_fd < 0) { return; }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+            // unblock the accept and any reads waiting on clients
+            shutdown(_listen_fd, SHUT_RDWR);
+            for (auto fd : _conn_fds) { shutdown(fd, SHUT_RDWR); }
+        }
+        _cv.notify_all();  // in case the accept loop is backing off
+        _accept_thread.join();
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this]() { return _conn_threads.empty(); });
+        }
+        _join_finished();
+        close(_listen_fd);
+        unlink(_path.c_str());
+    }
+    BoltSocketServer(const BoltSocketServer&) = delete;
+    BoltSocketServer& operator=(const BoltSocketServer&) = delete;
+
+    bool ok() const { return _listen_fd >= 0; }
+
+    // connections whose threads haven't been joined yet
+    size_t nconnection_threads() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _conn_threads.size() + _finished_threads.size();
+    }
+
+private:
+    void _accept_loop() {
+        static constexpr auto backoff = std::chrono::milliseconds(10);
+        while (true) {
+            int fd = accept(_listen_fd, nullptr, nullptr);
+            int err = errno;
+            _join_finished();
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_stop) {
+                if (fd >= 0) { close(fd); }
+                return;
+            }
+            if (fd < 0) {
+                if (err == EINTR || err == ECONNABORTED) { continue; }
+                if (err == EMFILE || err == ENFILE || err == ENOBUFS ||
+                    err == ENOMEM)
+                {
+                    // wait for connections to close instead of spinning
+                    _cv.wait_for(lock, backoff, [this]() { return _stop; });
+                    continue;
+                }
+                fprintf(stderr, "ERROR: accept on socket '%s' failed: %s\n",
+                    _path.c_str(), strerror(err));
+                return;
+            }
+            _conn_fds.push_back(fd);
+            auto id = _next_conn_id++;
+            _conn_threads[id] = std::thread([this, fd, id]() {
+                _serve(fd, id);
+            });
+        }
+    }
+
+    void _join_finished() {
+        std::vector<std::thread> finished;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            finished.swap(_finished_threads);
+        }
+        for (auto& t : finished) { t.join(); }
+    }
+
+    void _serve(int fd, int64_t id) {
+        auto ncols = _service.ncols();
+        auto k = _service.k();
+        std::vector<float> q(ncols);
+        std::vector<int64_t> idxs(k);
+        while (_socket_io_all(fd, q.data(), ncols * sizeof(float), false)) {
+            auto neighbors = _service.submit(q.data()).get();
+            std::fill(idxs.begin(), idxs.end(), -1);
+            std::copy(neighbors.idxs.begin(), neighbors.idxs.end(),
+                      idxs.begin());
+            if (!_socket_io_all(fd, idxs.data(), k * sizeof(int64_t), true)) {
+                break;
+            }
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _conn_fds.erase(std::find(_conn_fds.begin(), _conn_fds.end(), fd));
+        close(fd);
+        // can't join ourselves, so hand our thread to the accept loop
+        auto it = _conn_threads.find(id);
+        _finished_threads.push_back(std::move(it->second));
+        _conn_threads.erase(it);
+        _cv.notify_all();
+    }
+
+    BoltQueryService& _service;
+    std::string _path;
+    int _listen_fd = -1;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _stop = false;
+    std::vector<int> _conn_fds;
+    int64_t _next_conn_id = 0;
+    std::map<int64_t, std::thread> _conn_threads;  // still serving
+    std::vector<std::thread> _finished_threads;    // done; need joining
+    std::thread _accept_thread;
+};
+
+// client side of the protocol above; returns -1 on failure
+static inline int bolt_socket_connect(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) { return -1; }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline bool bolt_socket_query(int fd, const float* q, int ncols,
+                                     int k, int64_t* idxs_out)
+{
+    return _socket_io_all(fd, const_cast<float*>(q), ncols * sizeof(float),
+                          true) &&
+        _socket_io_all(fd, idxs_out, k * sizeof(int64_t), false);
+}
+
+// ------------------------------------------------ load generator
+
+struct BoltLoadTestStats {
+    double offered_qps;
+    double achieved_qps;
+    double p50_ms;
+    double p99_ms;
+    double mean_batch_size;
+};
+
+/**
+ * @brief Open-loop load test: submits nrequests queries (cycling through
+ * the rows of Q) with exponentially distributed gaps averaging 1 /
+ * offered_qps, regardless of how fast they're answered, and measures
+ * each request's latency from its scheduled send time to its answer.
+ */
+static inline BoltLoadTestStats bolt_service_load_test(
+    BoltQueryService& service, const RowMatrix<float>& Q, double offered_qps,
+    int nrequests, int seed=123)
+{
+    using clock = BoltQueryService::clock;
+    BoltLoadTestStats stats {offered_qps, 0, 0, 0, 0};
+    if (nrequests <= 0) { return stats; }
+    std::vector<double> latencies_ms(nrequests);
+    std::atomic<int> ndone{0};
+    std::mt19937 rng(seed);
+    std::exponential_distribution<double> gap_s(offered_qps);
+    auto nbatches_before = service.nbatches();
+    auto nqueries_before = service.nqueries();
+
+    auto t_start = clock::now();
+    auto t_send = t_start;
+    for (int i = 0; i < nrequests; i++) {
+        t_send += std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(gap_s(rng)));
+        std::this_thread::sleep_until(t_send);
+        auto scheduled = t_send;
+        auto& latency = latencies_ms[i];
+        service.submit(Q.row(i % Q.rows()).data(),
+            [scheduled, &latency, &ndone](BoltStreamNeighbors&&) {
+                latency = std::chrono::duration<double, std::milli>(
+                    clock::now() - scheduled).count();
+                ndone++;
+            });
+    }
+    while (ndone < nrequests) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    auto elapsed_s = std::chrono::duration<double>(
+        clock::now() - t_start).count();
+
+    stats.achieved_qps = nrequests / elapsed_s;
+    std::sort(latencies_ms.begin(), latencies_ms.end());
+    stats.p50_ms = latencies_ms[nrequests / 2];
+    stats.p99_ms = latencies_ms[std::min(nrequests - 1,
+                                         (int)(nrequests * .99))];
+    auto nbatches = service.nbatches() - nbatches_before;
+    stats.mean_batch_size = nbatches > 0 ?
+        (double)(service.nqueries() - nqueries_before) / nbatches : 0;
+    return stats;
+}
+
+} // anon namespace
+#endif // __BOLT_SERVICE_HPP
@@ -0,0 +1,300 @@
+//
+//  bolt_sharded.hpp
+//  Bolt
+//
+//  Multithreaded, NUMA-aware Bolt scan. Code blocks are split into one
+//  contiguous shard per NUMA node, each copied into huge-page-backed memory
+//  on its node; queries are answered by a persistent pool of scan threads
+//  pinned to each shard's node, each with its own copy of the LUTs in the
+//  same kind of memory, so every thread reads only local memory, and their
+//  top k lists are merged at the end.
+//
+
+#ifndef __BOLT_SHARDED_HPP
+#define __BOLT_SHARDED_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/quantize/bolt_stream.hpp"
+    #include "src/utils/numa_memory.hpp"
+    #include "src/utils/thread_utils.hpp"
+#else
+    #include "bolt_stream.hpp"
+    #include "numa_memory.hpp"
+    #include "thread_utils.hpp"
+#endif
+
+namespace {
+
+class BoltShardedCodes {
+public:
+    /**
+     * @param codes Codes as output by bolt_encode()
+     * @param nshards Number of shards; defaults to the number of NUMA
+     *  nodes. Shard i lives on node i % numa_num_nodes().
+     * @param pages Page size to back each shard, and the scan threads'
+     *  copies of the LUTs, with, if available
+     *
+     * If the memory for a shard can't be allocated at all, ok() is false
+     * and bolt_sharded_knn() returns no results.
+     */
+    BoltShardedCodes(const uint8_t* codes, int64_t nblocks, int ncodebooks,
+                     int nshards=-1, PageKind pages=PageKind::Huge2MB):
+        _ncodebooks(ncodebooks), _nblocks(nblocks), _pages(pages)
+    {
+        int nnodes = numa_num_nodes();
+        if (nshards <= 0) { nshards = nnodes; }
+        nshards = static_cast<int>(std::min<int64_t>(nshards, nblocks));
+        nshards = std::max(nshards, 1);
+        auto block_nbytes = _block_nbytes();
+        _shards.resize(nshards);
+        std::vector<std::thread> threads;
+        for (int s = 0; s < nshards; s++) {
+            auto& shard = _shards[s];
+            shard.node = s % nnodes;
+            shard.first_block = (nblocks * s) / nshards;
+            shard.nblocks = (nblocks * (s + 1)) / nshards - shard.first_block;
+            // copy from a thread on the shard's node so that, even without
+            // mbind, first touch puts the pages there
+            threads.emplace_back([&shard, codes, block_nbytes, pages]() {
+                pin_thread_to_numa_node(shard.node);
+                auto nbytes = shard.nblocks * block_nbytes;
+                shard.buff = PageBuffer(nbytes, pages, shard.node);
+                if (shard.buff.ok() && nbytes > 0) {
+                    memcpy(shard.buff.data(),
+                        codes + shard.first_block * block_nbytes, nbytes);
+                }
+            });
+        }
+        for (auto& t : threads) { t.join(); }
+        for (const auto& shard : _shards) {
+            _ok = _ok && shard.buff.ok();
+        }
+    }
+
+    bool ok() const { return _ok; }
+    PageKind requested_page_kind() const { return _pages; }
+
+    int ncodebooks() const { return _ncodebooks; }
+    int64_t nblocks() const { return _nblocks; }
+    int nshards() const { return static_cast<int>(_shards.size()); }
+    int shard_node(int s) const { return _shards[s].node; }
+    int64_t shard_first_block(int s) const { return _shards[s].first_block; }
+    int64_t shard_nblocks(int s) const { return _shards[s].nblocks; }
+    const uint8_t* shard_codes(int s) const { return _shards[s].buff.data(); }
+    PageKind shard_page_kind(int s) const {
+        return _shards[s].buff.page_kind();
+    }
+
+private:
+    struct Shard {
+        PageBuffer buff;
+        int node;
+        int64_t first_block;
+        int64_t nblocks;
+    };
+    int64_t _block_nbytes() const { return 32 * (_ncodebooks / 2); }
+
+    int _ncodebooks;
+    int64_t _nblocks;
+    PageKind _pages;
+    bool _ok = true;
+    std::vector<Shard> _shards;
+};
+
+/**
+ * @brief Persistent pool of scan threads for a BoltShardedCodes, with
+ * threads_per_shard threads pinned to each shard's node.
+ *
+ * @details Each worker is started, pinned, and given its node-local LUT
+ * buffer once, rather than once per query, so that small queries don't
+ * pay for spawning threads and mapping pages. knn() hands each batch of
+ * queries to every worker's queue and merges their top k lists; it can be
+ * called from several threads at once. The codes are borrowed, not
+ * copied, and must outlive the scanner.
+ */
+class BoltShardedScanner {
+public:
+    BoltShardedScanner(const BoltShardedCodes& codes, int threads_per_shard=1):
+        _codes(codes)
+    {
+        threads_per_shard = std::max(threads_per_shard, 1);
+        int nworkers = codes.nshards() * threads_per_shard;
+        for (int w = 0; w < nworkers; w++) {
+            _queues.emplace_back(new BlockingQueue<_Batch*>());
+        }
+        for (int s = 0; s < codes.nshards(); s++) {
+            auto shard_nblocks = codes.shard_nblocks(s);
+            for (int t = 0; t < threads_per_shard; t++) {
+                int w = s * threads_per_shard + t;
+                auto b0 = (shard_nblocks * t) / threads_per_shard;
+                auto b1 = (shard_nblocks * (t + 1)) / threads_per_shard;
+                _workers.emplace_back([this, w, s, b0, b1]() {
+                    _worker_loop(w, s, b0, b1);
+                });
+            }
+        }
+    }
+
+    ~BoltShardedScanner() {
+        for (auto& queue : _queues) { queue->close(); }
+        for (auto& t : _workers) { t.join(); }
+    }
+    BoltShardedScanner(const BoltShardedScanner&) = delete;
+    BoltShardedScanner& operator=(const BoltShardedScanner&) = delete;
+
+    int nworkers() const { return static_cast<int>(_workers.size()); }
+
+    /**
+     * @brief Find the k nearest codes for each of nqueries queries.
+     *
+     * @param luts nqueries consecutive lookup tables, each of
+     *  16 * ncodebooks bytes, as produced by bolt_lut(); must be 32B-aligned
+     * @param ncodes Number of real codes; codes past this (padding in the
+     *  last block) are ignored. Pass -1 to use every code.
+     */
+    std::vector<BoltStreamNeighbors> knn(const uint8_t* luts, int nqueries,
+        int k, int64_t ncodes=-1, bool smaller_better=true)
+    {
+        static constexpr int block_nrows = 32;
+        if (!_codes.ok()) { return {}; }
+        if (ncodes < 0) { ncodes = _codes.nblocks() * block_nrows; }
+        _Batch batch;
+        batch.luts = luts;
+        batch.nqueries = nqueries;
+        batch.k = k;
+        batch.ncodes = ncodes;
+        batch.smaller_better = smaller_better;
+        batch.worker_results.resize(_queues.size());
+        batch.nremaining = static_cast<int>(_queues.size());
+        for (auto& queue : _queues) { queue->push(&batch); }
+        {
+            std::unique_lock<std::mutex> lock(batch.mutex);
+            batch.done.wait(lock, [&batch]() { return batch.nremaining == 0; });
+        }
+
+        std::vector<BoltStreamNeighbors> ret;
+        for (int q = 0; q < nqueries; q++) {
+            BoltStreamTopk topk(k, smaller_better);
+            for (const auto& results : batch.worker_results) {
+                topk.merge(results[q]);
+            }
+            ret.push_back(topk.finish());
+        }
+        return ret;
+    }
+
+private:
+    // lives on the stack of the knn() call that made it, which waits for
+    // every worker to finish with it
+    struct _Batch {
+        const uint8_t* luts;
+        int nqueries;
+        int k;
+        int64_t ncodes;
+        bool smaller_better;
+        std::vector<std::vector<BoltStreamNeighbors> > worker_results;
+        std::mutex mutex;
+        std::condition_variable done;
+        int nremaining;
+    };
+
+    // scans blocks [b0, b1) of shard s for each batch in queue w
+    void _worker_loop(int w, int s, int64_t b0, int64_t b1) {
+        static constexpr int block_nrows = 32;
+        static constexpr int lut_sz = 16;
+        auto node = _codes.shard_node(s);
+        pin_thread_to_numa_node(node);
+        auto ncodebooks = _codes.ncodebooks();
+        int block_nbytes = block_nrows * (ncodebooks / 2);
+        auto first_row = (_codes.shard_first_block(s) + b0) * block_nrows;
+        auto shard_codes = _codes.shard_codes(s) + b0 * block_nbytes;
+
+        // node-local copy of the luts, since they're read constantly; it's
+        // only reallocated when a batch has more queries than any before
+        PageBuffer luts_buff;
+        RowVector<uint8_t> fallback_luts;
+        uint8_t* local_luts = nullptr;
+        int64_t luts_capacity = 0;
+        RowVector<uint16_t> dists(
+            bolt_scan_tile_nblocks(ncodebooks) * block_nrows);
+        std::vector<BoltStreamTopk> topks;
+
+        _Batch* batch;
+        while (_queues[w]->pop(batch)) {
+            int64_t luts_nbytes = static_cast<int64_t>(batch->nqueries) *
+                ncodebooks * lut_sz;
+            if (luts_nbytes > luts_capacity) {
+                local_luts = _alloc_luts(luts_nbytes, node, luts_buff,
+                                         fallback_luts);
+                luts_capacity = luts_nbytes;
+            }
+            memcpy(local_luts, batch->luts, luts_nbytes);
+            topks.clear();
+            for (int q = 0; q < batch->nqueries; q++) {
+                topks.emplace_back(batch->k, batch->smaller_better);
+            }
+            bolt_scan_topk(shard_codes, b1 - b0, first_row, batch->ncodes,
+                ncodebooks, local_luts, batch->nqueries, topks, dists.data());
+            auto& results = batch->worker_results[w];
+            for (auto& topk : topks) {
+                results.push_back(topk.finish());
+            }
+            // notify while holding the lock, since once nremaining hits 0
+            // knn() may return and destroy the batch
+            std::lock_guard<std::mutex> lock(batch->mutex);
+            if (--batch->nremaining == 0) { batch->done.notify_one(); }
+        }
+    }
+
+    // on the same kind of pages as the codes unless the luts would fit in
+    // less than one huge page, which would just have to be zeroed;
+    // page-aligned, so also 32B-aligned as bolt_scan needs. Plain Eigen
+    // storage if no pages can be mapped
+    uint8_t* _alloc_luts(int64_t nbytes, int node, PageBuffer& buff,
+                         RowVector<uint8_t>& fallback) const
+    {
+        auto pages = nbytes >= (2 << 20) ?
+            _codes.requested_page_kind() : PageKind::Small;
+        buff = PageBuffer(nbytes, pages, node);
+        if (buff.ok()) { return buff.data(); }
+        fallback.resize(nbytes);
+        return fallback.data();
+    }
+
+    const BoltShardedCodes& _codes;
+    std::vector<std::unique_ptr<BlockingQueue<_Batch*> > > _queues;
+    std::vector<std::thread> _workers;  // last, so the queues exist first
+};
+
+/**
+ * @brief Find the k nearest codes for each of nqueries queries using
+ * threads_per_shard threads pinned to each shard's node.
+ *
+ * @details Starts and stops a BoltShardedScanner for just these queries;
+ * to answer many batches, keep a scanner around instead.
+ *
+ * @param luts nqueries consecutive lookup tables, each of
+ *  16 * ncodebooks bytes, as produced by bolt_lut(); must be 32B-aligned
+ * @param ncodes Number of real codes; codes past this (padding in the
+ *  last block) are ignored. Pass -1 to use every code.
+ */
+static inline std::vector<BoltStreamNeighbors> bolt_sharded_knn(
+    const BoltShardedCodes& codes, const uint8_t* luts, int nqueries, int k,
+    int64_t ncodes=-1, bool smaller_better=true, int threads_per_shard=1)
+{
+    if (!codes.ok()) { return {}; }
+    BoltShardedScanner scanner(codes, threads_per_shard);
+    return scanner.knn(luts, nqueries, k, ncodes, smaller_better);
+}
+
+} // anon namespace
+#endif // __BOLT_SHARDED_HPP
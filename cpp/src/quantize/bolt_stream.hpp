@@ -0,0 +1,548 @@
+//
+//  bolt_stream.hpp
+//  Bolt
+//
+//  Out-of-core Bolt scan for code sets too large to hold in memory. Codes
+//  are stored in a file exactly as bolt_encode() lays them out in memory
+//  (a sequence of [32 x NBytes] column-major blocks) and are read in large,
+//  block-aligned chunks. While one chunk is being scanned, the next is
+//  being read, so a scan is bound by whichever of disk and the scan kernel
+//  is slower, and memory use is two chunks no matter how many codes there
+//  are.
+//
+//  Reads use io_uring if built with BOLT_HAVE_LIBURING, and otherwise a
+//  pread on a background thread. Both open the file with O_DIRECT when the
+//  filesystem allows it so that streaming codes doesn't evict everything
+//  else from the page cache. O_DIRECT needs aligned offsets and lengths, so
+//  the rest of a read that the kernel only partially satisfied is finished
+//  through a second, buffered descriptor.
+//
+
+#ifndef __BOLT_STREAM_HPP
+#define __BOLT_STREAM_HPP
+
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <future>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include "immintrin.h"
+
+#ifdef BOLT_HAVE_LIBURING
+    #include <liburing.h>
+#endif
+
+#ifdef BLAZE
+    #include "src/quantize/bolt.hpp"
+    #include "src/utils/eigen_utils.hpp"
+#else
+    #include "bolt.hpp"
+    #include "eigen_utils.hpp"
+#endif
+
+namespace {
+
+static constexpr int kBoltStreamIOAlignBytes = 4096;  // O_DIRECT alignment
+static constexpr int64_t kBoltStreamDefaultChunkNBytes = 8 << 20;
+
+/** Write codes, as produced by bolt_encode(), to a file that
+ * BoltCodeReader can stream; returns false on failure.
+ */
+static inline bool bolt_write_codes(const std::string& path,
+    const uint8_t* codes, int64_t nblocks, int ncodebooks)
+{
+    FILE* f = fopen(path.c_str(), "wb");
+    if (f == nullptr) { return false; }
+    int64_t nbytes = nblocks * 32 * (ncodebooks / 2);
+    auto nwritten = fwrite(codes, 1, nbytes, f);
+    bool ok = (fclose(f) == 0) && (static_cast<int64_t>(nwritten) == nbytes);
+    return ok;
+}
+
+/**
+ * @brief Reads a file of Bolt codes as a sequence of chunks, each of which
+ * is a whole number of 32-row blocks, prefetching one chunk ahead.
+ *
+ * @details The pointer returned by next_chunk() stays valid until the
+ * following call to next_chunk(), during which the chunk after it is
+ * already being read into the other buffer.
+ */
+class BoltCodeReader {
+public:
+    BoltCodeReader(const std::string& path, int ncodebooks,
+                   int64_t target_chunk_nbytes=kBoltStreamDefaultChunkNBytes,
+                   bool direct_io=true):
+        _block_nbytes(32 * (ncodebooks / 2))
+    {
+        if (direct_io) {
+            _fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+            _direct_io = _fd >= 0;
+            if (_direct_io) {
+                _rest_fd = open(path.c_str(), O_RDONLY);
+                if (_rest_fd < 0) {
+                    close(_fd);
+                    _fd = -1;
+                    _direct_io = false;
+                }
+            }
+        }
+        if (_fd < 0) {  // O_DIRECT not requested or not supported here
+            _fd = open(path.c_str(), O_RDONLY);
+            if (_fd >= 0) {
+                posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            }
+            _rest_fd = _fd;
+        }
+        if (_fd < 0) {
+            fprintf(stderr, "ERROR: could not open code file '%s'\n",
+                path.c_str());
+            return;
+        }
+        struct stat st;
+        if (fstat(_fd, &st) != 0 || st.st_size % _block_nbytes != 0) {
+            fprintf(stderr, "ERROR: size of code file '%s' is not a whole "
+                "number of %d-byte blocks\n", path.c_str(), _block_nbytes);
+            _close_fds();
+            return;
+        }
+        _nblocks = st.st_size / _block_nbytes;
+
+        // chunks have to be a whole number of blocks, and, for O_DIRECT,
+        // a whole number of IO-aligned pages; so use a multiple of the lcm
+        int64_t a = _block_nbytes, b = kBoltStreamIOAlignBytes;
+        while (b != 0) { auto tmp = a % b; a = b; b = tmp; }
+        int64_t unit_nbytes = (_block_nbytes / a) * kBoltStreamIOAlignBytes;
+        int64_t nunits = std::max(target_chunk_nbytes / unit_nbytes, (int64_t)1);
+        _chunk_nbytes = nunits * unit_nbytes;
+        _chunk_nblocks = _chunk_nbytes / _block_nbytes;
+        _nchunks = (_nblocks + _chunk_nblocks - 1) / _chunk_nblocks;
+        for (int i = 0; i < 2; i++) {
+            void* ptr = nullptr;
+            if (posix_memalign(&ptr, kBoltStreamIOAlignBytes, _chunk_nbytes) != 0) {
+                ptr = nullptr;
+            }
+            _buffs[i] = static_cast<uint8_t*>(ptr);
+        }
+        if (_buffs[0] == nullptr || _buffs[1] == nullptr) {
+            fprintf(stderr, "ERROR: could not allocate read buffers\n");
+            _close_fds();
+        }
+#ifdef BOLT_HAVE_LIBURING
+        if (_fd >= 0 && io_uring_queue_init(2, &_ring, 0) != 0) {
+            fprintf(stderr, "ERROR: io_uring_queue_init failed\n");
+            _close_fds();
+        }
+#endif
+    }
+
+    ~BoltCodeReader() {
+        if (_fd >= 0) {
+            if (_read_pending) { _wait_read(); }
+#ifdef BOLT_HAVE_LIBURING
+            io_uring_queue_exit(&_ring);
+#endif
+            _close_fds();
+        }
+        free(_buffs[0]);
+        free(_buffs[1]);
+    }
+    BoltCodeReader(const BoltCodeReader&) = delete;
+    BoltCodeReader& operator=(const BoltCodeReader&) = delete;
+
+    bool ok() const { return _fd >= 0; }
+    // true if a read failed since the last rewind(); next_chunk() keeps
+    // returning -1 until then
+    bool error() const { return _error; }
+    bool using_direct_io() const { return _direct_io; }
+    int64_t nblocks() const { return _nblocks; }
+    int64_t chunk_nblocks() const { return _chunk_nblocks; }
+    int64_t chunk_nbytes() const { return _chunk_nbytes; }
+
+    // returns the number of blocks in the chunk, 0 at the end of the file,
+    // or -1 if a read failed; sets codes_out to the chunk's first block
+    int64_t next_chunk(const uint8_t** codes_out) {
+        if (_error) { return -1; }
+        if (!ok() || _next_chunk >= _nchunks) { return 0; }
+        if (!_read_pending) {
+            _start_read(_next_chunk, 0);
+        }
+        int slot = _pending_slot;
+        auto nbytes = _wait_read();
+        auto expected_nbytes = _chunk_expected_nbytes(_next_chunk);
+        if (nbytes != expected_nbytes) {
+            fprintf(stderr, "ERROR: short read of code chunk %lld: got %lld "
+                "of %lld bytes\n", (long long)_next_chunk, (long long)nbytes,
+                (long long)expected_nbytes);
+            _error = true;
+            return -1;
+        }
+        _next_chunk++;
+        if (_next_chunk < _nchunks) {  // read next chunk during caller's scan
+            _start_read(_next_chunk, 1 - slot);
+        }
+        *codes_out = _buffs[slot];
+        return nbytes / _block_nbytes;
+    }
+
+    void rewind() {
+        if (_read_pending) { _wait_read(); }
+        _next_chunk = 0;
+        _error = false;
+    }
+
+private:
+    void _close_fds() {
+        if (_rest_fd >= 0 && _rest_fd != _fd) { close(_rest_fd); }
+        if (_fd >= 0) { close(_fd); }
+        _fd = -1;
+        _rest_fd = -1;
+    }
+
+    int64_t _chunk_expected_nbytes(int64_t chunk) const {
+        auto nblocks = std::min(_chunk_nblocks,
+                                _nblocks - chunk * _chunk_nblocks);
+        return nblocks * _block_nbytes;
+    }
+
+    // the read size is rounded up to the IO alignment so that O_DIRECT
+    // works for the last chunk; the kernel just stops at the end of file
+    int64_t _chunk_read_nbytes(int64_t chunk) const {
+        auto nbytes = _chunk_expected_nbytes(chunk);
+        auto align = kBoltStreamIOAlignBytes;
+        return ((nbytes + align - 1) / align) * align;
+    }
+
+    // reads nbytes at offset, given that nread of them already were. The
+    // first read goes through fd, and any after it through rest_fd, since
+    // they start wherever the last one stopped, which O_DIRECT won't allow
+    static int64_t _pread_rest(int fd, int rest_fd, uint8_t* buff,
+                               int64_t nbytes, int64_t offset, int64_t nread)
+    {
+        while (nread >= 0 && nread < nbytes) {
+            auto n = pread(nread == 0 ? fd : rest_fd, buff + nread,
+                           nbytes - nread, offset + nread);
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n < 0) { return -1; }
+            if (n == 0) { break; }  // end of file
+            nread += n;
+        }
+        return nread;
+    }
+
+    void _start_read(int64_t chunk, int slot) {
+        auto buff = _buffs[slot];
+        auto nbytes = _chunk_read_nbytes(chunk);
+        auto offset = chunk * _chunk_nbytes;
+        _pending_slot = slot;
+        _read_pending = true;
+#ifdef BOLT_HAVE_LIBURING
+        _pending_buff = buff;
+        _pending_nbytes = nbytes;
+        _pending_offset = offset;
+        auto sqe = io_uring_get_sqe(&_ring);
+        if (sqe == nullptr) {  // queue full; shouldn't happen with one read
+            _pending_sync_nread = _pread_rest(
+                _fd, _rest_fd, buff, nbytes, offset, 0);
+            _pending_sync = true;
+            return;
+        }
+        io_uring_prep_read(sqe, _fd, buff, nbytes, offset);
+        io_uring_submit(&_ring);
+#else
+        int fd = _fd;
+        int rest_fd = _rest_fd;
+        _pending_read = std::async(std::launch::async,
+            [fd, rest_fd, buff, nbytes, offset]() {
+                return _pread_rest(fd, rest_fd, buff, nbytes, offset, 0);
+            });
+#endif
+    }
+
+    int64_t _wait_read() {
+        _read_pending = false;
+#ifdef BOLT_HAVE_LIBURING
+        if (_pending_sync) {
+            _pending_sync = false;
+            return _pending_sync_nread;
+        }
+        struct io_uring_cqe* cqe = nullptr;
+        int ret;
+        while ((ret = io_uring_wait_cqe(&_ring, &cqe)) == -EINTR) {}
+        if (ret != 0) { return -1; }
+        int64_t nread = cqe->res;
+        io_uring_cqe_seen(&_ring, cqe);
+        // an interrupted read just gets redone synchronously below
+        if (nread == -EINTR) { nread = 0; }
+        if (nread < 0) { return -1; }
+        return _pread_rest(_fd, _rest_fd, _pending_buff, _pending_nbytes,
+                           _pending_offset, nread);
+#else
+        return _pending_read.get();
+#endif
+    }
+
+    int _fd = -1;
+    int _rest_fd = -1;  // same as _fd unless it's O_DIRECT
+    bool _direct_io = false;
+    bool _error = false;
+    int _block_nbytes;
+    int64_t _nblocks = 0;
+    int64_t _chunk_nbytes = 0;
+    int64_t _chunk_nblocks = 0;
+    int64_t _nchunks = 0;
+    int64_t _next_chunk = 0;
+    uint8_t* _buffs[2] = {nullptr, nullptr};
+    bool _read_pending = false;
+    int _pending_slot = 0;
+#ifdef BOLT_HAVE_LIBURING
+    struct io_uring _ring;
+    uint8_t* _pending_buff = nullptr;
+    int64_t _pending_nbytes = 0;
+    int64_t _pending_offset = 0;
+    bool _pending_sync = false;
+    int64_t _pending_sync_nread = 0;
+#else
+    std::future<int64_t> _pending_read;
+#endif
+};
+
+struct BoltStreamNeighbors {
+    std::vector<int64_t> idxs;
+    std::vector<uint16_t> dists;
+};
+
+/**
+ * @brief Running top k over a stream of uint16_t distances.
+ *
+ * @details Only distances that beat the current kth best are kept as
+ * candidates; these are found 16 at a time with SIMD compares. Candidates
+ * get merged back down to k whenever there are enough of them, and at the
+ * end of each chunk of codes.
+ */
+class BoltStreamTopk {
+public:
+    BoltStreamTopk(int k, bool smaller_better=true):
+        _k(k), _smaller_better(smaller_better)
+    {
+        // k == 0 is allowed, and just finds nothing
+        assert(k >= 0);
+        _cands.reserve(4 * _k);
+    }
+
+    // if given, bit r of lane_masks[b] says whether dists[32 * b + r] may
+    // be a candidate at all; e.g., whether that row passes a filter
+    void add(const uint16_t* dists, int64_t n, int64_t first_idx,
+             const uint32_t* lane_masks=nullptr)
+    {
+        if (_k == 0) { return; }
+        int64_t i = 0;
+        // everything is a candidate until we have k of them; after that,
+        // go scalar only until i is 16-aligned, so the lane masks line up
+        for (; i < n && (!_full || i % 16 != 0); i++) {
+            _maybe_push(dists, i, first_idx, lane_masks);
+        }
+        if (_full && !_unbeatable()) {
+            // d < t iff min(d, t - 1) == d; d > t iff max(d, t + 1) == d
+            auto bound = _bound();
+            for (; i + 16 <= n; i += 16) {
+                auto d = _mm256_loadu_si256((const __m256i*)(dists + i));
+                auto clamped = _smaller_better ?
+                    _mm256_min_epu16(d, bound) : _mm256_max_epu16(d, bound);
+                auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi16(d, clamped)));
+                mask = _pext_u32(mask, 0x55555555);  // 1 bit per u16, not 2
+                if (lane_masks != nullptr) {
+                    mask &= (lane_masks[i / 32] >> (i % 32)) & 0xffff;
+                }
+                while (mask) {
+                    auto j = __builtin_ctz(mask);
+                    mask &= mask - 1;
+                    _push(dists[i + j], first_idx + i + j);
+                }
+                // compacting updates the threshold, so refresh the bound
+                if (_cands.size() >= 4 * _k) {
+                    _compact();
+                    if (_unbeatable()) { return; }
+                    bound = _bound();
+                }
+            }
+        } else if (_full) {
+            return;  // no candidates are possible
+        }
+        for (; i < n; i++) {
+            _maybe_push(dists, i, first_idx, lane_masks);
+        }
+    }
+
+    void merge_chunk() { if (_cands.size() > _k) { _compact(); } }
+
+    // folds in the top k found by another accumulator, e.g., one that
+    // scanned a different range of rows on another thread
+    void merge(const BoltStreamNeighbors& other) {
+        if (_k == 0) { return; }
+        for (size_t i = 0; i < other.idxs.size(); i++) {
+            if (!_full || _better(other.dists[i], _thresh)) {
+                _push(other.dists[i], other.idxs[i]);
+            }
+        }
+        merge_chunk();
+    }
+
+    BoltStreamNeighbors finish() {
+        _compact();
+        std::sort(_cands.begin(), _cands.end(),
+            [this](const Cand& a, const Cand& b) { return _before(a, b); });
+        BoltStreamNeighbors ret;
+        for (const auto& c : _cands) {
+            ret.dists.push_back(c.first);
+            ret.idxs.push_back(c.second);
+        }
+        return ret;
+    }
+
+private:
+    using Cand = std::pair<uint16_t, int64_t>;
+
+    bool _better(uint16_t a, uint16_t b) const {
+        return _smaller_better ? a < b : a > b;
+    }
+    // ties go to the lower index, like a full sort would produce
+    bool _before(const Cand& a, const Cand& b) const {
+        if (a.first != b.first) { return _better(a.first, b.first); }
+        return a.second < b.second;
+    }
+    // true if the kth best can't be beaten by any uint16_t
+    bool _unbeatable() const {
+        return _smaller_better ? _thresh == 0 : _thresh == 0xffff;
+    }
+    __m256i _bound() const {
+        return _mm256_set1_epi16(static_cast<int16_t>(
+            _smaller_better ? _thresh - 1 : _thresh + 1));
+    }
+    void _maybe_push(const uint16_t* dists, int64_t i, int64_t first_idx,
+                     const uint32_t* lane_masks)
+    {
+        if (lane_masks != nullptr && !((lane_masks[i / 32] >> (i % 32)) & 1)) {
+            return;
+        }
+        if (!_full || _better(dists[i], _thresh)) {
+            _push(dists[i], first_idx + i);
+        }
+    }
+    void _push(uint16_t dist, int64_t idx) {
+        _cands.emplace_back(dist, idx);
+        if (!_full && _cands.size() >= 4 * _k) { _compact(); }
+    }
+    void _compact() {
+        if (_k == 0) {
+            _cands.clear();
+            return;
+        }
+        if (_cands.size() > _k) {
+            std::nth_element(_cands.begin(), _cands.begin() + (_k - 1),
+                _cands.end(),
+                [this](const Cand& a, const Cand& b) { return _before(a, b); });
+            _cands.resize(_k);
+        }
+        _full = _cands.size() >= _k;
+        if (_full) {
+            auto worst = std::max_element(_cands.begin(), _cands.end(),
+                [this](const Cand& a, const Cand& b) { return _before(a, b); });
+            _thresh = worst->first;
+        }
+    }
+
+    size_t _k;
+    bool _smaller_better;
+    bool _full = false;
+    uint16_t _thresh = 0;
+    std::vector<Cand> _cands;
+};
+
+// scans nblocks of in-memory codes, starting at row first_row, in
+// cache-sized tiles for each query, feeding each query's top k. Rows at
+// or past ncodes are padding and are skipped. dists must hold at least
+// bolt_scan_tile_nblocks(ncodebooks) blocks of distances.
+static inline int64_t bolt_scan_tile_nblocks(int ncodebooks) {
+    static constexpr int target_tile_nbytes = 24 * 1024;
+    int block_nbytes = 32 * (ncodebooks / 2);
+    return std::max(target_tile_nbytes / block_nbytes, 1);
+}
+static inline void bolt_scan_topk(const uint8_t* codes, int64_t nblocks,
+    int64_t first_row, int64_t ncodes, int ncodebooks, const uint8_t* luts,
+    int nqueries, std::vector<BoltStreamTopk>& topks, uint16_t* dists)
+{
+    static constexpr int block_nrows = 32;
+    static constexpr int lut_sz = 16;
+    int block_nbytes = block_nrows * (ncodebooks / 2);
+    auto tile_nblocks = bolt_scan_tile_nblocks(ncodebooks);
+    for (int64_t b = 0; b < nblocks; b += tile_nblocks) {
+        auto use_nblocks = std::min(tile_nblocks, nblocks - b);
+        auto tile_first_row = first_row + b * block_nrows;
+        auto nrows = std::min(use_nblocks * block_nrows,
+                              ncodes - tile_first_row);
+        if (nrows <= 0) { break; }
+        auto tile_codes = codes + b * block_nbytes;
+        for (int q = 0; q < nqueries; q++) {
+            // dists is read back right away, so no streaming stores
+            bolt_scan<true, false, false>(tile_codes, use_nblocks, ncodebooks,
+                luts + q * ncodebooks * lut_sz, dists);
+            topks[q].add(dists, nrows, tile_first_row);
+        }
+    }
+}
+
+/**
+ * @brief Find the k nearest codes in a code file for each of nqueries
+ * queries, reading the file once.
+ *
+ * @param reader Reader for the code file; it is rewound first
+ * @param luts nqueries consecutive lookup tables, each of
+ *  16 * ncodebooks bytes, as produced by bolt_lut(); must be 32B-aligned
+ * @param ncodes Number of real codes in the file; codes past this (padding
+ *  in the last block) are ignored. Pass -1 to use every code.
+ * @param smaller_better false for dot products, true for distances
+ * @return One set of neighbors per query, or nothing if a read failed
+ *  partway through (see reader.error()), rather than results for just the
+ *  codes read before the failure.
+ */
+static inline std::vector<BoltStreamNeighbors> bolt_stream_knn(
+    BoltCodeReader& reader, int ncodebooks, const uint8_t* luts,
+    int nqueries, int k, int64_t ncodes=-1, bool smaller_better=true)
+{
+    static constexpr int block_nrows = 32;
+    if (ncodes < 0) { ncodes = reader.nblocks() * block_nrows; }
+    RowVector<uint16_t> dists(bolt_scan_tile_nblocks(ncodebooks) * block_nrows);
+
+    std::vector<BoltStreamTopk> topks;
+    for (int q = 0; q < nqueries; q++) {
+        topks.emplace_back(k, smaller_better);
+    }
+    reader.rewind();
+    int64_t first_row = 0;
+    const uint8_t* chunk_codes = nullptr;
+    int64_t chunk_nblocks;
+    while ((chunk_nblocks = reader.next_chunk(&chunk_codes)) > 0) {
+        bolt_scan_topk(chunk_codes, chunk_nblocks, first_row, ncodes,
+            ncodebooks, luts, nqueries, topks, dists.data());
+        for (auto& topk : topks) { topk.merge_chunk(); }
+        first_row += chunk_nblocks * block_nrows;
+    }
+    std::vector<BoltStreamNeighbors> ret;
+    if (chunk_nblocks < 0) { return ret; }
+    for (auto& topk : topks) {
+        ret.push_back(topk.finish());
+    }
+    return ret;
+}
+
+} // anon namespace
+#endif // __BOLT_STREAM_HPP
@@ -0,0 +1,253 @@
+//
+//  encoded_lstsq.hpp
+//  Bolt
+//
+//  Least squares with encoded inputs: the design matrix is the one-hot
+//  expansion of each row's codes, so X is N x (ncodebooks * K) with exactly
+//  ncodebooks ones per row. This is the regression at the core of fitting
+//  MADDNESS prototypes (see _XtX_encoded, _XtY_encoded and encoded_lstsq in
+//  experiments/python/clusterize.py), but nothing here needs X itself:
+//
+//  - XᵀX entry ((c, a), (cc, b)) is the number of rows whose code in
+//    codebook c is a and whose code in codebook cc is b. So XᵀX is just the
+//    16x16 co-occurrence histogram of each pair of codebooks.
+//  - XᵀY row (c, a) is the sum of the rows of Y whose code in codebook c
+//    is a, so it's a scatter-add of Y rows into per-(codebook, code) sums.
+//
+//  Both cost O(N * ncodebooks^2) integer ops (plus O(N * ncodebooks * M)
+//  float adds for XᵀY) rather than dense GEMMs over N x (ncodebooks * K)
+//  matrices, and rows are split across threads.
+//
+//  Codes are one per byte, in a column-major [N x ncodebooks] matrix, as
+//  mithral_encode() writes them before zip_bolt_colmajor().
+//
+
+#ifndef __ENCODED_LSTSQ_HPP
+#define __ENCODED_LSTSQ_HPP
+
+#include <algorithm>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "immintrin.h"
+
+#ifdef BLAZE
+    #include "src/utils/avx_utils.hpp"
+    #include "src/utils/eigen_utils.hpp"
+    #include "src/utils/thread_utils.hpp"
+#else
+    #include "avx_utils.hpp"
+    #include "eigen_utils.hpp"
+    #include "thread_utils.hpp"
+#endif
+
+namespace {
+
+// rows per chunk; the codes for a chunk of every codebook stay in L2
+static constexpr int64_t kEncodedLstsqChunkNrows = 8 * 1024;
+// not worth a thread per range if the ranges would be tiny
+static constexpr int64_t kEncodedLstsqMinThreadNrows = 1024;
+
+// adds the (16 * a + b) co-occurrence counts of codes a in col_a and b in
+// col_b, over nrows rows, to hist; buf needs room for nrows bytes
+static inline void _encoded_pair_hist(const uint8_t* col_a,
+    const uint8_t* col_b, int64_t nrows, uint8_t* buf, int32_t* hist)
+{
+    const __m256i low_4bits_mask = _mm256_set1_epi8(0x0F);
+    // pack each row's pair of 4-bit codes into one byte, 32 rows at a time
+    int64_t i = 0;
+    for (; i + 32 <= nrows; i += 32) {
+        auto a = _mm256_loadu_si256((const __m256i*)(col_a + i));
+        auto b = _mm256_loadu_si256((const __m256i*)(col_b + i));
+        auto a_high = _mm256_slli_epi16(_mm256_and_si256(a, low_4bits_mask), 4);
+        auto pairs = _mm256_or_si256(a_high, _mm256_and_si256(b, low_4bits_mask));
+        _mm256_storeu_si256((__m256i*)(buf + i), pairs);
+    }
+    for (; i < nrows; i++) {
+        buf[i] = (col_a[i] << 4) | (col_b[i] & 0x0F);
+    }
+
+    // histogram the packed bytes; four sub-histograms so that consecutive
+    // increments of the same bin don't wait on each other's stores
+    int32_t counts[4][256] = {{0}};
+    i = 0;
+    for (; i + 4 <= nrows; i += 4) {
+        counts[0][buf[i]]++;
+        counts[1][buf[i + 1]]++;
+        counts[2][buf[i + 2]]++;
+        counts[3][buf[i + 3]]++;
+    }
+    for (; i < nrows; i++) {
+        counts[0][buf[i]]++;
+    }
+    for (int j = 0; j < 256; j++) {
+        hist[j] += counts[0][j] + counts[1][j] + counts[2][j] + counts[3][j];
+    }
+}
+
+/**
+ * @brief Computes XᵀX for the one-hot expansion X of the codes.
+ *
+ * @param codes Column-major [nrows x ncodebooks] codes, each less than K
+ * @param out Row-major [D x D] counts, where D = ncodebooks * K and dim
+ *  (c * K + a) is the indicator of code a in codebook c
+ * @param K Number of codes per codebook; at most 16
+ */
+static inline void encoded_xtx(const uint8_t* codes, int64_t nrows,
+    int ncodebooks, int32_t* out, int nthreads=-1, int K=16)
+{
+    static constexpr int pair_hist_sz = 256;
+    assert(K <= 16);
+    int D = ncodebooks * K;
+    int npairs = ncodebooks * (ncodebooks - 1) / 2;
+    int max_nthreads = nthreads > 0 ? nthreads :
+        std::max(1u, std::thread::hardware_concurrency());
+    // per thread: co-occurrences of each pair c < cc, then each codebook's
+    // own histogram (the diagonal blocks of XᵀX are diagonal)
+    int hists_sz = npairs * pair_hist_sz + ncodebooks * 16;
+    std::vector<int32_t> all_hists(max_nthreads * hists_sz, 0);
+
+    auto nused = parallel_for_indexed_ranges(nrows, max_nthreads,
+        kEncodedLstsqMinThreadNrows,
+        [&](int64_t start, int64_t end, int t) {
+            auto hists = all_hists.data() + t * hists_sz;
+            auto diag_hists = hists + npairs * pair_hist_sz;
+            std::vector<uint8_t> buf(kEncodedLstsqChunkNrows);
+            for (int64_t i = start; i < end; i += kEncodedLstsqChunkNrows) {
+                auto n = std::min(kEncodedLstsqChunkNrows, end - i);
+                auto hist = hists;
+                for (int c = 0; c < ncodebooks; c++) {
+                    auto col = codes + c * nrows + i;
+                    for (int cc = c + 1; cc < ncodebooks; cc++) {
+                        _encoded_pair_hist(col, codes + cc * nrows + i, n,
+                                           buf.data(), hist);
+                        hist += pair_hist_sz;
+                    }
+                    for (int64_t r = 0; r < n; r++) {
+                        diag_hists[c * 16 + (col[r] & 0x0F)]++;
+                    }
+                }
+            }
+        });
+    for (int t = 1; t < nused; t++) {
+        auto hists = all_hists.data() + t * hists_sz;
+        for (int j = 0; j < hists_sz; j++) {
+            all_hists[j] += hists[j];
+        }
+    }
+
+    memset(out, 0, D * D * sizeof(out[0]));
+    auto hist = all_hists.data();
+    for (int c = 0; c < ncodebooks; c++) {
+        for (int cc = c + 1; cc < ncodebooks; cc++) {
+            for (int a = 0; a < K; a++) {
+                for (int b = 0; b < K; b++) {
+                    auto count = hist[a * 16 + b];
+                    out[(c * K + a) * D + cc * K + b] = count;
+                    out[(cc * K + b) * D + c * K + a] = count;
+                }
+            }
+            hist += pair_hist_sz;
+        }
+    }
+    for (int c = 0; c < ncodebooks; c++) {
+        for (int a = 0; a < K; a++) {
+            out[(c * K + a) * D + c * K + a] = hist[c * 16 + a];
+        }
+    }
+}
+
+/**
+ * @brief Computes XᵀY for the one-hot expansion X of the codes.
+ *
+ * @param codes Column-major [nrows x ncodebooks] codes, each less than K
+ * @param Y Row-major [nrows x M] targets
+ * @param out Row-major [(ncodebooks * K) x M] sums of Y rows
+ */
+static inline void encoded_xty(const uint8_t* codes, int64_t nrows,
+    int ncodebooks, const float* Y, int M, float* out, int nthreads=-1,
+    int K=16)
+{
+    // few enough rows that the chunk of Y being scattered stays in L1/L2
+    static constexpr int64_t chunk_nrows = 256;
+    int D = ncodebooks * K;
+    int max_nthreads = nthreads > 0 ? nthreads :
+        std::max(1u, std::thread::hardware_concurrency());
+    std::vector<RowMatrix<float> > partials(max_nthreads);
+
+    auto nused = parallel_for_indexed_ranges(nrows, max_nthreads,
+        kEncodedLstsqMinThreadNrows,
+        [&](int64_t start, int64_t end, int t) {
+            partials[t] = RowMatrix<float>::Zero(D, M);
+            auto& sums = partials[t];
+            for (int64_t i = start; i < end; i += chunk_nrows) {
+                auto n = std::min(chunk_nrows, end - i);
+                for (int c = 0; c < ncodebooks; c++) {
+                    auto col = codes + c * nrows + i;
+                    for (int64_t r = 0; r < n; r++) {
+                        auto dst = sums.row(c * K + col[r]).data();
+                        auto src = Y + (i + r) * M;
+                        int j = 0;
+                        for (; j + 8 <= M; j += 8) {
+                            _mm256_storeu_ps(dst + j, _mm256_add_ps(
+                                _mm256_loadu_ps(dst + j),
+                                _mm256_loadu_ps(src + j)));
+                        }
+                        for (; j < M; j++) {
+                            dst[j] += src[j];
+                        }
+                    }
+                }
+            }
+        });
+    for (int t = 1; t < nused; t++) {
+        partials[0] += partials[t];
+    }
+    memcpy(out, partials[0].data(), D * M * sizeof(float));
+}
+
+/**
+ * @brief Solves (XᵀX + lamda * I) W = XᵀY for W.
+ *
+ * @details XᵀX of a one-hot code matrix is singular (each codebook's
+ * indicators sum to the all-ones column), so lamda should be positive.
+ *
+ * @param XtX Row-major [D x D], as from encoded_xtx()
+ * @param XtY Row-major [D x M], as from encoded_xty()
+ * @param W_out Row-major [D x M]
+ */
+static inline void encoded_ridge_solve(const int32_t* XtX, const float* XtY,
+    int D, int M, float lamda, float* W_out)
+{
+    // doubles, since counts can be large relative to lamda
+    RowMatrix<double> A = Eigen::Map<const RowMatrix<int32_t> >(
+        XtX, D, D).cast<double>();
+    A.diagonal().array() += lamda;
+    RowMatrix<double> B = Eigen::Map<const RowMatrix<float> >(
+        XtY, D, M).cast<double>();
+    RowMatrix<double> W = A.ldlt().solve(B);
+    Eigen::Map<RowMatrix<float> >(W_out, D, M) = W.cast<float>();
+}
+
+/**
+ * @brief Ridge regression of Y on the one-hot expansion of the codes.
+ *
+ * @param W_out Row-major [(ncodebooks * K) x M] weights, so that row
+ *  (c * K + a) is codebook c's prototype output for code a
+ */
+static inline void encoded_lstsq(const uint8_t* codes, int64_t nrows,
+    int ncodebooks, const float* Y, int M, float* W_out, float lamda=1,
+    int nthreads=-1, int K=16)
+{
+    int D = ncodebooks * K;
+    std::vector<int32_t> XtX(D * D);
+    RowMatrix<float> XtY(D, M);
+    encoded_xtx(codes, nrows, ncodebooks, XtX.data(), nthreads, K);
+    encoded_xty(codes, nrows, ncodebooks, Y, M, XtY.data(), nthreads, K);
+    encoded_ridge_solve(XtX.data(), XtY.data(), D, M, lamda, W_out);
+}
+
+} // anon namespace
+#endif // __ENCODED_LSTSQ_HPP
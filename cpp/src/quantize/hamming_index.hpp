@@ -0,0 +1,485 @@
+//
+//  hamming_index.hpp
+//  Bolt
+//
+//  Exact Hamming-space k-NN and radius search over binary codes with
+//  multi-index hashing (Norouzi et al., "Fast Exact Search in Hamming
+//  Space with Multi-Index Hashing"). Each code is split into m disjoint
+//  substrings, and each substring gets a table from its value to the rows
+//  having it. By pigeonhole, a row within distance r of the query is
+//  within floor(r / m) of it on at least one substring, so searching out
+//  to radius rho in every substring table finds every row within
+//  m * (rho + 1) - 1. k-NN search grows rho one step at a time until the
+//  kth best distance found is within that bound.
+//
+//  Candidates from the tables are gathered into small batches and
+//  verified with the same vectorized popcount as exhaustive scans
+//  (popcount.hpp). A row can be in several tables' buckets; it's only
+//  counted by the first probe that could have found it.
+//
+//  The number of probes grows combinatorially with rho, so once probing
+//  is estimated to cost more than a fused scan + top k over all rows, the
+//  search switches to the scan instead; this is also what small indexes
+//  and queries far from all codes end up doing.
+//
+
+#ifndef __HAMMING_INDEX_HPP
+#define __HAMMING_INDEX_HPP
+
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+#include <queue>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/quantize/bolt_stream.hpp"
+    #include "src/utils/avx_utils.hpp"
+#else
+    #include "bolt_stream.hpp"
+    #include "avx_utils.hpp"
+#endif
+
+namespace {
+
+enum class HammingSearchStrategy {
+    Auto,        // multi-index hashing, falling back to Scan when cheaper
+    MultiIndex,  // multi-index hashing only
+    Scan,        // exhaustive popcount scan + top k
+};
+
+static inline const char* hamming_search_strategy_name(
+    HammingSearchStrategy s)
+{
+    switch (s) {
+        case HammingSearchStrategy::Auto: return "auto";
+        case HammingSearchStrategy::MultiIndex: return "multi-index";
+        case HammingSearchStrategy::Scan: return "scan";
+    }
+    return "unknown";
+}
+
+// search costs, in units of scanning one row; a probe is a hash lookup
+// and a candidate a random access to its row
+static constexpr double kHammingProbeCost = 40;
+static constexpr double kHammingCandidateCost = 8;
+
+static constexpr uint64_t kHammingEmptySlot = ~uint64_t(0);
+
+/**
+ * @brief Multi-index hash tables over binary codes.
+ *
+ * @details The index stores row ids, not codes; codes must outlive it and
+ * hold fewer than 2^32 rows.
+ */
+template<int NBytes>
+class HammingIndex {
+public:
+    static_assert(NBytes % 8 == 0 && NBytes > 0,
+        "Codes must be a positive multiple of 8B");
+    static constexpr int nwords = NBytes / 8;
+    static constexpr int nbits = 8 * NBytes;
+
+    /**
+     * @param codes Row-major [nrows x NBytes] codes
+     * @param nsubstrings Number of tables, m; if <= 0, about
+     *  nbits / log2(nrows), so each substring has about one row per value
+     */
+    HammingIndex(const uint8_t* codes, int64_t nrows, int nsubstrings=-1):
+        _codes(reinterpret_cast<const uint64_t*>(codes)), _nrows(nrows)
+    {
+        assert(nrows < int64_t(0xffffffff));
+        static constexpr int max_substring_nbits = 32;
+        int min_nsubstrings = (nbits + max_substring_nbits - 1) /
+            max_substring_nbits;
+        if (nsubstrings <= 0) {
+            auto log2_nrows = log2(std::max<double>(2, nrows));
+            nsubstrings = static_cast<int>(round(nbits / log2_nrows));
+        }
+        nsubstrings = std::max(min_nsubstrings, std::min(nsubstrings, nbits));
+
+        // the first (nbits % m) substrings get one extra bit
+        int start_bit = 0;
+        for (int j = 0; j < nsubstrings; j++) {
+            int len = nbits / nsubstrings + (j < nbits % nsubstrings);
+            _tables.emplace_back();
+            _build_table(_tables.back(), start_bit, len);
+            start_bit += len;
+        }
+    }
+
+    int nsubstrings() const { return static_cast<int>(_tables.size()); }
+    int64_t nrows() const { return _nrows; }
+    int substring_nbits(int j) const { return _tables[j].nbits; }
+
+    /**
+     * @brief The k rows nearest q in Hamming distance, ascending.
+     *
+     * @details Ties go to the lower row index, as with a full sort.
+     */
+    BoltStreamNeighbors knn(const uint8_t* q, int k,
+        HammingSearchStrategy strategy=HammingSearchStrategy::Auto,
+        HammingSearchStrategy* used=nullptr) const
+    {
+        auto q64 = reinterpret_cast<const uint64_t*>(q);
+        k = static_cast<int>(std::min<int64_t>(k, _nrows));
+        if (strategy == HammingSearchStrategy::Scan || k <= 0) {
+            if (used != nullptr) { *used = HammingSearchStrategy::Scan; }
+            return _scan_knn(q64, k);
+        }
+        _Search s(*this, q64);
+        std::priority_queue<_Cand> best;  // max-heap; top is the kth best
+        double spent_cost = 0;
+        int m = nsubstrings();
+        for (int rho = 0; rho <= _max_substring_nbits(); rho++) {
+            // rounds 0 through rho - 1 found everything within m * rho - 1
+            if (best.size() == size_t(k) && best.top().first < m * rho) {
+                break;
+            }
+            auto round_cost = _round_cost(rho);
+            if (strategy == HammingSearchStrategy::Auto &&
+                spent_cost + round_cost > _nrows)
+            {
+                if (used != nullptr) { *used = HammingSearchStrategy::Scan; }
+                return _scan_knn(q64, k);
+            }
+            spent_cost += round_cost;
+            s.probe_round(rho, [&](uint16_t dist, uint32_t id) {
+                _Cand c(dist, id);
+                if (best.size() < size_t(k)) {
+                    best.push(c);
+                } else if (c < best.top()) {
+                    best.pop();
+                    best.push(c);
+                }
+            }, [&]() { return best.size() < size_t(k) ?
+                uint16_t(nbits) : best.top().first; });
+        }
+        if (used != nullptr) { *used = HammingSearchStrategy::MultiIndex; }
+        std::vector<_Cand> sorted;
+        while (!best.empty()) {
+            sorted.push_back(best.top());
+            best.pop();
+        }
+        std::reverse(sorted.begin(), sorted.end());
+        return _to_neighbors(sorted);
+    }
+
+    // all rows within Hamming distance radius of q, ascending
+    BoltStreamNeighbors radius_search(const uint8_t* q, int radius,
+        HammingSearchStrategy strategy=HammingSearchStrategy::Auto,
+        HammingSearchStrategy* used=nullptr) const
+    {
+        auto q64 = reinterpret_cast<const uint64_t*>(q);
+        int max_rho = std::min(radius / nsubstrings(), _max_substring_nbits());
+        bool scan = strategy == HammingSearchStrategy::Scan || radius < 0;
+        if (strategy == HammingSearchStrategy::Auto) {
+            double cost = 0;
+            for (int rho = 0; rho <= max_rho; rho++) {
+                cost += _round_cost(rho);
+            }
+            scan = cost > _nrows;
+        }
+        if (scan) {
+            if (used != nullptr) { *used = HammingSearchStrategy::Scan; }
+            return _scan_radius(q64, radius);
+        }
+        if (used != nullptr) { *used = HammingSearchStrategy::MultiIndex; }
+        _Search s(*this, q64);
+        std::vector<_Cand> found;
+        for (int rho = 0; rho <= max_rho; rho++) {
+            s.probe_round(rho, [&](uint16_t dist, uint32_t id) {
+                found.emplace_back(dist, id);
+            }, [&]() { return static_cast<uint16_t>(radius); });
+        }
+        std::sort(found.begin(), found.end());
+        return _to_neighbors(found);
+    }
+
+private:
+    using _Cand = std::pair<uint16_t, uint32_t>;  // (dist, row)
+
+    // rows grouped by the value of bits [start_bit, start_bit + nbits) of
+    // their codes; values index offsets directly if there are few enough
+    // of them, and are looked up in a linear probing hash table otherwise
+    struct _Table {
+        int start_bit;
+        int nbits;
+        bool direct;
+        std::vector<uint32_t> offsets;  // bucket b is [offsets[b], offsets[b + 1])
+        std::vector<uint32_t> ids;
+        std::vector<uint64_t> slots;    // (value << 32) | bucket, if hashed
+        int slot_shift;
+    };
+
+    static uint32_t _substring(const uint64_t* row, int start_bit, int nbits) {
+        int w = start_bit / 64;
+        int offset = start_bit % 64;
+        uint64_t bits = row[w] >> offset;
+        if (offset + nbits > 64) {
+            bits |= row[w + 1] << (64 - offset);
+        }
+        return static_cast<uint32_t>(bits & ((uint64_t(1) << nbits) - 1));
+    }
+    const uint64_t* _row(int64_t i) const { return _codes + i * nwords; }
+
+    static uint64_t _slot_hash(uint32_t value, int shift) {
+        return (value * 0x9E3779B97F4A7C15ull) >> shift;
+    }
+
+    void _build_table(_Table& t, int start_bit, int len) {
+        t.start_bit = start_bit;
+        t.nbits = len;
+        t.direct = len <= 24 && (int64_t(1) << len) <= 2 * std::max<int64_t>(
+            _nrows, 1024);
+        std::vector<uint32_t> values(_nrows);
+        for (int64_t i = 0; i < _nrows; i++) {
+            values[i] = _substring(_row(i), start_bit, len);
+        }
+        t.ids.resize(_nrows);
+        if (t.direct) {  // counting sort by value
+            t.offsets.assign((size_t(1) << len) + 1, 0);
+            for (auto v : values) { t.offsets[v + 1]++; }
+            for (size_t b = 1; b < t.offsets.size(); b++) {
+                t.offsets[b] += t.offsets[b - 1];
+            }
+            std::vector<uint32_t> next(t.offsets.begin(), t.offsets.end() - 1);
+            for (int64_t i = 0; i < _nrows; i++) {
+                t.ids[next[values[i]]++] = static_cast<uint32_t>(i);
+            }
+            return;
+        }
+        std::vector<uint64_t> pairs(_nrows);
+        for (int64_t i = 0; i < _nrows; i++) {
+            pairs[i] = (uint64_t(values[i]) << 32) | uint64_t(i);
+        }
+        std::sort(pairs.begin(), pairs.end());
+        t.offsets.clear();
+        for (int64_t i = 0; i < _nrows; i++) {
+            if (i == 0 || (pairs[i] >> 32) != (pairs[i - 1] >> 32)) {
+                t.offsets.push_back(static_cast<uint32_t>(i));
+            }
+            t.ids[i] = static_cast<uint32_t>(pairs[i]);
+        }
+        auto nbuckets = t.offsets.size();
+        t.offsets.push_back(static_cast<uint32_t>(_nrows));
+        // at most half full
+        int log2_nslots = 1;
+        while ((size_t(1) << log2_nslots) < 2 * nbuckets) { log2_nslots++; }
+        t.slot_shift = 64 - log2_nslots;
+        t.slots.assign(size_t(1) << log2_nslots, kHammingEmptySlot);
+        auto slot_mask = t.slots.size() - 1;
+        for (size_t b = 0; b < nbuckets; b++) {
+            auto value = static_cast<uint32_t>(pairs[t.offsets[b]] >> 32);
+            auto s = _slot_hash(value, t.slot_shift);
+            while (t.slots[s] != kHammingEmptySlot) { s = (s + 1) & slot_mask; }
+            t.slots[s] = (uint64_t(value) << 32) | b;
+        }
+    }
+
+    // rows whose substring for table t equals value
+    static std::pair<const uint32_t*, const uint32_t*> _bucket(
+        const _Table& t, uint32_t value)
+    {
+        size_t b;
+        if (t.direct) {
+            b = value;
+        } else {
+            auto slot_mask = t.slots.size() - 1;
+            auto s = _slot_hash(value, t.slot_shift);
+            while (true) {
+                auto slot = t.slots[s];
+                if (slot == kHammingEmptySlot) {
+                    return std::make_pair(nullptr, nullptr);
+                }
+                if ((slot >> 32) == value) {
+                    b = static_cast<uint32_t>(slot);
+                    break;
+                }
+                s = (s + 1) & slot_mask;
+            }
+        }
+        auto ids = t.ids.data();
+        return std::make_pair(ids + t.offsets[b], ids + t.offsets[b + 1]);
+    }
+
+    int _max_substring_nbits() const {
+        return _tables[0].nbits;  // the first substrings are the longest
+    }
+
+    static double _nchoosek(int n, int k) {
+        if (k < 0 || k > n) { return 0; }
+        double ret = 1;
+        for (int i = 0; i < k; i++) { ret = ret * (n - i) / (i + 1); }
+        return ret;
+    }
+
+    // estimated cost of probing every table at radius rho, assuming rows
+    // are spread evenly over substring values
+    double _round_cost(int rho) const {
+        double cost = 0;
+        for (const auto& t : _tables) {
+            auto nprobes = _nchoosek(t.nbits, rho);
+            auto rows_per_value = _nrows / ldexp(1., t.nbits);
+            cost += nprobes * (kHammingProbeCost +
+                               kHammingCandidateCost * rows_per_value);
+        }
+        return cost;
+    }
+
+    // per-query state for probing the tables
+    class _Search {
+    public:
+        _Search(const HammingIndex& index, const uint64_t* q):
+            _index(index), _q(q), _q_substrings(index.nsubstrings())
+        {
+            for (int j = 0; j < index.nsubstrings(); j++) {
+                const auto& t = index._tables[j];
+                _q_substrings[j] = _substring(q, t.start_bit, t.nbits);
+            }
+        }
+
+        /**
+         * @brief Probes every table for substrings at distance exactly rho.
+         *
+         * @details Calls emit(dist, id) for each row found for the first
+         * time whose distance is at most max_dist(), which is rechecked
+         * once per batch.
+         */
+        template<class EmitF, class MaxDistF>
+        void probe_round(int rho, EmitF emit, MaxDistF max_dist) {
+            for (int j = 0; j < _index.nsubstrings(); j++) {
+                const auto& t = _index._tables[j];
+                if (rho > t.nbits) { continue; }
+                auto q_sub = _q_substrings[j];
+                _for_each_at_distance(t.nbits, rho, [&](uint32_t flips) {
+                    auto bucket = _bucket(t, q_sub ^ flips);
+                    for (auto p = bucket.first; p < bucket.second; p++) {
+                        _batch_ids.push_back(*p);
+                        if (_batch_ids.size() == kBatchNrows) {
+                            _verify(j, rho, emit, max_dist);
+                        }
+                    }
+                });
+                _verify(j, rho, emit, max_dist);
+            }
+        }
+
+    private:
+        static constexpr size_t kBatchNrows = 256;
+
+        // calls f on each nbits-bit value with popcount rho, via Gosper's hack
+        template<class F>
+        static void _for_each_at_distance(int nbits, int rho, F f) {
+            if (rho == 0) { f(0); return; }
+            uint64_t limit = uint64_t(1) << nbits;
+            uint64_t flips = (uint64_t(1) << rho) - 1;
+            while (flips < limit) {
+                f(static_cast<uint32_t>(flips));
+                auto lowest = flips & (~flips + 1);
+                auto ripple = flips + lowest;
+                flips = (((ripple ^ flips) >> 2) / lowest) | ripple;
+            }
+        }
+
+        // true unless probing some earlier table, or this round of some
+        // earlier table, would already have found the row
+        bool _first_found(const uint64_t* row, int j, int rho) const {
+            for (int jj = 0; jj < _index.nsubstrings(); jj++) {
+                if (jj == j) { continue; }
+                const auto& t = _index._tables[jj];
+                auto dist = __builtin_popcount(
+                    _substring(row, t.start_bit, t.nbits) ^ _q_substrings[jj]);
+                if (dist < rho || (jj < j && dist == rho)) { return false; }
+            }
+            return true;
+        }
+
+        template<class EmitF, class MaxDistF>
+        void _verify(int j, int rho, EmitF& emit, MaxDistF& max_dist) {
+            using backend_t = popcnt_backend_for_t<PopcntDefault, nwords>;
+            auto n = _batch_ids.size();
+            if (n == 0) { return; }
+            _batch_rows.resize(n * nwords);
+            for (size_t i = 0; i < n; i++) {
+                memcpy(&_batch_rows[i * nwords], _index._row(_batch_ids[i]),
+                       NBytes);
+            }
+            _batch_dists.resize(n);
+            xor_popcount_rows<backend_t, nwords>(_batch_rows.data(), _q,
+                static_cast<int64_t>(n), _batch_dists.data());
+            auto thresh = max_dist();
+            for (size_t i = 0; i < n; i++) {
+                if (_batch_dists[i] <= thresh &&
+                    _first_found(&_batch_rows[i * nwords], j, rho))
+                {
+                    emit(_batch_dists[i], _batch_ids[i]);
+                    thresh = max_dist();
+                }
+            }
+            _batch_ids.clear();
+        }
+
+        const HammingIndex& _index;
+        const uint64_t* _q;
+        std::vector<uint32_t> _q_substrings;
+        std::vector<uint32_t> _batch_ids;
+        std::vector<uint64_t> _batch_rows;
+        std::vector<uint16_t> _batch_dists;
+    };
+
+    // fused popcount scan + top k, one L1-sized chunk of rows at a time
+    template<class F>
+    void _scan_chunks(const uint64_t* q, F f) const {
+        using backend_t = popcnt_backend_for_t<PopcntDefault, nwords>;
+        static constexpr int64_t chunk_nrows = std::max(256, 16 * 1024 / NBytes);
+        std::vector<uint16_t> dists(chunk_nrows);
+        for (int64_t i = 0; i < _nrows; i += chunk_nrows) {
+            auto n = std::min(chunk_nrows, _nrows - i);
+            xor_popcount_rows<backend_t, nwords>(_row(i), q, n, dists.data());
+            f(dists.data(), n, i);
+        }
+    }
+    BoltStreamNeighbors _scan_knn(const uint64_t* q, int k) const {
+        if (k <= 0) { return BoltStreamNeighbors(); }
+        BoltStreamTopk topk(k);
+        _scan_chunks(q, [&](const uint16_t* dists, int64_t n, int64_t i) {
+            topk.add(dists, n, i);
+            topk.merge_chunk();
+        });
+        return topk.finish();
+    }
+    BoltStreamNeighbors _scan_radius(const uint64_t* q, int radius) const {
+        BoltStreamNeighbors ret;
+        if (radius < 0) { return ret; }
+        std::vector<_Cand> found;
+        _scan_chunks(q, [&](const uint16_t* dists, int64_t n, int64_t i) {
+            for (int64_t r = 0; r < n; r++) {
+                if (dists[r] <= radius) {
+                    found.emplace_back(dists[r], static_cast<uint32_t>(i + r));
+                }
+            }
+        });
+        std::sort(found.begin(), found.end());
+        return _to_neighbors(found);
+    }
+
+    static BoltStreamNeighbors _to_neighbors(const std::vector<_Cand>& cands) {
+        BoltStreamNeighbors ret;
+        for (const auto& c : cands) {
+            ret.dists.push_back(c.first);
+            ret.idxs.push_back(c.second);
+        }
+        return ret;
+    }
+
+    const uint64_t* _codes;
+    int64_t _nrows;
+    std::vector<_Table> _tables;
+};
+
+} // anon namespace
+#endif // __HAMMING_INDEX_HPP
@@ -7,6 +7,17 @@
 //
 
 #include "mithral.hpp"
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/utils/sgemm.hpp"
+    #include "src/utils/thread_utils.hpp"
+#else
+    #include "sgemm.hpp"
+    #include "thread_utils.hpp"
+#endif
 
 
 // ================================================================ encode
@@ -423,13 +434,189 @@ void mithral_lut_sparse(const float* Q, int nrows, int ncols, int ncodebooks,
     quantize_luts(tmp_lut_f32, nrows, ncodebooks, tmp_offsets, out_scale, out);
 }
 
+// blocked f32 luts for rows [0, nrows), folding each lut's final values
+// into the per-codebook mins and maxs; centroids for each codebook are
+// stored as [ncols x 16], which is already the layout of a packed panel
+// of B for the sgemm micro-kernel, so only rows of Q need packing
+static void _mithral_lut_dense_f32_blocked(const float* Q, int64_t nrows,
+    int ncols, int ncodebooks, const float* centroids,
+    __m256* mins, __m256* maxs, float* out)
+{
+    static constexpr int lut_sz = 16;
+    static_assert(lut_sz == kSgemmNr, "a codebook's lut must be one panel");
+    // enough rows to reuse each kc x 16 sliver of centroids from L1
+    static constexpr int64_t row_block_sz = 8 * kSgemmMr;
+    auto out_row_stride = int64_t(ncodebooks) * lut_sz;
+    auto kc_max = std::min<int64_t>(kSgemmKc, ncols);
+    std::vector<float> Q_packed(row_block_sz * kc_max);
+
+    for (int64_t ib = 0; ib < nrows; ib += row_block_sz) {
+        auto nrows_block = std::min(row_block_sz, nrows - ib);
+        for (int64_t pc = 0; pc < ncols; pc += kSgemmKc) {
+            auto kc = std::min<int64_t>(kSgemmKc, ncols - pc);
+            bool last_kc = pc + kc == ncols;
+            _sgemm_pack_a({Q + ib * ncols + pc, ncols, 1}, nrows_block, kc,
+                          Q_packed.data());
+            for (int c = 0; c < ncodebooks; c++) {
+                auto b_panel = centroids + (c * int64_t(ncols) + pc) * lut_sz;
+                for (int64_t ir = 0; ir < nrows_block; ir += kSgemmMr) {
+                    auto mr = static_cast<int>(
+                        std::min<int64_t>(kSgemmMr, nrows_block - ir));
+                    auto a_panel = Q_packed.data() + ir * kc;
+                    auto lut_ptr = out + (ib + ir) * out_row_stride + c * lut_sz;
+                    if (mr == kSgemmMr) {
+                        _sgemm_micro_kernel(kc, a_panel, b_panel, lut_ptr,
+                                            out_row_stride, pc > 0);
+                    } else {
+                        _sgemm_micro_kernel_edge(kc, a_panel, b_panel,
+                            {lut_ptr, out_row_stride, 1}, lut_ptr, mr, lut_sz,
+                            pc > 0);
+                    }
+                    if (!last_kc) { continue; }
+                    // these luts are done and still in L1
+                    for (int r = 0; r < mr; r++) {
+                        auto lut = lut_ptr + r * out_row_stride;
+                        auto lut0 = _mm256_loadu_ps(lut);
+                        auto lut1 = _mm256_loadu_ps(lut + 8);
+                        mins[c] = _mm256_min_ps(mins[c],
+                                                _mm256_min_ps(lut0, lut1));
+                        maxs[c] = _mm256_max_ps(maxs[c],
+                                                _mm256_max_ps(lut0, lut1));
+                    }
+                }
+            }
+        }
+    }
+}
+
+void mithral_lut_dense_parallel(const float* Q, int nrows, int ncols,
+    int ncodebooks, const float* centroids, float& out_offset_sum,
+    float& out_scale, float*__restrict__ tmp_lut_f32, uint8_t* out,
+    int nthreads)
+{
+    static constexpr int lut_sz = 16;
+    // at least ~2M flops per thread
+    auto flops_per_row = int64_t(2) * ncols * ncodebooks * lut_sz;
+    auto min_rows_per_thread = std::max<int64_t>(kSgemmMr,
+        (int64_t(1) << 21) / std::max<int64_t>(1, flops_per_row));
+    auto row_stride = int64_t(ncodebooks) * lut_sz;
+
+    // each thread's luts and stats for its rows; the global stats are
+    // needed before anything can be quantized
+    std::mutex stats_mutex;
+    __m256 mins[ncodebooks];
+    __m256 maxs[ncodebooks];
+    for (int c = 0; c < ncodebooks; c++) {
+        mins[c] = _mm256_set1_ps(std::numeric_limits<float>::max());
+        maxs[c] = _mm256_set1_ps(std::numeric_limits<float>::lowest());
+    }
+    parallel_for_ranges(nrows, nthreads, min_rows_per_thread,
+        [&](int64_t start, int64_t end) {
+            __m256 thread_mins[ncodebooks];
+            __m256 thread_maxs[ncodebooks];
+            for (int c = 0; c < ncodebooks; c++) {
+                thread_mins[c] = _mm256_set1_ps(
+                    std::numeric_limits<float>::max());
+                thread_maxs[c] = _mm256_set1_ps(
+                    std::numeric_limits<float>::lowest());
+            }
+            _mithral_lut_dense_f32_blocked(Q + start * ncols, end - start,
+                ncols, ncodebooks, centroids, thread_mins, thread_maxs,
+                tmp_lut_f32 + start * row_stride);
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            for (int c = 0; c < ncodebooks; c++) {
+                mins[c] = _mm256_min_ps(mins[c], thread_mins[c]);
+                maxs[c] = _mm256_max_ps(maxs[c], thread_maxs[c]);
+            }
+        });
+
+    float offsets[ncodebooks];
+    _compute_offsets_scale_from_mins_maxs(mins, maxs, ncodebooks, offsets,
+                                          out_offset_sum, out_scale);
+
+    // quantizing is memory-bound, so split it more finely
+    parallel_for_ranges(nrows, nthreads, 256, [&](int64_t start, int64_t end) {
+        quantize_luts(tmp_lut_f32 + start * row_stride,
+                      static_cast<int>(end - start), ncodebooks, offsets,
+                      out_scale, out + start * row_stride);
+    });
+}
+
 // ================================================================ scan
 
+const char* mithral_scan_order_name(MithralScanOrder order) {
+    switch (order) {
+        case MithralScanOrder::Auto: return "auto";
+        case MithralScanOrder::CodesStationary: return "codes-stationary";
+        case MithralScanOrder::OutputStationary: return "output-stationary";
+        case MithralScanOrder::Tiled2D: return "tiled-2d";
+    }
+    return "unknown";
+}
+
+// bytes that an order streams into L1, with reads of arrays that don't fit
+// in L2 counting 4x, since they come from L3 at a fraction of the bandwidth;
+// assumes tiles of 2 outputs, as below. Tiled2D moves more bytes from L2
+// than CodesStationary, but reads the luts from L3 once per L2-sized panel
+// instead of once per L1-sized chunk when they don't fit in L2
+static double _mithral_scan_cost(MithralScanOrder order, int64_t nblocks,
+                                 int ncodebooks, int noutputs)
+{
+    static constexpr int out_tile_sz = 2;
+    double codes_nbytes = nblocks * 32 * (ncodebooks / 2);
+    double luts_nbytes = noutputs * ncodebooks * 16;
+    auto from_l2 = [](double nbytes) {
+        return nbytes <= kMithralScanL2NBytes ? nbytes : 4 * nbytes;
+    };
+    auto ceil_div = [](double a, double b) { return std::ceil(a / b); };
+    switch (order) {
+        case MithralScanOrder::OutputStationary: {
+            auto ntiles = ceil_div(noutputs, out_tile_sz);
+            if (codes_nbytes <= kMithralScanChunkNBytes) { ntiles = 1; }
+            return from_l2(luts_nbytes) + ntiles * from_l2(codes_nbytes);
+        }
+        case MithralScanOrder::Tiled2D: {
+            auto npanels = ceil_div(codes_nbytes, kMithralScanL2NBytes / 2);
+            auto nlut_blocks = ceil_div(luts_nbytes, kMithralScanL1NBytes / 2);
+            // panels are reread from L2 for every block of luts after the
+            // first
+            return npanels * from_l2(luts_nbytes) + from_l2(codes_nbytes) +
+                (nlut_blocks - 1) * codes_nbytes;
+        }
+        default: {  // CodesStationary
+            auto nchunks = ceil_div(codes_nbytes, kMithralScanChunkNBytes);
+            if (luts_nbytes + kMithralScanChunkNBytes <= kMithralScanL1NBytes) {
+                nchunks = 1;  // luts stay in L1 between chunks
+            }
+            return from_l2(codes_nbytes) + nchunks * from_l2(luts_nbytes);
+        }
+    }
+}
+
+MithralScanOrder mithral_scan_order_for(int64_t nblocks, int ncodebooks,
+                                        int noutputs)
+{
+    // ties go to CodesStationary, the original order
+    auto best = MithralScanOrder::CodesStationary;
+    auto best_cost = _mithral_scan_cost(best, nblocks, ncodebooks, noutputs);
+    for (auto order : {MithralScanOrder::Tiled2D,
+                       MithralScanOrder::OutputStationary}) {
+        auto cost = _mithral_scan_cost(order, nblocks, ncodebooks, noutputs);
+        if (cost < best_cost) {
+            best = order;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
 void mithral_scan(const uint8_t* codes, int64_t nblocks, int ncodebooks,
-                  int noutputs, const uint8_t* luts, uint8_t* dists_out)
+                  int noutputs, const uint8_t* luts, uint8_t* dists_out,
+                  MithralScanOrder order)
 {
     // mithral_scan<128, 2>(codes, nblocks, ncodebooks, noutputs, luts, dists_out);
-    mithral_scan<16, 2>(codes, nblocks, ncodebooks, noutputs, luts, dists_out);
+    mithral_scan<16, 2>(codes, nblocks, ncodebooks, noutputs, luts, dists_out,
+                        order);
     // if (ncodebooks >= 4) {
     //     mithral_scan<128, 2>(codes, nblocks, ncodebooks, noutputs, luts, dists_out);
     // } else {
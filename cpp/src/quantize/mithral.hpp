@@ -7,6 +7,7 @@
 #ifndef __MITHRAL_HPP
 #define __MITHRAL_HPP
 
+#include <algorithm>
 #include <assert.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -20,12 +21,14 @@
 #ifdef BLAZE
     #include "src/utils/avx_utils.hpp"
     #include "src/utils/eigen_utils.hpp"
+    #include "src/utils/scan_telemetry.hpp"
     #ifdef MITHRAL_USE_BOLT_SAFE_SCAN
         #include "src/quantize/bolt.hpp"
     #endif
 #else
     #include "avx_utils.hpp"
     #include "eigen_utils.hpp"
+    #include "scan_telemetry.hpp"
     #ifdef MITHRAL_USE_BOLT_SAFE_SCAN
         #include "bolt.hpp"
     #endif
@@ -68,6 +71,14 @@ void mithral_lut_dense(const float* Q, int nrows, int ncols, int ncodebooks,
     const float* centroids, float& out_offset_sum, float& out_scale,
     float*__restrict__ tmp_lut_f32, uint8_t* out);
 
+// mithral_lut_dense() for many rows of Q (up to float rounding); rows are split
+// across up to nthreads threads (all hardware threads if <= 0), the f32
+// luts are computed one L1/L2-sized block of rows x ncols at a time with
+// the mins and maxs folded in, and then quantized in a second parallel pass
+void mithral_lut_dense_parallel(const float* Q, int nrows, int ncols,
+    int ncodebooks, const float* centroids, float& out_offset_sum,
+    float& out_scale, float*__restrict__ tmp_lut_f32, uint8_t* out,
+    int nthreads=-1);
 
 void mithral_lut_sparse(const float* Q, int nrows, int ncols, int ncodebooks,
     const float* centroids, const int* idxs, int nnz_per_centroid,
@@ -76,8 +87,24 @@ void mithral_lut_sparse(const float* Q, int nrows, int ncols, int ncodebooks,
 
 // ------------------------ scan
 
+// loop orders for scanning codes against many outputs' luts
+enum class MithralScanOrder {
+    Auto = 0,
+    CodesStationary,   // each L1-sized chunk of codes gets every output's luts
+    OutputStationary,  // each tile of outputs' luts gets all of the codes
+    Tiled2D            // L1-sized blocks of luts x chunks of codes, within
+                       // L2-sized panels of codes
+};
+
+const char* mithral_scan_order_name(MithralScanOrder order);
+
+// the order that Auto picks; the one that streams the fewest bytes into L1
+MithralScanOrder mithral_scan_order_for(int64_t nblocks, int ncodebooks,
+                                        int noutputs);
+
 void mithral_scan(const uint8_t* codes, int64_t nblocks, int ncodebooks,
-                  int noutputs, const uint8_t* luts, uint8_t* dists_out);
+                  int noutputs, const uint8_t* luts, uint8_t* dists_out,
+                  MithralScanOrder order=MithralScanOrder::Auto);
 
 // ------------------------ wrapper
 
@@ -107,6 +134,13 @@ struct mithral_amm {
 //    static constexpr int scan_block_nrows = 32;
     int scan_block_nrows = 32;
     static constexpr int lut_sz = 16;
+    // dense luts for at least this many rows and codebooks use the blocked
+    // builder; with fewer codebooks, the 2x2 tiles in dense_lut_f32_fused
+    // are already fast enough
+    static constexpr int min_blocked_lut_nrows = 256;
+    static constexpr int min_blocked_lut_ncodebooks = 8;
+    int lut_nthreads = 1;
+    MithralScanOrder scan_order = MithralScanOrder::Auto;
 
     // NxD matrix @ DxM matrix
     mithral_amm(int N, int D, int M, int ncodebooks, const float* centroids,
@@ -120,7 +154,7 @@ struct mithral_amm {
         encode_scales(encode_scales), encode_offsets(encode_offsets),
         idxs(idxs), nnz_per_centroid(nnz_per_centroid),
         tmp_codes(N, ncodebooks), codes(N, ncodebooks),
-        tmp_luts_f32(N, ncodebooks * lut_sz), luts(N, ncodebooks * lut_sz),
+        tmp_luts_f32(M, ncodebooks * lut_sz), luts(M, ncodebooks * lut_sz),
         out_mat(N, M)
     {
         luts.setRandom();  // so profiling without LUT creation isn't undefined
@@ -136,11 +170,15 @@ struct mithral_amm {
     }
 
     void lut(const float* Q) {
-         printf("nnz_per_centroid=%d ", nnz_per_centroid);
         if (nnz_per_centroid > 0) {
             mithral_lut_sparse(Q, M, D, ncodebooks, centroids,
                 idxs, nnz_per_centroid, out_offset_sum, out_scale,
                 tmp_luts_f32.data(), luts.data());
+        } else if (lut_nthreads != 1 || (M >= min_blocked_lut_nrows &&
+                   ncodebooks >= min_blocked_lut_ncodebooks)) {
+            mithral_lut_dense_parallel(Q, M, D, ncodebooks, centroids,
+                out_offset_sum, out_scale, tmp_luts_f32.data(), luts.data(),
+                lut_nthreads);
         } else {
             // printf("dense lut! ");
             mithral_lut_dense(Q, M, D, ncodebooks, centroids,
@@ -155,7 +193,7 @@ struct mithral_amm {
                       luts.data(), out_mat.data());
         #else
             mithral_scan(codes.data(), nblocks, ncodebooks, M,
-                         luts.data(), (uint8_t*)out_mat.data());
+                         luts.data(), (uint8_t*)out_mat.data(), scan_order);
         #endif
     }
 
@@ -1148,10 +1186,13 @@ void mithral_scan_notile(const uint8_t* codes, int64_t nblocks,
     }
 }
 
+// out_nblocks is the number of blocks in each output column of dists_out,
+// if that's more than the nblocks scanned
 template<int NBytes, int UpcastEvery=16, int _OutTileSz=1,
          bool Force16BitOutput=false>
 void mithral_scan(const uint8_t* codes, int64_t nblocks,
-                  const uint8_t* luts, uint8_t* dists_out)
+                  const uint8_t* luts, uint8_t* dists_out,
+                  int64_t out_nblocks=-1)
 {
     static_assert(NBytes > 0, "Code length <= 0 is not valid");
     static_assert(UpcastEvery % 2 == 0, "UpcastEvery must be even");
@@ -1173,7 +1214,9 @@ void mithral_scan(const uint8_t* codes, int64_t nblocks,
         ncolgroups == 1 && !Force16BitOutput;
     static constexpr int OutTileSz = _OutTileSz > 0 ? _OutTileSz : 1;
 
-    int64_t out_stride = use_uint8_output ? nblocks * 32 : 2 * nblocks * 32;
+    if (out_nblocks < nblocks) { out_nblocks = nblocks; }
+    int64_t out_stride = use_uint8_output ?
+        out_nblocks * 32 : 2 * out_nblocks * 32;
     int lut_stride = ncodebooks * 16;
 
     uint8_t* out_ptrs[OutTileSz];
@@ -1195,13 +1238,18 @@ void mithral_scan(const uint8_t* codes, int64_t nblocks,
         }
     }
 
+    // averages can't overflow, but a group's average is pinned at 255 if
+    // the LUTs were clipped at the top of their range
+    int64_t nclipped = 0;  // only counted if kScanTelemetry
     for (int64_t i = 0; i < nblocks; i++) {
         // used if ncolgroups > 1, in which case we have to upcast
         __m256i totals_0_15[OutTileSz];
         __m256i totals_16_31[OutTileSz];
+        __m256i clipped_rows[OutTileSz];
         for (int mm = 0; mm < OutTileSz; mm++) {
             totals_0_15[mm] = _mm256_setzero_si256();
             totals_16_31[mm] = _mm256_setzero_si256();
+            clipped_rows[mm] = _mm256_setzero_si256();
         }
 
         auto low_4bits_mask = _mm256_set1_epi8(0x0F); // not static so sits in reg
@@ -1308,6 +1356,10 @@ void mithral_scan(const uint8_t* codes, int64_t nblocks,
                                  colgroup_sz == 32 ? avg_prev32[mm] :
                                  colgroup_sz == 64 ? avg_prev64[mm] :
                                  avg_prev128[mm];
+                if (kScanTelemetry) {
+                    clipped_rows[mm] = _mm256_or_si256(clipped_rows[mm],
+                        scan_telemetry::saturated_mask8<false>(group_avg));
+                }
                 if (use_uint8_output) { // write out 8b values
                     _mm256_stream_si256((__m256i*)out_ptrs[mm], group_avg);
                     out_ptrs[mm] += 32;
@@ -1330,7 +1382,13 @@ void mithral_scan(const uint8_t* codes, int64_t nblocks,
                 out_ptrs[mm] += 64;
             }
         }
+        if (kScanTelemetry) {
+            for (int mm = 0; mm < OutTileSz; mm++) {
+                nclipped += scan_telemetry::nrows_clipped(clipped_rows[mm]);
+            }
+        }
     }
+    scan_telemetry::record(nblocks * 32 * OutTileSz, nclipped);
 }
 
 template<int UpcastEvery=64>
@@ -1351,36 +1409,82 @@ void mithral_scan_notile(const uint8_t* codes, int64_t nblocks, int ncodebooks,
 
 template<int UpcastEvery=64, int OutTileSz=1>
 void mithral_scan(const uint8_t* codes, int64_t nblocks, int ncodebooks,
-             const uint8_t* luts, uint8_t* out)
+             const uint8_t* luts, uint8_t* out, int64_t out_nblocks=-1)
 {
     switch(ncodebooks) {
         case 2: mithral_scan<1, UpcastEvery, OutTileSz>(
-            codes, nblocks, luts, out); break;
+            codes, nblocks, luts, out, out_nblocks); break;
         case 4: mithral_scan<2, UpcastEvery, OutTileSz>(
-            codes, nblocks, luts, out); break;
+            codes, nblocks, luts, out, out_nblocks); break;
         case 8: mithral_scan<4, UpcastEvery, OutTileSz>(
-            codes, nblocks, luts, out); break;
+            codes, nblocks, luts, out, out_nblocks); break;
         case 16: mithral_scan<8, UpcastEvery, OutTileSz>(
-            codes, nblocks, luts, out); break;
+            codes, nblocks, luts, out, out_nblocks); break;
         case 32: mithral_scan<16, UpcastEvery, OutTileSz>(
-            codes, nblocks, luts, out); break;
+            codes, nblocks, luts, out, out_nblocks); break;
         case 64: mithral_scan<32, UpcastEvery, OutTileSz>(
-            codes, nblocks, luts, out); break;
+            codes, nblocks, luts, out, out_nblocks); break;
         case 128: mithral_scan<64, UpcastEvery, OutTileSz>(
-            codes, nblocks, luts, out); break;
+            codes, nblocks, luts, out, out_nblocks); break;
         default: assert(false);  // unsupported ncodebooks
     }
 }
 
+// cache sizes that the MithralScanOrders are tiled for
+static constexpr int64_t kMithralScanL1NBytes = 32 * 1024;
+static constexpr int64_t kMithralScanL2NBytes = 256 * 1024;
+// codes per chunk for CodesStationary; most of L1
+static constexpr int64_t kMithralScanChunkNBytes = 24 * 1024;
+
+// bytes per output in mithral_scan() outputs; sums of more than UpcastEvery
+// codebooks are written as 16 bits
+template<int UpcastEvery>
+static inline int _mithral_scan_out_elem_sz(int ncodebooks) {
+    return ncodebooks > UpcastEvery ? 2 : 1;
+}
+
+// how many units of unit_nbytes fit in nbytes, rounded down to a multiple
+// of multiple_of but at least one multiple
+static inline int64_t _mithral_scan_nfit(int64_t nbytes, int64_t unit_nbytes,
+                                         int64_t multiple_of=1)
+{
+    auto n = (nbytes / unit_nbytes) / multiple_of * multiple_of;
+    return std::max(n, multiple_of);
+}
+
+// scans nblocks blocks of codes for noutputs consecutive outputs,
+// OutTileSz outputs at a time; output columns are out_nblocks blocks apart
+template<int UpcastEvery, int OutTileSz>
+void _mithral_scan_outputs(const uint8_t* codes, int64_t nblocks,
+    int ncodebooks, int noutputs, const uint8_t* luts, uint8_t* dists_out,
+    int64_t out_nblocks)
+{
+    static constexpr int lut_sz = 16;
+    auto out_col_stride = _mithral_scan_out_elem_sz<UpcastEvery>(ncodebooks) *
+        out_nblocks * 32;
+    auto lut_col_stride = ncodebooks * lut_sz;
+    int m = 0;
+    for (; m + OutTileSz <= noutputs; m += OutTileSz) {
+        mithral_scan<UpcastEvery, OutTileSz>(codes, nblocks, ncodebooks,
+            luts + m * lut_col_stride, dists_out + m * out_col_stride,
+            out_nblocks);
+    }
+    for (; m < noutputs; m++) {
+        mithral_scan<UpcastEvery, 1>(codes, nblocks, ncodebooks,
+            luts + m * lut_col_stride, dists_out + m * out_col_stride,
+            out_nblocks);
+    }
+}
+
 template<int UpcastEvery=64>
-// void mithral_scan(const uint8_t* codes, int64_t nblocks, int ncodebooks,
 void mithral_scan_nochunk(const uint8_t* codes, int64_t nblocks, int ncodebooks,
                   int noutputs, const uint8_t* luts, uint8_t* dists_out)
 {
     static constexpr int block_nrows = 32;
     static constexpr int lut_sz = 16;
     auto out_ptr = dists_out;
-    auto out_stride = nblocks * block_nrows;
+    auto out_stride = _mithral_scan_out_elem_sz<UpcastEvery>(ncodebooks) *
+        nblocks * block_nrows;
     auto lut_ptr = luts;
     auto lut_stride = ncodebooks * lut_sz;
 
@@ -1392,116 +1496,75 @@ void mithral_scan_nochunk(const uint8_t* codes, int64_t nblocks, int ncodebooks,
     }
 }
 
+/**
+ * @brief Scans codes against the luts for each of noutputs outputs.
+ *
+ * @details The luts for all outputs can be far bigger than L1 (e.g., 64KB
+ * for M = 256 and 16 codebooks), so the loop order matters:
+ *  - CodesStationary: each L1-sized chunk of codes is scanned against every
+ *    output's luts, so the luts stream through L1 once per chunk.
+ *  - OutputStationary: each tile of OutTileSz outputs' luts is scanned
+ *    against all the codes, so the codes stream through once per tile.
+ *  - Tiled2D: within each L2-sized panel of codes, an L1-sized block of
+ *    luts stays put while half-L1-sized chunks of codes stream past it;
+ *    the codes are read once per lut block, but from L2.
+ * Auto picks one with mithral_scan_order_for(). Each output column of
+ * dists_out is nblocks * 32 uint8s, or uint16s if ncodebooks > UpcastEvery.
+ */
 template<int UpcastEvery=128, int _OutTileSz=2>
-// void mithral_scan_tiled(const uint8_t* codes, int64_t nblocks, int ncodebooks,
 void mithral_scan(const uint8_t* codes, int64_t nblocks, int ncodebooks,
-                  int noutputs, const uint8_t* luts, uint8_t* dists_out)
+                  int noutputs, const uint8_t* luts, uint8_t* dists_out,
+                  MithralScanOrder order=MithralScanOrder::Auto)
 {
     static constexpr int OutTileSz = _OutTileSz > 0 ? _OutTileSz : 1;
     static constexpr int block_nrows = 32;
     static constexpr int lut_sz = 16;
-    // static constexpr int chunk_nrows = 999999;  // no chunking
-    // static constexpr int chunk_nblocks = chunk_nrows / block_nrows;
-
-    static constexpr int target_chunk_nbytes = 24 * 1024;  // most of L1 cache
-    int codes_row_nbytes = ncodebooks / 2;
-    int codes_block_nbytes = codes_row_nbytes * block_nrows;
-    int chunk_nblocks = target_chunk_nbytes / codes_block_nbytes;
-    int chunk_nrows = chunk_nblocks * block_nrows;
-
-    auto codes_row_stride = ncodebooks / 2;
-    auto codes_chunk_stride = codes_row_stride * chunk_nrows;
-    auto out_chunk_stride = chunk_nrows;
-    auto out_col_stride = nblocks * block_nrows;
-    auto lut_chunk_stride = 0;
-    auto lut_col_stride = ncodebooks * lut_sz;
-
-    auto nchunks = (nblocks + chunk_nblocks - 1) / chunk_nblocks;
-    for (int chunk = 0; chunk < nchunks; chunk++) { // for each chunk of input rows
-        int64_t use_nblocks = chunk_nblocks;
-        if (chunk == (nchunks - 1)) { // handle last chunk
-            auto nblocks_done = chunk * chunk_nblocks;
-            use_nblocks = nblocks - nblocks_done;
-        }
-        auto codes_ptr = codes + (chunk * codes_chunk_stride);
-        auto out_ptr = dists_out + (chunk * out_chunk_stride);
-        auto lut_ptr = luts + (chunk * lut_chunk_stride);
-
-        // if (ncodebooks <= 4) {
-        //     // static constexpr int OutTileSzBigger = OutTileSz * 2;
-        //     static constexpr int OutTileSzBigger = OutTileSz + 1;
-        //     int nfullgroups_out = noutputs / OutTileSzBigger;
-        //     for (int g = 0; g < nfullgroups_out; g++) {
-        //         mithral_scan<UpcastEvery, OutTileSzBigger>(
-        //             codes_ptr, use_nblocks, ncodebooks, lut_ptr, out_ptr);
-        //         out_ptr += out_col_stride * OutTileSz;
-        //         lut_ptr += lut_col_stride * OutTileSz;
-        //     }
-        //     int ntrailing_outputs = noutputs % OutTileSzBigger;
-        //     for (int m = 0; m < ntrailing_outputs; m++) {
-        //         mithral_scan<UpcastEvery, 1>(
-        //             codes_ptr, use_nblocks, ncodebooks, lut_ptr, out_ptr);
-        //         out_ptr += out_col_stride * OutTileSz;
-        //         lut_ptr += lut_col_stride * OutTileSz;
-        //     }
-        // } else {
-        //     int nfullgroups_out = noutputs / OutTileSz;
-        //     for (int g = 0; g < nfullgroups_out; g++) {
-        //         mithral_scan<UpcastEvery, OutTileSz>(
-        //             codes_ptr, use_nblocks, ncodebooks, lut_ptr, out_ptr);
-        //         out_ptr += out_col_stride * OutTileSz;
-        //         lut_ptr += lut_col_stride * OutTileSz;
-        //     }
-        //     int ntrailing_outputs = noutputs % OutTileSz;
-        //     for (int m = 0; m < ntrailing_outputs; m++) {
-        //         mithral_scan<UpcastEvery, 1>(
-        //             codes_ptr, use_nblocks, ncodebooks, lut_ptr, out_ptr);
-        //         out_ptr += out_col_stride * OutTileSz;
-        //         lut_ptr += lut_col_stride * OutTileSz;
-        //     }
-        // }
-
-        int nfullgroups_out = noutputs / OutTileSz;
-        for (int g = 0; g < nfullgroups_out; g++) {
-            mithral_scan<UpcastEvery, OutTileSz>(
-                codes_ptr, use_nblocks, ncodebooks, lut_ptr, out_ptr);
-            out_ptr += out_col_stride * OutTileSz;
-            lut_ptr += lut_col_stride * OutTileSz;
-        }
-        int ntrailing_outputs = noutputs % OutTileSz;
-        for (int m = 0; m < ntrailing_outputs; m++) {
-            mithral_scan<UpcastEvery, 1>(
-                codes_ptr, use_nblocks, ncodebooks, lut_ptr, out_ptr);
-            out_ptr += out_col_stride * OutTileSz;
-            lut_ptr += lut_col_stride * OutTileSz;
+    if (order == MithralScanOrder::Auto) {
+        order = mithral_scan_order_for(nblocks, ncodebooks, noutputs);
+    }
+    int64_t codes_block_nbytes = ncodebooks / 2 * block_nrows;
+    int64_t lut_nbytes = ncodebooks * lut_sz;
+    auto out_block_nbytes = block_nrows *
+        _mithral_scan_out_elem_sz<UpcastEvery>(ncodebooks);
+    auto out_col_stride = out_block_nbytes * nblocks;
+
+    if (order == MithralScanOrder::OutputStationary) {
+        _mithral_scan_outputs<UpcastEvery, OutTileSz>(codes, nblocks,
+            ncodebooks, noutputs, luts, dists_out, nblocks);
+        return;
+    }
+    if (order == MithralScanOrder::Tiled2D) {
+        auto panel_nblocks = _mithral_scan_nfit(
+            kMithralScanL2NBytes / 2, codes_block_nbytes);
+        auto chunk_nblocks = _mithral_scan_nfit(
+            kMithralScanL1NBytes / 2, codes_block_nbytes);
+        auto lut_block_noutputs = _mithral_scan_nfit(
+            kMithralScanL1NBytes / 2, lut_nbytes, OutTileSz);
+        for (int64_t p = 0; p < nblocks; p += panel_nblocks) {
+            auto p_end = std::min(nblocks, p + panel_nblocks);
+            for (int m = 0; m < noutputs; m += lut_block_noutputs) {
+                auto use_noutputs = (int)std::min<int64_t>(
+                    lut_block_noutputs, noutputs - m);
+                for (int64_t b = p; b < p_end; b += chunk_nblocks) {
+                    auto use_nblocks = std::min(chunk_nblocks, p_end - b);
+                    _mithral_scan_outputs<UpcastEvery, OutTileSz>(
+                        codes + b * codes_block_nbytes, use_nblocks,
+                        ncodebooks, use_noutputs, luts + m * lut_nbytes,
+                        dists_out + m * out_col_stride + b * out_block_nbytes,
+                        nblocks);
+                }
+            }
         }
-
-
-        // if (OutTileSz > 0) {
-        //     int nfullgroups_out = noutputs / OutTileSz;
-        //     for (int g = 0; g < nfullgroups_out; g++) {
-        //         mithral_scan<UpcastEvery, OutTileSz>(
-        //             codes_ptr, use_nblocks, ncodebooks, lut_ptr, out_ptr);
-        //         out_ptr += out_col_stride * OutTileSz;
-        //         lut_ptr += lut_col_stride * OutTileSz;
-        //     }
-        //     int ntrailing_outputs = noutputs % OutTileSz;
-        //     for (int m = 0; m < ntrailing_outputs; m++) {
-        //         mithral_scan<UpcastEvery, 1>(
-        //             codes_ptr, use_nblocks, ncodebooks, lut_ptr, out_ptr);
-        //         out_ptr += out_col_stride * OutTileSz;
-        //         lut_ptr += lut_col_stride * OutTileSz;
-        //     }
-        // } else {
-        //     // TODO just call mithral_scan with OutTileSz=1 and eliminate
-        //     // dup code
-        //     for (int i = 0; i < noutputs; i++) {
-        //         mithral_scan_notile<UpcastEvery>(
-        //             codes_ptr, use_nblocks, ncodebooks, lut_ptr, out_ptr);
-        //         out_ptr += out_col_stride;
-        //         lut_ptr += lut_col_stride;
-        //     }
-        // }
+        return;
+    }
+    // CodesStationary
+    auto chunk_nblocks = _mithral_scan_nfit(
+        kMithralScanChunkNBytes, codes_block_nbytes);
+    for (int64_t b = 0; b < nblocks; b += chunk_nblocks) {
+        auto use_nblocks = std::min(chunk_nblocks, nblocks - b);
+        _mithral_scan_outputs<UpcastEvery, OutTileSz>(
+            codes + b * codes_block_nbytes, use_nblocks, ncodebooks, noutputs,
+            luts, dists_out + b * out_block_nbytes, nblocks);
     }
 }
 
@@ -42,11 +42,35 @@ void mithral_lut_dense(const float* Q, int nrows, int ncols, int ncodebooks,
     const float* centroids, float& out_offset_sum, float& out_scale,
     float*__restrict__ tmp_lut_f32, uint8_t* out);
 
+void mithral_lut_dense_parallel(const float* Q, int nrows, int ncols,
+    int ncodebooks, const float* centroids, float& out_offset_sum,
+    float& out_scale, float*__restrict__ tmp_lut_f32, uint8_t* out,
+    int nthreads=-1);
+
 void mithral_lut_sparse(const float* Q, int nrows, int ncols, int ncodebooks,
     const float* centroids, const int* idxs, int nnz_per_centroid,
     float& out_offset_sum, float& out_scale,
     float*__restrict__ tmp_lut_f32, uint8_t* out);
 
+// loop orders for scanning codes against many outputs' luts
+enum class MithralScanOrder {
+    Auto = 0,
+    CodesStationary,   // each L1-sized chunk of codes gets every output's luts
+    OutputStationary,  // each tile of outputs' luts gets all of the codes
+    Tiled2D            // L1-sized blocks of luts x chunks of codes, within
+                       // L2-sized panels of codes
+};
+
+const char* mithral_scan_order_name(MithralScanOrder order);
+
+MithralScanOrder mithral_scan_order_for(int64_t nblocks, int ncodebooks,
+                                        int noutputs);
+
+// no default order, so that it doesn't clash with the mithral_scan() below
+void mithral_scan(const uint8_t* codes, int64_t nblocks, int ncodebooks,
+                  int noutputs, const uint8_t* luts, uint8_t* dists_out,
+                  MithralScanOrder order);
+
 // ================================================================ here
 
 namespace {
@@ -688,14 +688,13 @@ inline void lut_dists_8b_stride4b(const uint8_t* codes,
 inline void popcount_8B(const uint8_t* codes, const uint64_t q,
     uint8_t* dists_out, int64_t N)
 {
-    for (int64_t i = 0; i < N; i++) {
-        auto row_ptr = reinterpret_cast<const uint64_t*>(codes + (8 * i));
-        dists_out[i] = __builtin_popcountll((*row_ptr) ^ q);
-    }
+    xor_popcount_rows<PopcntDefault, 1>(
+        reinterpret_cast<const uint64_t*>(codes), &q, N, dists_out);
 }
 
+// scalar popcnt, one word at a time; for comparison with popcount_generic()
 template<int NBytes>
-inline void popcount_generic(const uint8_t* codes, const uint8_t* q,
+inline void popcount_generic_scalar(const uint8_t* codes, const uint8_t* q,
     uint8_t* dists_out, int64_t N)
 {
     static_assert(NBytes % 8 == 0, "Popcount requires multiples of 8B");
@@ -717,6 +716,21 @@ inline void popcount_generic(const uint8_t* codes, const uint8_t* q,
     }
 }
 
+// Hamming distances between each NBytes-byte code and q, vectorized
+// unless NBytes / 8 neither divides nor is a multiple of the Backend's
+// vector width. Distances are stored in uint8s, so codes over 32B can wrap.
+template<int NBytes, class Backend=PopcntDefault>
+inline void popcount_generic(const uint8_t* codes, const uint8_t* q,
+    uint8_t* dists_out, int64_t N)
+{
+    static_assert(NBytes % 8 == 0, "Popcount requires multiples of 8B");
+    static_assert(NBytes > 0, "Code length <= 0 is not valid");
+    using backend_t = popcnt_backend_for_t<Backend, NBytes / 8>;
+    xor_popcount_rows<backend_t, NBytes / 8>(
+        reinterpret_cast<const uint64_t*>(codes),
+        reinterpret_cast<const uint64_t*>(q), N, dists_out);
+}
+
 // returns a * b + c, elementwise; see eigen/src/Core/arch/AVX/PacketMath.h
 inline __m256 fma(__m256 a, __m256 b, __m256 c) {
     __m256 res = c;
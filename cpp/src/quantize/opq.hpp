@@ -0,0 +1,244 @@
+//
+//  opq.hpp
+//  Bolt
+//
+//  Optimized product quantization (OPQ) with structured rotations and
+//  tiled encoding. opq_encode_8b() rotates the whole input into a
+//  temporary with a dense GEMM before encoding it, so it streams the data
+//  through memory twice and costs O(D^2) per row. Here, each tile of rows
+//  is rotated into a small cache-resident buffer and encoded right away,
+//  and rotations can be structured so that applying them is cheap:
+//
+//  - DenseRotation: any orthogonal matrix; O(D^2) per row.
+//  - BlockDiagonalRotation: one small rotation per group of dims, as
+//    learned by learn_bopq() in experiments/python/product_quantize.py;
+//    O(D * block_sz) per row.
+//  - HadamardRotation: random sign flips and permutations interleaved
+//    with Hadamard transforms; O(D log D) per row and needs no training.
+//
+//  Every rotation maps row-major [nrows x D] rows x to x * R.
+//
+
+#ifndef __OPQ_HPP
+#define __OPQ_HPP
+
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+#include <numeric>
+#include <random>
+#include <stdint.h>
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/quantize/product_quantize.hpp"
+    #include "src/utils/eigen_utils.hpp"
+    #include "src/utils/hadamard.hpp"
+#else
+    #include "product_quantize.hpp"
+    #include "eigen_utils.hpp"
+    #include "hadamard.hpp"
+#endif
+
+namespace {
+
+// rows per tile; enough to amortize per-tile overhead while the rotated
+// tile stays in L2
+static inline int64_t opq_tile_nrows(int ncols) {
+    static constexpr int64_t target_tile_nbytes = 256 * 1024;
+    return std::max<int64_t>(64, target_tile_nbytes / (ncols * sizeof(float)));
+}
+
+// ------------------------------------------------ rotations
+
+class DenseRotation {
+public:
+    // R is ncols x ncols; rows are rotated as x * R, like opq_encode_8b()
+    explicit DenseRotation(const RowMatrix<float>& R): _R(R) {
+        assert(R.rows() == R.cols());
+    }
+    int ncols() const { return static_cast<int>(_R.rows()); }
+
+    void apply(const float* X, int64_t nrows, float* out) const {
+        Eigen::Map<const RowMatrix<float> > X_map(X, nrows, ncols());
+        Eigen::Map<RowMatrix<float> > out_map(out, nrows, ncols());
+        out_map.noalias() = X_map * _R;
+    }
+
+private:
+    RowMatrix<float> _R;
+};
+
+class BlockDiagonalRotation {
+public:
+    /**
+     * @param rotations One block_sz x block_sz rotation per group of
+     *  block_sz consecutive dims. As in bopq_rotate(), each group of dims
+     *  x_i is mapped to x_i * R_i^T.
+     */
+    explicit BlockDiagonalRotation(const std::vector<RowMatrix<float> >& rotations):
+        _block_sz(static_cast<int>(rotations.at(0).rows())),
+        _ncols(_block_sz * static_cast<int>(rotations.size()))
+    {
+        for (const auto& R : rotations) {
+            assert(R.rows() == _block_sz && R.cols() == _block_sz);
+            _Rts.push_back(R.transpose());
+        }
+    }
+    int ncols() const { return _ncols; }
+    int block_sz() const { return _block_sz; }
+
+    void apply(const float* X, int64_t nrows, float* out) const {
+        using StridedMap = Eigen::Map<const RowMatrix<float>, 0,
+            Eigen::OuterStride<> >;
+        using StridedMapOut = Eigen::Map<RowMatrix<float>, 0,
+            Eigen::OuterStride<> >;
+        for (size_t b = 0; b < _Rts.size(); b++) {
+            auto offset = b * _block_sz;
+            StridedMap X_block(X + offset, nrows, _block_sz,
+                               Eigen::OuterStride<>(_ncols));
+            StridedMapOut out_block(out + offset, nrows, _block_sz,
+                                    Eigen::OuterStride<>(_ncols));
+            out_block.noalias() = X_block * _Rts[b];
+        }
+    }
+
+private:
+    int _block_sz;
+    int _ncols;
+    std::vector<RowMatrix<float> > _Rts;
+};
+
+/**
+ * @brief Randomized Hadamard rotation.
+ *
+ * @details Each of nrounds rounds permutes the dims, flips the sign of a
+ * random subset of them, and applies an orthonormal Hadamard transform to
+ * the first block_sz dims, where block_sz is the largest power of 2 that's
+ * <= ncols. If ncols isn't a power of 2, it then applies another to the
+ * last block_sz dims, after flipping the signs of a random subset of
+ * them again; the two blocks overlap and together cover every dim,
+ * so each round mixes all of them (e.g., for D = 960, blocks of 512 at 0
+ * and 448) while the rotation stays orthogonal.
+ */
+class HadamardRotation {
+public:
+    explicit HadamardRotation(int ncols, int nrounds=2, int seed=123):
+        _ncols(ncols), _block_sz(_max_pow2_block_sz(ncols)),
+        _perms(nrounds, std::vector<int>(ncols)),
+        _signs(nrounds, std::vector<float>(ncols)),
+        _second_signs(nrounds, std::vector<float>(
+            _block_sz < ncols ? _block_sz : 0))
+    {
+        assert(ncols > 0);
+        std::mt19937 rng(seed);
+        std::bernoulli_distribution coin(.5);
+        float scale = 1.f / sqrtf(_block_sz);
+        for (int r = 0; r < nrounds; r++) {
+            std::iota(_perms[r].begin(), _perms[r].end(), 0);
+            std::shuffle(_perms[r].begin(), _perms[r].end(), rng);
+            // fold the 1 / sqrt(block_sz) normalization of each block into
+            // the signs applied just before it; the second block gets its
+            // own signs, since the first block's output is exactly what a
+            // Hadamard transform would map back onto a few dims
+            for (int j = 0; j < ncols; j++) {
+                float s = j < _block_sz ? scale : 1.f;
+                _signs[r][j] = coin(rng) ? s : -s;
+            }
+            for (auto& s : _second_signs[r]) { s = coin(rng) ? scale : -scale; }
+        }
+    }
+    int ncols() const { return _ncols; }
+    int block_sz() const { return _block_sz; }
+
+    void apply(const float* X, int64_t nrows, float* out) const {
+        std::vector<float> tmp(_ncols);
+        auto second_block = tmp.data() + _ncols - _block_sz;
+        for (int64_t i = 0; i < nrows; i++) {
+            auto in_row = X + i * _ncols;
+            auto out_row = out + i * _ncols;
+            for (size_t r = 0; r < _perms.size(); r++) {
+                const float* src = r == 0 ? in_row : out_row;
+                auto& perm = _perms[r];
+                auto& signs = _signs[r];
+                for (int j = 0; j < _ncols; j++) {
+                    tmp[j] = src[perm[j]] * signs[j];
+                }
+                fwht(tmp.data(), _block_sz);
+                if (_block_sz < _ncols) {
+                    auto& second_signs = _second_signs[r];
+                    for (int j = 0; j < _block_sz; j++) {
+                        second_block[j] *= second_signs[j];
+                    }
+                    fwht(second_block, _block_sz);
+                }
+                std::copy(tmp.begin(), tmp.end(), out_row);
+            }
+            if (_perms.empty()) {
+                std::copy(in_row, in_row + _ncols, out_row);
+            }
+        }
+    }
+
+private:
+    // largest power of 2 that's <= ncols
+    static int _max_pow2_block_sz(int ncols) {
+        auto p = next_pow2(ncols);
+        return static_cast<int>(p == ncols ? p : p / 2);
+    }
+
+    int _ncols;
+    int _block_sz;
+    std::vector<std::vector<int> > _perms;
+    std::vector<std::vector<float> > _signs;
+    std::vector<std::vector<float> > _second_signs;
+};
+
+// ------------------------------------------------ encoding and luts
+
+/**
+ * @brief Rotates and PQ-encodes X one tile of rows at a time.
+ *
+ * @details Same output as opq_encode_8b(), without the [nrows x ncols]
+ * temporary.
+ *
+ * @param X Row-major [nrows x ncols] data
+ * @param centroids Centroids as from pq_encode_centroids_8b(), learned on
+ *  rotated data
+ * @param rot A DenseRotation, BlockDiagonalRotation, or HadamardRotation
+ * @param out Row-major [nrows x ncodebooks] codes
+ */
+template<class RotationT>
+void opq_encode_8b_tiled(const float* X, int64_t nrows, int ncols,
+    int ncodebooks, const float* centroids, const RotationT& rot, uint8_t* out)
+{
+    assert(rot.ncols() == ncols);
+    auto tile_nrows = std::min(opq_tile_nrows(ncols), nrows);
+    RowMatrix<float> tile(tile_nrows, ncols);
+    for (int64_t i = 0; i < nrows; i += tile_nrows) {
+        auto n = std::min(tile_nrows, nrows - i);
+        rot.apply(X + i * ncols, n, tile.data());
+        pq_encode_8b(tile.data(), n, ncols, ncodebooks, centroids,
+                     out + i * ncodebooks);
+    }
+}
+
+// as opq_lut_8b(), but with any rotation and one tile of queries at a time
+template<int Reduction=Reductions::DistL2, class RotationT, class dist_t>
+void opq_lut_8b_tiled(const float* Q, int nrows, int ncols, int ncodebooks,
+    const float* centroids, const RotationT& rot, dist_t* out)
+{
+    static constexpr int lut_sz = 256;
+    assert(rot.ncols() == ncols);
+    auto tile_nrows = std::min<int64_t>(opq_tile_nrows(ncols), nrows);
+    RowMatrix<float> tile(tile_nrows, ncols);
+    for (int64_t i = 0; i < nrows; i += tile_nrows) {
+        auto n = static_cast<int>(std::min<int64_t>(tile_nrows, nrows - i));
+        rot.apply(Q + i * ncols, n, tile.data());
+        pq_lut_8b<Reduction>(tile.data(), n, ncols, ncodebooks, centroids,
+                             out + i * ncodebooks * lut_sz);
+    }
+}
+
+} // anon namespace
+#endif // __OPQ_HPP
@@ -69,7 +69,8 @@ void pq_encode_8b(const float* X, int64_t nrows, int64_t ncols,
             // that group
 
             // find the group of 16 centroids containing the lowest min
-            __m256i best_min_broadcast = _mm256_undefined_si256();
+            __m256i best_min_broadcast = _mm256_set1_epi32(
+                std::numeric_limits<int32_t>::max());
             int32_t min_val = std::numeric_limits<int32_t>::max();
             // uint8_t best_s = -1;
             uint32_t indicators = 0;
@@ -115,8 +116,9 @@ void pq_encode_8b(const float* X, int64_t nrows, int64_t ncols,
             uint64_t mask = mask0 + (static_cast<uint64_t>(mask1) << 32);
             uint8_t min_idx = __tzcnt_u64(mask) >> 2; // div by 4 since 4B objs
 
-            // offset min_idx based on which group of 16 it was in
-            min_idx += 16 * best_s;
+            // offset min_idx based on which group of 16 it was in; best_s
+            // indexes stripes of 8, so each group spans two of them
+            min_idx += 8 * best_s;
 
             out[m] = min_idx;
         } // m
@@ -159,13 +161,18 @@ void pq_lut_8b(const float* q, int len, const float* centroids, dist_t* out)
         "Distance type must be one of {float, uint16_t, uint8_t}.");
     static_assert(
         Reduction == Reductions::DistL2 ||
-        Reduction == Reductions::DotProd,
-        "Only reductions {DistL2, DotProd} are supported.");
+        Reduction == Reductions::DotProd ||
+        Reduction == Reductions::DistL1 ||
+        Reduction == Reductions::CosineSim,
+        "Only reductions {DistL2, DotProd, DistL1, CosineSim} are supported.");
     const int subvect_len = static_cast<int>(len / ncodebooks);
     const int trailing_subvect_len = len % ncodebooks;
     assert(trailing_subvect_len == 0); // TODO remove this constraint
 
     __m256 accumulators[nstripes];
+    // for cosine similarity, dot with q / ||q|| so callers needn't normalize
+    auto inv_qnorm_vect = _mm256_set1_ps(
+        Reduction == Reductions::CosineSim ? inv_l2_norm(q, len) : 1.f);
 
     for (int m = 0; m < ncodebooks; m++) { // for each codebook
         for (int i = 0; i < nstripes; i++) {
@@ -177,14 +184,24 @@ void pq_lut_8b(const float* q, int len, const float* centroids, dist_t* out)
                 auto centroids_col = _mm256_load_ps(centroids);
                 centroids += packet_width;
 
-                if (Reduction == Reductions::DotProd) {
+                if (Reduction == Reductions::DotProd ||
+                    Reduction == Reductions::CosineSim)
+                {
                     accumulators[i] = fma(q_broadcast, centroids_col, accumulators[i]);
                 } else if (Reduction == Reductions::DistL2) {
                     auto diff = _mm256_sub_ps(q_broadcast, centroids_col);
                     accumulators[i] = fma(diff, diff, accumulators[i]);
+                } else if (Reduction == Reductions::DistL1) {
+                    auto diff = _mm256_sub_ps(q_broadcast, centroids_col);
+                    accumulators[i] = _mm256_add_ps(abs_ps(diff), accumulators[i]);
                 }
             }
         }
+        if (Reduction == Reductions::CosineSim) {
+            for (int i = 0; i < nstripes; i++) {
+                accumulators[i] = _mm256_mul_ps(accumulators[i], inv_qnorm_vect);
+            }
+        }
         // write out dists in this col of the lut
         if (float_dists) {
             for (uint8_t i = 0; i < nstripes; i++) {
@@ -236,13 +253,13 @@ void pq_lut_8b(const float* Q, int nrows, int ncols, int ncodebooks,
                const float* centroids, dist_t* out)
 {
     switch(ncodebooks) {
-        case 1: pq_lut_8b<1>(Q, nrows, ncols, centroids, out); break;
-        case 2: pq_lut_8b<2>(Q, nrows, ncols, centroids, out); break;
-        case 4: pq_lut_8b<4>(Q, nrows, ncols, centroids, out); break;
-        case 8: pq_lut_8b<8>(Q, nrows, ncols, centroids, out); break;
-        case 16: pq_lut_8b<16>(Q, nrows, ncols, centroids, out); break;
-        case 32: pq_lut_8b<32>(Q, nrows, ncols, centroids, out); break;
-        case 64: pq_lut_8b<64>(Q, nrows, ncols, centroids, out); break;
+        case 1: pq_lut_8b<1, Reduction>(Q, nrows, ncols, centroids, out); break;
+        case 2: pq_lut_8b<2, Reduction>(Q, nrows, ncols, centroids, out); break;
+        case 4: pq_lut_8b<4, Reduction>(Q, nrows, ncols, centroids, out); break;
+        case 8: pq_lut_8b<8, Reduction>(Q, nrows, ncols, centroids, out); break;
+        case 16: pq_lut_8b<16, Reduction>(Q, nrows, ncols, centroids, out); break;
+        case 32: pq_lut_8b<32, Reduction>(Q, nrows, ncols, centroids, out); break;
+        case 64: pq_lut_8b<64, Reduction>(Q, nrows, ncols, centroids, out); break;
         default: assert(false);  // unsupported ncodebooks
     }
 }
@@ -308,6 +325,39 @@ void pq_scan_8b(const uint8_t* codes, int nrows, int ncodebooks,
     }
 }
 
+// like pq_scan_8b, but given CosineSim LUTs (as floats) and 1 / ||x_i|| for
+// each row, outputs cosine similarities; see bolt_inv_row_norms()
+template<int NBytes>
+inline void pq_scan_8b_cosine(const uint8_t* codes, const float* luts,
+    const float* inv_norms, float* dists_out, int64_t N)
+{
+    static_assert(NBytes > 0, "Code length <= 0 is not valid");
+    static constexpr int ncentroids = 256;
+    for (int64_t i = 0; i < N; i++) {
+        float sum = 0;
+        for (int j = 0; j < NBytes; j++) {
+            sum += luts[ncentroids * j + codes[j]];
+        }
+        dists_out[i] = sum * inv_norms[i];
+        codes += NBytes;
+    }
+}
+
+static inline void pq_scan_8b_cosine(const uint8_t* codes, int nrows,
+    int ncodebooks, const float* luts, const float* inv_norms, float* dists_out)
+{
+    switch(ncodebooks) {
+        case 1: pq_scan_8b_cosine<1>(codes, luts, inv_norms, dists_out, nrows); break;
+        case 2: pq_scan_8b_cosine<2>(codes, luts, inv_norms, dists_out, nrows); break;
+        case 4: pq_scan_8b_cosine<4>(codes, luts, inv_norms, dists_out, nrows); break;
+        case 8: pq_scan_8b_cosine<8>(codes, luts, inv_norms, dists_out, nrows); break;
+        case 16: pq_scan_8b_cosine<16>(codes, luts, inv_norms, dists_out, nrows); break;
+        case 32: pq_scan_8b_cosine<32>(codes, luts, inv_norms, dists_out, nrows); break;
+        case 64: pq_scan_8b_cosine<64>(codes, luts, inv_norms, dists_out, nrows); break;
+        default: assert(false);  // unsupported ncodebooks
+    }
+}
+
 template<class dist_t>
 void pq_scan_8b(const uint8_t* codes, int nrows, int ncodebooks,
                int noutputs, const dist_t* luts, dist_t* dists_out)
@@ -9,12 +9,30 @@
 #ifndef sketch_hpp
 #define sketch_hpp
 
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <math.h>
+#include <mutex>
+#include <numeric>
+#include <random>
 #include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "immintrin.h"
 
 #ifdef BLAZE
     #include "src/utils/eigen_utils.hpp"
+    #include "src/utils/hadamard.hpp"
+    #include "src/utils/thread_utils.hpp"
+    #include "src/external/eigen/Eigen/SparseCore"
 #else
     #include "eigen_utils.hpp"
+    #include "hadamard.hpp"
+    #include "thread_utils.hpp"
+    #include "SparseCore"
 #endif
 
 
@@ -22,8 +40,8 @@ namespace {
 // template<typename ColMatrixT>
 // void _osnap_sketch_cols(const ColMatrixT0& A, RowMatrix<uint32_t> all_idxs,
 template<bool SketchCols=true, typename MatrixT0, typename MatrixT1>
-void osnap_sketch(const MatrixT0& A, RowMatrix<uint32_t> all_idxs,
-                        RowMatrix<float> all_signs, MatrixT1&& out)
+void osnap_sketch(const MatrixT0& A, const RowMatrix<uint32_t>& all_idxs,
+                  const RowMatrix<float>& all_signs, MatrixT1&& out)
 {
     // all_idxs is ncols x nsketches
     // printf("sketch_cols\n");
@@ -77,8 +95,30 @@ void osnap_sketch(const MatrixT0& A, RowMatrix<uint32_t> all_idxs,
 //     }
 // }
 
+// flips the sign of x iff sign_bit is 0x80000000
+static inline float _xor_sign(float x, uint32_t sign_bit) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits ^= sign_bit;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
 } // end anonymous namespace
 
+/**
+ * @brief OSNAP sketch: each input dim is added, with a random sign, to one
+ * random output dim in each of nsketches disjoint ranges of output dims.
+ *
+ * @details Sketching float matrices doesn't go through osnap_sketch(),
+ * which scatters one input column at a time into the output. Instead, the
+ * (input dim, sign) pairs are grouped by the output dim they feed, so
+ * that each output column is summed in registers and written once. Rows
+ * are processed in tiles small enough that the tile of the input stays in
+ * cache while every output column reads from it, tiles are split across
+ * threads, and signs are applied by XORing the float sign bit rather than
+ * multiplying. There's also a path for CSR inputs.
+ */
 struct OsnapSketch {
 
     OsnapSketch(int D, int d_total, int nsketches):
@@ -102,18 +142,22 @@ struct OsnapSketch {
             assert(end_idx - 1 < d_total);
             std::uniform_int_distribution<uint32_t> idx_distro(
                 start_idx, end_idx - 1);
-            end_idx = start_idx;
+            start_idx = end_idx;
             for (int i = 0; i < D; i++) {
                 sketch_idxs(i, s) = idx_distro(rng);
-                sketch_signs(i, s) = (2 * sign_distro(rng)) - 1;
+                sketch_signs(i, s) = 2 * static_cast<int>(sign_distro(rng)) - 1;
             }
         }
+        _group_by_destination();
     }
 
-  template<typename T>
-    void operator()(const ColMatrix<T>& A, ColMatrix<T>out,
+    // A is [N x D] and out is [N x d_total], or, if transpose, A is
+    // [D x N] and out is [d_total x N]
+    template<typename T>
+    void operator()(const ColMatrix<T>& A, ColMatrix<T>& out,
                     bool transpose=false) const
     {
+        out.setZero();
         if (transpose) {
             osnap_sketch<false>(
                 A.transpose(), sketch_idxs, sketch_signs, out.transpose());
@@ -122,9 +166,541 @@ struct OsnapSketch {
         }
     }
 
+    void operator()(const ColMatrix<float>& A, ColMatrix<float>& out,
+                    bool transpose=false, int nthreads=-1) const
+    {
+        if (transpose) {
+            assert(A.rows() == D);
+            assert(out.rows() == d_total && out.cols() == A.cols());
+            _apply_transposed(A, out, nthreads);
+        } else {
+            assert(A.cols() == D);
+            assert(out.rows() == A.rows() && out.cols() == d_total);
+            _apply(A, out, nthreads);
+        }
+    }
+
+    // CSR input; A is [N x D] and out is [N x d_total]
+    void operator()(const Eigen::SparseMatrix<float, Eigen::RowMajor>& A,
+                    RowMatrix<float>& out, int nthreads=-1) const
+    {
+        static constexpr int64_t min_rows_per_thread = 1024;
+        assert(A.cols() == D);
+        assert(out.rows() == A.rows() && out.cols() == d_total);
+        auto row_starts = A.outerIndexPtr();
+        auto cols = A.innerIndexPtr();
+        auto vals = A.valuePtr();
+        auto dests = sketch_idxs.data();
+        auto sign_bits = _src_sign_bits.data();
+        parallel_for_ranges(A.rows(), nthreads, min_rows_per_thread,
+            [&](int64_t start, int64_t end) {
+                for (int64_t r = start; r < end; r++) {
+                    auto out_row = out.row(r).data();
+                    std::fill(out_row, out_row + d_total, 0.f);
+                    for (auto p = row_starts[r]; p < row_starts[r + 1]; p++) {
+                        auto val = vals[p] * _scale;
+                        auto offset = cols[p] * nsketches;
+                        for (int j = 0; j < nsketches; j++) {
+                            out_row[dests[offset + j]] +=
+                                _xor_sign(val, sign_bits[offset + j]);
+                        }
+                    }
+                }
+            });
+    }
+
     int D, d_total, nsketches;
     RowMatrix<uint32_t> sketch_idxs;
     RowMatrix<float> sketch_signs;
+
+private:
+    void _group_by_destination() {
+        _scale = nsketches > 1 ? 1.f / sqrtf(nsketches) : 1.f;
+        _src_sign_bits.resize(D * nsketches);
+        for (int i = 0; i < D * nsketches; i++) {
+            _src_sign_bits[i] = sketch_signs.data()[i] < 0 ? 0x80000000 : 0;
+        }
+        // counting sort of (input dim, sketch) pairs by output dim
+        _dest_offsets.assign(d_total + 1, 0);
+        for (int i = 0; i < D * nsketches; i++) {
+            _dest_offsets[sketch_idxs.data()[i] + 1]++;
+        }
+        for (int k = 0; k < d_total; k++) {
+            _dest_offsets[k + 1] += _dest_offsets[k];
+        }
+        _src_cols.resize(D * nsketches);
+        _dest_sign_bits.resize(D * nsketches);
+        auto next = _dest_offsets;
+        for (int i = 0; i < D; i++) {
+            for (int j = 0; j < nsketches; j++) {
+                auto pos = next[sketch_idxs(i, j)]++;
+                _src_cols[pos] = i;
+                _dest_sign_bits[pos] = _src_sign_bits[i * nsketches + j];
+            }
+        }
+    }
+
+    void _apply(const ColMatrix<float>& A, ColMatrix<float>& out,
+                int nthreads) const
+    {
+        // rows per tile; about 128KB of A, and a multiple of the 64 rows
+        // summed in registers at once
+        static constexpr int64_t target_tile_sz = 32 * 1024;
+        auto N = A.rows();
+        auto tile_nrows = std::max<int64_t>(64, (target_tile_sz / D) & ~63);
+        auto ntiles = (N + tile_nrows - 1) / tile_nrows;
+        parallel_for_ranges(ntiles, nthreads, 1,
+            [&](int64_t start_tile, int64_t end_tile) {
+                for (int64_t t = start_tile; t < end_tile; t++) {
+                    auto start = t * tile_nrows;
+                    auto end = std::min(N, start + tile_nrows);
+                    _apply_tile(A.data(), N, out.data(), start, end);
+                }
+            });
+    }
+
+    // sketches rows [start, end) of column-major A [N x D]
+    void _apply_tile(const float* A, int64_t N, float* out, int64_t start,
+                     int64_t end) const
+    {
+        // 8 independent accumulators hide the latency of the adds
+        static constexpr int block_nvecs = 8;
+        static constexpr int block_nrows = 8 * block_nvecs;
+        auto scale = _mm256_set1_ps(_scale);
+        for (int k = 0; k < d_total; k++) {
+            auto p_begin = _dest_offsets[k];
+            auto p_end = _dest_offsets[k + 1];
+            auto out_col = out + k * N;
+            int64_t i = start;
+            for (; i + block_nrows <= end; i += block_nrows) {
+                __m256 accs[block_nvecs];
+                for (int v = 0; v < block_nvecs; v++) {
+                    accs[v] = _mm256_setzero_ps();
+                }
+                for (auto p = p_begin; p < p_end; p++) {
+                    auto src = A + _src_cols[p] * N + i;
+                    auto sign = _mm256_castsi256_ps(
+                        _mm256_set1_epi32(_dest_sign_bits[p]));
+                    for (int v = 0; v < block_nvecs; v++) {
+                        accs[v] = _mm256_add_ps(accs[v], _mm256_xor_ps(
+                            _mm256_loadu_ps(src + 8 * v), sign));
+                    }
+                }
+                for (int v = 0; v < block_nvecs; v++) {
+                    _mm256_storeu_ps(out_col + i + 8 * v,
+                                     _mm256_mul_ps(accs[v], scale));
+                }
+            }
+            for (; i + 8 <= end; i += 8) {
+                auto acc = _mm256_setzero_ps();
+                for (auto p = p_begin; p < p_end; p++) {
+                    auto sign = _mm256_castsi256_ps(
+                        _mm256_set1_epi32(_dest_sign_bits[p]));
+                    acc = _mm256_add_ps(acc, _mm256_xor_ps(_mm256_loadu_ps(
+                        A + _src_cols[p] * N + i), sign));
+                }
+                _mm256_storeu_ps(out_col + i, _mm256_mul_ps(acc, scale));
+            }
+            for (; i < end; i++) {
+                float acc = 0;
+                for (auto p = p_begin; p < p_end; p++) {
+                    acc += _xor_sign(A[_src_cols[p] * N + i],
+                                     _dest_sign_bits[p]);
+                }
+                out_col[i] = acc * _scale;
+            }
+        }
+    }
+
+    // A is [D x N] and out is [d_total x N]; each column of A is a
+    // contiguous vector to sketch, so this is a gather per output entry
+    void _apply_transposed(const ColMatrix<float>& A, ColMatrix<float>& out,
+                           int nthreads) const
+    {
+        static constexpr int64_t min_cols_per_thread = 256;
+        parallel_for_ranges(A.cols(), nthreads, min_cols_per_thread,
+            [&](int64_t start, int64_t end) {
+                for (int64_t n = start; n < end; n++) {
+                    auto in = A.col(n).data();
+                    auto out_col = out.col(n).data();
+                    for (int k = 0; k < d_total; k++) {
+                        float acc = 0;
+                        for (auto p = _dest_offsets[k];
+                             p < _dest_offsets[k + 1]; p++)
+                        {
+                            acc += _xor_sign(in[_src_cols[p]],
+                                             _dest_sign_bits[p]);
+                        }
+                        out_col[k] = acc * _scale;
+                    }
+                }
+            });
+    }
+
+    float _scale;
+    std::vector<uint32_t> _src_sign_bits;   // D x nsketches, like sketch_signs
+    std::vector<uint32_t> _dest_offsets;    // d_total + 1
+    std::vector<uint32_t> _src_cols;        // grouped by output dim
+    std::vector<uint32_t> _dest_sign_bits;  // grouped by output dim
+};
+
+namespace {
+/**
+ * Flips the signs of A's columns, zero-pads them to D_pad, and Hadamard
+ * transforms each row, one tile of rows at a time. Calls
+ * fn(tile, row_start, tile_nrows) with each transformed tile, which is a
+ * column-major [tile_nrows x D_pad] matrix.
+ */
+template<class F>
+void _randomized_hadamard_tiles(const ColMatrix<float>& A, int D_pad,
+                                const std::vector<float>& signs, F fn)
+{
+    // ~128KB tiles, a multiple of 8 rows wide
+    static constexpr int64_t target_tile_sz = 32 * 1024;
+    int64_t N = A.rows();
+    int D = static_cast<int>(A.cols());
+    auto tile_nrows = std::max<int64_t>(8, (target_tile_sz / D_pad) & ~7);
+    tile_nrows = std::min(tile_nrows, N);
+    std::vector<float> tile(tile_nrows * D_pad);
+    for (int64_t i = 0; i < N; i += tile_nrows) {
+        auto n = std::min(tile_nrows, N - i);
+        for (int j = 0; j < D; j++) {
+            auto in = A.col(j).data() + i;
+            auto out = tile.data() + j * n;
+            auto sign = signs[j];
+            for (int64_t r = 0; r < n; r++) {
+                out[r] = in[r] * sign;
+            }
+        }
+        std::fill(tile.data() + D * n, tile.data() + D_pad * n, 0.f);
+        fwht_cols(tile.data(), D_pad, n);
+        fn(tile.data(), i, n);
+    }
+}
+
+std::vector<float> _random_signs(int n, float scale, std::mt19937& rng) {
+    std::bernoulli_distribution coin(.5);
+    std::vector<float> signs(n);
+    for (auto& s : signs) { s = coin(rng) ? scale : -scale; }
+    return signs;
+}
+} // anon namespace
+
+/**
+ * @brief Subsampled randomized Hadamard transform (SRHT) sketch.
+ *
+ * @details Maps rows x in R^D to sqrt(D_pad / d) * P H S x, where S flips
+ * random signs, H is the orthonormal D_pad x D_pad Hadamard matrix (x is
+ * zero-padded to the next power of 2, D_pad), and P keeps d of the D_pad
+ * coordinates, sampled without replacement. The expected outer product of
+ * the sketch matrix is the identity. O(D_pad log D_pad) per row instead of
+ * the O(D d) of a dense random projection.
+ */
+struct SrhtSketch {
+
+    SrhtSketch(int D, int d, int seed=123):
+        D(D), D_pad(static_cast<int>(next_pow2(D))), d(d)
+    {
+        assert(d <= D_pad);
+        std::mt19937 rng(seed);
+        // fold sqrt(D_pad / d) and H's 1 / sqrt(D_pad) into the signs
+        signs = _random_signs(D_pad, 1.f / sqrtf(d), rng);
+        std::vector<int> perm(D_pad);
+        std::iota(perm.begin(), perm.end(), 0);
+        std::shuffle(perm.begin(), perm.end(), rng);
+        idxs.assign(perm.begin(), perm.begin() + d);
+        std::sort(idxs.begin(), idxs.end());
+    }
+
+    // A is [N x D]; out is [N x d]
+    void operator()(const ColMatrix<float>& A, ColMatrix<float>& out) const {
+        assert(A.cols() == D);
+        assert(out.rows() == A.rows() && out.cols() == d);
+        _randomized_hadamard_tiles(A, D_pad, signs,
+            [&](const float* tile, int64_t start_row, int64_t nrows) {
+                for (int k = 0; k < d; k++) {
+                    auto in = tile + idxs[k] * nrows;
+                    std::copy(in, in + nrows, out.col(k).data() + start_row);
+                }
+            });
+    }
+
+    int D, D_pad, d;
+    std::vector<float> signs;
+    std::vector<int> idxs;
+};
+
+/**
+ * @brief Fast Johnson-Lindenstrauss transform (Ailon & Chazelle) sketch.
+ *
+ * @details Maps rows x in R^D to P H S x / sqrt(d), with S and H as in
+ * SrhtSketch and P a sparse D_pad x d matrix whose entries are nonzero
+ * with probability q = min(1, log2(D_pad)^2 / D_pad) and are then drawn
+ * from N(0, 1 / q). Unlike fastjl_sketches() in
+ * experiments/python/amm.py, which keeps entries with probability 1 - q,
+ * this uses the sparsity of the original construction.
+ */
+struct FastJlSketch {
+
+    FastJlSketch(int D, int d, int seed=123):
+        D(D), D_pad(static_cast<int>(next_pow2(D))), d(d), P(D_pad, d)
+    {
+        std::mt19937 rng(seed);
+        signs = _random_signs(D_pad, 1.f / sqrtf(D_pad), rng);
+        float log2_D = log2f(D_pad);
+        float q = std::min(1.f, log2_D * log2_D / D_pad);
+        std::bernoulli_distribution keep(q);
+        std::normal_distribution<float> gauss(0, 1.f / sqrtf(q * d));
+        std::vector<Eigen::Triplet<float> > entries;
+        for (int k = 0; k < d; k++) {
+            for (int j = 0; j < D_pad; j++) {
+                if (keep(rng)) {
+                    entries.emplace_back(j, k, gauss(rng));
+                }
+            }
+        }
+        P.setFromTriplets(entries.begin(), entries.end());
+    }
+
+    // A is [N x D]; out is [N x d]
+    void operator()(const ColMatrix<float>& A, ColMatrix<float>& out) const {
+        assert(A.cols() == D);
+        assert(out.rows() == A.rows() && out.cols() == d);
+        _randomized_hadamard_tiles(A, D_pad, signs,
+            [&](const float* tile, int64_t start_row, int64_t nrows) {
+                Eigen::Map<const ColMatrix<float> > tile_map(
+                    tile, nrows, D_pad);
+                out.middleRows(start_row, nrows).noalias() = tile_map * P;
+            });
+    }
+
+    int D, D_pad, d;
+    std::vector<float> signs;
+    Eigen::SparseMatrix<float> P;
+};
+
+/**
+ * @brief Frequent Directions sketch (Liberty, 2013) of a stream of rows.
+ *
+ * @details Keeps an ell x D matrix B such that, for the matrix A of all
+ * rows added so far, AᵀA - BᵀB is PSD with spectral norm at most
+ * error_bound() <= ||A||_F^2 / ell. Memory is O(ell * D) no matter how
+ * many rows are added.
+ *
+ * Rows are copied into one of two ell-row buffers. When a buffer fills,
+ * it's absorbed: stacked under B, and the resulting (2 * ell) x D matrix
+ * is shrunk back to ell rows using the eigendecomposition of its small
+ * (2 * ell) x (2 * ell) Gram matrix. This is the batched variant of
+ * frequent_directions() in experiments/python/amm.py, which does an SVD
+ * for every row. With background=true, absorption runs on a worker thread
+ * while the other buffer fills, so adding rows only waits if both
+ * buffers are full.
+ */
+class FrequentDirections {
+public:
+    FrequentDirections(int D, int ell, bool background=true):
+        _D(D), _ell(ell), _work(RowMatrix<float>::Zero(2 * ell, D)),
+        _bufs{{RowMatrix<float>(ell, D), RowMatrix<float>(ell, D)}}
+    {
+        assert(ell >= 2);
+        if (background) {
+            _worker = std::thread(&FrequentDirections::_worker_loop, this);
+        }
+    }
+    FrequentDirections(const FrequentDirections&) = delete;
+    FrequentDirections& operator=(const FrequentDirections&) = delete;
+
+    ~FrequentDirections() {
+        if (_worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _cv.notify_all();
+            _worker.join();
+        }
+    }
+
+    int D() const { return _D; }
+    int ell() const { return _ell; }
+    int64_t nrows() const { return _nrows; }
+
+    // X is row-major [nrows x D]
+    void add_rows(const float* X, int64_t nrows) {
+        _add_rows(X, _D, nullptr, 0, nrows);
+    }
+
+    // adds the rows of [X Y]; X is row-major [nrows x DX] and Y is
+    // row-major [nrows x (D - DX)]
+    void add_rows(const float* X, int DX, const float* Y, int64_t nrows) {
+        assert(DX <= _D);
+        _add_rows(X, DX, Y, _D - DX, nrows);
+    }
+
+    // absorbs any buffered rows and waits for absorption to finish
+    void flush() {
+        if (_nfilled > 0) { _hand_off(); }
+        _wait_idle();
+    }
+
+    // B, [ell x D]
+    RowMatrix<float> sketch() {
+        flush();
+        return _work.topRows(_ell);
+    }
+
+    // sum of the shrinkages, which bounds ||AᵀA - BᵀB||_2
+    double error_bound() {
+        flush();
+        return _total_shrinkage;
+    }
+
+private:
+    void _add_rows(const float* X, int DX, const float* Y, int DY,
+                   int64_t nrows)
+    {
+        for (int64_t i = 0; i < nrows; i++) {
+            auto dst = _bufs[_fill_idx].row(_nfilled).data();
+            std::copy(X + i * DX, X + (i + 1) * DX, dst);
+            if (DY > 0) {
+                std::copy(Y + i * DY, Y + (i + 1) * DY, dst + DX);
+            }
+            _nrows++;
+            if (++_nfilled == _ell) { _hand_off(); }
+        }
+    }
+
+    // queues the buffer being filled for absorption and switches to the
+    // other one, once that one has been absorbed
+    void _hand_off() {
+        if (!_worker.joinable()) {
+            _absorb(_bufs[_fill_idx], _nfilled);
+        } else {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this]() { return !_pending; });
+            _pending = true;
+            _pending_idx = _fill_idx;
+            _pending_nrows = _nfilled;
+            lock.unlock();
+            _cv.notify_all();
+        }
+        _fill_idx ^= 1;
+        _nfilled = 0;
+    }
+
+    void _wait_idle() {
+        if (!_worker.joinable()) { return; }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this]() { return !_pending; });
+    }
+
+    void _worker_loop() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _cv.wait(lock, [this]() { return _pending || _stop; });
+            if (_pending) {
+                auto idx = _pending_idx;
+                auto n = _pending_nrows;
+                lock.unlock();
+                _absorb(_bufs[idx], n);
+                lock.lock();
+                _pending = false;
+                _cv.notify_all();
+            } else {
+                return;
+            }
+        }
+    }
+
+    // shrinks [B; first n rows of buf] back to ell rows
+    void _absorb(const RowMatrix<float>& buf, int n) {
+        auto m = _ell + n;
+        _work.middleRows(_ell, n) = buf.topRows(n);
+        auto W = _work.topRows(m);
+        // W = U Σ Vᵀ, so the eigenvectors of W Wᵀ are U and Σ Vᵀ = Uᵀ W
+        // only the lower triangle of the Gram matrix is computed or read
+        Eigen::MatrixXf gram = Eigen::MatrixXf::Zero(m, m);
+        gram.selfadjointView<Eigen::Lower>().rankUpdate(W);
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(
+            gram.cast<double>());
+        const auto& lambdas = eig.eigenvalues();  // ascending
+        const auto& U = eig.eigenvectors();
+        // subtract the ell-th largest squared singular value from all of
+        // them, which zeroes the ell-th row and all after it
+        auto delta = std::max(0., lambdas(m - _ell));
+        _total_shrinkage += delta;
+        RowMatrix<float> proj(_ell, m);
+        for (int i = 0; i < _ell; i++) {
+            auto lambda = lambdas(m - 1 - i);
+            double scale = lambda > delta ?
+                sqrt((lambda - delta) / lambda) : 0;
+            proj.row(i) = (U.col(m - 1 - i) * scale).transpose().cast<float>();
+        }
+        RowMatrix<float> shrunk = proj * W;
+        _work.topRows(_ell) = shrunk;
+    }
+
+    int _D;
+    int _ell;
+    int64_t _nrows = 0;
+    double _total_shrinkage = 0;
+    // B in the first ell rows; rows being absorbed after those
+    RowMatrix<float> _work;
+    std::array<RowMatrix<float>, 2> _bufs;
+    int _fill_idx = 0;
+    int _nfilled = 0;
+
+    std::thread _worker;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _pending = false;
+    int _pending_idx = 0;
+    int _pending_nrows = 0;
+    bool _stop = false;
+};
+
+/**
+ * @brief Approximates XᵀY over a stream of paired rows (x_i, y_i).
+ *
+ * @details Sketches the concatenated rows [x_i y_i] with Frequent
+ * Directions, as fd_amm_sketches() does in experiments/python/amm.py.
+ * With B = [B_X B_Y], B_XᵀB_Y is the off-diagonal block of
+ * BᵀB ~= [X Y]ᵀ[X Y], so its error is also at most error_bound(). For
+ * the product of an [N x D] and a [D x M] matrix, the rows are the
+ * columns of the first and rows of the second, and the sketch takes
+ * O(ell * (N + M)) memory instead of O(D * (N + M)).
+ */
+class FdAmm {
+public:
+    FdAmm(int DX, int DY, int ell, bool background=true):
+        _DX(DX), _DY(DY), _fd(DX + DY, ell, background) {}
+
+    // X is row-major [nrows x DX] and Y is row-major [nrows x DY]
+    void add_rows(const float* X, const float* Y, int64_t nrows) {
+        _fd.add_rows(X, _DX, Y, nrows);
+    }
+
+    // B_X is [ell x DX] and B_Y is [ell x DY]
+    void factors(RowMatrix<float>& B_X, RowMatrix<float>& B_Y) {
+        auto B = _fd.sketch();
+        B_X = B.leftCols(_DX);
+        B_Y = B.rightCols(_DY);
+    }
+
+    // approximate XᵀY, [DX x DY]
+    RowMatrix<float> product() {
+        RowMatrix<float> B_X, B_Y;
+        factors(B_X, B_Y);
+        return B_X.transpose() * B_Y;
+    }
+
+    double error_bound() { return _fd.error_bound(); }
+    int64_t nrows() const { return _fd.nrows(); }
+
+private:
+    int _DX;
+    int _DY;
+    FrequentDirections _fd;
 };
 
 // void generate_hash_sketch_idxs_and_signs(
@@ -2,16 +2,25 @@
 #ifdef BLAZE
 	//#include "src/utils/avx_utils.hpp"
 	#include "avx_utils.hpp"
+	#include "sgemm.hpp"
 #else
 	#include "avx_utils.hpp"
+	#include "sgemm.hpp"
 #endif
 
-// N has to be a multiple of 8; better if D a multiple of 3 or 4, M a multiple
-// of 2 or 3
+// B is small enough that streaming A past it beats packing; past this many
+// floats, and whenever N isn't a multiple of 8, use the packed sgemm
+static constexpr int64_t kSgemmColmajorMaxUnpackedBSz = 128 * 1024;
+
+// better if D a multiple of 3 or 4, M a multiple of 2 or 3
 void sgemm_colmajor(const float* A, const float *B, int N, int D, int M,
                     float* out)
 {
     if (N < 1 || D < 1 || M < 1) { return; }
+    if (N % 8 != 0 || int64_t(D) * M > kSgemmColmajorMaxUnpackedBSz) {
+        sgemm_colmajor_packed(A, B, N, D, M, out);
+        return;
+    }
     if (D == 1 && M <= 6) {
         switch(M) {
             case 1: sgemm_colmajor_narrow_padded<1, 1>(A, B, N, D, M, out); return;
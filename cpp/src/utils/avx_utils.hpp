@@ -18,8 +18,16 @@
 // #include <stdio.h> // TODO rm
 #include "debug_utils.hpp"
 
+#include <math.h>
+#include <stdint.h>
 #include "immintrin.h"
 
+#ifdef BLAZE
+    #include "src/utils/popcount.hpp"
+#else
+    #include "popcount.hpp"
+#endif
+
 #ifndef MAX
     #define MAX(x, y) ((x) < (y) ? (y) : (x))
 #endif
@@ -34,8 +42,10 @@ namespace {
 // ================================================================ Types
 
 // TODO this is probably not the best file for this
+// CosineSim is the dot product with the query scaled to unit length; data
+// norms aren't known when building LUTs, so scans fold them in afterwards
 struct Reductions {
-    enum { DotProd, DistL2, DistL1 };
+    enum { DotProd, DistL2, DistL1, CosineSim };
 };
 
 // ================================================================ Functions
@@ -75,6 +85,18 @@ inline __m256 fma(__m256 a, __m256 b, __m256 c) {
     return res;
 }
 
+// returns |a|, elementwise
+inline __m256 abs_ps(__m256 a) {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a);
+}
+
+// 1 / ||x||, or 0 if x is all zeros
+inline float inv_l2_norm(const float* x, int64_t len) {
+    float sum_sq = 0;
+    for (int64_t i = 0; i < len; i++) { sum_sq += x[i] * x[i]; }
+    return sum_sq > 0 ? 1.f / sqrtf(sum_sq) : 0.f;
+}
+
 inline __m256i avg_epu8(__m256i a, __m256i b) {
     __m256i res = _mm256_undefined_si256();
     __asm__("vpavgb %[a], %[b], %[c]" : [c] "=x" (res) : [a] "x" (a), [b] "x" (b));
@@ -131,6 +153,11 @@ static inline __m256 broadcast_max(const __m256 a) {
     auto tmp2 = _mm256_max_ps(tmp, _mm256_shuffle_ps(tmp, tmp, _MM_SHUFFLE(1,0,3,2)));
     return _mm256_max_ps(tmp2, _mm256_shuffle_ps(tmp2, tmp2, _MM_SHUFFLE(2,3,0,1)));
 }
+static inline __m256 broadcast_sum(const __m256 a) {
+    auto tmp = _mm256_add_ps(a, _mm256_permute2f128_ps(a,a,1));
+    auto tmp2 = _mm256_add_ps(tmp, _mm256_shuffle_ps(tmp, tmp, _MM_SHUFFLE(1,0,3,2)));
+    return _mm256_add_ps(tmp2, _mm256_shuffle_ps(tmp2, tmp2, _MM_SHUFFLE(2,3,0,1)));
+}
 
 
 static inline __m256i packed_epu16_to_unpacked_epu8(const __m256i& a, const __m256i& b) {
@@ -605,7 +632,7 @@ void _bgemm(const uint64_t* A, const uint64_t* B,
                     }
                 }
                 // write out accumulator values
-                OutT nbits_per_row = D * 8;
+                OutT nbits_per_row = D * 64;
                 for (int mm = 0; mm < OutColTileSz; mm++) {
                     for (int nn = 0; nn < InRowTileSz; nn++) {
                         auto nbits_same = nbits_per_row - accumulators[nn][mm];
@@ -664,19 +691,61 @@ void _bgemm(const uint64_t* A, const uint64_t* B,
     // // printf("min max output vals: %d, %d\n", min, max);
 }
 
+// as _bgemm(), but with a vectorized popcount from popcount.hpp; for each
+// column of B, each L1-sized chunk of rows of A is scanned like a query
+// against a database of codes
+template<class Backend=PopcntDefault, int StaticD, class OutT>
+void _bgemm_vec(const uint64_t* A, const uint64_t* B,
+    int N, int M, OutT* out)
+{
+    static constexpr int target_chunk_nbytes = 24 * 1024; // most of L1
+    static constexpr int W = Backend::nwords;
+    static constexpr int A_row_nbytes = StaticD * sizeof(A[0]);
+    static constexpr int nrows_per_chunk = MAX(W,
+        (target_chunk_nbytes / A_row_nbytes) / W * W);
+    for (int i = 0; i < N; i += nrows_per_chunk) {
+        int nrows = MIN(nrows_per_chunk, N - i);
+        for (int m = 0; m < M; m++) {
+            xor_popcount_rows<Backend, StaticD, true>(A + i * StaticD,
+                B + m * StaticD, nrows, out + m * N + i);
+        }
+    }
+}
+
+// rows longer than _bgemm_vec() handles; one dot product at a time
+template<class Backend=PopcntDefault, class OutT>
+void _bgemm_rowwise(const uint64_t* A, const uint64_t* B,
+    int N, int D, int M, OutT* out)
+{
+    OutT nbits_per_row = D * 64;
+    for (int m = 0; m < M; m++) {
+        for (int i = 0; i < N; i++) {
+            out[m * N + i] = nbits_per_row - static_cast<OutT>(
+                xor_popcount<Backend>(A + i * D, B + m * D, D));
+        }
+    }
+}
+
+// number of matching bits between each row of A and each col of B; D is
+// in 64-bit words
 template<class OutT>
 void bgemm(const uint64_t* A, const uint64_t* B,
            int N, int D, int M, OutT* out)
 {
     switch(D) {
-        case 1: _bgemm<1, 1, 1>(A, B, N, -1, M, out); break;
-        case 2: _bgemm<1, 1, 2>(A, B, N, -1, M, out); break;
+        case 1: _bgemm_vec<PopcntDefault, 1>(A, B, N, M, out); break;
+        case 2: _bgemm_vec<PopcntDefault, 2>(A, B, N, M, out); break;
         case 3: _bgemm<1, 1, 3>(A, B, N, -1, M, out); break;
-        case 4: _bgemm<1, 1, 4>(A, B, N, -1, M, out); break;
-        case 8: _bgemm<1, 1, 8>(A, B, N, -1, M, out); break;
+        case 4: _bgemm_vec<PopcntDefault, 4>(A, B, N, M, out); break;
+        case 8: _bgemm_vec<PopcntDefault, 8>(A, B, N, M, out); break;
+        case 16: _bgemm_vec<PopcntDefault, 16>(A, B, N, M, out); break;
+        case 32: _bgemm_vec<PopcntDefault, 32>(A, B, N, M, out); break;
         default:
-            assert(false); // should only be passing in D in {1,2,4,8}
-            _bgemm<1, 1>(A, B, N, D, M, out);
+            if (D > 8) {
+                _bgemm_rowwise(A, B, N, D, M, out);
+            } else {
+                _bgemm<1, 1>(A, B, N, D, M, out);
+            }
             break;
     }
 }
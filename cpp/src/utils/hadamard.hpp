@@ -0,0 +1,236 @@
+//
+//  hadamard.hpp
+//  Bolt
+//
+//  Fast Walsh-Hadamard transforms (FWHTs), vectorized with AVX2.
+//
+//  log2(n) stages of butterflies are fused three at a time into radix-8
+//  passes over eight vectors held in registers, so each pass reads and
+//  writes the data once for every three stages. Long vectors are done one
+//  L1-sized block at a time first, so that only the stages that mix
+//  blocks make passes over the whole vector.
+//
+//  fwht() and fwht_rows() transform contiguous vectors. fwht_cols()
+//  transforms many vectors at once whose elements are interleaved, as
+//  the columns of a row-major matrix (or the rows of a column-major one)
+//  are; every butterfly then runs on 8 vectors per instruction.
+//
+
+#ifndef __HADAMARD_HPP
+#define __HADAMARD_HPP
+
+#include <algorithm>
+#include <assert.h>
+#include <stdint.h>
+#include "immintrin.h"
+
+namespace {
+
+static inline bool is_pow2(int64_t x) { return x > 0 && (x & (x - 1)) == 0; }
+
+// largest power of 2 that divides x
+static inline int64_t largest_pow2_factor(int64_t x) { return x & (-x); }
+
+// smallest power of 2 that is >= x
+static inline int64_t next_pow2(int64_t x) {
+    int64_t p = 1;
+    while (p < x) { p *= 2; }
+    return p;
+}
+
+// floats per block whose stages are finished before moving on; half of L1
+static constexpr int64_t kFwhtBlockSz = 4 * 1024;
+
+// butterflies among Radix vectors, covering log2(Radix) stages
+template<int Radix>
+static inline void _fwht_butterflies(__m256* v) {
+    for (int s = 1; s < Radix; s *= 2) {
+        for (int k = 0; k < Radix; k++) {
+            if (k & s) { continue; }
+            auto a = v[k];
+            auto b = v[k + s];
+            v[k] = _mm256_add_ps(a, b);
+            v[k + s] = _mm256_sub_ps(a, b);
+        }
+    }
+}
+
+// the first three stages, which mix elements within each 8-float vector
+static inline __m256 _fwht8_ps(__m256 v) {
+    // not static, so these become constants instead of a guard check on
+    // every call
+    const __m256 odd_1 = _mm256_castsi256_ps(_mm256_setr_epi32(
+        0, 0x80000000, 0, 0x80000000, 0, 0x80000000, 0, 0x80000000));
+    const __m256 odd_2 = _mm256_castsi256_ps(_mm256_setr_epi32(
+        0, 0, 0x80000000, 0x80000000, 0, 0, 0x80000000, 0x80000000));
+    const __m256 odd_4 = _mm256_castsi256_ps(_mm256_setr_epi32(
+        0, 0, 0, 0, 0x80000000, 0x80000000, 0x80000000, 0x80000000));
+    // element j becomes x[j] + x[j ^ h] if its h bit is 0, else
+    // x[j ^ h] - x[j]
+    auto swapped = _mm256_permute_ps(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm256_add_ps(swapped, _mm256_xor_ps(v, odd_1));
+    swapped = _mm256_permute_ps(v, _MM_SHUFFLE(1, 0, 3, 2));
+    v = _mm256_add_ps(swapped, _mm256_xor_ps(v, odd_2));
+    swapped = _mm256_permute2f128_ps(v, v, 1);
+    return _mm256_add_ps(swapped, _mm256_xor_ps(v, odd_4));
+}
+
+// one radix-Radix pass of stages h through Radix/2 * h; h >= 8
+template<int Radix>
+static inline void _fwht_pass(float* x, int64_t n, int64_t h) {
+    __m256 v[Radix];
+    for (int64_t g = 0; g < n; g += Radix * h) {
+        for (int64_t j = g; j < g + h; j += 8) {
+            for (int k = 0; k < Radix; k++) {
+                v[k] = _mm256_loadu_ps(x + j + k * h);
+            }
+            _fwht_butterflies<Radix>(v);
+            for (int k = 0; k < Radix; k++) {
+                _mm256_storeu_ps(x + j + k * h, v[k]);
+            }
+        }
+    }
+}
+
+// stages h, 2h, ..., up to but excluding h_end, over all of x
+static inline void _fwht_stages(float* x, int64_t n, int64_t h, int64_t h_end) {
+    while (h < h_end) {
+        if (8 * h <= h_end) {
+            _fwht_pass<8>(x, n, h);
+            h *= 8;
+        } else if (4 * h <= h_end) {
+            _fwht_pass<4>(x, n, h);
+            h *= 4;
+        } else {
+            _fwht_pass<2>(x, n, h);
+            h *= 2;
+        }
+    }
+}
+
+static inline void _fwht_scalar(float* x, int64_t n, int64_t stride=1) {
+    for (int64_t h = 1; h < n; h *= 2) {
+        for (int64_t i = 0; i < n; i += 2 * h) {
+            for (int64_t j = i; j < i + h; j++) {
+                auto a = x[j * stride];
+                auto b = x[(j + h) * stride];
+                x[j * stride] = a + b;
+                x[(j + h) * stride] = a - b;
+            }
+        }
+    }
+}
+
+/**
+ * @brief In-place, unnormalized Walsh-Hadamard transform of x.
+ *
+ * @details Multiplies x by the n x n Sylvester Hadamard matrix, whose
+ * entries are all +/-1; scale by 1 / sqrt(n) for an orthonormal transform.
+ * O(n log n).
+ *
+ * @param n Length of x; must be a power of 2
+ */
+static inline void fwht(float* x, int64_t n) {
+    assert(is_pow2(n));
+    if (n < 8) {
+        _fwht_scalar(x, n);
+        return;
+    }
+    auto block_sz = std::min(n, kFwhtBlockSz);
+    for (int64_t b = 0; b < n; b += block_sz) {
+        auto x_block = x + b;
+        for (int64_t i = 0; i < block_sz; i += 8) {
+            _mm256_storeu_ps(x_block + i,
+                             _fwht8_ps(_mm256_loadu_ps(x_block + i)));
+        }
+        _fwht_stages(x_block, block_sz, 8, block_sz);
+    }
+    _fwht_stages(x, n, block_sz, n);
+}
+
+// fwht() of each row of a row-major [nrows x n] matrix
+static inline void fwht_rows(float* X, int64_t nrows, int64_t n) {
+    for (int64_t i = 0; i < nrows; i++) {
+        fwht(X + i * n, n);
+    }
+}
+
+// one radix-Radix pass of fwht_cols() over columns [col_start, col_end)
+template<int Radix>
+static inline void _fwht_cols_pass(float* X, int64_t n, int64_t ncols,
+    int64_t col_start, int64_t col_end, int64_t h)
+{
+    __m256 v[Radix];
+    for (int64_t g = 0; g < n; g += Radix * h) {
+        for (int64_t j = g; j < g + h; j++) {
+            auto row = X + j * ncols;
+            for (int64_t c = col_start; c < col_end; c += 8) {
+                for (int k = 0; k < Radix; k++) {
+                    v[k] = _mm256_loadu_ps(row + k * h * ncols + c);
+                }
+                _fwht_butterflies<Radix>(v);
+                for (int k = 0; k < Radix; k++) {
+                    _mm256_storeu_ps(row + k * h * ncols + c, v[k]);
+                }
+            }
+        }
+    }
+}
+
+// fwht_cols() stages h, 2h, ..., up to but excluding h_end, over rows
+// [0, n) and columns [col_start, col_end)
+static inline void _fwht_cols_stages(float* X, int64_t n, int64_t ncols,
+    int64_t col_start, int64_t col_end, int64_t h, int64_t h_end)
+{
+    while (h < h_end) {
+        if (8 * h <= h_end) {
+            _fwht_cols_pass<8>(X, n, ncols, col_start, col_end, h);
+            h *= 8;
+        } else if (4 * h <= h_end) {
+            _fwht_cols_pass<4>(X, n, ncols, col_start, col_end, h);
+            h *= 4;
+        } else {
+            _fwht_cols_pass<2>(X, n, ncols, col_start, col_end, h);
+            h *= 2;
+        }
+    }
+}
+
+/**
+ * @brief Unnormalized Walsh-Hadamard transform of each column of X.
+ *
+ * @details Equivalently, of each row of a column-major [ncols x n]
+ * matrix. Columns are processed in strips of 64 or more, and within a
+ * strip, the stages that only mix nearby rows are finished one L1-sized
+ * block of rows at a time.
+ *
+ * @param X Row-major [n x ncols] matrix; n must be a power of 2
+ */
+static inline void fwht_cols(float* X, int64_t n, int64_t ncols) {
+    static constexpr int64_t min_strip_ncols = 64;
+    assert(is_pow2(n));
+    auto ncols_vec = ncols - (ncols % 8);
+    // short columns fit in L1 in wider strips
+    auto strip_ncols = std::min(ncols_vec, std::max(
+        min_strip_ncols, (kFwhtBlockSz / n) & ~int64_t(7)));
+    // largest power of 2 rows such that a block of the strip fits
+    int64_t block_nrows = 8;
+    while (2 * block_nrows * std::max<int64_t>(8, strip_ncols) <= kFwhtBlockSz) {
+        block_nrows *= 2;
+    }
+    block_nrows = std::min(n, block_nrows);
+    for (int64_t c = 0; c < ncols_vec; c += strip_ncols) {
+        auto c_end = std::min(c + strip_ncols, ncols_vec);
+        for (int64_t b = 0; b < n; b += block_nrows) {
+            _fwht_cols_stages(X + b * ncols, block_nrows, ncols, c, c_end,
+                              1, block_nrows);
+        }
+        _fwht_cols_stages(X, n, ncols, c, c_end, block_nrows, n);
+    }
+    for (int64_t c = ncols_vec; c < ncols; c++) {
+        _fwht_scalar(X + c, n, ncols);
+    }
+}
+
+} // anon namespace
+#endif // __HADAMARD_HPP
@@ -0,0 +1,241 @@
+//
+//  numa_memory.hpp
+//  Bolt
+//
+//  Allocation policies for big, long-lived arrays like code matrices:
+//  backing them with huge pages to cut TLB misses during scans, and
+//  placing them on a particular NUMA node so that scan threads pinned to
+//  that node read local memory.
+//
+//  Uses the raw mbind syscall rather than libnuma so there's nothing extra
+//  to link; on machines with one node (or without NUMA support) node
+//  binding is a no-op.
+//
+
+#ifndef __NUMA_MEMORY_HPP
+#define __NUMA_MEMORY_HPP
+
+#include <fstream>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#ifndef MAP_HUGE_SHIFT
+    #define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+    #define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+    #define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+namespace {
+
+// what a buffer ended up being backed by; we fall back from explicit
+// (hugetlbfs) huge pages to transparent huge pages to normal pages, since
+// explicit huge pages only exist if an admin reserved some
+enum class PageKind { Small = 0, TransparentHuge, Huge2MB, Huge1GB };
+
+static inline const char* page_kind_name(PageKind kind) {
+    switch (kind) {
+        case PageKind::Small: return "4KB";
+        case PageKind::TransparentHuge: return "THP";
+        case PageKind::Huge2MB: return "2MB";
+        case PageKind::Huge1GB: return "1GB";
+    }
+    return "?";
+}
+
+// ------------------------------------------------ topology
+
+// parses sysfs cpu / node lists like "0-3,8-11"
+static inline std::vector<int> _parse_sysfs_list(const std::string& path) {
+    std::vector<int> ret;
+    std::ifstream f(path);
+    std::string s;
+    if (!(f >> s)) { return ret; }
+    size_t pos = 0;
+    while (pos < s.size()) {
+        auto end = s.find(',', pos);
+        if (end == std::string::npos) { end = s.size(); }
+        auto range = s.substr(pos, end - pos);
+        auto dash = range.find('-');
+        int lo = atoi(range.c_str());
+        int hi = dash == std::string::npos ? lo : atoi(range.c_str() + dash + 1);
+        for (int i = lo; i <= hi; i++) { ret.push_back(i); }
+        pos = end + 1;
+    }
+    return ret;
+}
+
+static inline int numa_num_nodes() {
+    auto nodes = _parse_sysfs_list("/sys/devices/system/node/online");
+    return nodes.empty() ? 1 : nodes.back() + 1;
+}
+
+static inline std::vector<int> numa_node_cpus(int node) {
+    auto cpus = _parse_sysfs_list("/sys/devices/system/node/node" +
+        std::to_string(node) + "/cpulist");
+    if (cpus.empty()) {  // no NUMA info; treat every cpu as local
+        auto ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int i = 0; i < ncpus; i++) { cpus.push_back(i); }
+    }
+    return cpus;
+}
+
+// restricts the calling thread to the cpus of the given node
+static inline bool pin_thread_to_numa_node(int node) {
+    auto cpus = numa_node_cpus(node);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus) { CPU_SET(cpu, &set); }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// ------------------------------------------------ allocation
+
+static constexpr int kMpolBind = 2;  // MPOL_BIND from numaif.h
+
+static inline bool _mbind_to_node(void* ptr, size_t nbytes, int node) {
+    if (node < 0 || node >= 64) { return false; }
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, ptr, nbytes, kMpolBind, &mask,
+        8 * sizeof(mask), 0) == 0;
+}
+
+/**
+ * @brief Page-aligned buffer backed by huge pages where possible and,
+ * optionally, bound to one NUMA node.
+ *
+ * @details The memory is touched before the constructor returns, so
+ * pages are actually placed (on the given node, if any) right away rather
+ * than on first use by whichever thread happens to get there first.
+ */
+class PageBuffer {
+public:
+    PageBuffer() = default;
+    PageBuffer(size_t nbytes, PageKind want=PageKind::Huge2MB, int node=-1) {
+        if (nbytes == 0) { return; }
+        if (want == PageKind::Huge1GB) {
+            _try_mmap(nbytes, 1 << 30, MAP_HUGETLB | MAP_HUGE_1GB,
+                      PageKind::Huge1GB);
+        }
+        if (_ptr == nullptr && want >= PageKind::Huge2MB) {
+            _try_mmap(nbytes, 2 << 20, MAP_HUGETLB | MAP_HUGE_2MB,
+                      PageKind::Huge2MB);
+        }
+        if (_ptr == nullptr) {
+            // ask for THP; start at a 2MB boundary so the kernel can
+            // actually use huge pages for the whole range
+            static constexpr size_t huge_sz = 2 << 20;
+            bool use_thp = want != PageKind::Small && nbytes >= huge_sz;
+            size_t align = use_thp ? huge_sz : 4096;
+            size_t mapped_nbytes = _round_up(nbytes, align) + align;
+            void* raw = mmap(nullptr, mapped_nbytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == MAP_FAILED) {
+                fprintf(stderr, "ERROR: PageBuffer mmap of %lld bytes failed\n",
+                    (long long)nbytes);
+                _failed = true;
+                return;
+            }
+            // trim the unaligned head and tail
+            auto start = reinterpret_cast<uintptr_t>(raw);
+            auto aligned = _round_up(start, align);
+            auto len = _round_up(nbytes, align);
+            if (aligned > start) { munmap(raw, aligned - start); }
+            auto tail = start + mapped_nbytes - (aligned + len);
+            if (tail > 0) {
+                munmap(reinterpret_cast<void*>(aligned + len), tail);
+            }
+            _ptr = reinterpret_cast<uint8_t*>(aligned);
+            _mapped_nbytes = len;
+            _kind = PageKind::Small;
+            if (use_thp && madvise(_ptr, len, MADV_HUGEPAGE) == 0) {
+                _kind = PageKind::TransparentHuge;
+            }
+        }
+        _nbytes = nbytes;
+        if (node >= 0 && numa_num_nodes() > 1) {
+            _node_bound = _mbind_to_node(_ptr, _mapped_nbytes, node);
+        }
+        memset(_ptr, 0, _mapped_nbytes);  // fault in the pages now
+        _node = node;
+    }
+
+    ~PageBuffer() { _release(); }
+    PageBuffer(const PageBuffer&) = delete;
+    PageBuffer& operator=(const PageBuffer&) = delete;
+    PageBuffer(PageBuffer&& rhs) { *this = std::move(rhs); }
+    PageBuffer& operator=(PageBuffer&& rhs) {
+        if (this != &rhs) {
+            _release();
+            _ptr = rhs._ptr;
+            _nbytes = rhs._nbytes;
+            _mapped_nbytes = rhs._mapped_nbytes;
+            _kind = rhs._kind;
+            _node = rhs._node;
+            _node_bound = rhs._node_bound;
+            _failed = rhs._failed;
+            rhs._ptr = nullptr;
+            rhs._nbytes = 0;
+            rhs._mapped_nbytes = 0;
+        }
+        return *this;
+    }
+
+    uint8_t* data() { return _ptr; }
+    const uint8_t* data() const { return _ptr; }
+    template<class T> T* as() { return reinterpret_cast<T*>(_ptr); }
+    template<class T> const T* as() const {
+        return reinterpret_cast<const T*>(_ptr);
+    }
+    // false if even the fallback mmap of small pages failed, in which case
+    // data() is null
+    bool ok() const { return !_failed; }
+    size_t size() const { return _nbytes; }
+    PageKind page_kind() const { return _kind; }
+    int node() const { return _node; }
+    bool node_bound() const { return _node_bound; }
+
+private:
+    template<class IntT>
+    static IntT _round_up(IntT x, size_t align) {
+        return static_cast<IntT>(((x + align - 1) / align) * align);
+    }
+
+    void _try_mmap(size_t nbytes, size_t page_sz, int flags, PageKind kind) {
+        auto len = _round_up(nbytes, page_sz);
+        void* ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+        if (ptr == MAP_FAILED) { return; }
+        _ptr = static_cast<uint8_t*>(ptr);
+        _mapped_nbytes = len;
+        _kind = kind;
+    }
+
+    void _release() {
+        if (_ptr != nullptr) { munmap(_ptr, _mapped_nbytes); }
+        _ptr = nullptr;
+    }
+
+    uint8_t* _ptr = nullptr;
+    size_t _nbytes = 0;
+    size_t _mapped_nbytes = 0;
+    PageKind _kind = PageKind::Small;
+    int _node = -1;
+    bool _node_bound = false;
+    bool _failed = false;
+};
+
+} // anon namespace
+#endif // __NUMA_MEMORY_HPP
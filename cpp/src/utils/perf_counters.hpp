@@ -0,0 +1,246 @@
+//
+//  perf_counters.hpp
+//  Bolt
+//
+//  Hardware performance counters (via perf_event_open) that can wrap any
+//  kernel call and are aggregated per named region. Everything here is
+//  compiled out unless BOLT_PERF_COUNTERS is defined; otherwise,
+//  PERF_COUNTERS_SCOPE and PERF_COUNTERS_REPORT expand to nothing.
+//
+
+#ifndef __PERF_COUNTERS_HPP
+#define __PERF_COUNTERS_HPP
+
+#ifdef BOLT_PERF_COUNTERS
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+
+#include <asm/unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace perf {
+namespace {
+
+enum Event {
+    kCycles = 0,
+    kInstructions,
+    kL1DReadMisses,
+    kLLCMisses,
+    kBranchMisses,
+    kShufflePortUops,  // raw event; see raw_shuffle_port_event_config()
+    kNumEvents
+};
+
+static const char* event_names[kNumEvents] = {
+    "cycles", "instrs", "L1D_miss", "LLC_miss", "br_miss", "p5_uops"
+};
+
+// UOPS_DISPATCHED.PORT_5 on Skylake through Alder Lake is event 0xA1,
+// umask 0x80 (on Ice Lake and newer this counts ports 5 and 11). Other
+// microarchitectures need a different encoding; set BOLT_PERF_SHUFFLE_EVENT
+// to the raw config (e.g., BOLT_PERF_SHUFFLE_EVENT=0x80a1) or to 0 to skip it.
+static inline uint64_t raw_shuffle_port_event_config() {
+    const char* s = getenv("BOLT_PERF_SHUFFLE_EVENT");
+    if (s != nullptr) {
+        return strtoull(s, nullptr, 0);
+    }
+    return 0x80a1;
+}
+
+static inline int open_event(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // pid = 0, cpu = -1 -> this thread, on whatever core it runs on
+    return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+struct CounterValues {
+    uint64_t counts[kNumEvents];
+    bool valid[kNumEvents];
+};
+
+// owns one fd per event; events the kernel / PMU refuses (e.g., in a VM
+// without a virtual PMU) are just marked as unavailable
+class PerfCounters {
+public:
+    PerfCounters() {
+        static constexpr uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        _fds[kCycles] = open_event(
+            PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        _fds[kInstructions] = open_event(
+            PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        _fds[kL1DReadMisses] = open_event(PERF_TYPE_HW_CACHE, l1d_read_miss);
+        _fds[kLLCMisses] = open_event(
+            PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        _fds[kBranchMisses] = open_event(
+            PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        auto raw_config = raw_shuffle_port_event_config();
+        _fds[kShufflePortUops] = raw_config ?
+            open_event(PERF_TYPE_RAW, raw_config) : -1;
+    }
+    ~PerfCounters() {
+        for (int i = 0; i < kNumEvents; i++) {
+            if (_fds[i] >= 0) { close(_fds[i]); }
+        }
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool any_available() const {
+        for (int i = 0; i < kNumEvents; i++) {
+            if (_fds[i] >= 0) { return true; }
+        }
+        return false;
+    }
+
+    void start() {
+        for (int i = 0; i < kNumEvents; i++) {
+            if (_fds[i] < 0) { continue; }
+            ioctl(_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    void stop(CounterValues& out) {
+        for (int i = 0; i < kNumEvents; i++) {
+            if (_fds[i] >= 0) { ioctl(_fds[i], PERF_EVENT_IOC_DISABLE, 0); }
+        }
+        for (int i = 0; i < kNumEvents; i++) {
+            out.counts[i] = 0;
+            out.valid[i] = false;
+            if (_fds[i] < 0) { continue; }
+            // value, time enabled, time running; scale up if the kernel
+            // had to multiplex this counter with others
+            uint64_t buff[3];
+            if (read(_fds[i], buff, sizeof(buff)) != sizeof(buff)) {
+                continue;
+            }
+            if (buff[2] == 0) { continue; }
+            double scale = buff[2] < buff[1] ?
+                static_cast<double>(buff[1]) / buff[2] : 1.;
+            out.counts[i] = static_cast<uint64_t>(buff[0] * scale);
+            out.valid[i] = true;
+        }
+    }
+private:
+    int _fds[kNumEvents];
+};
+
+struct RegionStats {
+    int64_t ncalls;
+    uint64_t totals[kNumEvents];
+    bool valid[kNumEvents];
+};
+
+static inline PerfCounters& thread_counters() {
+    static thread_local PerfCounters counters;
+    return counters;
+}
+
+static inline std::map<std::string, RegionStats>& region_stats() {
+    static std::map<std::string, RegionStats> stats;
+    return stats;
+}
+
+static inline void record_region(const std::string& name,
+                                 const CounterValues& vals)
+{
+    auto& stats = region_stats()[name];  // value-initialized if new
+    stats.ncalls++;
+    for (int i = 0; i < kNumEvents; i++) {
+        stats.totals[i] += vals.counts[i];
+        stats.valid[i] = stats.valid[i] || vals.valid[i];
+    }
+}
+
+// wrap a kernel call in one of these to accumulate its counts into the
+// region with the given name
+class CounterScope {
+public:
+    CounterScope(const std::string& name): _name(name) {
+        thread_counters().start();
+    }
+    ~CounterScope() {
+        CounterValues vals;
+        thread_counters().stop(vals);
+        record_region(_name, vals);
+    }
+private:
+    std::string _name;
+};
+
+static inline void print_region_stats(bool reset=true) {
+    auto& all_stats = region_stats();
+    if (all_stats.empty()) { return; }
+    if (!thread_counters().any_available()) {
+        printf("perf counters: perf_event_open unavailable "
+               "(check /proc/sys/kernel/perf_event_paranoid)\n");
+    }
+    printf("%-48s, %8s", "perf region", "ncalls");
+    for (int i = 0; i < kNumEvents; i++) {
+        printf(", %12s", event_names[i]);
+    }
+    printf(", %6s\n", "IPC");
+    for (const auto& kv : all_stats) {
+        const auto& stats = kv.second;
+        printf("%-48s, %8lld", kv.first.c_str(), (long long)stats.ncalls);
+        for (int i = 0; i < kNumEvents; i++) {
+            if (stats.valid[i]) {
+                printf(", %12.5g", static_cast<double>(stats.totals[i]) /
+                    stats.ncalls);
+            } else {
+                printf(", %12s", "n/a");
+            }
+        }
+        if (stats.valid[kCycles] && stats.valid[kInstructions] &&
+            stats.totals[kCycles] > 0)
+        {
+            printf(", %6.3f\n", static_cast<double>(
+                stats.totals[kInstructions]) / stats.totals[kCycles]);
+        } else {
+            printf(", %6s\n", "n/a");
+        }
+    }
+    if (reset) {
+        all_stats.clear();
+    }
+}
+
+} // anon namespace
+} // namespace perf
+
+#define _PERF_COUNTERS_CONCAT_INNER(A, B) A ## B
+#define _PERF_COUNTERS_CONCAT(A, B) _PERF_COUNTERS_CONCAT_INNER(A, B)
+
+// counts everything from here to the end of the enclosing block
+#define PERF_COUNTERS_SCOPE(NAME) \
+    perf::CounterScope _PERF_COUNTERS_CONCAT(__perf_scope_, __LINE__)(NAME)
+
+// prints per-call averages for every region seen so far, then clears them
+#define PERF_COUNTERS_REPORT() perf::print_region_stats()
+
+#else // BOLT_PERF_COUNTERS
+
+#define PERF_COUNTERS_SCOPE(NAME)
+#define PERF_COUNTERS_REPORT()
+
+#endif // BOLT_PERF_COUNTERS
+
+#endif // __PERF_COUNTERS_HPP
@@ -0,0 +1,375 @@
+//
+//  popcount.hpp
+//  Bolt
+//
+//  Vectorized popcounts of xors, for Hamming distances between binary
+//  codes and the binary GEMM in avx_utils.hpp. Scalar popcnt retires one
+//  64-bit word per cycle at best; each backend here counts a vector of
+//  words at once:
+//
+//  - PopcntAvx512: _mm512_popcnt_epi64 (AVX-512 VPOPCNTDQ), 8 words.
+//  - PopcntAvx2: a 16-entry nibble lookup table with _mm256_shuffle_epi8,
+//    4 words. Byte counts are accumulated across a row's vectors and only
+//    widened to 64 bits (with _mm256_sad_epu8) once per row.
+//  - PopcntHarleySeal: the AVX2 table, but rows of 16 or more vectors
+//    (512B) are first reduced with Harley-Seal carry-save adders, so only
+//    about one vector in sixteen gets looked up. Shorter rows are left to
+//    the table, which is faster for them.
+//  - PopcntScalar: __builtin_popcountll, one word at a time.
+//
+//  xor_popcount_rows() computes the Hamming distance between each row of
+//  a matrix of codes and one query, W rows at a time for a W-word backend.
+//  Rows shorter than a vector share one; longer rows are summed
+//  vertically first. Either way, per-word counts are then summed with
+//  log2 levels of pairwise adds that also pack W rows' counts into one
+//  vector, so that storing them is a narrowing conversion and a single
+//  store. PopcntDefault is the fastest backend the target supports.
+//
+
+#ifndef __POPCOUNT_HPP
+#define __POPCOUNT_HPP
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include "immintrin.h"
+
+namespace {
+
+// ------------------------------------------------ backends
+
+struct PopcntScalar {
+    using vec_t = uint64_t;
+    static constexpr int nwords = 1;
+
+    static vec_t zero() { return 0; }
+    static vec_t load(const uint64_t* p) { return *p; }
+    static void store(uint64_t* p, vec_t v) { *p = v; }
+    static vec_t set1(uint64_t x) { return x; }
+    static vec_t add(vec_t a, vec_t b) { return a + b; }
+    static vec_t sub(vec_t a, vec_t b) { return a - b; }
+    static vec_t popcnt_epi64(vec_t v) { return __builtin_popcountll(v); }
+    static vec_t pair_sums(vec_t a, vec_t b) { return a + b; }
+
+    template<class OutT>
+    static void store_counts(OutT* out, vec_t counts) {
+        *out = static_cast<OutT>(counts);
+    }
+
+    // popcounts of a ^ b for NVecs consecutive vectors, summed
+    template<int NVecs>
+    static vec_t xor_popcnt(const uint64_t* a, const vec_t* b) {
+        vec_t sum = 0;
+        for (int k = 0; k < NVecs; k++) {
+            sum += __builtin_popcountll(a[k] ^ b[k]);
+        }
+        return sum;
+    }
+};
+
+struct PopcntAvx2 {
+    using vec_t = __m256i;
+    static constexpr int nwords = 4;
+
+    static vec_t zero() { return _mm256_setzero_si256(); }
+    static vec_t load(const uint64_t* p) {
+        return _mm256_loadu_si256((const __m256i*)p);
+    }
+    static void store(uint64_t* p, vec_t v) {
+        _mm256_storeu_si256((__m256i*)p, v);
+    }
+    static vec_t set1(uint64_t x) { return _mm256_set1_epi64x(x); }
+    static vec_t add(vec_t a, vec_t b) { return _mm256_add_epi64(a, b); }
+    static vec_t sub(vec_t a, vec_t b) { return _mm256_sub_epi64(a, b); }
+
+    // stores the counts as OutTs, truncating like a cast would
+    template<class OutT>
+    static void store_counts(OutT* out, vec_t counts) {
+        static_assert(std::is_integral<OutT>::value, "Counts are integers");
+        auto counts32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+            counts, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6)));
+        switch (sizeof(OutT)) {
+            case 1: {
+                auto counts8 = _mm_shuffle_epi8(counts32, _mm_setr_epi8(
+                    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+                int32_t packed = _mm_cvtsi128_si32(counts8);
+                memcpy(out, &packed, sizeof(packed));
+                break;
+            }
+            case 2:
+                _mm_storel_epi64((__m128i*)out, _mm_shuffle_epi8(counts32,
+                    _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13,
+                                  -1, -1, -1, -1, -1, -1, -1, -1)));
+                break;
+            case 4: _mm_storeu_si128((__m128i*)out, counts32); break;
+            default: _mm256_storeu_si256((__m256i*)out, counts); break;
+        }
+    }
+
+    // popcount of each byte
+    static vec_t popcnt_epi8(vec_t v) {
+        const __m256i lut = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low_4bits_mask = _mm256_set1_epi8(0x0F);
+        auto lo = _mm256_and_si256(v, low_4bits_mask);
+        auto hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_4bits_mask);
+        return _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                               _mm256_shuffle_epi8(lut, hi));
+    }
+    // sums of each group of 8 byte counts
+    static vec_t widen_epi8(vec_t counts) {
+        return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+    }
+    static vec_t popcnt_epi64(vec_t v) { return widen_epi8(popcnt_epi8(v)); }
+
+    // [a0 + a1, a2 + a3, b0 + b1, b2 + b3]
+    static vec_t pair_sums(vec_t a, vec_t b) {
+        auto sums = _mm256_add_epi64(_mm256_unpacklo_epi64(a, b),
+                                     _mm256_unpackhi_epi64(a, b));
+        return _mm256_permute4x64_epi64(sums, _MM_SHUFFLE(3, 1, 2, 0));
+    }
+
+    template<int NVecs>
+    static vec_t xor_popcnt(const uint64_t* a, const vec_t* b) {
+        // each byte count is at most 8, so 31 vectors' worth fit in a byte
+        static constexpr int max_nvecs_epi8 = 31;
+        auto sums = _mm256_setzero_si256();
+        auto counts = _mm256_setzero_si256();
+        for (int k = 0; k < NVecs; k++) {
+            auto v = _mm256_xor_si256(load(a + k * nwords), b[k]);
+            counts = _mm256_add_epi8(counts, popcnt_epi8(v));
+            if ((k + 1) % max_nvecs_epi8 == 0 && k + 1 < NVecs) {
+                sums = _mm256_add_epi64(sums, widen_epi8(counts));
+                counts = _mm256_setzero_si256();
+            }
+        }
+        return _mm256_add_epi64(sums, widen_epi8(counts));
+    }
+};
+
+struct PopcntHarleySeal : public PopcntAvx2 {
+    // carry-save adder; sums bits of a, b, and c into high and low
+    static void csa(vec_t& high, vec_t& low, vec_t a, vec_t b, vec_t c) {
+        auto u = _mm256_xor_si256(a, b);
+        high = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+        low = _mm256_xor_si256(u, c);
+    }
+
+    template<int NVecs>
+    static vec_t xor_popcnt(const uint64_t* a, const vec_t* b) {
+        static constexpr int block_nvecs = 16;
+        static constexpr int nblocks = NVecs / block_nvecs;
+        if (nblocks == 0) {  // too few vectors for the adders to pay off
+            return PopcntAvx2::xor_popcnt<NVecs>(a, b);
+        }
+        auto v = [&](int k) {
+            return _mm256_xor_si256(load(a + k * nwords), b[k]);
+        };
+        // bits of weight 1, 2, 4, and 8 not yet counted
+        auto ones = _mm256_setzero_si256();
+        auto twos = _mm256_setzero_si256();
+        auto fours = _mm256_setzero_si256();
+        auto eights = _mm256_setzero_si256();
+        auto sixteens = _mm256_setzero_si256();
+        for (int k = 0; k < block_nvecs * nblocks; k += block_nvecs) {
+            vec_t twos_a, twos_b, fours_a, fours_b, eights_a, eights_b,
+                sixteens_k;
+            csa(twos_a, ones, ones, v(k + 0), v(k + 1));
+            csa(twos_b, ones, ones, v(k + 2), v(k + 3));
+            csa(fours_a, twos, twos, twos_a, twos_b);
+            csa(twos_a, ones, ones, v(k + 4), v(k + 5));
+            csa(twos_b, ones, ones, v(k + 6), v(k + 7));
+            csa(fours_b, twos, twos, twos_a, twos_b);
+            csa(eights_a, fours, fours, fours_a, fours_b);
+            csa(twos_a, ones, ones, v(k + 8), v(k + 9));
+            csa(twos_b, ones, ones, v(k + 10), v(k + 11));
+            csa(fours_a, twos, twos, twos_a, twos_b);
+            csa(twos_a, ones, ones, v(k + 12), v(k + 13));
+            csa(twos_b, ones, ones, v(k + 14), v(k + 15));
+            csa(fours_b, twos, twos, twos_a, twos_b);
+            csa(eights_b, fours, fours, fours_a, fours_b);
+            csa(sixteens_k, eights, eights, eights_a, eights_b);
+            sixteens = _mm256_add_epi64(sixteens, popcnt_epi64(sixteens_k));
+        }
+        auto total = _mm256_slli_epi64(sixteens, 4);
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(popcnt_epi64(eights), 3));
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(popcnt_epi64(fours), 2));
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(popcnt_epi64(twos), 1));
+        total = _mm256_add_epi64(total, popcnt_epi64(ones));
+        static constexpr int ntail = NVecs % block_nvecs;
+        if (ntail > 0) {
+            total = _mm256_add_epi64(total, PopcntAvx2::xor_popcnt<ntail>(
+                a + (NVecs - ntail) * nwords, b + (NVecs - ntail)));
+        }
+        return total;
+    }
+};
+
+#ifdef __AVX512VPOPCNTDQ__
+struct PopcntAvx512 {
+    using vec_t = __m512i;
+    static constexpr int nwords = 8;
+
+    static vec_t zero() { return _mm512_setzero_si512(); }
+    static vec_t load(const uint64_t* p) { return _mm512_loadu_si512(p); }
+    static void store(uint64_t* p, vec_t v) { _mm512_storeu_si512(p, v); }
+    static vec_t set1(uint64_t x) { return _mm512_set1_epi64(x); }
+    static vec_t add(vec_t a, vec_t b) { return _mm512_add_epi64(a, b); }
+    static vec_t sub(vec_t a, vec_t b) { return _mm512_sub_epi64(a, b); }
+    static vec_t popcnt_epi64(vec_t v) { return _mm512_popcnt_epi64(v); }
+
+    template<class OutT>
+    static void store_counts(OutT* out, vec_t counts) {
+        static_assert(std::is_integral<OutT>::value, "Counts are integers");
+        switch (sizeof(OutT)) {
+            case 1:
+                _mm_storel_epi64((__m128i*)out, _mm512_cvtepi64_epi8(counts));
+                break;
+            case 2:
+                _mm_storeu_si128((__m128i*)out, _mm512_cvtepi64_epi16(counts));
+                break;
+            case 4:
+                _mm256_storeu_si256((__m256i*)out,
+                                    _mm512_cvtepi64_epi32(counts));
+                break;
+            default: _mm512_storeu_si512(out, counts); break;
+        }
+    }
+
+    // [a0 + a1, a2 + a3, ..., b0 + b1, ..., b14 + b15]
+    static vec_t pair_sums(vec_t a, vec_t b) {
+        const __m512i evens = _mm512_setr_epi64(0, 2, 4, 6, 8, 10, 12, 14);
+        const __m512i odds = _mm512_setr_epi64(1, 3, 5, 7, 9, 11, 13, 15);
+        return _mm512_add_epi64(_mm512_permutex2var_epi64(a, evens, b),
+                                _mm512_permutex2var_epi64(a, odds, b));
+    }
+
+    template<int NVecs>
+    static vec_t xor_popcnt(const uint64_t* a, const vec_t* b) {
+        auto sum = _mm512_setzero_si512();
+        for (int k = 0; k < NVecs; k++) {
+            auto v = _mm512_xor_si512(load(a + k * nwords), b[k]);
+            sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(v));
+        }
+        return sum;
+    }
+};
+using PopcntDefault = PopcntAvx512;
+#else
+using PopcntDefault = PopcntHarleySeal;
+#endif
+
+// Backend if xor_popcount_rows() can use it for rows of D words, else
+// PopcntScalar (e.g., for D = 3)
+template<class Backend, int D>
+using popcnt_backend_for_t = typename std::conditional<
+    D % Backend::nwords == 0 || Backend::nwords % D == 0,
+    Backend, PopcntScalar>::type;
+
+// ------------------------------------------------ kernels
+
+/**
+ * @brief Popcount of a ^ b, for any number of words.
+ *
+ * @details Counts blocks of 16 vectors at a time, which is where
+ * PopcntHarleySeal pulls ahead of PopcntAvx2.
+ */
+template<class Backend=PopcntDefault>
+static inline uint64_t xor_popcount(const uint64_t* a, const uint64_t* b,
+                                    int64_t nwords)
+{
+    using vec_t = typename Backend::vec_t;
+    static constexpr int W = Backend::nwords;
+    static constexpr int block_nvecs = 16;
+    auto sum = Backend::zero();
+    vec_t bv[block_nvecs];
+    int64_t j = 0;
+    for (; j + block_nvecs * W <= nwords; j += block_nvecs * W) {
+        for (int k = 0; k < block_nvecs; k++) {
+            bv[k] = Backend::load(b + j + k * W);
+        }
+        sum = Backend::add(sum, Backend::template xor_popcnt<block_nvecs>(
+            a + j, bv));
+    }
+    for (; j + W <= nwords; j += W) {
+        bv[0] = Backend::load(b + j);
+        sum = Backend::add(sum, Backend::template xor_popcnt<1>(a + j, bv));
+    }
+    uint64_t lanes[W];
+    Backend::store(lanes, sum);
+    uint64_t total = 0;
+    for (int k = 0; k < W; k++) { total += lanes[k]; }
+    for (; j < nwords; j++) {
+        total += __builtin_popcountll(a[j] ^ b[j]);
+    }
+    return total;
+}
+
+/**
+ * @brief Hamming distances between each row of A and the query b.
+ *
+ * @details Rows are D words, so D must divide the vector width or be a
+ * multiple of it. If CountSame, writes the number of matching bits,
+ * 64 * D minus the distance, instead.
+ *
+ * @param A Row-major [nrows x D] codes
+ * @param b The query; D words
+ * @param out nrows counts
+ */
+template<class Backend, int D, bool CountSame=false, class OutT>
+static inline void xor_popcount_rows(const uint64_t* A, const uint64_t* b,
+                                     int64_t nrows, OutT* out)
+{
+    using vec_t = typename Backend::vec_t;
+    static constexpr int W = Backend::nwords;
+    static_assert(D > 0 && (D % W == 0 || W % D == 0),
+        "Row length must divide or be a multiple of the vector width");
+    // vectors per row if rows are long; else vectors per W rows
+    static constexpr int row_nvecs = D >= W ? D / W : 1;
+    static constexpr int group_nvecs = D >= W ? W : D;
+    static constexpr uint64_t nbits = 64 * D;
+
+    vec_t bv[row_nvecs];
+    if (D >= W) {
+        for (int k = 0; k < row_nvecs; k++) {
+            bv[k] = Backend::load(b + k * W);
+        }
+    } else {
+        uint64_t tiled[W];  // several rows per vector, so repeat the query
+        for (int k = 0; k < W; k++) { tiled[k] = b[k % D]; }
+        bv[0] = Backend::load(tiled);
+    }
+
+    int64_t i = 0;
+    for (; i + W <= nrows; i += W) {
+        auto group = A + i * D;
+        vec_t counts[group_nvecs];
+        for (int k = 0; k < group_nvecs; k++) {
+            counts[k] = D >= W ?
+                Backend::template xor_popcnt<row_nvecs>(group + k * D, bv) :
+                Backend::template xor_popcnt<1>(group + k * W, bv);
+        }
+        // sum adjacent lanes until each lane is one row
+        for (int n = group_nvecs; n > 1; n /= 2) {
+            for (int k = 0; k < n / 2; k++) {
+                counts[k] = Backend::pair_sums(counts[2 * k], counts[2 * k + 1]);
+            }
+        }
+        if (CountSame) {
+            counts[0] = Backend::sub(Backend::set1(nbits), counts[0]);
+        }
+        Backend::store_counts(out + i, counts[0]);
+    }
+    for (auto row = A + i * D; i < nrows; i++, row += D) {
+        uint64_t count = 0;
+        for (int j = 0; j < D; j++) {
+            count += __builtin_popcountll(row[j] ^ b[j]);
+        }
+        out[i] = static_cast<OutT>(CountSame ? nbits - count : count);
+    }
+}
+
+} // anon namespace
+#endif // __POPCOUNT_HPP
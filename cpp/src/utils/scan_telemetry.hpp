@@ -0,0 +1,157 @@
+//
+//  scan_telemetry.hpp
+//  Bolt
+//
+//  Counts of how many distances the quantized scans clip. bolt_scan() sums
+//  LUT entries with saturating adds, so a row whose distance doesn't fit in
+//  8 or 16 bits silently comes out as the max value; mithral_scan()'s
+//  averages can't overflow, but pin at 255 wherever the LUTs were clipped
+//  when they were quantized. With BOLT_SCAN_TELEMETRY defined, the scan
+//  kernels count the rows in each block of 32 that hit these limits and
+//  record them here; otherwise kScanTelemetry is false, the counting code
+//  in the kernels is dead, and recording does nothing.
+//
+//  A row counts as clipped if any of its partial sums is at the max (or,
+//  for signed LUTs, the min) of its type. This includes sums that land on
+//  the max exactly, and for signed LUTs misses sums that saturated and then
+//  came back down, so it's an estimate there.
+//
+
+#ifndef __SCAN_TELEMETRY_HPP
+#define __SCAN_TELEMETRY_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include "immintrin.h"
+
+#ifdef BOLT_SCAN_TELEMETRY
+    #include <atomic>
+#endif
+
+#ifdef BOLT_SCAN_TELEMETRY
+static constexpr bool kScanTelemetry = true;
+#else
+static constexpr bool kScanTelemetry = false;
+#endif
+
+struct ScanTelemetryCounts {
+    int64_t nrows;
+    int64_t nclipped;
+
+    double clipped_frac() const {
+        return nrows > 0 ? static_cast<double>(nclipped) / nrows : 0;
+    }
+};
+
+namespace scan_telemetry {
+
+#ifdef BOLT_SCAN_TELEMETRY
+
+// these aren't in an anon namespace, so that the kernels instantiated in
+// every translation unit share one set of counters
+inline ScanTelemetryCounts& _query_counts() {
+    static thread_local ScanTelemetryCounts counts {0, 0};
+    return counts;
+}
+inline std::atomic<int64_t>& _total_nrows() {
+    static std::atomic<int64_t> nrows {0};
+    return nrows;
+}
+inline std::atomic<int64_t>& _total_nclipped() {
+    static std::atomic<int64_t> nclipped {0};
+    return nclipped;
+}
+
+// called by the scan kernels once per call, not per block
+inline void record(int64_t nrows, int64_t nclipped) {
+    auto& counts = _query_counts();
+    counts.nrows += nrows;
+    counts.nclipped += nclipped;
+    _total_nrows() += nrows;
+    _total_nclipped() += nclipped;
+}
+
+// starts a new query on this thread; query_counts() then covers every scan
+// this thread runs until the next call
+inline void begin_query() { _query_counts() = {0, 0}; }
+
+inline ScanTelemetryCounts query_counts() { return _query_counts(); }
+
+// summed over all queries and threads since the last reset()
+inline ScanTelemetryCounts total_counts() {
+    return {_total_nrows().load(), _total_nclipped().load()};
+}
+
+inline void reset() {
+    _total_nrows() = 0;
+    _total_nclipped() = 0;
+    begin_query();
+}
+
+#else // BOLT_SCAN_TELEMETRY
+
+inline void record(int64_t, int64_t) {}
+inline void begin_query() {}
+inline ScanTelemetryCounts query_counts() { return {0, 0}; }
+inline ScanTelemetryCounts total_counts() { return {0, 0}; }
+inline void reset() {}
+
+#endif // BOLT_SCAN_TELEMETRY
+
+inline void print_counts(bool reset_after=true) {
+    if (!kScanTelemetry) { return; }
+    auto counts = total_counts();
+    printf("scan telemetry: %lld of %lld rows clipped (%.4f%%)\n",
+        (long long)counts.nclipped, (long long)counts.nrows, 100. * counts.clipped_frac());
+    if (reset_after) { reset(); }
+}
+
+// ------------------------------------------------ helpers for the kernels
+
+// 0xFF in each byte that's at the max of its type: 255, or 127 or -128
+// if Signed
+template<bool Signed>
+inline __m256i saturated_mask8(__m256i x) {
+    if (Signed) {
+        return _mm256_or_si256(
+            _mm256_cmpeq_epi8(x, _mm256_set1_epi8(127)),
+            _mm256_cmpeq_epi8(x, _mm256_set1_epi8(-128)));
+    }
+    return _mm256_cmpeq_epi8(x, _mm256_set1_epi8(-1));
+}
+
+// as above, for 16-bit lanes: 65535, or 32767 or -32768 if Signed
+template<bool Signed>
+inline __m256i saturated_mask16(__m256i x) {
+    if (Signed) {
+        return _mm256_or_si256(
+            _mm256_cmpeq_epi16(x, _mm256_set1_epi16(32767)),
+            _mm256_cmpeq_epi16(x, _mm256_set1_epi16(-32768)));
+    }
+    return _mm256_cmpeq_epi16(x, _mm256_set1_epi16(-1));
+}
+
+// rows of a block whose byte in rows_mask is set; byte i is row i
+inline int nrows_clipped(__m256i rows_mask) {
+    return __builtin_popcount(
+        static_cast<uint32_t>(_mm256_movemask_epi8(rows_mask)));
+}
+
+// rows of a block whose 16-bit total saturated, with the totals for rows
+// 0, 2, ..., 30 in evens and rows 1, 3, ..., 31 in odds, as in bolt_scan();
+// also counts rows set in rows_mask, as above
+template<bool Signed>
+inline int nrows_clipped16(__m256i evens, __m256i odds, __m256i rows_mask) {
+    // each 16-bit lane sets two bits of the movemask; keep the one at the
+    // position of its row
+    auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(rows_mask));
+    mask |= static_cast<uint32_t>(_mm256_movemask_epi8(
+        saturated_mask16<Signed>(evens))) & 0x55555555u;
+    mask |= static_cast<uint32_t>(_mm256_movemask_epi8(
+        saturated_mask16<Signed>(odds))) & 0xAAAAAAAAu;
+    return __builtin_popcount(mask);
+}
+
+} // namespace scan_telemetry
+
+#endif // __SCAN_TELEMETRY_HPP
@@ -0,0 +1,314 @@
+//
+//  sgemm.hpp
+//  Bolt
+//
+//  Cache-blocked, packed single-precision GEMM, in the style of Goto and
+//  van de Geijn's "Anatomy of high-performance matrix multiplication".
+//
+//  C = A * B (or C += A * B) for any N, D, M and any row and column
+//  strides, so row-major, column-major, and transposed operands all work
+//  without copies. Loops are blocked so that a kc x nc block of B stays
+//  in L3 (or this core's share of it), an mc x kc block of A stays in L2,
+//  and a kc x 16 sliver of B stays in L1 while a 6 x 16 register
+//  micro-kernel streams through the block of A. Both blocks are packed
+//  into contiguous panels first, so the micro-kernel only does unit-stride
+//  loads no matter what the strides of the inputs are.
+//
+//  With nthreads > 1, the longer of C's two dims is split into ranges of
+//  whole micro-tiles, and each thread runs the blocked loops on its own
+//  range with its own packing buffers.
+//
+
+#ifndef __SGEMM_HPP
+#define __SGEMM_HPP
+
+#include <algorithm>
+#include <assert.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "immintrin.h"
+
+#ifdef BLAZE
+    #include "src/utils/thread_utils.hpp"
+#else
+    #include "thread_utils.hpp"
+#endif
+
+namespace {
+
+// register tile; 12 accumulators, 2 rows of B, and 1 broadcast of A fill
+// 15 of the 16 ymm registers
+static constexpr int kSgemmMr = 6;
+static constexpr int kSgemmNr = 16;
+// cache blocks; kc x nr floats of B is 16KB (half of L1), mc x kc of A is
+// 120KB (half of L2), and kc x nc of B is 1MB (a core's share of L3)
+static constexpr int64_t kSgemmKc = 256;
+static constexpr int64_t kSgemmMc = 120;
+static constexpr int64_t kSgemmNc = 1024;
+// don't bother spawning threads for less work than this many flops each
+static constexpr int64_t kSgemmMinFlopsPerThread = 4 * 1024 * 1024;
+
+struct SgemmOperand {
+    const float* data;
+    int64_t row_stride;
+    int64_t col_stride;
+
+    const float* at(int64_t i, int64_t j) const {
+        return data + i * row_stride + j * col_stride;
+    }
+    SgemmOperand transpose() const { return {data, col_stride, row_stride}; }
+};
+
+// packs rows [0, nrows) and cols [0, kc) of A into panels of kSgemmMr
+// rows, stored k-major; rows past nrows are zero
+static inline void _sgemm_pack_a(SgemmOperand A, int64_t nrows, int64_t kc,
+                                 float* out)
+{
+    for (int64_t i = 0; i < nrows; i += kSgemmMr) {
+        auto mr = static_cast<int>(std::min<int64_t>(kSgemmMr, nrows - i));
+        if (mr == kSgemmMr && A.row_stride < A.col_stride) {
+            // col-major; read each col's slice of the panel contiguously
+            for (int64_t k = 0; k < kc; k++) {
+                auto in = A.at(i, k);
+                for (int r = 0; r < kSgemmMr; r++) {
+                    out[k * kSgemmMr + r] = in[r * A.row_stride];
+                }
+            }
+        } else {
+            for (int r = 0; r < mr; r++) {
+                auto in = A.at(i + r, 0);
+                for (int64_t k = 0; k < kc; k++) {
+                    out[k * kSgemmMr + r] = in[k * A.col_stride];
+                }
+            }
+            for (int r = mr; r < kSgemmMr; r++) {
+                for (int64_t k = 0; k < kc; k++) { out[k * kSgemmMr + r] = 0; }
+            }
+        }
+        out += kc * kSgemmMr;
+    }
+}
+
+// packs rows [0, kc) and cols [0, ncols) of B into panels of kSgemmNr
+// cols, stored k-major; cols past ncols are zero
+static inline void _sgemm_pack_b(SgemmOperand B, int64_t kc, int64_t ncols,
+                                 float* out)
+{
+    for (int64_t j = 0; j < ncols; j += kSgemmNr) {
+        auto nr = std::min<int64_t>(kSgemmNr, ncols - j);
+        for (int64_t k = 0; k < kc; k++) {
+            auto in = B.at(k, j);
+            auto out_row = out + k * kSgemmNr;
+            if (nr == kSgemmNr && B.col_stride == 1) {
+                _mm256_storeu_ps(out_row, _mm256_loadu_ps(in));
+                _mm256_storeu_ps(out_row + 8, _mm256_loadu_ps(in + 8));
+                continue;
+            }
+            int c = 0;
+            for (; c < nr; c++) { out_row[c] = in[c * B.col_stride]; }
+            for (; c < kSgemmNr; c++) { out_row[c] = 0; }
+        }
+        out += kc * kSgemmNr;
+    }
+}
+
+// C[0:mr, 0:nr] (+)= sum over k of outer(a[k, :], b[k, :]), where C's
+// cols are contiguous and ldc is its row stride
+static inline void _sgemm_micro_kernel(int64_t kc, const float* a,
+    const float* b, float* C, int64_t ldc, bool add_to_output)
+{
+    __m256 acc[kSgemmMr][2];
+    for (int r = 0; r < kSgemmMr; r++) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+    #pragma GCC unroll 4
+    for (int64_t k = 0; k < kc; k++) {
+        auto b0 = _mm256_loadu_ps(b);
+        auto b1 = _mm256_loadu_ps(b + 8);
+        for (int r = 0; r < kSgemmMr; r++) {
+            auto ar = _mm256_broadcast_ss(a + r);
+            acc[r][0] = _mm256_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(ar, b1, acc[r][1]);
+        }
+        a += kSgemmMr;
+        b += kSgemmNr;
+    }
+    for (int r = 0; r < kSgemmMr; r++) {
+        auto row = C + r * ldc;
+        if (add_to_output) {
+            acc[r][0] = _mm256_add_ps(acc[r][0], _mm256_loadu_ps(row));
+            acc[r][1] = _mm256_add_ps(acc[r][1], _mm256_loadu_ps(row + 8));
+        }
+        _mm256_storeu_ps(row, acc[r][0]);
+        _mm256_storeu_ps(row + 8, acc[r][1]);
+    }
+}
+
+// partial tiles, or C whose cols aren't contiguous, go through a buffer
+static inline void _sgemm_micro_kernel_edge(int64_t kc, const float* a,
+    const float* b, SgemmOperand C, float* C_data, int mr, int nr,
+    bool add_to_output)
+{
+    float tile[kSgemmMr * kSgemmNr];
+    _sgemm_micro_kernel(kc, a, b, tile, kSgemmNr, false);
+    for (int r = 0; r < mr; r++) {
+        for (int c = 0; c < nr; c++) {
+            auto out = C_data + r * C.row_stride + c * C.col_stride;
+            auto val = tile[r * kSgemmNr + c];
+            *out = add_to_output ? *out + val : val;
+        }
+    }
+}
+
+// the blocked loops for C[0:N, 0:M] on one thread
+static inline void _sgemm_serial(SgemmOperand A, SgemmOperand B,
+    SgemmOperand C, int64_t N, int64_t D, int64_t M, bool add_to_output)
+{
+    auto kc_max = std::min(kSgemmKc, D);
+    auto mc_max = std::min(kSgemmMc,
+        (N + kSgemmMr - 1) / kSgemmMr * kSgemmMr);
+    auto nc_max = std::min(kSgemmNc,
+        (M + kSgemmNr - 1) / kSgemmNr * kSgemmNr);
+    std::vector<float> A_packed(mc_max * kc_max);
+    std::vector<float> B_packed(kc_max * nc_max);
+    bool direct_store = C.col_stride == 1;
+
+    for (int64_t jc = 0; jc < M; jc += kSgemmNc) {
+        auto nc = std::min(kSgemmNc, M - jc);
+        for (int64_t pc = 0; pc < D; pc += kSgemmKc) {
+            auto kc = std::min(kSgemmKc, D - pc);
+            // only the first block of D can overwrite the output
+            bool add = add_to_output || pc > 0;
+            _sgemm_pack_b({B.at(pc, jc), B.row_stride, B.col_stride}, kc, nc,
+                          B_packed.data());
+            for (int64_t ic = 0; ic < N; ic += kSgemmMc) {
+                auto mc = std::min(kSgemmMc, N - ic);
+                _sgemm_pack_a({A.at(ic, pc), A.row_stride, A.col_stride},
+                              mc, kc, A_packed.data());
+                for (int64_t jr = 0; jr < nc; jr += kSgemmNr) {
+                    auto nr = static_cast<int>(
+                        std::min<int64_t>(kSgemmNr, nc - jr));
+                    auto b_panel = B_packed.data() + jr * kc;
+                    for (int64_t ir = 0; ir < mc; ir += kSgemmMr) {
+                        auto mr = static_cast<int>(
+                            std::min<int64_t>(kSgemmMr, mc - ir));
+                        auto a_panel = A_packed.data() + ir * kc;
+                        auto C_tile = const_cast<float*>(
+                            C.at(ic + ir, jc + jr));
+                        if (direct_store && mr == kSgemmMr && nr == kSgemmNr) {
+                            _sgemm_micro_kernel(kc, a_panel, b_panel, C_tile,
+                                                C.row_stride, add);
+                        } else {
+                            _sgemm_micro_kernel_edge(kc, a_panel, b_panel, C,
+                                                     C_tile, mr, nr, add);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief C = A * B, or C += A * B, with A N x D, B D x M, and C N x M.
+ *
+ * @details Element (i, j) of each matrix is at data[i * row_stride +
+ * j * col_stride], so, e.g., a row-major matrix with ncols cols has
+ * strides (ncols, 1), a col-major one with nrows rows has strides
+ * (1, nrows), and swapping the strides transposes it. If D is 0, C is
+ * zeroed (or left alone if add_to_output).
+ *
+ * @param nthreads Threads to split C over; <= 0 means all hardware
+ *  threads. Threads each get at least kSgemmMinFlopsPerThread of work,
+ *  so small products always run on the calling thread.
+ */
+static inline void sgemm(const float* A, const float* B, float* C,
+    int64_t N, int64_t D, int64_t M,
+    int64_t A_row_stride, int64_t A_col_stride,
+    int64_t B_row_stride, int64_t B_col_stride,
+    int64_t C_row_stride, int64_t C_col_stride,
+    bool add_to_output=false, int nthreads=1)
+{
+    if (N < 1 || M < 1) { return; }
+    SgemmOperand A_op {A, A_row_stride, A_col_stride};
+    SgemmOperand B_op {B, B_row_stride, B_col_stride};
+    SgemmOperand C_op {C, C_row_stride, C_col_stride};
+    if (D < 1) {
+        if (add_to_output) { return; }
+        for (int64_t i = 0; i < N; i++) {
+            for (int64_t j = 0; j < M; j++) {
+                *const_cast<float*>(C_op.at(i, j)) = 0;
+            }
+        }
+        return;
+    }
+    // the micro-kernel stores contiguous rows of C, so if C's cols are
+    // contiguous and its rows aren't, compute C^T = B^T * A^T instead; also
+    // do so if it wastes much less of each micro-tile on padding, as when
+    // M is less than kSgemmNr
+    auto tile_util = [](int64_t nrows, int64_t ncols) {
+        auto padded_nrows = (nrows + kSgemmMr - 1) / kSgemmMr * kSgemmMr;
+        auto padded_ncols = (ncols + kSgemmNr - 1) / kSgemmNr * kSgemmNr;
+        return double(nrows * ncols) / double(padded_nrows * padded_ncols);
+    };
+    bool transpose = C_col_stride != 1 && C_row_stride == 1;
+    if (C_col_stride == 1 && C_row_stride != 1) {
+        transpose = tile_util(M, N) > 1.25 * tile_util(N, M);
+    }
+    if (transpose) {
+        auto A_t = B_op.transpose();
+        B_op = A_op.transpose();
+        A_op = A_t;
+        C_op = C_op.transpose();
+        std::swap(N, M);
+    }
+
+    // split whichever dim of C is longer, in whole micro-tiles
+    bool split_rows = (N / kSgemmMr) >= (M / kSgemmNr);
+    int64_t tile_sz = split_rows ? kSgemmMr : kSgemmNr;
+    int64_t split_len = split_rows ? N : M;
+    int64_t ntiles = (split_len + tile_sz - 1) / tile_sz;
+    int64_t flops_per_tile = 2 * tile_sz * D * (split_rows ? M : N);
+    int64_t min_tiles_per_thread = std::max<int64_t>(1,
+        kSgemmMinFlopsPerThread / std::max<int64_t>(1, flops_per_tile));
+    parallel_for_ranges(ntiles, nthreads, min_tiles_per_thread,
+        [&](int64_t start, int64_t end) {
+            auto begin = start * tile_sz;
+            auto len = std::min(end * tile_sz, split_len) - begin;
+            if (split_rows) {
+                _sgemm_serial({A_op.at(begin, 0), A_op.row_stride,
+                               A_op.col_stride}, B_op,
+                              {C_op.at(begin, 0), C_op.row_stride,
+                               C_op.col_stride},
+                              len, D, M, add_to_output);
+            } else {
+                _sgemm_serial(A_op, {B_op.at(0, begin), B_op.row_stride,
+                                     B_op.col_stride},
+                              {C_op.at(0, begin), C_op.row_stride,
+                               C_op.col_stride},
+                              N, D, len, add_to_output);
+            }
+        });
+}
+
+// row-major A (N x D), B (D x M), and out (N x M)
+static inline void sgemm_rowmajor(const float* A, const float* B,
+    int64_t N, int64_t D, int64_t M, float* out, bool add_to_output=false,
+    int nthreads=1)
+{
+    sgemm(A, B, out, N, D, M, D, 1, M, 1, M, 1, add_to_output, nthreads);
+}
+
+// col-major A (N x D), B (D x M), and out (N x M), like sgemm_colmajor(),
+// but for any N, D, and M
+static inline void sgemm_colmajor_packed(const float* A, const float* B,
+    int64_t N, int64_t D, int64_t M, float* out, bool add_to_output=false,
+    int nthreads=1)
+{
+    sgemm(A, B, out, N, D, M, 1, N, 1, D, 1, N, add_to_output, nthreads);
+}
+
+} // anon namespace
+#endif // __SGEMM_HPP
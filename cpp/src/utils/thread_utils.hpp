@@ -0,0 +1,129 @@
+//
+//  thread_utils.hpp
+//  Bolt
+//
+
+#ifndef __THREAD_UTILS_HPP
+#define __THREAD_UTILS_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+/**
+ * @brief Bounded multi-producer, multi-consumer FIFO queue.
+ *
+ * @details push() blocks while the queue is full, which is what provides
+ * backpressure between pipeline stages. After close(), push() fails and
+ * pop() fails once the queue has been drained, which is how consumers
+ * learn to exit.
+ */
+template<class T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity=0): _capacity(capacity) {}
+
+    // returns false if the queue was closed
+    bool push(T x) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_full.wait(lock, [this]() {
+            return _closed || _capacity == 0 || _items.size() < _capacity;
+        });
+        if (_closed) { return false; }
+        _items.push_back(std::move(x));
+        lock.unlock();
+        _not_empty.notify_one();
+        return true;
+    }
+
+    // returns false if the queue is closed and empty
+    bool pop(T& out) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_empty.wait(lock, [this]() { return _closed || !_items.empty(); });
+        if (_items.empty()) { return false; }
+        out = std::move(_items.front());
+        _items.pop_front();
+        lock.unlock();
+        _not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+        }
+        _not_empty.notify_all();
+        _not_full.notify_all();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _items.size();
+    }
+
+private:
+    size_t _capacity;  // 0 = unbounded
+    bool _closed = false;
+    std::deque<T> _items;
+    std::mutex _mutex;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
+};
+
+/**
+ * @brief Runs fn(start, end, range_idx) on contiguous ranges of [0, n) in
+ * parallel and returns the number of ranges.
+ *
+ * @details Uses at most nthreads threads (all hardware threads if
+ * nthreads <= 0), but none whose range would be shorter than
+ * min_range_sz. With one range, fn runs on the calling thread. Range i
+ * always starts before range i + 1, so callers that keep per-range partial
+ * results can combine them in a fixed order.
+ */
+template<class F>
+static inline int parallel_for_indexed_ranges(int64_t n, int nthreads,
+    int64_t min_range_sz, F fn)
+{
+    if (nthreads <= 0) {
+        nthreads = static_cast<int>(
+            std::max(1u, std::thread::hardware_concurrency()));
+    }
+    nthreads = static_cast<int>(std::max<int64_t>(1, std::min<int64_t>(
+        nthreads, n / std::max<int64_t>(1, min_range_sz))));
+    if (nthreads == 1) {
+        fn(int64_t(0), n, 0);
+        return 1;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back(fn, n * t / nthreads, n * (t + 1) / nthreads, t);
+    }
+    for (auto& t : threads) { t.join(); }
+    return nthreads;
+}
+
+/**
+ * @brief Runs fn(start, end) on contiguous ranges of [0, n) in parallel.
+ *
+ * @details As parallel_for_indexed_ranges(), for callers that don't need
+ * to know which range they're in.
+ */
+template<class F>
+static inline void parallel_for_ranges(int64_t n, int nthreads,
+    int64_t min_range_sz, F fn)
+{
+    parallel_for_indexed_ranges(n, nthreads, min_range_sz,
+        [&fn](int64_t start, int64_t end, int) { fn(start, end); });
+}
+
+} // anon namespace
+#endif // __THREAD_UTILS_HPP
@@ -0,0 +1,130 @@
+//
+//  vecs_io.hpp
+//  Bolt
+//
+//  Readers for the .fvecs / .bvecs / .ivecs formats used by the standard
+//  ANN datasets (SIFT1M, GIST1M, Deep1B, etc). Each vector in these files
+//  is stored as an int32 dimension followed by that many float32, uint8,
+//  or int32 values, respectively.
+//
+
+#ifndef __VECS_IO_HPP
+#define __VECS_IO_HPP
+
+#include <fstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/utils/eigen_utils.hpp"
+#else
+    #include "eigen_utils.hpp"
+#endif
+
+namespace {
+
+/**
+ * @brief Read up to max_nrows vectors from a *vecs file into a row-major
+ * matrix.
+ *
+ * @details Returns an empty matrix (and prints why) if the file can't be
+ * read or the vectors don't all have the same dimension.
+ *
+ * @tparam FileT The type of the stored elements; float for .fvecs, uint8_t
+ *  for .bvecs, and int32_t for .ivecs
+ * @tparam OutT The type of the elements in the returned matrix
+ */
+template<class FileT, class OutT=FileT>
+RowMatrix<OutT> read_vecs(const std::string& path, int64_t max_nrows=-1) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+        fprintf(stderr, "ERROR: could not open vecs file '%s'\n", path.c_str());
+        return RowMatrix<OutT>(0, 0);
+    }
+    int32_t ncols = 0;
+    if (!f.read(reinterpret_cast<char*>(&ncols), sizeof(ncols)) || ncols <= 0) {
+        fprintf(stderr, "ERROR: bad header in vecs file '%s'\n", path.c_str());
+        return RowMatrix<OutT>(0, 0);
+    }
+    f.seekg(0, std::ios::end);
+    int64_t nbytes = f.tellg();
+    f.seekg(0, std::ios::beg);
+    int64_t row_nbytes = sizeof(int32_t) + ncols * sizeof(FileT);
+    int64_t nrows = nbytes / row_nbytes;
+    if (nrows * row_nbytes != nbytes) {
+        fprintf(stderr, "ERROR: size of vecs file '%s' is not a multiple of "
+            "its row size; mismatched file type?\n", path.c_str());
+        return RowMatrix<OutT>(0, 0);
+    }
+    if (max_nrows >= 0 && max_nrows < nrows) {
+        nrows = max_nrows;
+    }
+
+    RowMatrix<OutT> out(nrows, ncols);
+    std::vector<FileT> row_buff(ncols);
+    for (int64_t i = 0; i < nrows; i++) {
+        int32_t dim;
+        f.read(reinterpret_cast<char*>(&dim), sizeof(dim));
+        f.read(reinterpret_cast<char*>(row_buff.data()),
+            ncols * sizeof(FileT));
+        if (!f || dim != ncols) {
+            fprintf(stderr, "ERROR: malformed row %lld in vecs file '%s'\n",
+                (long long)i, path.c_str());
+            return RowMatrix<OutT>(0, 0);
+        }
+        for (int j = 0; j < ncols; j++) {
+            out(i, j) = static_cast<OutT>(row_buff[j]);
+        }
+    }
+    return out;
+}
+
+static inline RowMatrix<float> read_fvecs(const std::string& path,
+                                          int64_t max_nrows=-1)
+{
+    return read_vecs<float, float>(path, max_nrows);
+}
+
+static inline RowMatrix<float> read_bvecs(const std::string& path,
+                                          int64_t max_nrows=-1)
+{
+    return read_vecs<uint8_t, float>(path, max_nrows);
+}
+
+static inline RowMatrix<int32_t> read_ivecs(const std::string& path,
+                                            int64_t max_nrows=-1)
+{
+    return read_vecs<int32_t, int32_t>(path, max_nrows);
+}
+
+// picks fvecs vs bvecs based on the file extension
+static inline RowMatrix<float> read_vecs_as_float(const std::string& path,
+                                                  int64_t max_nrows=-1)
+{
+    auto ext_start = path.rfind('.');
+    auto ext = ext_start == std::string::npos ? "" : path.substr(ext_start);
+    if (ext == ".bvecs") {
+        return read_bvecs(path, max_nrows);
+    } else if (ext == ".ivecs") {
+        return read_vecs<int32_t, float>(path, max_nrows);
+    }
+    return read_fvecs(path, max_nrows);
+}
+
+template<class T>
+bool write_vecs(const std::string& path, const RowMatrix<T>& X) {
+    std::ofstream f(path, std::ios::binary);
+    if (!f) { return false; }
+    int32_t ncols = static_cast<int32_t>(X.cols());
+    for (int64_t i = 0; i < X.rows(); i++) {
+        f.write(reinterpret_cast<const char*>(&ncols), sizeof(ncols));
+        f.write(reinterpret_cast<const char*>(X.row(i).data()),
+            ncols * sizeof(T));
+    }
+    return static_cast<bool>(f);
+}
+
+} // anon namespace
+#endif // __VECS_IO_HPP
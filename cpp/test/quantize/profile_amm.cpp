@@ -24,6 +24,7 @@ TEST_CASE("amm mithral", "[amm][matmul][mithral][profile]") {
      _profile_mithral(kUcrTaskShape0, ncodebooks, lutconsts);
      _profile_mithral(kUcrTaskShape1, ncodebooks, lutconsts);
      _profile_mithral(kUcrTaskShape2, ncodebooks, lutconsts);
+     PERF_COUNTERS_REPORT();
 }
 
 TEST_CASE("amm mithral N2pow", "[amm][matmul][mithralN2pow][profile]") {
@@ -73,6 +74,7 @@ TEST_CASE("amm bolt", "[amm][matmul][bolt][profile]") {
      _profile_bolt_amm(kUcrTaskShape0, ncodebooks);
      _profile_bolt_amm(kUcrTaskShape1, ncodebooks);
      _profile_bolt_amm(kUcrTaskShape2, ncodebooks);
+     PERF_COUNTERS_REPORT();
 }
 
 TEST_CASE("amm linear approx matmul", "[amm][matmul][dense][linear][profile]") {
@@ -140,6 +142,65 @@ TEST_CASE("amm osnap", "[amm][matmul][osnap][linear][profile]") {
     _profile_osnap(dvals, nsketches, kUcrTaskShape2);
 }
 
+TEST_CASE("osnap apply speed", "[amm][osnap][sketch][profile]") {
+    for (auto shape : {kCaltechTaskShape1, kCifar10TaskShape,
+                       kCifar100TaskShape, kUcrTaskShape0}) {
+        printf("------------------------ %s\n", shape.name);
+        for (int d : {16, 64}) {
+            for (int s : {1, 4}) {
+                _profile_osnap_apply(shape, d, s);
+            }
+        }
+    }
+}
+
+TEST_CASE("amm frequent directions", "[amm][matmul][fd][linear][profile]") {
+    for (auto shape : {kCifar10TaskShape, kCifar100TaskShape,
+                       kUcrTaskShape0, kUcrTaskShape1, kUcrTaskShape2}) {
+        printf("------------------------ %s\n", shape.name);
+        for (int d : {8, 16, 32, 64}) {
+            _profile_fd_amm(shape, d);
+        }
+    }
+}
+
+TEST_CASE("amm srht fastjl", "[amm][matmul][hadamard][linear][profile]") {
+    std::vector<int> dvals {2, 4, 8, 16, 32, 64, 128};
+
+    _profile_hadamard_sketches(dvals, kCaltechTaskShape0);
+    _profile_hadamard_sketches(dvals, kCaltechTaskShape1);
+    _profile_hadamard_sketches(dvals, kCifar10TaskShape);
+    _profile_hadamard_sketches(dvals, kCifar100TaskShape);
+    _profile_hadamard_sketches(dvals, kUcrTaskShape0);
+    _profile_hadamard_sketches(dvals, kUcrTaskShape1);
+    _profile_hadamard_sketches(dvals, kUcrTaskShape2);
+}
+
+TEST_CASE("fwht speed", "[hadamard][profile]") {
+    static constexpr int64_t nfloats = 1 << 22;
+    std::vector<float> x(nfloats);
+    for (int64_t i = 0; i < nfloats; i++) { x[i] = (i % 7) - 3.f; }
+    printf("------------------------ fwht\n");
+    for (int64_t n : {16, 64, 256, 1024, 4096, 1 << 16, 1 << 22}) {
+        auto nvecs = nfloats / n;
+        auto fwht_rows_scalar = [&]() {
+            for (int64_t i = 0; i < nvecs; i++) {
+                _fwht_scalar(x.data() + i * n, n);
+            }
+        };
+        std::string msg;
+        msg = string_with_format("fwht scalar, n=%7lld", (long long)n);
+        REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+            x.data(), nfloats, fwht_rows_scalar());
+        msg = string_with_format("fwht rows,   n=%7lld", (long long)n);
+        REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+            x.data(), nfloats, fwht_rows(x.data(), nvecs, n));
+        msg = string_with_format("fwht cols,   n=%7lld", (long long)n);
+        REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+            x.data(), nfloats, fwht_cols(x.data(), n, nvecs));
+    }
+}
+
 TEST_CASE("amm sparse", "[amm][matmul][sparse][linear][profile]") {
     std::vector<int> dvals {2, 4, 8, 16, 32, 64, 128};
     // std::vector<float> nnz_fracs(19);  // .05 thru .95
@@ -159,3 +220,153 @@ TEST_CASE("amm sparse", "[amm][matmul][sparse][linear][profile]") {
     _profile_sparse_amm(dvals, nnz_fracs, kUcrTaskShape1);
     _profile_sparse_amm(dvals, nnz_fracs, kUcrTaskShape2);
 }
+
+// shapes the planner is calibrated on; a mix of N=1 requests, tall-skinny,
+// and wide M
+static const std::vector<MatmulTaskShape> kPlannerCalibrationShapes {
+    kCaltechTaskShape0, kCifar10TaskShape, kCifar10N1TaskShape,
+    kCifar10N64TaskShape, kCifar100N1024TaskShape, kUcrTaskShape1,
+    MatmulTaskShape{4096, 256, 512, "Wide512"}};
+
+static inline std::string _amm_cost_model_path() {
+    const char* path = getenv("BOLT_AMM_COST_MODEL");
+    return path != nullptr ? path : "amm_cost_model.txt";
+}
+
+TEST_CASE("amm planner calibrate", "[amm][matmul][planner][profile]") {
+    auto model = _calibrate_amm_cost_model(kPlannerCalibrationShapes);
+    auto path = _amm_cost_model_path();
+    REQUIRE(model.save(path));
+    printf("wrote amm cost model to %s\n", path.c_str());
+}
+
+TEST_CASE("amm planner explain", "[amm][matmul][planner][profile]") {
+    AmmCostModel model;
+    if (!model.load(_amm_cost_model_path())) {
+        model = _calibrate_amm_cost_model(kPlannerCalibrationShapes);
+        model.save(_amm_cost_model_path());
+    }
+    AmmPlanner planner(model);
+    // placeholder errors for illustration; the real ones depend on the
+    // data and should come from evaluating trained models on the task
+    for (int c : {8, 16, 32}) {
+        planner.add_variant(AmmVariant{AmmMethod::Bolt, c}, 1.2 / std::sqrt(c));
+        planner.add_variant(AmmVariant{AmmMethod::Mithral, c}, 1. / std::sqrt(c));
+    }
+    for (int d : {8, 16, 32, 64}) {
+        planner.add_variant(AmmVariant{AmmMethod::Osnap, d});
+    }
+
+    std::vector<MatmulTaskShape> shapes {
+        kCifar10N1TaskShape, kCifar10TaskShape, kCifar100N256TaskShape,
+        kUcrTaskShape2, kCaltechTaskShape1,
+        MatmulTaskShape{2048, 512, 1024, "Wide1024"}};
+    for (const auto& shape : shapes) {
+        amm_planner_task task(shape.N, shape.D, shape.M);
+        auto executors = task.executors();
+        for (double tol : {0., .2, .4}) {
+            AmmPlan plan;
+            // run once untimed so that one-time setup isn't counted
+            auto chosen = planner.plan(shape.N, shape.D, shape.M, tol);
+            task.run(chosen.variant);
+            printf("%s ", shape.name);
+            auto t = planner.run(shape.N, shape.D, shape.M, tol, executors,
+                true /*explain*/, &plan);
+            REQUIRE(t >= 0);
+            REQUIRE(plan.expected_rel_err <= tol);
+        }
+    }
+}
+
+TEST_CASE("amm encoded lstsq", "[amm][mithral][lstsq][profile]") {
+    static constexpr int K = 16;
+    static constexpr int64_t N = 64 * 1024;
+    static constexpr int M = 64;
+    int ncpus = static_cast<int>(std::thread::hardware_concurrency());
+    for (int ncodebooks : {8, 16, 32}) {
+        int D = ncodebooks * K;
+        ColMatrix<uint8_t> codes(N, ncodebooks);
+        codes.setRandom();
+        codes = codes.array() / 16;
+        RowMatrix<float> Y(N, M);
+        Y.setRandom();
+        RowMatrix<int32_t> XtX(D, D);
+        RowMatrix<float> XtY(D, M);
+        RowMatrix<float> W(D, M);
+
+        double t_xtx = std::numeric_limits<double>::max();
+        double t_xty = std::numeric_limits<double>::max();
+        double t_solve = std::numeric_limits<double>::max();
+        double t_dense = std::numeric_limits<double>::max();
+        for (int trial = 0; trial < 3; trial++) {
+            double t = 0;
+            { EasyTimer _(t);
+                encoded_xtx(codes.data(), N, ncodebooks, XtX.data(), ncpus); }
+            t_xtx = std::min(t_xtx, t);
+            { EasyTimer _(t);
+                encoded_xty(codes.data(), N, ncodebooks, Y.data(), M,
+                    XtY.data(), ncpus); }
+            t_xty = std::min(t_xty, t);
+            { EasyTimer _(t);
+                encoded_ridge_solve(XtX.data(), XtY.data(), D, M, 1,
+                                    W.data()); }
+            t_solve = std::min(t_solve, t);
+            // dense GEMMs on the one-hot matrix, for comparison
+            { EasyTimer _(t);
+                RowMatrix<float> X(N, D);
+                X.setZero();
+                for (int64_t n = 0; n < N; n++) {
+                    for (int c = 0; c < ncodebooks; c++) {
+                        X(n, c * K + codes(n, c)) = 1;
+                    }
+                }
+                RowMatrix<float> XtX_dense = X.transpose() * X;
+                RowMatrix<float> XtY_dense = X.transpose() * Y;
+                W(0, 0) += XtX_dense(0, 0) + XtY_dense(0, 0);
+            }
+            t_dense = std::min(t_dense, t);
+        }
+        printf("encoded lstsq N=%lld C=%2d M=%d: XtX %7.2fms, XtY %7.2fms, "
+            "solve %7.2fms; dense XtX+XtY %8.2fms\n", (long long)N,
+            ncodebooks, M, t_xtx, t_xty, t_solve, t_dense);
+    }
+}
+
+TEST_CASE("amm mithral scan orders", "[amm][scan][mithral][profile]") {
+    // last shape has luts bigger than L2, where tiling should pay off
+    std::vector<MatmulTaskShape> shapes {kCifar10TaskShape, kCifar100TaskShape,
+        kUcrTaskShape1, kUcrTaskShape2, {32 * 1024, 512, 1024, "Big1024"}};
+    std::vector<MithralScanOrder> orders {MithralScanOrder::CodesStationary,
+        MithralScanOrder::OutputStationary, MithralScanOrder::Tiled2D};
+    for (const auto& shape : shapes) {
+        for (int ncodebooks : {8, 16, 32, 64}) {
+            mithral_amm_task<float> task(
+                shape.N, shape.D, shape.M, ncodebooks, -1);
+            task.encode();
+            task.lut();
+            printf("%-8s C=%2d:", shape.name, ncodebooks);
+            double best_t = std::numeric_limits<double>::max();
+            auto best_order = MithralScanOrder::Auto;
+            for (auto order : orders) {
+                task.amm.scan_order = order;
+                double t_order = std::numeric_limits<double>::max();
+                for (int trial = 0; trial < kNtrials; trial++) {
+                    double t = 0;
+                    { EasyTimer _(t); task.scan(); }
+                    t_order = std::min(t_order, t);
+                }
+                prevent_optimizing_away_dists(
+                    task.output().data(), task.output().size());
+                printf("  %s %7.3fms", mithral_scan_order_name(order), t_order);
+                if (t_order < best_t) {
+                    best_t = t_order;
+                    best_order = order;
+                }
+            }
+            auto auto_order = mithral_scan_order_for(
+                task.N_padded / 32, ncodebooks, shape.M);
+            printf("  | best %s, auto %s\n", mithral_scan_order_name(best_order),
+                mithral_scan_order_name(auto_order));
+        }
+    }
+}
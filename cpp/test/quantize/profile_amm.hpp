@@ -9,11 +9,20 @@
 #ifndef profile_amm_h
 #define profile_amm_h
 
+#include <map>
+#include <memory>
+
 #ifdef BLAZE
     #include "test/quantize/amm_common.hpp"
+    #include "src/amm_planner.hpp"
+    #include "src/quantize/encoded_lstsq.hpp"
+    #include "src/utils/sgemm.hpp"
     #include "src/external/eigen/Eigen/SparseCore"
 #else
     #include "amm_common.hpp"
+    #include "amm_planner.hpp"
+    #include "encoded_lstsq.hpp"
+    #include "sgemm.hpp"
     #include "SparseCore"
 #endif
 
@@ -272,11 +281,19 @@ void _run_matmul(const MatrixT1& X, const MatrixT2& Q, MatrixT3& out) {
 
 template<class MatrixT1, class MatrixT2, class MatrixT3>
 void _run_our_matmul(const MatrixT1& X, const MatrixT2& Q, MatrixT3& out) {
-    // not actually faster than the eigen one
+    // narrow kernels for small B, packed sgemm otherwise
     sgemm_colmajor(
         X.data(), Q.data(), (int)X.rows(), (int)X.cols(), (int)Q.cols(), out.data());
 }
 
+template<class MatrixT1, class MatrixT2, class MatrixT3>
+void _run_packed_matmul(const MatrixT1& X, const MatrixT2& Q, MatrixT3& out,
+                        int nthreads=1)
+{
+    sgemm_colmajor_packed(X.data(), Q.data(), X.rows(), X.cols(), Q.cols(),
+                          out.data(), false, nthreads);
+}
+
 void _profile_matmul(const char* dset_name, uint32_t N, uint32_t D, uint32_t M)
 {
     using MatrixT = ColMatrix<float>;
@@ -315,6 +332,16 @@ void _profile_matmul(const char* dset_name, uint32_t N, uint32_t D, uint32_t M)
             out.data(), out.size(),
             _run_our_matmul(X, W, out));
     }
+    {
+        msg = string_with_format(fmt, "packed matmul");
+        REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+            out.data(), out.size(),
+            _run_packed_matmul(X, W, out));
+        msg = string_with_format(fmt, "packed matmul all threads");
+        REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+            out.data(), out.size(),
+            _run_packed_matmul(X, W, out, -1));
+    }
 }
 
 template<class MatrixT>
@@ -538,6 +565,142 @@ void _profile_osnap(std::vector<int> dvals, std::vector<int> nsketches,
     }
 }
 
+// sketching X alone: the reference scatter, the grouped engine on one and
+// all threads, and the CSR path
+void _profile_osnap_apply(MatmulTaskShape shape, int d, int nsketches,
+                          float nnz_frac=.1)
+{
+    auto N = shape.N;
+    auto D = shape.D;
+    if (d > D) { return; }
+    ColMatrix<float> X(N, D); X.setRandom();
+    ColMatrix<float> out(N, d);
+    RowMatrix<float> out_rowmajor(N, d);
+    ColMatrix<float> X_sparse = X;
+    int64_t nnz_period = static_cast<int64_t>(1. / nnz_frac);
+    for (int64_t i = 0; i < X.size(); i++) {
+        if (i % nnz_period != 0) { X_sparse.data()[i] = 0; }
+    }
+    Eigen::SparseMatrix<float, Eigen::RowMajor> X_csr = X_sparse.sparseView();
+
+    auto sketch = OsnapSketch(D, d, nsketches);
+    auto fmt_as_cppstring = string_with_format(
+        "%s, %%-22s, N D d s:, %6d, %3d, %3d, %2d,\t",
+        shape.name, N, D, d, nsketches);
+    auto fmt = fmt_as_cppstring.c_str();
+
+    auto msg = string_with_format(fmt, "osnap reference");
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+        out.data(), out.size(),
+        (out.setZero(), osnap_sketch(
+            X, sketch.sketch_idxs, sketch.sketch_signs, out)));
+    msg = string_with_format(fmt, "osnap grouped 1 thread");
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+        out.data(), out.size(), sketch(X, out, false, 1));
+    msg = string_with_format(fmt, "osnap grouped");
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+        out.data(), out.size(), sketch(X, out));
+    msg = string_with_format(fmt, "osnap csr 10% nnz");
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+        out_rowmajor.data(), out_rowmajor.size(), sketch(X_csr, out_rowmajor));
+}
+
+// ================================================================ srht, fastjl
+
+template<class SketchT>
+void _profile_hadamard_sketch(const char* dset_name, const char* method_name,
+                              uint32_t N, uint32_t D, uint32_t M, uint32_t d)
+{
+    if (d > next_pow2(D)) { return; }
+
+    using MatrixT = ColMatrix<float>;
+    MatrixT X(N, D); X.setRandom();
+    MatrixT Wt(M, D); Wt.setRandom();
+    MatrixT sketch_X(N, d);
+    sketch_X.setRandom();
+    MatrixT sketch_Wt(M, d);
+    sketch_Wt.setRandom();
+    MatrixT out(N, M);
+    out.setRandom();
+
+    auto fmt_as_cppstring = string_with_format(
+        "%s, %%-15s, N D M d:, %6d, %3d, %3d, %3d,\t",
+        dset_name, N, D, M, d);
+    auto fmt = fmt_as_cppstring.c_str();
+
+    auto sketch = SketchT(D, d);
+    // as for osnap, W is sketched once ahead of time
+    auto msg = string_with_format(fmt, method_name);
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+        out.data(), out.size(),
+        (_run_fancy_sketch_matmul<false>(
+            sketch, X, Wt, sketch_X, sketch_Wt, out)));
+}
+
+void _profile_hadamard_sketches(std::vector<int> dvals, MatmulTaskShape shape) {
+    printf("------------------------ %s\n", shape.name);
+    for (auto d : dvals) {
+        _profile_hadamard_sketch<SrhtSketch>(
+            shape.name, "srht fixedW", shape.N, shape.D, shape.M, d);
+        _profile_hadamard_sketch<FastJlSketch>(
+            shape.name, "fastjl fixedW", shape.N, shape.D, shape.M, d);
+    }
+}
+
+// ================================================================ frequent directions
+
+// ||AB - approx||_F / ||AB||_F
+template<class MatrixT1, class MatrixT2>
+double _amm_rel_err(const MatrixT1& exact, const MatrixT2& approx) {
+    return (exact - approx).norm() / exact.norm();
+}
+
+// one pass of FD-AMM over the D columns of X / rows of W, vs osnap with
+// a sketch of the same size; both sketch W as part of the timed work here
+void _profile_fd_amm(MatmulTaskShape shape, int d) {
+    auto N = shape.N;
+    auto D = shape.D;
+    auto M = shape.M;
+    if (d > D) { return; }
+    using MatrixT = ColMatrix<float>;
+    MatrixT X(N, D); X.setRandom();
+    MatrixT Wt(M, D); Wt.setRandom();
+    // a few strong directions, so that low-rank sketches are meaningful
+    X.leftCols(4) *= 8;
+    Wt.leftCols(4) *= 8;
+    MatrixT exact = X * Wt.transpose();
+    MatrixT X_sketched(N, d);
+    MatrixT Wt_sketched(M, d);
+    RowMatrix<float> fd_out(N, M);
+    MatrixT osnap_out(N, M);
+
+    auto fmt_as_cppstring = string_with_format(
+        "%s, %%-15s, N D M d:, %6d, %3d, %3d, %3d,\t",
+        shape.name, N, D, M, d);
+    auto fmt = fmt_as_cppstring.c_str();
+
+    // columns of X and Wt are the rows (x_j, w_j) of the stream
+    auto run_fd = [&]() {
+        FdAmm amm(N, M, d);
+        amm.add_rows(X.data(), Wt.data(), D);
+        fd_out = amm.product();
+    };
+    auto msg = string_with_format(fmt, "fd amm");
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+        fd_out.data(), fd_out.size(), run_fd());
+
+    auto sketch = OsnapSketch(D, d, 1);
+    msg = string_with_format(fmt, "osnap");
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+        osnap_out.data(), osnap_out.size(),
+        (_run_fancy_sketch_matmul<true>(
+            sketch, X, Wt, X_sketched, Wt_sketched, osnap_out)));
+
+    printf("%s, rel err, N D M d:, %6d, %3d, %3d, %3d,\tfd amm %.4f, osnap %.4f\n",
+        shape.name, N, D, M, d, _amm_rel_err(exact, fd_out),
+        _amm_rel_err(exact, osnap_out));
+}
+
 // ================================================================ bolt
 
 template<int M, bool Safe=false, class dist_t=void>
@@ -760,5 +923,162 @@ void _profile_sparse_amm(std::vector<int> dvals, std::vector<float> nnz_fracs,
     }
 }
 
+// ================================================================ planner
+
+// random operands for one (N, D, M) shape, plus whatever state each
+// method needs; the state for a given variant is created on first use
+struct amm_planner_task {
+    struct bolt_state {
+        bolt_state(int N, int D, int M, int ncodebooks):
+            nblocks((M + 31) / 32),
+            D_padded(D % ncodebooks ? D + ncodebooks - (D % ncodebooks) : D),
+            X(nblocks * 32, D_padded), Q(N, D_padded),
+            centroids(16, D_padded), lut(16, ncodebooks),
+            codes(nblocks * 32, ncodebooks / 2), dists(N, nblocks * 32)
+        {
+            X.setRandom();
+            Q.setRandom();
+            centroids.setRandom();
+            codes.setRandom();
+        }
+        int nblocks;
+        int D_padded;
+        RowMatrix<float> X;
+        RowMatrix<float> Q;
+        ColMatrix<float> centroids;
+        ColMatrix<uint8_t> lut;
+        ColMatrix<uint8_t> codes;
+        ColMatrix<uint16_t> dists;
+    };
+    struct osnap_state {
+        osnap_state(int N, int D, int M, int d):
+            sketch(D, d, 1), X_sketched(N, d), Wt_sketched(M, d)
+        {
+            X_sketched.setRandom();
+            Wt_sketched.setRandom();
+        }
+        OsnapSketch sketch;
+        ColMatrix<float> X_sketched;
+        ColMatrix<float> Wt_sketched;
+    };
+
+    amm_planner_task(int N, int D, int M):
+        N(N), D(D), M(M), X(N, D), W(D, M), Wt(M, D), out(N, M)
+    {
+        X.setRandom();
+        W.setRandom();
+        Wt = W.transpose();
+    }
+
+    void run(const AmmVariant& v) {
+        switch (v.method) {
+        case AmmMethod::ExactGemm:
+            _run_matmul(X, W, out);
+            break;
+        case AmmMethod::Bolt: {
+            auto& state = bolt_states[v.param];
+            if (!state) { state.reset(new bolt_state(N, D, M, v.param)); }
+            auto& s = *state;
+            switch (v.param) {
+                #define CASE(C)                                             \
+                case C: _amm_bolt<C>(s.X.data(), s.nblocks * 32,            \
+                    s.Q.data(), N, s.D_padded, s.centroids.data(),          \
+                    s.lut.data(), s.dists.data(), s.codes.data(),           \
+                    s.nblocks); break;
+                CASE(2); CASE(4); CASE(8); CASE(16); CASE(32); CASE(64);
+                #undef CASE
+                default: break;
+            }
+            break;
+        }
+        case AmmMethod::Mithral: {
+            auto& task = mithral_tasks[v.param];
+            if (!task) {
+                task.reset(new mithral_amm_task<float>(N, D, M, v.param, 2));
+            }
+            task->run_matmul(true);
+            break;
+        }
+        case AmmMethod::Osnap: {
+            auto& state = osnap_states[v.param];
+            if (!state) { state.reset(new osnap_state(N, D, M, v.param)); }
+            _run_fancy_sketch_matmul<false>(state->sketch, X, Wt,
+                state->X_sketched, state->Wt_sketched, out);
+            break;
+        }
+        }
+    }
+
+    std::array<AmmExecutor, kNumAmmMethods> executors() {
+        std::array<AmmExecutor, kNumAmmMethods> ret;
+        for (auto& e : ret) {
+            e = [this](const AmmVariant& v) { this->run(v); };
+        }
+        return ret;
+    }
+
+    int N, D, M;
+    ColMatrix<float> X;
+    ColMatrix<float> W;
+    ColMatrix<float> Wt;
+    ColMatrix<float> out;
+    std::map<int, std::unique_ptr<bolt_state> > bolt_states;
+    std::map<int, std::unique_ptr<mithral_amm_task<float> > > mithral_tasks;
+    std::map<int, std::unique_ptr<osnap_state> > osnap_states;
+};
+
+static inline std::vector<AmmVariant> _amm_planner_variants() {
+    std::vector<AmmVariant> variants {{AmmMethod::ExactGemm, 0}};
+    for (int c : {8, 16, 32}) {
+        variants.push_back(AmmVariant{AmmMethod::Bolt, c});
+        variants.push_back(AmmVariant{AmmMethod::Mithral, c});
+    }
+    for (int d : {8, 16, 32, 64}) {
+        variants.push_back(AmmVariant{AmmMethod::Osnap, d});
+    }
+    return variants;
+}
+
+// best-of-ntrials time for one variant, after an untimed warmup run
+// that also builds any state the variant needs
+double _time_amm_variant(amm_planner_task& task, const AmmVariant& v,
+                         int ntrials=kNtrials)
+{
+    task.run(v);
+    double t_best = std::numeric_limits<double>::max();
+    for (int i = 0; i < ntrials; i++) {
+        double t = 0;
+        {
+            EasyTimer _(t);
+            task.run(v);
+        }
+        prevent_optimizing_away_dists(task.out.data(), task.out.size());
+        t_best = MIN(t_best, t);
+    }
+    return t_best;
+}
+
+// times every variant on every shape and fits the cost model to it
+AmmCostModel _calibrate_amm_cost_model(
+    const std::vector<MatmulTaskShape>& shapes)
+{
+    AmmCostModel model;
+    auto variants = _amm_planner_variants();
+    for (const auto& shape : shapes) {
+        amm_planner_task task(shape.N, shape.D, shape.M);
+        for (const auto& v : variants) {
+            if (!amm_variant_supports_shape(v, shape.D)) {
+                continue;
+            }
+            auto t = _time_amm_variant(task, v);
+            printf("%s, %-16s, N D M:, %6d, %4d, %4d, %9.4f ms\n", shape.name,
+                amm_variant_name(v).c_str(), shape.N, shape.D, shape.M, t);
+            model.add_sample(v, shape.N, shape.D, shape.M, t);
+        }
+    }
+    model.fit();
+    return model;
+}
+
 } // anonymous namespace
 #endif /* profile_amm_h */
@@ -0,0 +1,416 @@
+//
+//  profile_ann.cpp
+//  Bolt
+//
+//  Recall@R vs queries/sec for Bolt and PQ nearest neighbor search, so that
+//  speed / quality tradeoffs can be evaluated without the python stack.
+//
+//  By default, this runs on a synthetic clustered dataset. To use a real
+//  one (e.g., SIFT1M), point these environment variables at local files:
+//
+//      BOLT_ANN_BASE         base vectors (.fvecs or .bvecs); required
+//      BOLT_ANN_QUERIES      query vectors (.fvecs or .bvecs); required
+//      BOLT_ANN_GROUNDTRUTH  true L2 neighbors (.ivecs); optional
+//      BOLT_ANN_LEARN        training vectors; optional, else uses base
+//      BOLT_ANN_MAX_NROWS    max base vectors to load; optional
+//      BOLT_ANN_MAX_NQUERIES max queries to load; optional
+//
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef BLAZE
+    #include "test/external/catch.hpp"
+    #include "src/include/public.hpp"
+    #include "src/quantize/bolt.hpp"
+    #include "src/quantize/product_quantize.hpp"
+    #include "src/utils/debug_utils.hpp"
+    #include "src/utils/eigen_utils.hpp"
+    #include "src/utils/timing_utils.hpp"
+    #include "src/utils/vecs_io.hpp"
+    #include "test/testing_utils/testing_utils.hpp"
+#else
+    #include "catch.hpp"
+    #include "public.hpp"
+    #include "bolt.hpp"
+    #include "product_quantize.hpp"
+    #include "debug_utils.hpp"
+    #include "eigen_utils.hpp"
+    #include "timing_utils.hpp"
+    #include "vecs_io.hpp"
+    #include "testing_utils.hpp"
+#endif
+
+namespace {
+
+static constexpr int kMaxR = 100;            // largest R in recall@R
+static constexpr int kNtrainRows = 20*1000;  // rows used to learn centroids
+static constexpr int kNtrainQueries = 200;   // rows used to learn lut params
+static constexpr int kKmeansIters = 16;
+
+// synthetic dataset params
+static constexpr int kSynthNrows = 100*1000;
+static constexpr int kSynthNqueries = 1000;
+static constexpr int kSynthNcols = 128;
+static constexpr int kSynthNclusters = 256;
+
+struct AnnDataset {
+    std::string name;
+    RowMatrix<float> X;              // base vectors
+    RowMatrix<float> X_train;        // for learning centroids
+    RowMatrix<float> Q;              // queries
+    RowMatrix<int32_t> true_knn_l2;  // [nqueries x kMaxR]
+    RowMatrix<int32_t> true_knn_mips;
+};
+
+static inline int64_t env_int(const char* name, int64_t default_val) {
+    const char* s = getenv(name);
+    return s != nullptr ? atoll(s) : default_val;
+}
+
+// gaussian blobs; the scale is large because pq_encode_8b rounds
+// distances to ints
+RowMatrix<float> make_clustered_data(int64_t nrows, int ncols,
+    const RowMatrix<float>& centers, float noise_std, std::mt19937& gen)
+{
+    std::uniform_int_distribution<int> which_center(0, centers.rows() - 1);
+    std::normal_distribution<float> noise(0, noise_std);
+    RowMatrix<float> X(nrows, ncols);
+    for (int64_t i = 0; i < nrows; i++) {
+        auto c = which_center(gen);
+        for (int j = 0; j < ncols; j++) {
+            X(i, j) = centers(c, j) + noise(gen);
+        }
+    }
+    return X;
+}
+
+// indices of the k smallest (or largest) dists, best first
+template<class dist_t>
+std::vector<int32_t> topk_idxs(const dist_t* dists, int64_t n, int k,
+                               bool smaller_better=true)
+{
+    k = static_cast<int>(std::min(static_cast<int64_t>(k), n));
+    std::vector<int32_t> idxs(n);
+    std::iota(idxs.begin(), idxs.end(), 0);
+    auto cmp = [dists, smaller_better](int32_t a, int32_t b) {
+        return smaller_better ? dists[a] < dists[b] : dists[a] > dists[b];
+    };
+    std::partial_sort(idxs.begin(), idxs.begin() + k, idxs.end(), cmp);
+    idxs.resize(k);
+    return idxs;
+}
+
+// exact neighbors, computed in batches of queries with a dense matmul
+RowMatrix<int32_t> brute_force_knn(const RowMatrix<float>& X,
+    const RowMatrix<float>& Q, int k, bool mips)
+{
+    static constexpr int batch_sz = 64;
+    auto nqueries = Q.rows();
+    k = static_cast<int>(std::min(static_cast<int64_t>(k), (int64_t)X.rows()));
+    RowMatrix<int32_t> out(nqueries, k);
+    ColVector<float> row_norms_sq = X.rowwise().squaredNorm();
+    RowMatrix<float> prods(batch_sz, X.rows());
+    for (int64_t q0 = 0; q0 < nqueries; q0 += batch_sz) {
+        auto nq = std::min(static_cast<int64_t>(batch_sz), nqueries - q0);
+        prods.topRows(nq).noalias() = Q.middleRows(q0, nq) * X.transpose();
+        for (int i = 0; i < nq; i++) {
+            // ||x - q||^2 ranks the same as ||x||^2 - 2<x, q>
+            if (!mips) {
+                prods.row(i) = row_norms_sq.transpose() - 2 * prods.row(i);
+            }
+            auto idxs = topk_idxs(prods.row(i).data(), X.rows(), k, !mips);
+            for (int j = 0; j < k; j++) {
+                out(q0 + i, j) = idxs[j];
+            }
+        }
+    }
+    return out;
+}
+
+// plain Lloyd's algorithm, initialized with random rows of X
+RowMatrix<float> kmeans(const RowMatrix<float>& X, int k, int niters,
+                        std::mt19937& gen)
+{
+    auto nrows = X.rows();
+    RowMatrix<float> centroids(k, X.cols());
+    std::vector<int64_t> perm(nrows);
+    std::iota(perm.begin(), perm.end(), 0);
+    std::shuffle(perm.begin(), perm.end(), gen);
+    for (int c = 0; c < k; c++) {
+        centroids.row(c) = X.row(perm[c % nrows]);
+    }
+    ColVector<float> counts(k);
+    RowMatrix<float> sums(k, X.cols());
+    RowMatrix<float> prods(nrows, k);
+    for (int it = 0; it < niters; it++) {
+        RowVector<float> centroid_norms_sq =
+            centroids.rowwise().squaredNorm().transpose();
+        prods.noalias() = X * centroids.transpose();
+        counts.setZero();
+        sums.setZero();
+        for (int64_t i = 0; i < nrows; i++) {
+            int best_c = 0;
+            (centroid_norms_sq - 2 * prods.row(i)).minCoeff(&best_c);
+            counts(best_c) += 1;
+            sums.row(best_c) += X.row(i);
+        }
+        for (int c = 0; c < k; c++) {
+            if (counts(c) > 0) {  // empty clusters just keep old centroid
+                centroids.row(c) = sums.row(c) / counts(c);
+            }
+        }
+    }
+    return centroids;
+}
+
+// returns row-major centroids, one codebook after another, as expected by
+// BoltEncoder::set_centroids and pq_encode_centroids_8b
+RowMatrix<float> learn_pq_centroids(const RowMatrix<float>& X,
+    int ncodebooks, int ncentroids, std::mt19937& gen)
+{
+    auto subvect_len = X.cols() / ncodebooks;
+    RowMatrix<float> centroids(ncodebooks * ncentroids, subvect_len);
+    for (int m = 0; m < ncodebooks; m++) {
+        RowMatrix<float> X_sub = X.middleCols(m * subvect_len, subvect_len);
+        centroids.middleRows(m * ncentroids, ncentroids) = kmeans(
+            X_sub, ncentroids, kKmeansIters, gen);
+    }
+    return centroids;
+}
+
+template<class MatrixT>
+float percentile(const MatrixT& vals_expr, float pct) {
+    RowMatrix<float> vals = vals_expr;  // contiguous copy, even for columns
+    std::vector<float> sorted(vals.data(), vals.data() + vals.size());
+    int64_t idx = static_cast<int64_t>((pct / 100.f) * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+    return sorted[idx];
+}
+
+// C++ version of _learn_best_quantization in python/bolt/bolt_api.py;
+// luts is [nqueries * 16, ncodebooks]
+void learn_lut_quantization(const RowMatrix<float>& luts,
+    RowVector<float>& offsets_out, float& scale_out)
+{
+    auto ncodebooks = luts.cols();
+    float best_loss = std::numeric_limits<float>::max();
+    RowVector<float> floors(ncodebooks);
+    for (float alpha : {0.f, .001f, .002f, .005f, .01f, .02f, .05f, .1f}) {
+        for (int m = 0; m < ncodebooks; m++) {
+            floors(m) = percentile(luts.col(m), 100 * alpha);
+        }
+        RowMatrix<float> luts_offset = (luts.rowwise() - floors).cwiseMax(0);
+        float ceil = percentile(luts_offset, 100 * (1 - alpha));
+        float scale = 255.f / std::max(ceil, 1e-20f);
+        RowMatrix<float> ideal = luts_offset * scale;
+        RowMatrix<float> quantized = ideal.array().floor().min(255.f);
+        float loss = (ideal - quantized).squaredNorm();
+        if (loss <= best_loss) {
+            best_loss = loss;
+            // bolt_lut computes dist * scale + offset
+            offsets_out = -floors * scale;
+            scale_out = scale;
+        }
+    }
+}
+
+template<int Reduction>
+RowMatrix<float> pq_luts_f32(const RowMatrix<float>& Q,
+    const RowMatrix<float>& centroids, int ncentroids)
+{
+    auto ncodebooks = centroids.rows() / ncentroids;
+    auto subvect_len = centroids.cols();
+    RowMatrix<float> luts(Q.rows() * ncentroids, ncodebooks);
+    for (int64_t i = 0; i < Q.rows(); i++) {
+        for (int m = 0; m < ncodebooks; m++) {
+            auto q_sub = Q.row(i).segment(m * subvect_len, subvect_len);
+            for (int c = 0; c < ncentroids; c++) {
+                auto centroid = centroids.row(m * ncentroids + c);
+                luts(i * ncentroids + c, m) = Reduction == Reductions::DotProd ?
+                    q_sub.dot(centroid) : (q_sub - centroid).squaredNorm();
+            }
+        }
+    }
+    return luts;
+}
+
+AnnDataset load_or_generate_dataset() {
+    AnnDataset data;
+    const char* base_path = getenv("BOLT_ANN_BASE");
+    const char* queries_path = getenv("BOLT_ANN_QUERIES");
+    if (base_path != nullptr && queries_path != nullptr) {
+        data.name = base_path;
+        auto max_nrows = env_int("BOLT_ANN_MAX_NROWS", -1);
+        auto max_nqueries = env_int("BOLT_ANN_MAX_NQUERIES", 1000);
+        data.X = read_vecs_as_float(base_path, max_nrows);
+        data.Q = read_vecs_as_float(queries_path, max_nqueries);
+        const char* learn_path = getenv("BOLT_ANN_LEARN");
+        data.X_train = learn_path != nullptr ?
+            read_vecs_as_float(learn_path, kNtrainRows) :
+            RowMatrix<float>(data.X.topRows(
+                std::min((int64_t)kNtrainRows, (int64_t)data.X.rows())));
+        const char* gt_path = getenv("BOLT_ANN_GROUNDTRUTH");
+        // ground truth files are only valid if we used the whole base set
+        if (gt_path != nullptr && max_nrows < 0) {
+            data.true_knn_l2 = read_ivecs(gt_path, data.Q.rows());
+        }
+    } else {
+        data.name = string_with_format("synthetic_N=%d_D=%d_K=%d",
+            kSynthNrows, kSynthNcols, kSynthNclusters);
+        std::mt19937 gen(123);
+        std::normal_distribution<float> center_dist(0, 100);
+        RowMatrix<float> centers(kSynthNclusters, kSynthNcols);
+        for (int i = 0; i < centers.size(); i++) {
+            centers.data()[i] = center_dist(gen);
+        }
+        data.X = make_clustered_data(kSynthNrows, kSynthNcols, centers, 40, gen);
+        data.Q = make_clustered_data(kSynthNqueries, kSynthNcols, centers, 40, gen);
+        data.X_train = make_clustered_data(kNtrainRows, kSynthNcols, centers, 40, gen);
+    }
+    if (data.true_knn_l2.rows() == 0 && data.X.rows() > 0) {
+        data.true_knn_l2 = brute_force_knn(data.X, data.Q, kMaxR, false);
+    }
+    if (data.X.rows() > 0) {
+        data.true_knn_mips = brute_force_knn(data.X, data.Q, kMaxR, true);
+    }
+    return data;
+}
+
+// fraction of queries whose true nearest neighbor is in the top R results
+void print_recall_and_qps(const std::string& algo, int nbytes,
+    const RowMatrix<int32_t>& true_knn,
+    const std::vector<std::vector<int64_t> >& found_knn, double t_ms)
+{
+    auto nqueries = true_knn.rows();
+    std::vector<int> Rs {1, 10, 100};
+    printf("%-12s, %2d", algo.c_str(), nbytes);
+    for (int R : Rs) {
+        int nhits = 0;
+        for (int i = 0; i < nqueries; i++) {
+            const auto& found = found_knn[i];
+            auto end = found.begin() + std::min((size_t)R, found.size());
+            nhits += std::find(found.begin(), end, true_knn(i, 0)) != end;
+        }
+        printf(", %6.4f", static_cast<double>(nhits) / nqueries);
+    }
+    printf(", %10.1f\n", nqueries * 1e3 / t_ms);
+}
+
+template<int Reduction>
+void _profile_ann_bolt(const AnnDataset& data, int nbytes) {
+    static constexpr int ncentroids = 16;
+    static constexpr bool mips = Reduction == Reductions::DotProd;
+    int ncodebooks = 2 * nbytes;
+    auto ncols = static_cast<int>(data.X.cols());
+    if (ncols % ncodebooks || ncols <= 2 * nbytes) { return; }
+
+    std::mt19937 gen(123);
+    auto centroids = learn_pq_centroids(data.X_train, ncodebooks,
+        ncentroids, gen);
+    BoltEncoder enc(nbytes);
+    enc.set_centroids(centroids.data(), centroids.rows(), centroids.cols());
+
+    auto ntrain_queries = std::min((int64_t)kNtrainQueries, (int64_t)data.X_train.rows());
+    RowMatrix<float> luts = pq_luts_f32<Reduction>(
+        data.X_train.topRows(ntrain_queries), centroids, ncentroids);
+    RowVector<float> offsets;
+    float scale = 1;
+    learn_lut_quantization(luts, offsets, scale);
+    enc.set_scale(scale);
+    enc.set_offsets(offsets.data(), ncodebooks);
+    enc.set_data(data.X.data(), data.X.rows(), data.X.cols());
+
+    auto nqueries = data.Q.rows();
+    std::vector<std::vector<int64_t> > found(nqueries);
+    double t_ms = 0;
+    {
+        EasyTimer _(t_ms);
+        for (int i = 0; i < nqueries; i++) {
+            found[i] = mips ? enc.knn_mips(data.Q.row(i).data(), ncols, kMaxR) :
+                enc.knn_l2(data.Q.row(i).data(), ncols, kMaxR);
+        }
+    }
+    print_recall_and_qps(mips ? "bolt mips" : "bolt l2", nbytes,
+        mips ? data.true_knn_mips : data.true_knn_l2, found, t_ms);
+}
+
+template<int Reduction>
+void _profile_ann_pq(const AnnDataset& data, int nbytes) {
+    static constexpr int ncentroids = 256;
+    static constexpr bool mips = Reduction == Reductions::DotProd;
+    int ncodebooks = nbytes;
+    auto ncols = static_cast<int>(data.X.cols());
+    if (ncols % ncodebooks) { return; }
+
+    std::mt19937 gen(123);
+    auto centroids_rowmajor = learn_pq_centroids(data.X_train, ncodebooks,
+        ncentroids, gen);
+    ColMatrix<float> centroids(ncentroids * ncodebooks, ncols / ncodebooks);
+    RowMatrix<uint8_t> codes(data.X.rows(), ncodebooks);
+    RowVector<float> lut(ncentroids * ncodebooks);
+    RowVector<float> dists(data.X.rows());
+    switch (ncodebooks) {
+        #define CASE(NBYTES)                                                \
+        case NBYTES:                                                        \
+            pq_encode_centroids_8b<NBYTES>(centroids_rowmajor.data(),       \
+                ncols, centroids.data());                                   \
+            pq_encode_8b<NBYTES>(data.X.data(), data.X.rows(), ncols,       \
+                centroids.data(), codes.data());                            \
+            break;
+        CASE(8); CASE(16); CASE(32);
+        #undef CASE
+        default: return;
+    }
+
+    auto nqueries = data.Q.rows();
+    std::vector<std::vector<int64_t> > found(nqueries);
+    double t_ms = 0;
+    {
+        EasyTimer _(t_ms);
+        for (int i = 0; i < nqueries; i++) {
+            switch (ncodebooks) {
+                #define CASE(NBYTES)                                        \
+                case NBYTES:                                                \
+                    pq_lut_8b<NBYTES, Reduction>(data.Q.row(i).data(),      \
+                        ncols, centroids.data(), lut.data());               \
+                    pq_scan_8b<NBYTES>(codes.data(), lut.data(),            \
+                        dists.data(), data.X.rows());                       \
+                    break;
+                CASE(8); CASE(16); CASE(32);
+                #undef CASE
+            }
+            auto idxs = topk_idxs(dists.data(), dists.size(), kMaxR, !mips);
+            found[i].assign(idxs.begin(), idxs.end());
+        }
+    }
+    print_recall_and_qps(mips ? "pq mips" : "pq l2", nbytes,
+        mips ? data.true_knn_mips : data.true_knn_l2, found, t_ms);
+}
+
+} // anon namespace
+
+TEST_CASE("ann recall vs qps", "[ann][bolt][pq][profile]") {
+    auto data = load_or_generate_dataset();
+    REQUIRE(data.X.rows() > 0);
+    REQUIRE(data.Q.rows() > 0);
+    REQUIRE(data.X.cols() == data.Q.cols());
+    REQUIRE(data.X_train.cols() == data.X.cols());
+    REQUIRE(data.true_knn_l2.rows() == data.Q.rows());
+
+    printf("dataset: %s, N=%lld, D=%lld, nqueries=%lld\n", data.name.c_str(),
+        (long long)data.X.rows(), (long long)data.X.cols(),
+        (long long)data.Q.rows());
+    printf("algo, nbytes, recall@1, recall@10, recall@100, queries/sec\n");
+
+    std::vector<int> all_nbytes {8, 16, 32};
+    for (auto b : all_nbytes) {
+        _profile_ann_bolt<Reductions::DistL2>(data, b);
+        _profile_ann_bolt<Reductions::DotProd>(data, b);
+        _profile_ann_pq<Reductions::DistL2>(data, b);
+        _profile_ann_pq<Reductions::DotProd>(data, b);
+    }
+}
@@ -1,11 +1,20 @@
 
 // #include "test_bolt.hpp"
 
+#include <functional>
 #include <string>
 
 #ifdef BLAZE
     #include "test/external/catch.hpp"
     #include "src/quantize/bolt.hpp"
+    #include "src/quantize/bolt_decode.hpp"
+    #include "src/quantize/bolt_filter.hpp"
+    #include "src/quantize/bolt_join.hpp"
+    #include "src/quantize/bolt_kmeans.hpp"
+    #include "src/quantize/bolt_pipeline.hpp"
+    #include "src/quantize/bolt_service.hpp"
+    #include "src/quantize/bolt_sharded.hpp"
+    #include "src/quantize/bolt_stream.hpp"
     #include "src/utils/debug_utils.hpp"
     #include "src/utils/eigen_utils.hpp"
     #include "src/utils/timing_utils.hpp"
@@ -14,6 +23,14 @@
 #else
     #include "catch.hpp"
     #include "bolt.hpp"
+    #include "bolt_decode.hpp"
+    #include "bolt_filter.hpp"
+    #include "bolt_join.hpp"
+    #include "bolt_kmeans.hpp"
+    #include "bolt_pipeline.hpp"
+    #include "bolt_service.hpp"
+    #include "bolt_sharded.hpp"
+    #include "bolt_stream.hpp"
     #include "debug_utils.hpp"
     #include "eigen_utils.hpp"
     #include "timing_utils.hpp"
@@ -31,6 +48,7 @@ static constexpr int64_t nrows_enc = 10*1000;   // number of rows to encode
 static constexpr int64_t nrows_lut = 10*1000;   // number of luts to create
 static constexpr int64_t nblocks_scan = 1000*1000 / 32;
 static constexpr int64_t nblocks_query = 100*1000 / 32;
+static constexpr int64_t nblocks_stream = 8*1000*1000 / 32;
 static constexpr int nqueries = 100;
 
 static constexpr int bits_per_codebook = 4;
@@ -120,6 +138,531 @@ TEST_CASE("bolt scan speed", "[bolt][scan][mcq][profile]") {
         dists_u16_safe.data(), nrows,
         bolt_scan<(M, true)>(
             codes.data(), luts.data(), dists_u16_safe.data(), nblocks));
+
+    // cosine sims, with row norms folded in as part of the scan
+    RowVector<float> inv_norms(nrows);
+    inv_norms.setRandom();
+    RowVector<float> sims(nrows);
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, "bolt scan cosine f32", kNtrials,
+        sims.data(), nrows,
+        bolt_scan_cosine<M>(codes.data(), luts.data(), inv_norms.data(),
+            128.f, 4.f, sims.data(), nblocks));
+    PERF_COUNTERS_REPORT();
+}
+
+template<int NBytes>
+static void _profile_long_code_scan(int64_t nblocks) {
+    auto nrows = nblocks * 32;
+    ColMatrix<uint8_t> codes(nrows, NBytes);
+    codes.setRandom();
+    ColMatrix<uint8_t> luts(ncentroids, 2 * NBytes);
+    luts.setRandom();
+    luts = luts.array() / (2 * NBytes);
+    RowVector<uint16_t> dists(nrows);
+    RowVector<uint16_t> dists_blocked(nrows);
+
+    auto suffix = std::string(" NBytes=") + std::to_string(NBytes) +
+        " nrows=" + std::to_string(nrows);
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, "bolt scan uint16 safe" + suffix,
+        kNtrials, dists.data(), nrows,
+        (bolt_scan<NBytes, true>(
+            codes.data(), luts.data(), dists.data(), nblocks)));
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps,
+        "bolt scan blocked uint16 safe" + suffix, kNtrials,
+        dists_blocked.data(), nrows,
+        (bolt_scan_blocked<NBytes, true>(
+            codes.data(), luts.data(), dists_blocked.data(), nblocks)));
+    REQUIRE(dists == dists_blocked);
+}
+
+TEST_CASE("bolt long code scan speed", "[bolt][scan][mcq][profile]") {
+    for (int64_t nblocks : {nblocks_query, nblocks_scan}) {
+        _profile_long_code_scan<16>(nblocks);
+        _profile_long_code_scan<32>(nblocks);
+        _profile_long_code_scan<64>(nblocks);
+    }
+}
+
+TEST_CASE("bolt stream scan speed", "[bolt][scan][stream][mcq][profile]") {
+    static constexpr int nblocks = nblocks_stream;
+    static constexpr int64_t nrows = nblocks * 32;
+    static constexpr int k = 10;
+    static constexpr int nqueries_stream = 4;
+
+    ColMatrix<uint8_t> codes(nrows, M);
+    codes.setRandom();
+    ColMatrix<uint8_t> luts(ncentroids, ncodebooks * nqueries_stream);
+    luts.setRandom();
+    luts = luts.array() / (2 * M);
+
+    // BOLT_STREAM_PATH lets this read from the disk you care about
+    const char* path_env = getenv("BOLT_STREAM_PATH");
+    std::string path = path_env ? path_env : "/tmp/bolt_profile_stream.bin";
+    REQUIRE(bolt_write_codes(path, codes.data(), nblocks, ncodebooks));
+    printf("bolt stream file: %s, %.1f MB\n", path.c_str(),
+        nrows * M / 1e6);
+
+    // in-memory scan + top k, for reference
+    RowVector<uint16_t> dists(nrows);
+    int64_t idx_sum = 0;  // so nothing is optimized away
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, "bolt in-memory knn", kNtrials,
+        dists.data(), nrows,
+        ([&]() {
+            bolt_scan(codes.data(), nblocks, ncodebooks, luts.data(),
+                dists.data());
+            BoltStreamTopk topk(k);
+            topk.add(dists.data(), nrows, 0);
+            idx_sum += topk.finish().idxs[0];
+        }()));
+
+    for (bool direct_io : {true, false}) {
+        BoltCodeReader reader(path, ncodebooks, kBoltStreamDefaultChunkNBytes,
+            direct_io);
+        REQUIRE(reader.ok());
+        for (int nq : {1, nqueries_stream}) {
+            auto name = std::string("bolt stream knn ") +
+                (reader.using_direct_io() ? "O_DIRECT" : "buffered") +
+                " nqueries=" + std::to_string(nq);
+            REPEATED_PROFILE_DIST_COMPUTATION(kNreps, name, kNtrials,
+                dists.data(), nrows,
+                idx_sum += bolt_stream_knn(reader, ncodebooks, luts.data(),
+                    nq, k)[0].idxs[0]);
+        }
+    }
+    printf("(ignore) %lld\n", (long long)idx_sum);
+    std::remove(path.c_str());
+}
+
+// best-of-ntrials time for fn, reported as code bytes scanned per second
+template<class F>
+static void _profile_scan_bandwidth(const std::string& name,
+    int64_t nbytes, F fn)
+{
+    double t_min = std::numeric_limits<double>::max();
+    for (int i = 0; i < kNtrials; i++) {
+        double t = 0;
+        {
+            EasyTimer _(t);
+            fn();
+        }
+        t_min = std::min(t, t_min);
+    }
+    printf("%-48s: %8.3f ms, %6.2f GB/s\n", name.c_str(), t_min,
+        nbytes / (t_min * 1e6));
+}
+
+TEST_CASE("bolt sharded scan speed", "[bolt][scan][numa][mcq][profile]") {
+    static constexpr int nblocks = nblocks_stream;
+    static constexpr int64_t nrows = nblocks * 32;
+    static constexpr int64_t nbytes = nrows * M;
+    static constexpr int k = 10;
+    int nnodes = numa_num_nodes();
+    int ncpus = static_cast<int>(std::thread::hardware_concurrency());
+    int threads_per_node = std::max(1, ncpus / nnodes);
+    printf("bolt sharded scan: %d NUMA node(s), %d cpu(s), %.1f MB of codes\n",
+        nnodes, ncpus, nbytes / 1e6);
+
+    ColMatrix<uint8_t> codes(nrows, M);
+    codes.setRandom();
+    ColMatrix<uint8_t> luts(ncentroids, ncodebooks);
+    luts.setRandom();
+    luts = luts.array() / (2 * M);
+
+    int64_t idx_sum = 0;  // so nothing is optimized away
+    _profile_scan_bandwidth("default alloc, 1 thread", nbytes, [&]() {
+        RowVector<uint16_t> dists(bolt_scan_tile_nblocks(ncodebooks) * 32);
+        std::vector<BoltStreamTopk> topks(1, BoltStreamTopk(k));
+        bolt_scan_topk(codes.data(), nblocks, 0, nrows, ncodebooks,
+            luts.data(), 1, topks, dists.data());
+        idx_sum += topks[0].finish().idxs[0];
+    });
+    for (auto pages : {PageKind::Small, PageKind::Huge1GB}) {
+        BoltShardedCodes sharded(codes.data(), nblocks, ncodebooks, -1, pages);
+        for (int nthreads : {1, threads_per_node}) {
+            auto name = std::string("sharded, ") + std::to_string(
+                sharded.nshards()) + " shard(s), " +
+                page_kind_name(sharded.shard_page_kind(0)) + " pages, " +
+                std::to_string(nthreads) + " thread(s)/shard";
+            BoltShardedScanner scanner(sharded, nthreads);
+            _profile_scan_bandwidth(name, nbytes, [&]() {
+                idx_sum += scanner.knn(luts.data(), 1, k)[0].idxs[0];
+            });
+            if (threads_per_node == 1) { break; }
+        }
+    }
+    printf("(ignore) %lld\n", (long long)idx_sum);
+}
+
+TEST_CASE("bolt query service load", "[bolt][service][mcq][profile]") {
+    static constexpr int nblocks = nblocks_query;
+    static constexpr int64_t nrows = nblocks * 32;
+    static constexpr int nrequests = 1000;
+
+    ColMatrix<float> centroids(ncentroids, ncols);
+    centroids.setRandom();
+    ColMatrix<uint8_t> codes(nrows, M);
+    codes.setRandom();
+    RowMatrix<float> Q(nqueries, ncols);
+    Q.setRandom();
+    RowVector<float> offsets(ncodebooks);
+    offsets.setZero();
+    float scaleby = 4;
+
+    BoltServiceConfig unbatched;
+    unbatched.max_batch_size = 1;
+    unbatched.max_wait_us = 0;
+    BoltServiceConfig batched;
+    batched.max_batch_size = 32;
+    batched.max_wait_us = 1000;
+
+    printf("%-24s, %9s, %9s, %8s, %8s, %6s\n", "bolt service config",
+        "offered", "qps", "p50_ms", "p99_ms", "batch");
+    for (double qps : {1000., 3000., 10000., 30000.}) {
+        for (const auto& config : {unbatched, batched}) {
+            BoltQueryService service(centroids.data(), ncols, codes.data(),
+                nblocks, ncodebooks, nrows, offsets.data(), scaleby, config);
+            auto stats = bolt_service_load_test(service, Q, qps, nrequests);
+            auto name = "batch<=" + std::to_string(config.max_batch_size) +
+                ", wait<=" + std::to_string(config.max_wait_us) + "us";
+            printf("%-24s, %9.0f, %9.0f, %8.3f, %8.3f, %6.2f\n",
+                name.c_str(), stats.offered_qps, stats.achieved_qps,
+                stats.p50_ms, stats.p99_ms, stats.mean_batch_size);
+        }
+    }
+}
+
+TEST_CASE("bolt query pipeline speed", "[bolt][pipeline][mcq][profile]") {
+    static constexpr int k = 10;
+    ColMatrix<float> centroids(ncentroids, ncols);
+    centroids.setRandom();
+    RowMatrix<float> Q(nqueries, ncols);
+    Q.setRandom();
+    RowVector<float> offsets(ncodebooks);
+    offsets.setZero();
+    float scaleby = 4;
+    int ncpus = static_cast<int>(std::thread::hardware_concurrency());
+
+    // fewer codes -> luts are a bigger fraction of the time
+    for (int64_t nblocks : {nblocks_query / 10, nblocks_query}) {
+        int64_t nrows = nblocks * 32;
+        ColMatrix<uint8_t> codes(nrows, M);
+        codes.setRandom();
+        printf("---- bolt pipeline, %lld codes, %d queries\n",
+            (long long)nrows, nqueries);
+        // only here so the timing macros count nrows * nqueries dists
+        RowVector<uint16_t> dists(nrows * nqueries);
+        dists.setZero();
+        int64_t idx_sum = 0;
+
+        REPEATED_PROFILE_DIST_COMPUTATION(kNreps, "sequential lut + scan",
+            kNtrials, dists.data(), nrows * nqueries,
+            ([&]() {
+                ColMatrix<uint8_t> lut(ncentroids, ncodebooks);
+                RowVector<uint16_t> tile_dists(
+                    bolt_scan_tile_nblocks(ncodebooks) * 32);
+                for (int i = 0; i < nqueries; i++) {
+                    bolt_lut(Q.row(i).data(), ncols, centroids.data(),
+                        ncodebooks, offsets.data(), scaleby, lut.data());
+                    std::vector<BoltStreamTopk> topks(1, BoltStreamTopk(k));
+                    bolt_scan_topk(codes.data(), nblocks, 0, nrows,
+                        ncodebooks, lut.data(), 1, topks, tile_dists.data());
+                    idx_sum += topks[0].finish().idxs[0];
+                }
+            }()));
+        for (int nscan_threads : {1, std::max(1, ncpus - 1)}) {
+            BoltPipelineConfig config;
+            config.k = k;
+            config.nscan_threads = nscan_threads;
+            BoltQueryPipeline pipeline(centroids.data(), ncols, codes.data(),
+                nblocks, ncodebooks, nrows, offsets.data(), scaleby, config);
+            auto name = "pipeline, 1 lut thread, " +
+                std::to_string(nscan_threads) + " scan thread(s)";
+            REPEATED_PROFILE_DIST_COMPUTATION(kNreps, name, kNtrials,
+                dists.data(), nrows * nqueries,
+                ([&]() {
+                    std::vector<std::future<BoltStreamNeighbors> > futures;
+                    for (int i = 0; i < nqueries; i++) {
+                        futures.push_back(pipeline.submit(Q.row(i).data()));
+                    }
+                    for (auto& f : futures) { idx_sum += f.get().idxs[0]; }
+                }()));
+            if (ncpus <= 2) { break; }
+        }
+        printf("(ignore) %lld\n", (long long)idx_sum);
+    }
+}
+
+TEST_CASE("bolt filtered knn speed", "[bolt][scan][filter][mcq][profile]") {
+    static constexpr int nblocks = nblocks_scan;
+    static constexpr int64_t nrows = nblocks * 32;
+    static constexpr int64_t nbytes = nrows * M;
+    static constexpr int k = 10;
+
+    ColMatrix<uint8_t> codes(nrows, M);
+    codes.setRandom();
+    ColMatrix<uint8_t> lut(ncentroids, ncodebooks);
+    lut.setRandom();
+    lut = lut.array() / (2 * M);
+    // scattered: passing rows spread uniformly; clustered: contiguous runs,
+    // as when rows are sorted by the filtered attribute
+    std::vector<uint16_t> scattered(nrows);
+    std::vector<uint16_t> clustered(nrows);
+    for (int64_t i = 0; i < nrows; i++) {
+        scattered[i] = static_cast<uint16_t>(rand() % 10000);
+        clustered[i] = static_cast<uint16_t>((i * 10000) / nrows);
+    }
+    BoltAttributeTable attrs(nrows);
+    auto scattered_col = attrs.add_column_u16(scattered.data());
+    auto clustered_col = attrs.add_column_u16(clustered.data());
+
+    int64_t idx_sum = 0;
+    for (double selectivity : {1., .1, .01, .001}) {
+        int hi = static_cast<int>(10000 * selectivity) - 1;
+        for (int col : {scattered_col, clustered_col}) {
+            auto masks = attrs.bitmap({{col, 0, hi}});
+            auto col_name = col == scattered_col ? "scattered" : "clustered";
+            BoltFilterStrategy chosen;
+            bolt_filtered_knn(codes.data(), nblocks, ncodebooks, lut.data(),
+                masks.data(), k, true, BoltFilterStrategy::Auto, &chosen);
+            printf("---- filter selectivity %g, %s; auto chooses %s\n",
+                selectivity, col_name, bolt_filter_strategy_name(chosen));
+            for (auto strategy : {BoltFilterStrategy::Scan,
+                    BoltFilterStrategy::SkipBlocks, BoltFilterStrategy::Gather})
+            {
+                auto name = std::string("filtered knn, ") +
+                    bolt_filter_strategy_name(strategy);
+                _profile_scan_bandwidth(name, nbytes, [&]() {
+                    auto res = bolt_filtered_knn(codes.data(), nblocks,
+                        ncodebooks, lut.data(), masks.data(), k, true,
+                        strategy);
+                    idx_sum += res.idxs.empty() ? 0 : res.idxs[0];
+                });
+            }
+        }
+    }
+    printf("(ignore) %lld\n", (long long)idx_sum);
+}
+
+TEST_CASE("bolt radius search speed", "[bolt][scan][radius][mcq][profile]") {
+    static constexpr int nblocks = nblocks_scan;
+    static constexpr int64_t nrows = nblocks * 32;
+    static constexpr int64_t nbytes = nrows * M;
+
+    ColMatrix<uint8_t> codes(nrows, M);
+    codes.setRandom();
+    ColMatrix<uint8_t> lut(ncentroids, ncodebooks);
+    lut.setRandom();
+    lut = lut.array() / (2 * M);
+    RowVector<uint16_t> dists(nrows);
+    bolt_scan(codes.data(), nblocks, ncodebooks, lut.data(), dists.data());
+    std::vector<uint16_t> sorted(dists.data(), dists.data() + nrows);
+    std::sort(sorted.begin(), sorted.end());
+
+    int64_t count_sum = 0;
+    for (double frac : {.5, .01, .0001}) {
+        auto thresh = sorted[static_cast<int64_t>(frac * (nrows - 1))];
+        printf("---- radius search, %g of codes within threshold\n", frac);
+        _profile_scan_bandwidth("scan, then filter dists", nbytes, [&]() {
+            bolt_scan(codes.data(), nblocks, ncodebooks, lut.data(),
+                      dists.data());
+            std::vector<int64_t> idxs;
+            for (int64_t i = 0; i < nrows; i++) {
+                if (dists(i) <= thresh) { idxs.push_back(i); }
+            }
+            count_sum += idxs.size();
+        });
+        _profile_scan_bandwidth("fused radius scan", nbytes, [&]() {
+            std::vector<int64_t> idxs;
+            bolt_scan_radius<true>(codes.data(), nblocks, ncodebooks,
+                lut.data(), thresh, nrows, idxs);
+            count_sum += idxs.size();
+        });
+    }
+    printf("(ignore) %lld\n", (long long)count_sum);
+}
+
+TEST_CASE("bolt self join speed", "[bolt][join][mcq][profile]") {
+    static constexpr int64_t nblocks = 32 * 1000 / 32;
+    static constexpr int64_t nrows = nblocks * 32;
+    static constexpr int k = 10;
+    ColMatrix<float> centroids(ncentroids, ncols);
+    centroids.setRandom();
+    ColMatrix<uint8_t> codes(nrows, M);
+    codes.setRandom();
+    BoltSymmetricTables tables(centroids.data(), ncols, ncodebooks);
+    int ncpus = static_cast<int>(std::thread::hardware_concurrency());
+
+    // rate in code pairs per second; the threshold join only scans about
+    // half the pairs, but we report it relative to all of them
+    auto report = [](const std::string& name, double t_ms) {
+        double pairs_per_sec = nrows * (double)nrows / (t_ms / 1e3);
+        double hours_10m = (1e7 * 1e7) / pairs_per_sec / 3600;
+        printf("%-40s: %8.1f ms, %6.2fG pairs/s, ~%.0f hours for 10M rows\n",
+            name.c_str(), t_ms, pairs_per_sec / 1e9, hours_10m);
+    };
+    int64_t sum = 0;
+    for (int nthreads : {1, ncpus}) {
+        auto suffix = ", " + std::to_string(nthreads) + " thread(s)";
+        double t_knn = std::numeric_limits<double>::max();
+        double t_join = std::numeric_limits<double>::max();
+        for (int trial = 0; trial < kNtrials; trial++) {
+            double t = 0;
+            {
+                EasyTimer _(t);
+                auto graph = bolt_knn_graph(codes.data(), nblocks, nrows,
+                    tables, k, nthreads);
+                sum += graph[0].idxs[0];
+            }
+            t_knn = std::min(t_knn, t);
+            {
+                EasyTimer _(t);
+                auto pairs = bolt_self_join(codes.data(), nblocks, nrows,
+                    tables, 2.f, nthreads);
+                sum += pairs.size();
+            }
+            t_join = std::min(t_join, t);
+        }
+        report("knn graph, k=10" + suffix, t_knn);
+        report("threshold join" + suffix, t_join);
+        if (ncpus == 1) { break; }
+    }
+    printf("(ignore) %lld\n", (long long)sum);
+}
+
+TEST_CASE("bolt kmeans speed", "[bolt][kmeans][mcq][profile]") {
+    static constexpr int64_t nblocks = 100 * 1000 / 32;
+    static constexpr int64_t nrows = nblocks * 32;
+    static constexpr int k = 64;
+    static constexpr int niters = 5;
+    ColMatrix<float> centroids(ncentroids, ncols);
+    centroids.setRandom();
+    ColMatrix<uint8_t> codes(nrows, M);
+    codes.setRandom();
+    RowVector<float> offsets(ncodebooks);
+    offsets.setZero();
+    float scaleby = 255.f / (4 * subvect_len);  // entries in [-1, 1]
+
+    // float baseline: Lloyd's iterations on the reconstructed data
+    RowMatrix<float> X(nrows, ncols);
+    for (int64_t i = 0; i < nrows; i++) {
+        auto block = codes.data() + (i / 32) * 32 * M;
+        for (int m = 0; m < ncodebooks; m++) {
+            auto byte = block[32 * (m / 2) + i % 32];
+            int code = (m % 2) ? byte >> 4 : byte & 0x0F;
+            for (int j = 0; j < subvect_len; j++) {
+                X(i, m * subvect_len + j) = centroids(code, m * subvect_len + j);
+            }
+        }
+    }
+    RowMatrix<float> init = X.topRows(k);
+
+    int64_t sum = 0;
+    double t_bolt = std::numeric_limits<double>::max();
+    double t_float = std::numeric_limits<double>::max();
+    for (int trial = 0; trial < kNtrials; trial++) {
+        double t = 0;
+        {
+            EasyTimer _(t);
+            auto res = bolt_kmeans(centroids.data(), ncols, codes.data(),
+                nblocks, ncodebooks, nrows, offsets.data(), scaleby, k,
+                niters, init.data());
+            sum += res.assignments[0] + res.niters;
+        }
+        t_bolt = std::min(t_bolt, t);
+        {
+            EasyTimer _(t);
+            RowMatrix<float> C = init;
+            RowMatrix<float> sums(k, ncols);
+            std::vector<int64_t> counts(k);
+            for (int it = 0; it < niters; it++) {
+                // argmin ||x - c||^2 = argmin ||c||^2 - 2 x.c
+                RowMatrix<float> prods = X * C.transpose();
+                RowVector<float> c_norms = C.rowwise().squaredNorm();
+                sums.setZero();
+                std::fill(counts.begin(), counts.end(), 0);
+                for (int64_t i = 0; i < nrows; i++) {
+                    int best;
+                    (c_norms - 2 * prods.row(i)).minCoeff(&best);
+                    sums.row(best) += X.row(i);
+                    counts[best]++;
+                }
+                for (int c = 0; c < k; c++) {
+                    if (counts[c]) { C.row(c) = sums.row(c) / counts[c]; }
+                }
+            }
+            sum += C(0, 0) > 0;
+        }
+        t_float = std::min(t_float, t);
+    }
+    printf("%-40s: %8.2f ms/iter\n", "bolt kmeans, k=64", t_bolt / niters);
+    printf("%-40s: %8.2f ms/iter\n", "float kmeans on decoded data, k=64",
+        t_float / niters);
+    printf("(ignore) %lld\n", (long long)sum);
+}
+
+TEST_CASE("bolt decode speed", "[bolt][decode][mcq][profile]") {
+    static constexpr int64_t nblocks = 100 * 1000 / 32;
+    static constexpr int64_t nrows = nblocks * 32;
+    static constexpr int64_t nidxs = 10 * 1000;
+    static constexpr int nsmall = 8;  // below the precomputed-dots cutoff
+    ColMatrix<float> centroids(ncentroids, ncols);
+    centroids.setRandom();
+    ColMatrix<uint8_t> codes(nrows, M);
+    codes.setRandom();
+    ColMatrix<float> centroids_pq(256, ncols);
+    centroids_pq.setRandom();
+    RowMatrix<uint8_t> codes_pq(nrows, ncodebooks);
+    codes_pq.setRandom();
+    RowMatrix<float> table(ncodebooks * ncentroids, subvect_len);
+    bolt_decode_table(centroids.data(), ncols, ncodebooks, table.data());
+    RowMatrix<float> table_pq(ncodebooks * 256, subvect_len);
+    pq_decode_table_8b(centroids_pq.data(), ncols, ncodebooks,
+                       table_pq.data());
+
+    std::vector<int64_t> idxs(nidxs);
+    for (auto& idx : idxs) { idx = rand() % nrows; }
+    RowVector<float> v(ncols);
+    v.setRandom();
+    RowMatrix<float> out(nrows, ncols);
+    RowVector<float> dots(nidxs);
+
+    auto report = [](const char* name, int64_t n, double t_ms) {
+        printf("%-40s: %8.3f ms, %7.1fM rows/s\n", name, t_ms,
+            n / (t_ms / 1e3) / 1e6);
+    };
+    auto best_time = [](std::function<void()> f) {
+        double best = std::numeric_limits<double>::max();
+        for (int trial = 0; trial < kNtrials; trial++) {
+            double t = 0;
+            { EasyTimer _(t); f(); }
+            best = std::min(best, t);
+        }
+        return best;
+    };
+    report("bolt decode all", nrows, best_time([&]() {
+        bolt_decode(codes.data(), nrows, ncodebooks, table.data(), ncols,
+            out.data()); }));
+    report("bolt decode random rows", nidxs, best_time([&]() {
+        bolt_decode_rows(codes.data(), ncodebooks, table.data(), ncols,
+            idxs.data(), nidxs, out.data()); }));
+    report("bolt decode+dot random rows", nidxs, best_time([&]() {
+        bolt_decode_dot(codes.data(), ncodebooks, table.data(), ncols,
+            idxs.data(), nidxs, v.data(), dots.data()); }));
+    report("bolt decode+dot, 8 rows at a time", nidxs, best_time([&]() {
+        for (int64_t i = 0; i < nidxs; i += nsmall) {
+            bolt_decode_dot(codes.data(), ncodebooks, table.data(), ncols,
+                idxs.data() + i, nsmall, v.data(), dots.data() + i);
+        } }));
+    report("pq decode all", nrows, best_time([&]() {
+        pq_decode_8b(codes_pq.data(), nrows, ncodebooks, table_pq.data(),
+            ncols, out.data()); }));
+    report("pq decode random rows", nidxs, best_time([&]() {
+        pq_decode_rows_8b(codes_pq.data(), ncodebooks, table_pq.data(), ncols,
+            idxs.data(), nidxs, out.data()); }));
+    report("pq decode+dot random rows", nidxs, best_time([&]() {
+        pq_decode_dot_8b(codes_pq.data(), ncodebooks, table_pq.data(), ncols,
+            idxs.data(), nidxs, v.data(), dots.data()); }));
+    printf("(ignore) %f\n", out(nidxs - 1, 0) + dots(nidxs - 1));
 }
 
 template<int M, bool Safe=false, class dist_t=void>
@@ -173,6 +716,7 @@ TEST_CASE("bolt query (lut + scan) speed", "[bolt][mcq][profile]") {
             (_run_query<M, true>(codes.data(), nblocks, Q.row(i).data(), ncols,
                 centroids.data(), luts.data(), dists.data()) ));
     }
+    PERF_COUNTERS_REPORT();
 }
 
 
@@ -9,11 +9,13 @@
 #ifdef BLAZE
     #include "src/quantize/bolt.hpp"
     #include "src/quantize/product_quantize.hpp"
+    #include "src/utils/sgemm.hpp"
     #include "test/quantize/amm_common.hpp"
 #else
     #include "bolt.hpp"
     #include "amm_common.hpp"
     #include "product_quantize.hpp"
+    #include "sgemm.hpp"
 #endif
 
 
@@ -69,6 +71,14 @@ void _profile_lut_mithral(int nrows, int ncols, int nbytes,
             (mithral_lut_dense(X.data(), nrows, ncols, ncodebooks,
                 centroids16.data(), offset, scale,
                 lut_f32_out.data(), lut_out.data())) );
+        // just the f32 products, X * centroids^T, as one big gemm
+        auto lut_ncols = ncodebooks * 16;
+        msg = string_with_format(fmt, "sgemm lut f32", -1.f);
+        REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+            lut_f32_out.data(), lut_f32_out.size(),
+            (sgemm(X.data(), centroids16.data(), lut_f32_out.data(),
+                nrows, ncols, lut_ncols, ncols, 1, lut_ncols, 1,
+                lut_ncols, 1)) );
     } else {
         msg = string_with_format(fmt, "mithral lut sparse", lut_work_const);
         REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
@@ -143,6 +153,51 @@ void _profile_lut_others(int nrows, int ncols, int nbytes) {
     }
 }
 
+void _profile_lut_mithral_large(int nrows, int ncols, int ncodebooks) {
+    ColMatrix<float> centroids16(ncodebooks*16, ncols); centroids16.setRandom();
+    RowMatrix<float> X(nrows, ncols);                   X.setRandom();
+    RowMatrix<uint8_t> lut_out(nrows, ncodebooks * 16); lut_out.setRandom();
+    RowMatrix<float> lut_f32_out(nrows, ncodebooks*16); lut_f32_out.setRandom();
+    float offset = 0.;
+    float scale = 1.;
+
+    std::string msg;
+    auto fmt_as_cppstring = string_with_format(
+        "%%-28s, N D C:, %7d, %4d, %3d,\t", nrows, ncols, ncodebooks);
+    auto fmt = fmt_as_cppstring.c_str();
+
+    msg = string_with_format(fmt, "mithral lut dense");
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+        lut_out.data(), lut_out.size(),
+        (mithral_lut_dense(X.data(), nrows, ncols, ncodebooks,
+            centroids16.data(), offset, scale,
+            lut_f32_out.data(), lut_out.data())) );
+    msg = string_with_format(fmt, "mithral lut blocked");
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+        lut_out.data(), lut_out.size(),
+        (mithral_lut_dense_parallel(X.data(), nrows, ncols, ncodebooks,
+            centroids16.data(), offset, scale,
+            lut_f32_out.data(), lut_out.data(), 1)) );
+    msg = string_with_format(fmt, "mithral lut blocked all threads");
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrials,
+        lut_out.data(), lut_out.size(),
+        (mithral_lut_dense_parallel(X.data(), nrows, ncols, ncodebooks,
+            centroids16.data(), offset, scale,
+            lut_f32_out.data(), lut_out.data(), -1)) );
+}
+
+// many lut rows, as for wide outputs; this is where lut creation stops
+// being negligible next to the scan
+TEST_CASE("mithral lut large M", "[amm][lut][mithral][profile]") {
+    for (int nrows : {1024, 8192}) {
+        for (int ncols : {64, 256, 1024}) {
+            for (int ncodebooks : {16, 64}) {
+                _profile_lut_mithral_large(nrows, ncols, ncodebooks);
+            }
+        }
+    }
+}
+
 TEST_CASE("vq lut timing", "[amm][lut][profile]") {
 //    static constexpr int nrows = 10 * 1024;
     static constexpr int nrows = 1 << 14;
@@ -1,6 +1,10 @@
+#include <memory>
+#include <random>
+
 
 #ifdef BLAZE
     #include "test/external/catch.hpp"
+    #include "src/quantize/hamming_index.hpp"
     #include "src/quantize/multi_codebook.hpp"
     #include "src/utils/bit_ops.hpp"
     #include "src/utils/memory.hpp"
@@ -9,6 +13,7 @@
 #else
     #include "catch.hpp"
     #include "bit_ops.hpp"
+    #include "hamming_index.hpp"
     #include "multi_codebook.hpp"
     #include "memory.hpp"
     #include "timing_utils.hpp"
@@ -31,6 +36,27 @@ static constexpr int M = 8;
 // static constexpr int M = 16;
 // static constexpr int M = 32;
 
+// hamming distances to NBytes-byte codes with each popcount backend
+template<int NBytes>
+void _profile_popcount_backends(const uint8_t* codes, const uint8_t* q,
+    uint8_t* dists, int64_t N)
+{
+    std::cout << "-------- popcount backends, " << NBytes << "B codes\n";
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, "scalar popcnt", kNtrials,
+        dists, N, dist::popcount_generic_scalar<NBytes>(codes, q, dists, N));
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, "avx2 nibble lut", kNtrials,
+        dists, N, (dist::popcount_generic<NBytes, PopcntAvx2>(
+            codes, q, dists, N)));
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, "avx2 harley-seal", kNtrials,
+        dists, N, (dist::popcount_generic<NBytes, PopcntHarleySeal>(
+            codes, q, dists, N)));
+#ifdef __AVX512VPOPCNTDQ__
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, "avx512 vpopcntdq", kNtrials,
+        dists, N, (dist::popcount_generic<NBytes, PopcntAvx512>(
+            codes, q, dists, N)));
+#endif
+}
+
 
 // TODO split this into smaller functions and also call from other test file
 TEST_CASE("popcnt_timing", "[mcq][profile][popcount]") {
@@ -142,6 +168,15 @@ TEST_CASE("popcnt_timing", "[mcq][profile][popcount]") {
         dists_popcnt, N,
         dist::popcount_generic<M>(codes, q, dists_popcnt, N));
 
+    // 1MB of codes for each code length, so that they stay in L2 and
+    // memory bandwidth doesn't hide differences between backends
+    static constexpr int64_t l2_nbytes = 1024 * 1024;
+    _profile_popcount_backends<8>(codes, q, dists_popcnt, l2_nbytes / 8);
+    _profile_popcount_backends<32>(codes, q, dists_popcnt, l2_nbytes / 32);
+    _profile_popcount_backends<128>(codes, q, dists_popcnt, l2_nbytes / 128);
+    _profile_popcount_backends<256>(codes, q, dists_popcnt, l2_nbytes / 256);
+    _profile_popcount_backends<1024>(codes, q, dists_popcnt, l2_nbytes / 1024);
+
 #ifdef PROFILE_4bit
 
     // scalar version takes 10x longer than vectorized version
@@ -425,3 +460,88 @@ TEST_CASE("popcnt_timing", "[mcq][profile][popcount]") {
     aligned_free(dists_unpack);
     aligned_free(dists_vertical32);
 }
+
+// k-NN among noisy copies of random centers; for queries near centers,
+// multi-index hashing should only touch a sliver of the rows, while for
+// random queries, auto should give up on it and scan
+template<int NBytes>
+void _profile_hamming_index(int64_t nrows, int k, bool near_centers=true) {
+    static constexpr int nwords = NBytes / 8;
+    static constexpr int ncenters = 1000;
+    static constexpr int nqueries = 50;
+    std::mt19937_64 rng(123);
+    std::vector<uint64_t> centers(ncenters * nwords);
+    for (auto& c : centers) { c = rng(); }
+    auto noisy_copy = [&](const uint64_t* center, uint64_t* out) {
+        for (int j = 0; j < nwords; j++) { out[j] = center[j]; }
+        auto nflips = rng() % (4 * nwords + 4);
+        for (size_t f = 0; f < nflips; f++) {
+            auto bit = rng() % (64 * nwords);
+            out[bit / 64] ^= uint64_t(1) << (bit % 64);
+        }
+    };
+    std::vector<uint64_t> codes(nrows * nwords);
+    for (int64_t i = 0; i < nrows; i++) {
+        noisy_copy(&centers[(rng() % ncenters) * nwords], &codes[i * nwords]);
+    }
+    std::vector<uint64_t> queries(nqueries * nwords);
+    for (int i = 0; i < nqueries; i++) {
+        if (near_centers) {
+            noisy_copy(&centers[i * nwords], &queries[i * nwords]);
+        } else {
+            for (int j = 0; j < nwords; j++) { queries[i * nwords + j] = rng(); }
+        }
+    }
+
+    double t_build = 0;
+    auto codes_u8 = reinterpret_cast<const uint8_t*>(codes.data());
+    std::unique_ptr<HammingIndex<NBytes> > index;
+    {
+        EasyTimer _(t_build);
+        index.reset(new HammingIndex<NBytes>(codes_u8, nrows));
+    }
+    printf("---- hamming index, %lld %dB codes, k = %d, %s queries: "
+           "%d substrings, built in %.1f ms\n", (long long)nrows, NBytes, k,
+           near_centers ? "near" : "random", index->nsubstrings(), t_build);
+
+    int64_t idx_sum = 0;
+    for (auto strategy : {HammingSearchStrategy::Auto,
+            HammingSearchStrategy::MultiIndex, HammingSearchStrategy::Scan})
+    {
+        // probing alone out to random queries' neighbors takes ages
+        if (!near_centers && strategy == HammingSearchStrategy::MultiIndex) {
+            continue;
+        }
+        int nmulti_index = 0;
+        double t_min = std::numeric_limits<double>::max();
+        for (int trial = 0; trial < kNtrials; trial++) {
+            double t = 0;
+            {
+                EasyTimer _(t);
+                for (int i = 0; i < nqueries; i++) {
+                    HammingSearchStrategy used;
+                    auto q = reinterpret_cast<const uint8_t*>(
+                        &queries[i * nwords]);
+                    auto res = index->knn(q, k, strategy, &used);
+                    idx_sum += res.idxs[0];
+                    nmulti_index += used == HammingSearchStrategy::MultiIndex;
+                }
+            }
+            t_min = std::min(t, t_min);
+        }
+        printf("%-12s: %8.3f ms/query; %2d / %d queries used multi-index\n",
+            hamming_search_strategy_name(strategy), t_min / nqueries,
+            nmulti_index / kNtrials, nqueries);
+    }
+    printf("(ignore) %lld\n", (long long)idx_sum);
+}
+
+TEST_CASE("hamming index knn speed", "[mcq][profile][popcount][hamming]") {
+    static constexpr int64_t nrows = 1000 * 1000;
+    _profile_hamming_index<8>(nrows, 10);
+    _profile_hamming_index<8>(nrows, 100);
+    _profile_hamming_index<16>(nrows, 10);
+    _profile_hamming_index<32>(nrows, 10);
+    _profile_hamming_index<8>(nrows, 10, false);
+    _profile_hamming_index<16>(nrows, 10, false);
+}
@@ -1,8 +1,10 @@
 
+#include <functional>
 #include <string>
 
 #ifdef BLAZE
     #include "test/external/catch.hpp"
+    #include "src/quantize/opq.hpp"
     #include "src/quantize/product_quantize.hpp"
     #include "src/utils/eigen_utils.hpp"
     #include "src/utils/timing_utils.hpp"
@@ -11,6 +13,7 @@
     #include "test/testing_utils/testing_utils.hpp"
 #else
     #include "catch.hpp"
+    #include "opq.hpp"
     #include "product_quantize.hpp"
     #include "eigen_utils.hpp"
     #include "timing_utils.hpp"
@@ -139,6 +142,72 @@ TEST_CASE("pq lut encoding speed", "[pq][mcq][profile]") {
 }
 #endif // PROFILE_ENCODE
 
+TEST_CASE("opq rotation speed", "[pq][opq][mcq][profile]") {
+    // high-dimensional, as for GIST1M; not a power of 2
+    static constexpr int D = 960;
+    static constexpr int opq_ncodebooks = 16;
+    static constexpr int block_sz = 16;  // as in learn_bopq()
+    static constexpr int64_t nrows = nrows_enc;
+    static constexpr int nluts = 1000;
+
+    ColMatrix<float> centroids(ncentroids, D);
+    centroids.setRandom();
+    RowMatrix<float> X(nrows, D);
+    X.setRandom();
+    RowMatrix<uint8_t> codes(nrows, opq_ncodebooks);
+    ColMatrix<float> luts(ncentroids * opq_ncodebooks, nluts);
+
+    RowMatrix<float> R(D, D);
+    R.setRandom();
+    std::vector<RowMatrix<float> > blocks(D / block_sz,
+        RowMatrix<float>::Identity(block_sz, block_sz));
+    DenseRotation dense(R);
+    BlockDiagonalRotation block_diag(blocks);
+    HadamardRotation hadamard(D);
+
+    auto profile = [&](const char* name, std::function<void()> f, int64_t n) {
+        double best = std::numeric_limits<double>::max();
+        for (int trial = 0; trial < kNtrials; trial++) {
+            double t = 0;
+            { EasyTimer _(t); f(); }
+            best = std::min(best, t);
+        }
+        printf("%-36s: %8.2f ms, %8.1f us/row\n", name, best, best * 1e3 / n);
+    };
+    RowMatrix<float> X_tmp(nrows, D);
+    profile("pq encode D=960 (no rotation)", [&]() {
+        pq_encode_8b(X.data(), nrows, D, opq_ncodebooks, centroids.data(),
+            codes.data()); }, nrows);
+    profile("opq encode, dense, untiled", [&]() {
+        opq_encode_8b(X, opq_ncodebooks, centroids.data(), R, X_tmp,
+            codes.data()); }, nrows);
+    profile("opq encode, dense, tiled", [&]() {
+        opq_encode_8b_tiled(X.data(), nrows, D, opq_ncodebooks,
+            centroids.data(), dense, codes.data()); }, nrows);
+    profile("opq encode, block diagonal, tiled", [&]() {
+        opq_encode_8b_tiled(X.data(), nrows, D, opq_ncodebooks,
+            centroids.data(), block_diag, codes.data()); }, nrows);
+    profile("opq encode, hadamard, tiled", [&]() {
+        opq_encode_8b_tiled(X.data(), nrows, D, opq_ncodebooks,
+            centroids.data(), hadamard, codes.data()); }, nrows);
+
+    RowMatrix<float> Q = X.topRows(nluts);
+    RowMatrix<float> Q_tmp(nluts, D);
+    profile("pq lut D=960 (no rotation)", [&]() {
+        pq_lut_8b(Q.data(), nluts, D, opq_ncodebooks, centroids.data(),
+            luts.data()); }, nluts);
+    profile("opq lut, dense, untiled", [&]() {
+        opq_lut_8b(Q, opq_ncodebooks, centroids.data(), R, Q_tmp,
+            luts.data()); }, nluts);
+    profile("opq lut, block diagonal, tiled", [&]() {
+        opq_lut_8b_tiled(Q.data(), nluts, D, opq_ncodebooks,
+            centroids.data(), block_diag, luts.data()); }, nluts);
+    profile("opq lut, hadamard, tiled", [&]() {
+        opq_lut_8b_tiled(Q.data(), nluts, D, opq_ncodebooks,
+            centroids.data(), hadamard, luts.data()); }, nluts);
+    printf("(ignore) %d %f\n", (int)codes(0, 0), luts(0, 0));
+}
+
 #ifdef PROFILE_SCAN
 TEST_CASE("pq scan speed", "[pq][mcq][profile]") {
     static constexpr int nrows = nrows_scan;
@@ -177,6 +246,7 @@ TEST_CASE("pq scan speed", "[pq][mcq][profile]") {
     REPEATED_PROFILE_DIST_COMPUTATION(kNreps, "pq scan float", kNtrials,
         dists_f.data(), nrows,
         pq_scan_8b<M>(codes.data(), luts_f.data(), dists_f.data(), nrows));
+    PERF_COUNTERS_REPORT();
 }
 #endif
 
@@ -267,6 +337,7 @@ TEST_CASE("pq query (lut + scan) speed", "[pq][mcq][profile]") {
             _run_query_opq<M>(codes.data(), nrows, Q.row(i),
                 centroids.data(), R, q_tmp, luts.data(), dists.data()) );
     }
+    PERF_COUNTERS_REPORT();
 }
 #endif //PROFILE_QUERY
 
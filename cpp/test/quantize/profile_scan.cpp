@@ -32,6 +32,13 @@ void _profile_scan_popcount(int nrows, int nbytes, int M=1) {
     REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg, kNtrialsScan,
         out.data(), out.size(),
         (bgemm(A.data(), B.data(), nrows, ncols, M, out.data()) ));
+
+    std::string msg_scalar(string_with_format(
+        "%-22s, N C B M:, %7d,  -1, %2d, %2d,\t", "popcount scan scalar",
+        nrows, nbytes, M));
+    REPEATED_PROFILE_DIST_COMPUTATION(kNreps, msg_scalar, kNtrialsScan,
+        out.data(), out.size(),
+        (_bgemm<1, 1>(A.data(), B.data(), nrows, ncols, M, out.data()) ));
 }
 
 TEST_CASE("popcnt scan timing", "[amm][scan][popcount][profile][old]") {
@@ -505,7 +512,7 @@ TEST_CASE("popcount scan timing", "[amm][scan][popcount][profile]") {
     // printf("algo, _0, N, B, _1, latency0, _2, latency1, _3, latency2, _4\n");
     printf("algo, _0, N, C, B, M, _1, latency0, _2, latency1, _3, latency2, _4,"
            " latency3, _5, latency4, _6\n");
-    std::vector<int> all_nbytes {8, 16, 32, 64};
+    std::vector<int> all_nbytes {8, 16, 32, 64, 128, 256};
     for (auto b : all_nbytes) {
         _profile_scan_popcount(nrows, b, nout);
     }
@@ -520,6 +527,7 @@ TEST_CASE("vq scan timing", "[amm][scan][profile]") {
         printf("------------------------ B = %d\n", b);
         _profile_scan(nrows, b, nout);
     }
+    PERF_COUNTERS_REPORT();
 }
 
 // 'old' tag so this this doesn't run by default; use [scan][all] to run this
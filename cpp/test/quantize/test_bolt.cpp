@@ -1,9 +1,24 @@
 
 
+#include <cmath>
+#include <limits>
+#include <stdlib.h>  // for mkdtemp
+#include <unistd.h>  // for rmdir, unlink
+
 #ifdef BLAZE
     #include "test/external/catch.hpp"
     #include "test/quantize/test_bolt.hpp"
     #include "src/include/public.hpp" // for Bolt wrapper class
+    #include "src/quantize/bolt_decode.hpp"
+    #include "src/quantize/bolt_filter.hpp"
+    #include "src/quantize/bolt_join.hpp"
+    #include "src/quantize/bolt_kmeans.hpp"
+    #include "src/quantize/bolt_pipeline.hpp"
+    #include "src/quantize/bolt_service.hpp"
+    #include "src/quantize/bolt_sharded.hpp"
+    #include "src/quantize/bolt_stream.hpp"
+    #include "src/quantize/opq.hpp"
+    #include "src/quantize/product_quantize.hpp"
     #include "src/utils/debug_utils.hpp"
     #include "src/utils/memory.hpp"
     #include "test/testing_utils/testing_utils.hpp"
@@ -11,6 +26,16 @@
     #include "catch.hpp"
     #include "test_bolt.hpp"
     #include "public.hpp" // for Bolt wrapper class
+    #include "bolt_decode.hpp"
+    #include "bolt_filter.hpp"
+    #include "bolt_join.hpp"
+    #include "bolt_kmeans.hpp"
+    #include "bolt_pipeline.hpp"
+    #include "bolt_service.hpp"
+    #include "bolt_sharded.hpp"
+    #include "bolt_stream.hpp"
+    #include "opq.hpp"
+    #include "product_quantize.hpp"
     #include "testing_utils.hpp"
     #include "debug_utils.hpp"
     #include "memory.hpp"
@@ -218,6 +243,147 @@ TEST_CASE("bolt_lut_l2", "[mcq][bolt]") {
     }
 }
 
+TEST_CASE("bolt_l1_cosine", "[mcq][bolt]") {
+    static constexpr int nbytes = 8;
+    static constexpr int l1_ncodebooks = 2 * nbytes;
+    static constexpr int l1_subvect_len = 4;
+    static constexpr int l1_ncols = l1_ncodebooks * l1_subvect_len;
+    static constexpr int nrows = 77;
+    static constexpr int k = 5;
+
+    RowMatrix<float> centroids(ncentroids * l1_ncodebooks, l1_subvect_len);
+    centroids.setRandom();
+    RowMatrix<float> X(nrows, l1_ncols);
+    X.setRandom();
+    X.row(3) *= 10;  // cosine sims shouldn't care about row norms
+    RowVector<float> q(l1_ncols);
+    q.setRandom();
+
+    BoltEncoder enc(nbytes);
+    enc.set_centroids(centroids.data(), centroids.rows(), centroids.cols());
+    enc.set_data(X.data(), nrows, l1_ncols);
+    auto codes = enc.codes();
+    auto code_at = [&codes](int i, int m) {  // bolt_encode's block layout
+        auto block = codes.data() + (i / 32) * 32 * nbytes;
+        auto byte = block[32 * (m / 2) + (i % 32)];
+        return m % 2 ? byte >> 4 : byte & 0x0F;
+    };
+    auto centroid_at = [&centroids](int m, int c, int j) {
+        return centroids(m * ncentroids + c, j);
+    };
+
+    RowVector<float> offsets(l1_ncodebooks);
+    float q_norm = q.norm();
+    std::vector<float> true_l1(nrows, 0), true_dot(nrows, 0);
+    for (int i = 0; i < nrows; i++) {
+        for (int m = 0; m < l1_ncodebooks; m++) {
+            auto c = code_at(i, m);
+            for (int j = 0; j < l1_subvect_len; j++) {
+                auto q_j = q(m * l1_subvect_len + j);
+                true_l1[i] += fabs(q_j - centroid_at(m, c, j));
+                true_dot[i] += q_j * centroid_at(m, c, j);
+            }
+        }
+    }
+
+    SECTION("l1") {
+        // each lut entry is at most 8, so this can't saturate
+        float scaleby = 20;
+        offsets.setConstant(3);
+        enc.set_scale(scaleby);
+        enc.set_offsets(offsets.data(), l1_ncodebooks);
+        auto dists = enc.dists_l1(q.data(), l1_ncols);
+        for (int i = 0; i < nrows; i++) {
+            auto expected = true_l1[i] * scaleby + offsets.sum();
+            CAPTURE(i);
+            REQUIRE(fabs(dists(i) - expected) <= .5 * l1_ncodebooks + 1e-3);
+        }
+    }
+    SECTION("cosine") {
+        // each lut entry is in [-2, 2], so this can't saturate
+        float scaleby = 50;
+        offsets.setConstant(128);
+        enc.set_scale(scaleby);
+        enc.set_offsets(offsets.data(), l1_ncodebooks);
+        auto sims = enc.cosine_sims(q.data(), l1_ncols);
+        for (int i = 0; i < nrows; i++) {
+            auto expected = true_dot[i] / (q_norm * X.row(i).norm());
+            auto tol = (.5f * l1_ncodebooks / scaleby) / X.row(i).norm();
+            CAPTURE(i);
+            REQUIRE(fabs(sims(i) - expected) <= tol + 1e-4);
+        }
+    }
+
+    SECTION("knn") {
+        offsets.setConstant(128);
+        enc.set_scale(50);
+        enc.set_offsets(offsets.data(), l1_ncodebooks);
+        auto sims = enc.cosine_sims(q.data(), l1_ncols);
+        auto dists = enc.dists_l1(q.data(), l1_ncols);
+        std::vector<std::pair<float, int64_t> > by_sim, by_l1;
+        for (int i = 0; i < nrows; i++) {
+            by_sim.emplace_back(-sims(i), i);
+            by_l1.emplace_back(dists(i), i);
+        }
+        std::sort(by_sim.begin(), by_sim.end());
+        std::sort(by_l1.begin(), by_l1.end());
+        auto knn_sim = enc.knn_cosine(q.data(), l1_ncols, k);
+        auto knn_l1 = enc.knn_l1(q.data(), l1_ncols, k);
+        REQUIRE(knn_sim.size() == k);
+        for (int i = 0; i < k; i++) {
+            CAPTURE(i);
+            REQUIRE(knn_sim[i] == by_sim[i].second);
+            REQUIRE(dists(knn_l1[i]) == by_l1[i].first);
+        }
+        REQUIRE(enc.knn_cosine(q.data(), l1_ncols, 0).empty());
+        REQUIRE(enc.knn_cosine(q.data(), l1_ncols, -1).empty());
+        REQUIRE(enc.knn_cosine(q.data(), l1_ncols, nrows + 10).size() == nrows);
+    }
+
+    SECTION("pq") {
+        static constexpr int pq_ncodebooks = 4;
+        static constexpr int pq_subvect_len = l1_ncols / pq_ncodebooks;
+        ColMatrix<float> pq_centroids(256, pq_ncodebooks * pq_subvect_len);
+        pq_centroids.setRandom();
+        ColMatrix<float> lut_l1(256, pq_ncodebooks);
+        ColMatrix<float> lut_cos(256, pq_ncodebooks);
+        pq_lut_8b<Reductions::DistL1>(q.data(), 1, l1_ncols, pq_ncodebooks,
+            pq_centroids.data(), lut_l1.data());
+        pq_lut_8b<Reductions::CosineSim>(q.data(), 1, l1_ncols, pq_ncodebooks,
+            pq_centroids.data(), lut_cos.data());
+        for (int m = 0; m < pq_ncodebooks; m++) {
+            for (int c = 0; c < 256; c++) {
+                float l1 = 0, dot = 0;
+                for (int j = 0; j < pq_subvect_len; j++) {
+                    auto q_j = q(m * pq_subvect_len + j);
+                    auto c_j = pq_centroids(c, m * pq_subvect_len + j);
+                    l1 += fabs(q_j - c_j);
+                    dot += q_j * c_j;
+                }
+                CAPTURE(m);
+                CAPTURE(c);
+                REQUIRE(fabs(lut_l1(c, m) - l1) < 1e-4);
+                REQUIRE(fabs(lut_cos(c, m) - dot / q_norm) < 1e-4);
+            }
+        }
+
+        RowMatrix<uint8_t> pq_codes(nrows, pq_ncodebooks);
+        pq_codes.setRandom();
+        RowVector<float> inv_norms(nrows);
+        bolt_inv_row_norms(X.data(), nrows, l1_ncols, inv_norms.data());
+        RowVector<float> sims(nrows);
+        pq_scan_8b_cosine(pq_codes.data(), nrows, pq_ncodebooks,
+            lut_cos.data(), inv_norms.data(), sims.data());
+        for (int i = 0; i < nrows; i++) {
+            float dot = 0;
+            for (int m = 0; m < pq_ncodebooks; m++) {
+                dot += lut_cos(pq_codes(i, m), m);
+            }
+            REQUIRE(fabs(sims(i) - dot / X.row(i).norm()) < 1e-4);
+        }
+    }
+}
+
 void check_encoding(int nrows, const ColMatrix<uint8_t>& encoding_out) {
 
     // number of rows in output must be a multiple of 32, and >32 would
@@ -350,3 +516,1217 @@ TEST_CASE("bolt_scan", "[mcq][bolt]") {
 //        printf("checked bolt wrapper scan\n");  // TODO rm
     }
 }
+
+template<int NBytes, bool NoOverflow, bool SignedLUTs>
+void check_bolt_scan_blocked(int64_t nblocks) {
+    auto nrows = nblocks * 32;
+    ColMatrix<uint8_t> codes(nrows, NBytes);
+    codes.setRandom();
+    // big entries, so that both the uint8 pair sums and the uint16
+    // totals saturate for some rows
+    ColMatrix<uint8_t> luts(ncentroids, 2 * NBytes);
+    luts.setRandom();
+    RowVector<uint16_t> ans(nrows);
+    RowVector<uint16_t> dists(nrows);
+    bolt_scan<NBytes, NoOverflow, SignedLUTs, false>(
+        codes.data(), luts.data(), ans.data(), nblocks);
+    bolt_scan_blocked<NBytes, NoOverflow, SignedLUTs, false>(
+        codes.data(), luts.data(), dists.data(), nblocks);
+    CAPTURE(NBytes);
+    CAPTURE(NoOverflow);
+    CAPTURE(SignedLUTs);
+    CAPTURE(nblocks);
+    REQUIRE(dists == ans);
+}
+
+TEST_CASE("bolt_scan_blocked", "[mcq][bolt]") {
+    // tiles of 8 blocks, groups of 4 bytes; include partial ones
+    for (int64_t nblocks : {1, 8, 19}) {
+        check_bolt_scan_blocked<5, true, false>(nblocks);
+        check_bolt_scan_blocked<32, true, false>(nblocks);
+        check_bolt_scan_blocked<32, false, false>(nblocks);
+        check_bolt_scan_blocked<64, true, false>(nblocks);
+        check_bolt_scan_blocked<64, false, true>(nblocks);
+        check_bolt_scan_blocked<64, true, true>(nblocks);
+    }
+
+    SECTION("wrapper") {
+        static constexpr int64_t nblocks = 11;
+        static constexpr int nbytes = 64;
+        ColMatrix<uint8_t> codes(nblocks * 32, nbytes);
+        codes.setRandom();
+        ColMatrix<uint8_t> luts(ncentroids, 2 * nbytes);
+        luts.setRandom();
+        luts = luts.array() / 64;
+        RowVector<uint16_t> ans(nblocks * 32);
+        RowVector<uint16_t> dists(nblocks * 32);
+        bolt_scan<nbytes, true>(codes.data(), luts.data(), ans.data(), nblocks);
+        bolt_scan(codes.data(), nblocks, 2 * nbytes, luts.data(), dists.data());
+        REQUIRE(dists == ans);
+        // and by hand, for the first block, which is column-major
+        for (int i = 0; i < 32; i++) {
+            int dist = 0;
+            for (int j = 0; j < nbytes; j++) {
+                auto code = codes.data()[32 * j + i];
+                dist += luts(code & 0x0F, 2 * j) + luts(code >> 4, 2 * j + 1);
+            }
+            CAPTURE(i);
+            REQUIRE(ans(i) == dist);
+        }
+    }
+}
+
+TEST_CASE("bolt scan telemetry", "[mcq][bolt][telemetry]") {
+    static constexpr int nblocks = 7;
+    static constexpr int nrows = 32 * nblocks;
+    static constexpr int nbytes = 8;
+    ColMatrix<uint8_t> codes(nrows, nbytes);
+    codes.setRandom();
+    ColMatrix<uint8_t> luts(ncentroids, 2 * nbytes);
+    luts.setRandom();
+    luts = luts.array() / 5 * 3;  // so that only some pair sums saturate
+
+    // rows whose uint8 total saturates, and rows where any of the uint8 pair
+    // sums in the !NoOverflow uint16 scans do; codes are column-major
+    int64_t nclipped8 = 0;
+    int64_t nclipped_pairs = 0;
+    for (int i = 0; i < nrows; i++) {
+        int block = i / 32;
+        int dist = 0;
+        bool pair_clipped = false;
+        for (int j = 0; j < nbytes; j++) {
+            auto code = codes.data()[32 * (block * nbytes + j) + (i % 32)];
+            int pair = luts(code & 0x0F, 2 * j) + luts(code >> 4, 2 * j + 1);
+            pair_clipped = pair_clipped || pair >= 255;
+            dist += pair;
+        }
+        nclipped8 += dist >= 255;
+        nclipped_pairs += pair_clipped;
+    }
+    REQUIRE(nclipped8 > nclipped_pairs);
+    REQUIRE(nclipped_pairs > 0);
+
+    RowVector<uint8_t> dists8(nrows);
+    RowVector<uint16_t> dists16(nrows);
+    auto check_counts = [&](int64_t expected_nclipped) {
+        auto counts = scan_telemetry::query_counts();
+        if (kScanTelemetry) {
+            REQUIRE(counts.nrows == nrows);
+            REQUIRE(counts.nclipped == expected_nclipped);
+            REQUIRE(counts.clipped_frac() ==
+                Approx(static_cast<double>(expected_nclipped) / nrows));
+        } else {
+            REQUIRE(counts.nrows == 0);
+        }
+        scan_telemetry::begin_query();
+    };
+
+    scan_telemetry::reset();
+    bolt_scan<nbytes, false, false, false>(
+        codes.data(), luts.data(), dists8.data(), nblocks);
+    check_counts(nclipped8);
+    bolt_scan<nbytes, false, false, false>(
+        codes.data(), luts.data(), dists16.data(), nblocks);
+    check_counts(nclipped_pairs);
+    bolt_scan_blocked<nbytes, false, false, false>(
+        codes.data(), luts.data(), dists16.data(), nblocks);
+    check_counts(nclipped_pairs);
+    // no uint16 total of 8 bytes' worth of uint8s can saturate
+    bolt_scan<nbytes, true, false, false>(
+        codes.data(), luts.data(), dists16.data(), nblocks);
+    check_counts(0);
+
+    auto totals = scan_telemetry::total_counts();
+    if (kScanTelemetry) {
+        REQUIRE(totals.nrows == 4 * nrows);
+        REQUIRE(totals.nclipped == nclipped8 + 2 * nclipped_pairs);
+    }
+    scan_telemetry::reset();
+    REQUIRE(scan_telemetry::total_counts().nrows == 0);
+}
+
+// random codes, laid out in blocks as by bolt_encode(), and LUTs for
+// nqueries queries with entries small enough that no uint16 sum saturates
+struct BoltKnnFixture {
+    BoltKnnFixture(int64_t nblocks, int nbytes, int nqueries=1):
+        ncodebooks(2 * nbytes), codes(32 * nblocks, nbytes),
+        luts(ncentroids, 2 * nbytes * nqueries)
+    {
+        codes.setRandom();
+        luts.setRandom();
+        luts = luts.array() / 8;
+    }
+    int ncodebooks;
+    RowMatrix<uint8_t> codes;
+    ColMatrix<uint8_t> luts;
+};
+
+// a path in a fresh temp directory, so that concurrent test runs don't
+// collide; the file and directory are removed when this goes out of scope
+class TempPath {
+public:
+    explicit TempPath(const std::string& name) {
+        char dir_template[] = "/tmp/bolt_test_XXXXXX";
+        REQUIRE(mkdtemp(dir_template) != nullptr);
+        _dir = dir_template;
+        _path = _dir + "/" + name;
+    }
+    ~TempPath() {
+        unlink(_path.c_str());
+        rmdir(_dir.c_str());
+    }
+    TempPath(const TempPath&) = delete;
+    TempPath& operator=(const TempPath&) = delete;
+
+    const std::string& str() const { return _path; }
+private:
+    std::string _dir;
+    std::string _path;
+};
+
+// checks knn results against sorting the dists from a full in-memory scan
+static void check_bolt_knn(const std::vector<BoltStreamNeighbors>& results,
+    const uint8_t* codes, int64_t nblocks, int ncodebooks,
+    const uint8_t* luts, int64_t ncodes, int k, bool smaller_better)
+{
+    auto nrows = nblocks * 32;
+    for (size_t q = 0; q < results.size(); q++) {
+        RowVector<uint16_t> dists(nrows);
+        bolt_scan(codes, nblocks, ncodebooks,
+            luts + q * ncodebooks * ncentroids, dists.data());
+        std::vector<std::pair<int, int64_t> > sorted;
+        for (int64_t i = 0; i < ncodes; i++) {
+            auto d = smaller_better ? dists(i) : -dists(i);
+            sorted.emplace_back(d, i);
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        const auto& res = results[q];
+        REQUIRE(res.idxs.size() == k);
+        for (int i = 0; i < k; i++) {
+            CAPTURE(smaller_better);
+            CAPTURE(q);
+            CAPTURE(i);
+            REQUIRE(res.idxs[i] == sorted[i].second);
+            REQUIRE(res.dists[i] == dists(res.idxs[i]));
+        }
+    }
+}
+
+TEST_CASE("bolt_scan_radius", "[mcq][bolt][radius]") {
+    static constexpr int nblocks = 37;
+    static constexpr int nrows = 32 * nblocks;
+    static constexpr int64_t ncodes = nrows - 9;
+
+    for (int nbytes : {8, 24}) {
+        BoltKnnFixture fixture(nblocks, nbytes);
+        int radius_ncodebooks = fixture.ncodebooks;
+        const auto& codes = fixture.codes;
+        const auto& lut = fixture.luts;
+        RowVector<uint16_t> dists(nrows);
+        bolt_scan(codes.data(), nblocks, radius_ncodebooks, lut.data(),
+                  dists.data());
+        auto max_dist = dists.head(ncodes).maxCoeff();
+
+        for (double thresh : {-1., 0., 100., 300.5, 600., 70000.}) {
+            CAPTURE(nbytes);
+            CAPTURE(thresh);
+            std::vector<int64_t> within_l2, within_mips;
+            bolt_scan_radius<true>(codes.data(), nblocks, radius_ncodebooks,
+                lut.data(), thresh, ncodes, within_l2);
+            bolt_scan_radius<false>(codes.data(), nblocks, radius_ncodebooks,
+                lut.data(), thresh, ncodes, within_mips);
+            std::vector<int64_t> expected_l2, expected_mips;
+            for (int64_t i = 0; i < ncodes; i++) {
+                if (dists(i) <= thresh) { expected_l2.push_back(i); }
+                if (dists(i) >= thresh) { expected_mips.push_back(i); }
+            }
+            REQUIRE(within_l2 == expected_l2);
+            REQUIRE(within_mips == expected_mips);
+        }
+        // appends to what's already there, like emplace_back would
+        std::vector<int64_t> all(1, -1);
+        bolt_scan_radius<true>(codes.data(), nblocks, radius_ncodebooks,
+            lut.data(), max_dist, ncodes, all);
+        REQUIRE(all.size() == ncodes + 1);
+        REQUIRE(all[0] == -1);
+        REQUIRE(all.back() == ncodes - 1);
+    }
+
+    SECTION("wrapper") {
+        static constexpr int wrapper_ncodes = 100;
+        RowMatrix<uint8_t> codes(wrapper_ncodes, ncodebooks);
+        codes.setRandom();
+        codes = codes.array() / 16;
+        BoltEncoder enc(M);
+        RowMatrix<float> centroids = create_rowmajor_centroids(1).cast<float>();
+        enc.set_centroids(centroids.data(), centroids.rows(), centroids.cols());
+        enc.set_codes(codes);
+        RowVector<float> q = create_bolt_query();
+        int len = static_cast<int>(q.size());
+
+        // offsets and scale apply to the threshold just like to the LUTs
+        RowVector<float> offsets(ncodebooks);
+        offsets.setConstant(2);
+        enc.set_offsets(offsets.data(), ncodebooks);
+        enc.set_scale(.5);
+        float total_offset = offsets.sum();
+
+        auto dists = enc.dists_sq(q.data(), len);
+        auto prods = enc.dot_prods(q.data(), len);
+        auto median = [](RowVector<uint16_t> x) {
+            std::vector<uint16_t> v(x.data(), x.data() + wrapper_ncodes);
+            std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+            return static_cast<float>(v[v.size() / 2]);
+        };
+        auto dist_thresh = median(dists);
+        auto prod_thresh = median(prods);
+        auto within_l2 = enc.radius_l2(q.data(), len,
+            (dist_thresh - total_offset) / .5f);
+        auto within_mips = enc.radius_mips(q.data(), len,
+            (prod_thresh - total_offset) / .5f);
+
+        std::vector<int64_t> expected_l2, expected_mips;
+        for (int64_t i = 0; i < wrapper_ncodes; i++) {
+            if (dists(i) <= dist_thresh) { expected_l2.push_back(i); }
+            if (prods(i) >= prod_thresh) { expected_mips.push_back(i); }
+        }
+        REQUIRE(expected_l2.size() >= wrapper_ncodes / 2);
+        REQUIRE(within_l2 == expected_l2);
+        REQUIRE(within_mips == expected_mips);
+    }
+}
+
+TEST_CASE("bolt_stream_knn", "[mcq][bolt][stream]") {
+    static constexpr int nbytes = 16;
+    static constexpr int nblocks = 1000;
+    static constexpr int nrows = 32 * nblocks;
+    static constexpr int nqueries = 3;
+    static constexpr int k = 10;
+    // not a multiple of 32, so the last block has padding rows to ignore
+    static constexpr int64_t ncodes = nrows - 7;
+
+    BoltKnnFixture fixture(nblocks, nbytes, nqueries);
+    int stream_ncodebooks = fixture.ncodebooks;
+    const auto& codes = fixture.codes;
+    const auto& luts = fixture.luts;
+
+    TempPath tmp("codes.bin");
+    const auto& path = tmp.str();
+    REQUIRE(bolt_write_codes(path, codes.data(), nblocks, stream_ncodebooks));
+
+    // small chunks so that there are many of them and a partial last one
+    for (bool direct_io : {true, false}) {
+        for (bool smaller_better : {true, false}) {
+            CAPTURE(direct_io);
+            BoltCodeReader reader(path, stream_ncodebooks, 20 * 1024, direct_io);
+            REQUIRE(reader.ok());
+            REQUIRE(reader.nblocks() == nblocks);
+            REQUIRE(reader.chunk_nblocks() < nblocks);
+            auto results = bolt_stream_knn(reader, stream_ncodebooks,
+                luts.data(), nqueries, k, ncodes, smaller_better);
+            REQUIRE(results.size() == nqueries);
+            check_bolt_knn(results, codes.data(), nblocks, stream_ncodebooks,
+                luts.data(), ncodes, k, smaller_better);
+        }
+    }
+
+    // k = 0 finds nothing, rather than tripping over an empty top k
+    {
+        BoltCodeReader reader(path, stream_ncodebooks, 20 * 1024, false);
+        REQUIRE(reader.ok());
+        auto results = bolt_stream_knn(reader, stream_ncodebooks,
+            luts.data(), nqueries, 0, ncodes);
+        REQUIRE(results.size() == nqueries);
+        for (const auto& res : results) {
+            REQUIRE(res.idxs.empty());
+            REQUIRE(res.dists.empty());
+        }
+    }
+
+    // a file that shrinks after it's opened makes later reads come up short,
+    // which is an error, not the end of the codes
+    for (bool direct_io : {true, false}) {
+        CAPTURE(direct_io);
+        BoltCodeReader reader(path, stream_ncodebooks, 20 * 1024, direct_io);
+        REQUIRE(reader.ok());
+        REQUIRE(truncate(path.c_str(), nblocks * 32 * nbytes / 2) == 0);
+        auto results = bolt_stream_knn(reader, stream_ncodebooks,
+            luts.data(), nqueries, k, ncodes);
+        REQUIRE(reader.error());
+        REQUIRE(results.empty());
+        REQUIRE(bolt_write_codes(
+            path, codes.data(), nblocks, stream_ncodebooks));
+    }
+}
+
+TEST_CASE("bolt_sharded_knn", "[mcq][bolt][numa]") {
+    static constexpr int nbytes = 8;
+    static constexpr int nblocks = 777;
+    static constexpr int nrows = 32 * nblocks;
+    static constexpr int nqueries = 2;
+    static constexpr int k = 5;
+    static constexpr int64_t ncodes = nrows - 3;
+
+    BoltKnnFixture fixture(nblocks, nbytes, nqueries);
+    int sharded_ncodebooks = fixture.ncodebooks;
+    const auto& codes = fixture.codes;
+    const auto& luts = fixture.luts;
+
+    // more shards than this machine likely has nodes, to exercise merging
+    for (auto pages : {PageKind::Small, PageKind::Huge2MB}) {
+        BoltShardedCodes sharded(codes.data(), nblocks, sharded_ncodebooks,
+            3, pages);
+        REQUIRE(sharded.ok());
+        REQUIRE(sharded.nshards() == 3);
+        int64_t nblocks_total = 0;
+        for (int s = 0; s < sharded.nshards(); s++) {
+            REQUIRE(sharded.shard_first_block(s) == nblocks_total);
+            nblocks_total += sharded.shard_nblocks(s);
+        }
+        REQUIRE(nblocks_total == nblocks);
+        for (bool smaller_better : {true, false}) {
+            auto results = bolt_sharded_knn(sharded, luts.data(), nqueries, k,
+                ncodes, smaller_better, 2 /*threads per shard*/);
+            REQUIRE(results.size() == nqueries);
+            check_bolt_knn(results, codes.data(), nblocks, sharded_ncodebooks,
+                luts.data(), ncodes, k, smaller_better);
+        }
+
+        // one pool answering many batches, of different sizes (so the
+        // workers' lut buffers grow), including from several threads at once
+        BoltShardedScanner scanner(sharded, 2);
+        REQUIRE(scanner.nworkers() == 2 * sharded.nshards());
+        for (int rep = 0; rep < 3; rep++) {
+            for (int nq : {1, nqueries}) {
+                auto results = scanner.knn(luts.data(), nq, k, ncodes);
+                REQUIRE(results.size() == nq);
+                check_bolt_knn(results, codes.data(), nblocks,
+                    sharded_ncodebooks, luts.data(), ncodes, k, true);
+            }
+        }
+        std::vector<std::vector<BoltStreamNeighbors> > thread_results(4);
+        std::vector<std::thread> threads;
+        for (auto& results : thread_results) {
+            threads.emplace_back([&]() {
+                results = scanner.knn(luts.data(), nqueries, k, ncodes, false);
+            });
+        }
+        for (auto& t : threads) { t.join(); }
+        for (const auto& results : thread_results) {
+            REQUIRE(results.size() == nqueries);
+            check_bolt_knn(results, codes.data(), nblocks, sharded_ncodebooks,
+                luts.data(), ncodes, k, false);
+        }
+    }
+}
+
+// each query's LUT + scan + top k on its own, for checking the services
+static std::vector<BoltStreamNeighbors> bolt_knn_one_at_a_time(
+    const RowMatrix<float>& Q, const ColMatrix<float>& centroids,
+    const uint8_t* codes, int64_t nblocks, int ncodebooks, int64_t ncodes,
+    const RowVector<float>& offsets, float scaleby, int k, bool mips)
+{
+    std::vector<BoltStreamNeighbors> ret;
+    ColMatrix<uint8_t> lut(ncentroids, ncodebooks);
+    RowVector<uint16_t> dists(bolt_scan_tile_nblocks(ncodebooks) * 32);
+    for (int i = 0; i < Q.rows(); i++) {
+        if (mips) {
+            bolt_lut<Reductions::DotProd>(Q.row(i).data(), (int)Q.cols(),
+                centroids.data(), ncodebooks, offsets.data(), scaleby,
+                lut.data());
+        } else {
+            bolt_lut<Reductions::DistL2>(Q.row(i).data(), (int)Q.cols(),
+                centroids.data(), ncodebooks, offsets.data(), scaleby,
+                lut.data());
+        }
+        std::vector<BoltStreamTopk> topks(1, BoltStreamTopk(k, !mips));
+        bolt_scan_topk(codes, nblocks, 0, ncodes, ncodebooks, lut.data(), 1,
+            topks, dists.data());
+        ret.push_back(topks[0].finish());
+    }
+    return ret;
+}
+
+TEST_CASE("bolt_query_service", "[mcq][bolt][service]") {
+    static constexpr int nbytes = 8;
+    static constexpr int service_ncodebooks = 2 * nbytes;
+    static constexpr int service_ncols = 4 * service_ncodebooks;
+    static constexpr int nblocks = 100;
+    static constexpr int64_t ncodes = 32 * nblocks - 5;
+    static constexpr int nqueries = 20;
+
+    ColMatrix<float> centroids(ncentroids, service_ncols);
+    centroids.setRandom();
+    RowMatrix<uint8_t> codes(32 * nblocks, nbytes);
+    codes.setRandom();
+    RowMatrix<float> Q(nqueries, service_ncols);
+    Q.setRandom();
+    RowVector<float> offsets(service_ncodebooks);
+    offsets.setConstant(40);
+    float scaleby = 8;
+
+    for (bool mips : {false, true}) {
+        BoltServiceConfig config;
+        config.k = 7;
+        config.max_batch_size = 8;
+        config.max_wait_us = 2000;
+        config.mips = mips;
+
+        auto expected = bolt_knn_one_at_a_time(Q, centroids, codes.data(),
+            nblocks, service_ncodebooks, ncodes, offsets, scaleby, config.k,
+            mips);
+
+        BoltQueryService service(centroids.data(), service_ncols,
+            codes.data(), nblocks, service_ncodebooks, ncodes,
+            offsets.data(), scaleby, config);
+        std::vector<std::future<BoltStreamNeighbors> > futures;
+        for (int i = 0; i < nqueries; i++) {
+            futures.push_back(service.submit(Q.row(i).data()));
+        }
+        for (int i = 0; i < nqueries; i++) {
+            CAPTURE(mips);
+            CAPTURE(i);
+            auto neighbors = futures[i].get();
+            REQUIRE(neighbors.idxs == expected[i].idxs);
+            REQUIRE(neighbors.dists == expected[i].dists);
+        }
+        // submitted all at once, so they should have been batched
+        REQUIRE(service.nqueries() == nqueries);
+        REQUIRE(service.nbatches() < nqueries);
+
+        SECTION("unix socket") {
+            TempPath tmp("service.sock");
+            const auto& path = tmp.str();
+            BoltSocketServer server(service, path);
+            REQUIRE(server.ok());
+            int fd = bolt_socket_connect(path);
+            REQUIRE(fd >= 0);
+            std::vector<int64_t> idxs(config.k);
+            for (int i = 0; i < 3; i++) {
+                REQUIRE(bolt_socket_query(fd, Q.row(i).data(), service_ncols,
+                    config.k, idxs.data()));
+                REQUIRE(idxs == expected[i].idxs);
+            }
+            close(fd);
+
+            // threads for closed connections get joined as new ones come
+            // in, rather than piling up
+            size_t nthreads = 0;
+            for (int i = 0; i < 50; i++) {
+                int conn = bolt_socket_connect(path);
+                REQUIRE(conn >= 0);
+                REQUIRE(bolt_socket_query(conn, Q.row(0).data(),
+                    service_ncols, config.k, idxs.data()));
+                close(conn);
+                nthreads = server.nconnection_threads();
+                if (i >= 10 && nthreads <= 2) { break; }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            REQUIRE(nthreads <= 2);
+        }
+
+        SECTION("unix socket, clients that hang up") {
+            TempPath tmp("service.sock");
+            const auto& path = tmp.str();
+            BoltSocketServer server(service, path);
+            REQUIRE(server.ok());
+            for (int i = 0; i < 20; i++) {
+                int conn = bolt_socket_connect(path);
+                REQUIRE(conn >= 0);
+                // half a query, or a whole one whose answer nobody reads;
+                // writing that answer mustn't SIGPIPE the server
+                auto nbytes = (i % 2) ? service_ncols * sizeof(float) :
+                    service_ncols * sizeof(float) / 2;
+                REQUIRE(send(conn, Q.row(i).data(), nbytes, MSG_NOSIGNAL) ==
+                        (ssize_t)nbytes);
+                close(conn);
+            }
+            int fd = bolt_socket_connect(path);
+            REQUIRE(fd >= 0);
+            std::vector<int64_t> idxs(config.k);
+            REQUIRE(bolt_socket_query(fd, Q.row(1).data(), service_ncols,
+                config.k, idxs.data()));
+            REQUIRE(idxs == expected[1].idxs);
+            close(fd);
+        }
+
+        SECTION("load test with no requests") {
+            auto stats = bolt_service_load_test(service, Q, 1000, 0);
+            REQUIRE(stats.achieved_qps == 0);
+            REQUIRE(stats.p50_ms == 0);
+            REQUIRE(stats.p99_ms == 0);
+        }
+    }
+}
+
+TEST_CASE("bolt_query_pipeline", "[mcq][bolt][pipeline]") {
+    static constexpr int nbytes = 16;
+    static constexpr int pipeline_ncodebooks = 2 * nbytes;
+    static constexpr int pipeline_ncols = 2 * pipeline_ncodebooks;
+    static constexpr int nblocks = 50;
+    static constexpr int64_t ncodes = 32 * nblocks;
+    static constexpr int nqueries = 40;
+
+    ColMatrix<float> centroids(ncentroids, pipeline_ncols);
+    centroids.setRandom();
+    RowMatrix<uint8_t> codes(32 * nblocks, nbytes);
+    codes.setRandom();
+    RowMatrix<float> Q(nqueries, pipeline_ncols);
+    Q.setRandom();
+    RowVector<float> offsets(pipeline_ncodebooks);
+    offsets.setConstant(20);
+    float scaleby = 16;
+
+    for (bool mips : {false, true}) {
+        BoltPipelineConfig config;
+        config.k = 5;
+        config.nlut_threads = 2;
+        config.nscan_threads = 3;
+        config.max_pending_luts = 4;  // so the lut threads hit backpressure
+        config.mips = mips;
+        auto expected = bolt_knn_one_at_a_time(Q, centroids, codes.data(),
+            nblocks, pipeline_ncodebooks, ncodes, offsets, scaleby, config.k,
+            mips);
+
+        std::vector<std::future<BoltStreamNeighbors> > futures;
+        {
+            BoltQueryPipeline pipeline(centroids.data(), pipeline_ncols,
+                codes.data(), nblocks, pipeline_ncodebooks, ncodes,
+                offsets.data(), scaleby, config);
+            for (int i = 0; i < nqueries; i++) {
+                futures.push_back(pipeline.submit(Q.row(i).data()));
+            }
+            // half answered here, half after the pipeline drains on exit
+            for (int i = 0; i < nqueries / 2; i++) {
+                CAPTURE(i);
+                auto neighbors = futures[i].get();
+                REQUIRE(neighbors.idxs == expected[i].idxs);
+                REQUIRE(neighbors.dists == expected[i].dists);
+            }
+        }
+        for (int i = nqueries / 2; i < nqueries; i++) {
+            CAPTURE(i);
+            auto neighbors = futures[i].get();
+            REQUIRE(neighbors.idxs == expected[i].idxs);
+        }
+    }
+}
+
+TEST_CASE("bolt_filtered_knn", "[mcq][bolt][filter]") {
+    static constexpr int nblocks = 300;
+    static constexpr int nrows = 32 * nblocks;
+    static constexpr int64_t ncodes = nrows - 5;
+    static constexpr int k = 10;
+
+    // 24 bytes is 48 codebooks, which isn't a power of 2
+    for (int nbytes : {8, 24}) {
+        CAPTURE(nbytes);
+        BoltKnnFixture fixture(nblocks, nbytes);
+        int filter_ncodebooks = fixture.ncodebooks;
+        const auto& codes = fixture.codes;
+        const auto& lut = fixture.luts;
+        RowVector<uint16_t> dists(nrows);
+        bolt_scan(codes.data(), nblocks, filter_ncodebooks, lut.data(),
+                  dists.data());
+
+        // one scattered column and one sorted, so passing rows are clustered
+        std::vector<uint8_t> scattered(ncodes);
+        std::vector<uint16_t> sorted(ncodes);
+        for (int64_t i = 0; i < ncodes; i++) {
+            scattered[i] = static_cast<uint8_t>(rand());
+            sorted[i] = static_cast<uint16_t>(i / 7);
+        }
+        BoltAttributeTable attrs(ncodes);
+        REQUIRE(attrs.nblocks() == nblocks);
+        auto scattered_col = attrs.add_column_u8(scattered.data());
+        auto sorted_col = attrs.add_column_u16(sorted.data());
+
+        std::vector<std::vector<BoltPredicate> > pred_lists = {
+            {},
+            {{scattered_col, 0, 127}},
+            {{scattered_col, 3, 3}},
+            {{scattered_col, 200, 100}},  // empty range
+            {{sorted_col, 500, 520}},
+            {{sorted_col, 0, 100000}, {scattered_col, -5, 40}},
+            {{sorted_col, 100, 900}, {scattered_col, 250, 255}},
+        };
+        for (size_t p = 0; p < pred_lists.size(); p++) {
+            CAPTURE(p);
+            const auto& preds = pred_lists[p];
+            auto masks = attrs.bitmap(preds);
+            REQUIRE(masks.size() == nblocks);
+
+            std::vector<int64_t> passing;
+            for (int64_t i = 0; i < nrows; i++) {
+                bool pass = i < ncodes;
+                for (const auto& pred : preds) {
+                    int v = pred.col == sorted_col ? sorted[i] : scattered[i];
+                    pass = pass && pred.lo <= v && v <= pred.hi;
+                }
+                CAPTURE(i);
+                REQUIRE(((masks[i / 32] >> (i % 32)) & 1) == pass);
+                if (pass) { passing.push_back(i); }
+            }
+
+            for (bool smaller_better : {true, false}) {
+                std::vector<std::pair<int, int64_t> > expected;
+                for (auto i : passing) {
+                    expected.emplace_back(
+                        smaller_better ? dists(i) : -dists(i), i);
+                }
+                std::sort(expected.begin(), expected.end());
+                auto nexpected = std::min<size_t>(k, expected.size());
+
+                for (auto strategy : {BoltFilterStrategy::Auto,
+                        BoltFilterStrategy::Scan, BoltFilterStrategy::SkipBlocks,
+                        BoltFilterStrategy::Gather})
+                {
+                    CAPTURE(smaller_better);
+                    CAPTURE(bolt_filter_strategy_name(strategy));
+                    BoltFilterStrategy used;
+                    auto res = bolt_filtered_knn(codes.data(), nblocks,
+                        filter_ncodebooks, lut.data(), masks.data(), k,
+                        smaller_better, strategy, &used);
+                    REQUIRE(used != BoltFilterStrategy::Auto);
+                    REQUIRE(res.idxs.size() == nexpected);
+                    for (size_t i = 0; i < nexpected; i++) {
+                        REQUIRE(res.idxs[i] == expected[i].second);
+                        REQUIRE(res.dists[i] == dists(res.idxs[i]));
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("bolt_self_join", "[mcq][bolt][join]") {
+    static constexpr int nbytes = 8;
+    static constexpr int join_ncodebooks = 2 * nbytes;
+    static constexpr int join_ncols = 2 * join_ncodebooks;
+    static constexpr int nblocks = 23;
+    static constexpr int64_t ncodes = 32 * nblocks - 11;
+    static constexpr int k = 7;
+
+    ColMatrix<float> centroids(ncentroids, join_ncols);
+    centroids.setRandom();
+    RowMatrix<uint8_t> codes(32 * nblocks, nbytes);
+    codes.setRandom();
+
+    for (bool mips : {false, true}) {
+        CAPTURE(mips);
+        BoltSymmetricTables tables(centroids.data(), join_ncols,
+            join_ncodebooks, mips);
+
+        // table entries should be quantized centroid dists / dot prods
+        for (int m = 0; m < join_ncodebooks; m++) {
+            for (int a = 0; a < ncentroids; a++) {
+                for (int b = 0; b < ncentroids; b++) {
+                    auto ca = centroids.block(a, 2 * m, 1, 2);
+                    auto cb = centroids.block(b, 2 * m, 1, 2);
+                    float raw = mips ? (ca.array() * cb.array()).sum() :
+                        (ca - cb).squaredNorm();
+                    float expected = raw * tables.scaleby() +
+                        tables.offsets()[m];
+                    REQUIRE(expected > -.51);
+                    REQUIRE(expected < 255.51);
+                    REQUIRE(fabs(tables.table_row(m, a)[b] - expected) <= .51);
+                }
+            }
+        }
+
+        // brute force: each code's LUT against every code
+        RowMatrix<uint16_t> all_dists(ncodes, 32 * nblocks);
+        ColMatrix<uint8_t> lut(ncentroids, join_ncodebooks);
+        for (int64_t i = 0; i < ncodes; i++) {
+            tables.lut_for_code(codes.data() + (i / 32) * 32 * nbytes, i % 32,
+                lut.data());
+            bolt_scan(codes.data(), nblocks, join_ncodebooks, lut.data(),
+                all_dists.row(i).data());
+        }
+        auto square_dists = all_dists.leftCols(ncodes);
+        REQUIRE(square_dists == square_dists.transpose());
+
+        for (int nthreads : {1, 3}) {
+            CAPTURE(nthreads);
+            auto graph = bolt_knn_graph(codes.data(), nblocks, ncodes,
+                tables, k, nthreads);
+            REQUIRE(graph.size() == ncodes);
+            for (int64_t i = 0; i < ncodes; i++) {
+                std::vector<std::pair<int, int64_t> > sorted;
+                for (int64_t j = 0; j < ncodes; j++) {
+                    if (j == i) { continue; }
+                    int d = all_dists(i, j);
+                    sorted.emplace_back(mips ? -d : d, j);
+                }
+                std::sort(sorted.begin(), sorted.end());
+                CAPTURE(i);
+                REQUIRE(graph[i].idxs.size() == k);
+                for (int n = 0; n < k; n++) {
+                    // self may have been dropped from among ties, so check
+                    // dists rather than idxs
+                    REQUIRE(graph[i].idxs[n] != i);
+                    REQUIRE(graph[i].dists[n] == all_dists(i, graph[i].idxs[n]));
+                    int d = graph[i].dists[n];
+                    REQUIRE((mips ? -d : d) == sorted[n].first);
+                }
+            }
+
+            // raw threshold -> roughly 1% of pairs match
+            std::vector<uint16_t> upper;
+            for (int64_t i = 0; i < ncodes; i++) {
+                for (int64_t j = i + 1; j < ncodes; j++) {
+                    upper.push_back(all_dists(i, j));
+                }
+            }
+            std::sort(upper.begin(), upper.end());
+            auto q_thresh = mips ? upper[upper.size() * 99 / 100] :
+                upper[upper.size() / 100];
+            auto offset_sum = tables.quantize_threshold(0);
+            float threshold = (q_thresh - offset_sum) / tables.scaleby();
+            // in case of float rounding, move the raw threshold so it
+            // quantizes to exactly q_thresh
+            auto actual_thresh = tables.quantize_threshold(threshold);
+            auto pairs = bolt_self_join(codes.data(), nblocks, ncodes,
+                tables, threshold, nthreads);
+            std::vector<BoltJoinPair> expected;
+            for (int64_t i = 0; i < ncodes; i++) {
+                for (int64_t j = i + 1; j < ncodes; j++) {
+                    auto d = all_dists(i, j);
+                    bool match = mips ? d >= ceil(actual_thresh) :
+                        d <= floor(actual_thresh);
+                    if (match) { expected.push_back({i, j, d}); }
+                }
+            }
+            REQUIRE(expected.size() > ncodes / 10);
+            REQUIRE(pairs.size() == expected.size());
+            for (size_t p = 0; p < pairs.size(); p++) {
+                CAPTURE(p);
+                REQUIRE(pairs[p].i == expected[p].i);
+                REQUIRE(pairs[p].j == expected[p].j);
+                REQUIRE(pairs[p].dist == expected[p].dist);
+            }
+        }
+    }
+}
+
+TEST_CASE("bolt_kmeans", "[mcq][bolt][kmeans]") {
+    static constexpr int k = 9;
+
+    // checks that each row's center is (one of) the nearest, up to tol, and
+    // that each nonempty cluster's center is the mean of its rows
+    auto check_result = [](const RowMatrix<float>& X, const RowMatrix<float>&
+        prev_centers, const CodeKmeansResult& res, float tol)
+    {
+        auto ncodes = X.rows();
+        REQUIRE(res.assignments.size() == ncodes);
+        RowMatrix<float> sums(k, X.cols());
+        sums.setZero();
+        std::vector<int64_t> counts(k);
+        for (int64_t i = 0; i < ncodes; i++) {
+            int c = res.assignments[i];
+            REQUIRE(c >= 0);
+            REQUIRE(c < k);
+            RowVector<float> dists = (prev_centers.rowwise() - X.row(i))
+                .rowwise().squaredNorm().transpose();
+            CAPTURE(i);
+            REQUIRE(dists(c) <= dists.minCoeff() + tol);
+            sums.row(c) += X.row(i);
+            counts[c]++;
+        }
+        REQUIRE(counts == res.counts);
+        for (int c = 0; c < k; c++) {
+            if (counts[c] == 0) { continue; }
+            RowVector<float> mean = sums.row(c) / counts[c];
+            RowVector<float> diffs = mean - res.centers.row(c);
+            REQUIRE(diffs.cwiseAbs().maxCoeff() < 1e-4);
+        }
+    };
+
+    SECTION("bolt") {
+        static constexpr int nbytes = 4;
+        static constexpr int km_ncodebooks = 2 * nbytes;
+        static constexpr int km_ncols = 2 * km_ncodebooks;
+        static constexpr int nblocks = 20;
+        static constexpr int64_t ncodes = 32 * nblocks - 5;
+        ColMatrix<float> centroids(ncentroids, km_ncols);
+        centroids.setRandom();
+        RowMatrix<uint8_t> codes(32 * nblocks, nbytes);
+        codes.setRandom();
+
+        RowMatrix<float> X(ncodes, km_ncols);
+        for (int64_t i = 0; i < ncodes; i++) {
+            auto block = codes.data() + (i / 32) * 32 * nbytes;
+            for (int m = 0; m < km_ncodebooks; m++) {
+                auto byte = block[32 * (m / 2) + i % 32];
+                int code = (m % 2) ? byte >> 4 : byte & 0x0F;
+                X.block(i, 2 * m, 1, 2) = centroids.block(code, 2 * m, 1, 2);
+            }
+        }
+        // centers stay in the convex hull of the centroids, so scaling by
+        // the largest centroid-to-centroid dist means no LUT saturates
+        float max_dist = 0;
+        for (int m = 0; m < km_ncodebooks; m++) {
+            for (int a = 0; a < ncentroids; a++) {
+                for (int b = 0; b < ncentroids; b++) {
+                    max_dist = std::max(max_dist, (centroids.block(a, 2*m, 1, 2)
+                        - centroids.block(b, 2*m, 1, 2)).squaredNorm());
+                }
+            }
+        }
+        float scaleby = 255.f / max_dist;
+        RowVector<float> offsets(km_ncodebooks);
+        offsets.setZero();
+        // each LUT entry is off by at most .5, so sums are off by ncodebooks/2
+        float tol = km_ncodebooks / scaleby + 1e-4;
+
+        RowMatrix<float> init = X.topRows(k);
+        auto res = bolt_kmeans(centroids.data(), km_ncols, codes.data(),
+            nblocks, km_ncodebooks, ncodes, offsets.data(), scaleby, k, 1,
+            init.data());
+        REQUIRE(res.niters == 1);
+        check_result(X, init, res, tol);
+        RowMatrix<float> init_dists(ncodes, k);
+        for (int c = 0; c < k; c++) {
+            init_dists.col(c) = (X.rowwise() - init.row(c))
+                .rowwise().squaredNorm();
+        }
+        double inertia = init_dists.rowwise().minCoeff().sum();
+        REQUIRE(fabs(res.inertia[0] - inertia) <= ncodes * tol / 2);
+
+        auto res_full = bolt_kmeans(centroids.data(), km_ncols, codes.data(),
+            nblocks, km_ncodebooks, ncodes, offsets.data(), scaleby, k, 50);
+        REQUIRE(res_full.niters <= 50);
+        REQUIRE(res_full.inertia.back() < res_full.inertia.front());
+        // centers are always the means of the final assignments
+        check_result(X, res_full.centers, res_full, 1e10);
+    }
+
+    SECTION("pq") {
+        static constexpr int km_ncodebooks = 4;
+        static constexpr int km_ncols = 2 * km_ncodebooks;
+        static constexpr int64_t ncodes = 1000;
+        ColMatrix<float> centroids(256, km_ncols);
+        centroids.setRandom();
+        RowMatrix<uint8_t> codes(ncodes, km_ncodebooks);
+        codes.setRandom();
+
+        RowMatrix<float> X(ncodes, km_ncols);
+        for (int64_t i = 0; i < ncodes; i++) {
+            for (int m = 0; m < km_ncodebooks; m++) {
+                X.block(i, 2 * m, 1, 2) = centroids.block(codes(i, m), 2 * m, 1, 2);
+            }
+        }
+
+        RowMatrix<float> init = X.topRows(k);
+        auto res = pq_kmeans(centroids.data(), km_ncols, codes.data(), ncodes,
+            km_ncodebooks, k, 1, init.data());
+        REQUIRE(res.niters == 1);
+        check_result(X, init, res, 1e-4);
+
+        // float LUTs, so this is exactly Lloyd's, which never gets worse
+        auto res_full = pq_kmeans(centroids.data(), km_ncols, codes.data(),
+            ncodes, km_ncodebooks, k, 50);
+        for (size_t it = 1; it < res_full.inertia.size(); it++) {
+            REQUIRE(res_full.inertia[it] <= res_full.inertia[it - 1] * (1 + 1e-5));
+        }
+        check_result(X, res_full.centers, res_full, 1e10);
+
+        // random init with no codes, or fewer codes than clusters
+        auto res_empty = pq_kmeans(centroids.data(), km_ncols, codes.data(),
+            0, km_ncodebooks, k, 2);
+        REQUIRE(res_empty.assignments.empty());
+        REQUIRE(res_empty.centers.cwiseAbs().maxCoeff() == 0);
+        static constexpr int64_t nfew = 3;
+        auto res_few = pq_kmeans(centroids.data(), km_ncols, codes.data(),
+            nfew, km_ncodebooks, k, 2);
+        REQUIRE(res_few.assignments.size() == nfew);
+        for (int64_t i = 0; i < nfew; i++) {
+            RowVector<float> diffs = res_few.centers.row(
+                res_few.assignments[i]) - X.row(i);
+            REQUIRE(diffs.cwiseAbs().maxCoeff() < 1e-4);
+        }
+    }
+}
+
+TEST_CASE("bolt_decode", "[mcq][bolt][decode]") {
+    static constexpr int nbytes = 4;
+    static constexpr int dec_ncodebooks = 2 * nbytes;
+    static constexpr int nblocks = 5;
+    static constexpr int64_t ncodes = 32 * nblocks - 3;
+    std::vector<int64_t> few_idxs {7, 0, ncodes - 1, 7};
+    std::vector<int64_t> many_idxs;
+    for (int i = 0; i < 50; i++) { many_idxs.push_back((i * 37) % ncodes); }
+
+    // checks decoded rows and dots for idxs against the reconstructions X
+    auto check_rows = [](const RowMatrix<float>& X,
+        const std::vector<int64_t>& idxs, const RowMatrix<float>& rows,
+        const RowVector<float>& v, const RowVector<float>& dots)
+    {
+        for (size_t i = 0; i < idxs.size(); i++) {
+            CAPTURE(i);
+            REQUIRE(rows.row(i) == X.row(idxs[i]));
+            float expected = X.row(idxs[i]).dot(v);
+            REQUIRE(fabs(dots(i) - expected) < 1e-4 * (1 + fabs(expected)));
+        }
+    };
+
+    for (int subvect_len : {2, 3, 8}) {
+        CAPTURE(subvect_len);
+        int dec_ncols = dec_ncodebooks * subvect_len;
+        RowVector<float> v(dec_ncols);
+        v.setRandom();
+
+        {  // bolt
+            ColMatrix<float> centroids(ncentroids, dec_ncols);
+            centroids.setRandom();
+            RowMatrix<uint8_t> codes(32 * nblocks, nbytes);
+            codes.setRandom();
+            RowMatrix<uint8_t> codes_rowmajor(ncodes, nbytes);
+            RowMatrix<float> X(ncodes, dec_ncols);
+            for (int64_t i = 0; i < ncodes; i++) {
+                auto block = codes.data() + (i / 32) * 32 * nbytes;
+                for (int j = 0; j < nbytes; j++) {
+                    codes_rowmajor(i, j) = block[32 * j + i % 32];
+                }
+                for (int m = 0; m < dec_ncodebooks; m++) {
+                    auto byte = codes_rowmajor(i, m / 2);
+                    int code = (m % 2) ? byte >> 4 : byte & 0x0F;
+                    X.block(i, m * subvect_len, 1, subvect_len) =
+                        centroids.block(code, m * subvect_len, 1, subvect_len);
+                }
+            }
+            RowMatrix<float> table(dec_ncodebooks * ncentroids, subvect_len);
+            bolt_decode_table(centroids.data(), dec_ncols, dec_ncodebooks,
+                table.data());
+
+            RowMatrix<float> out(ncodes, dec_ncols);
+            bolt_decode(codes.data(), ncodes, dec_ncodebooks, table.data(),
+                dec_ncols, out.data());
+            REQUIRE(out == X);
+            out.setZero();
+            bolt_decode<true>(codes_rowmajor.data(), ncodes, dec_ncodebooks,
+                table.data(), dec_ncols, out.data());
+            REQUIRE(out == X);
+
+            for (auto idxs : {few_idxs, many_idxs}) {
+                int64_t n = idxs.size();
+                RowMatrix<float> rows(n, dec_ncols);
+                RowVector<float> dots(n);
+                bolt_decode_rows(codes.data(), dec_ncodebooks, table.data(),
+                    dec_ncols, idxs.data(), n, rows.data());
+                bolt_decode_dot(codes.data(), dec_ncodebooks, table.data(),
+                    dec_ncols, idxs.data(), n, v.data(), dots.data());
+                check_rows(X, idxs, rows, v, dots);
+                bolt_decode_rows<true>(codes_rowmajor.data(), dec_ncodebooks,
+                    table.data(), dec_ncols, idxs.data(), n, rows.data());
+                bolt_decode_dot<true>(codes_rowmajor.data(), dec_ncodebooks,
+                    table.data(), dec_ncols, idxs.data(), n, v.data(),
+                    dots.data());
+                check_rows(X, idxs, rows, v, dots);
+            }
+        }
+        {  // pq
+            ColMatrix<float> centroids(256, dec_ncols);
+            centroids.setRandom();
+            RowMatrix<uint8_t> codes(ncodes, dec_ncodebooks);
+            codes.setRandom();
+            RowMatrix<float> X(ncodes, dec_ncols);
+            for (int64_t i = 0; i < ncodes; i++) {
+                for (int m = 0; m < dec_ncodebooks; m++) {
+                    X.block(i, m * subvect_len, 1, subvect_len) =
+                        centroids.block(codes(i, m), m * subvect_len, 1,
+                                        subvect_len);
+                }
+            }
+            RowMatrix<float> table(dec_ncodebooks * 256, subvect_len);
+            pq_decode_table_8b(centroids.data(), dec_ncols, dec_ncodebooks,
+                table.data());
+
+            RowMatrix<float> out(ncodes, dec_ncols);
+            pq_decode_8b(codes.data(), ncodes, dec_ncodebooks, table.data(),
+                dec_ncols, out.data());
+            REQUIRE(out == X);
+
+            // 256 centroids, so only the per-row dot path runs for these
+            for (auto idxs : {few_idxs, many_idxs}) {
+                int64_t n = idxs.size();
+                RowMatrix<float> rows(n, dec_ncols);
+                RowVector<float> dots(n);
+                pq_decode_rows_8b(codes.data(), dec_ncodebooks, table.data(),
+                    dec_ncols, idxs.data(), n, rows.data());
+                pq_decode_dot_8b(codes.data(), dec_ncodebooks, table.data(),
+                    dec_ncols, idxs.data(), n, v.data(), dots.data());
+                check_rows(X, idxs, rows, v, dots);
+            }
+            // enough rows for the precomputed-dots path
+            std::vector<int64_t> all_idxs(ncodes);
+            for (int64_t i = 0; i < ncodes; i++) { all_idxs[i] = ncodes - 1 - i; }
+            RowMatrix<float> rows(ncodes, dec_ncols);
+            RowVector<float> dots(ncodes);
+            pq_decode_rows_8b(codes.data(), dec_ncodebooks, table.data(),
+                dec_ncols, all_idxs.data(), ncodes, rows.data());
+            pq_decode_dot_8b(codes.data(), dec_ncodebooks, table.data(),
+                dec_ncols, all_idxs.data(), ncodes, v.data(), dots.data());
+            check_rows(X, all_idxs, rows, v, dots);
+        }
+    }
+}
+
+TEST_CASE("pq_encode_8b", "[mcq][pq]") {
+    static constexpr int pq_ncodebooks = 8;
+    static constexpr int subvect_len = 4;
+    static constexpr int pq_ncols = pq_ncodebooks * subvect_len;
+    static constexpr int lut_sz = 256;
+    static constexpr int nrows = 2 * lut_sz + 7;
+
+    // far-apart centroids, and rows near a different one in each codebook,
+    // cycling through all 256 so that every stripe of 8 has winners
+    ColMatrix<float> centroids(lut_sz, pq_ncols);
+    centroids.setRandom();
+    centroids *= 100;
+    RowMatrix<float> X(nrows, pq_ncols);
+    X.setRandom();
+    X *= .1;
+    for (int i = 0; i < nrows; i++) {
+        for (int m = 0; m < pq_ncodebooks; m++) {
+            int target = (i + 37 * m) % lut_sz;
+            for (int j = 0; j < subvect_len; j++) {
+                X(i, m * subvect_len + j) +=
+                    centroids(target, m * subvect_len + j);
+            }
+        }
+    }
+
+    RowMatrix<uint8_t> codes(nrows, pq_ncodebooks);
+    pq_encode_8b(X.data(), nrows, pq_ncols, pq_ncodebooks, centroids.data(),
+                 codes.data());
+
+    // brute force argmin, with the same fma order and the same rounding to
+    // int32 as the kernel, so ties break the same way (lowest index)
+    std::vector<bool> stripe_won(lut_sz / 8, false);
+    for (int i = 0; i < nrows; i++) {
+        for (int m = 0; m < pq_ncodebooks; m++) {
+            int best = -1;
+            int32_t best_dist = std::numeric_limits<int32_t>::max();
+            for (int c = 0; c < lut_sz; c++) {
+                float dist = 0;
+                for (int j = 0; j < subvect_len; j++) {
+                    auto col = m * subvect_len + j;
+                    float diff = X(i, col) - centroids(c, col);
+                    dist = std::fma(diff, diff, dist);
+                }
+                auto dist_int = static_cast<int32_t>(std::nearbyint(dist));
+                if (dist_int < best_dist) {
+                    best_dist = dist_int;
+                    best = c;
+                }
+            }
+            CAPTURE(i);
+            CAPTURE(m);
+            REQUIRE(codes(i, m) == best);
+            stripe_won[best / 8] = true;
+        }
+    }
+    for (size_t s = 0; s < stripe_won.size(); s++) {
+        CAPTURE(s);
+        REQUIRE(stripe_won[s]);
+    }
+}
+
+TEST_CASE("opq_encode_tiled", "[mcq][pq][opq]") {
+    static constexpr int opq_ncodebooks = 8;
+    static constexpr int opq_ncols = 48;  // not a power of 2
+    static constexpr int block_sz = 16;
+    int64_t nrows = 3 * opq_tile_nrows(opq_ncols) + 5;
+
+    RowMatrix<float> X(nrows, opq_ncols);
+    X.setRandom();
+    ColMatrix<float> centroids(256, opq_ncols);
+    centroids.setRandom();
+
+    // random rotations via QR of random matrices
+    RowMatrix<float> rand_mat(opq_ncols, opq_ncols);
+    rand_mat.setRandom();
+    RowMatrix<float> R = Eigen::HouseholderQR<RowMatrix<float> >(
+        rand_mat).householderQ();
+    std::vector<RowMatrix<float> > blocks;
+    for (int b = 0; b < opq_ncols / block_sz; b++) {
+        RowMatrix<float> rand_block(block_sz, block_sz);
+        rand_block.setRandom();
+        blocks.push_back(Eigen::HouseholderQR<RowMatrix<float> >(
+            rand_block).householderQ());
+    }
+    RowMatrix<float> R_blocks(opq_ncols, opq_ncols);
+    R_blocks.setZero();
+    for (int b = 0; b < opq_ncols / block_sz; b++) {
+        R_blocks.block(b * block_sz, b * block_sz, block_sz, block_sz) =
+            blocks[b].transpose();
+    }
+
+    DenseRotation dense(R);
+    BlockDiagonalRotation block_diag(blocks);
+    HadamardRotation hadamard(opq_ncols);
+    REQUIRE(hadamard.block_sz() == 32);
+
+    // returns the matrix that rot multiplies rows by
+    auto as_matrix = [](const auto& rot) {
+        RowMatrix<float> I = RowMatrix<float>::Identity(rot.ncols(), rot.ncols());
+        RowMatrix<float> out(rot.ncols(), rot.ncols());
+        rot.apply(I.data(), rot.ncols(), out.data());
+        return out;
+    };
+    auto check_rotation = [&](const auto& rot, const RowMatrix<float>* expected) {
+        RowMatrix<float> mat = as_matrix(rot);
+        RowMatrix<float> eye = mat * mat.transpose();
+        REQUIRE(eye.isIdentity(1e-4));
+        if (expected != nullptr) {
+            REQUIRE(mat.isApprox(*expected, 1e-5));
+        }
+
+        RowMatrix<float> X_rot = X * mat;
+        RowMatrix<uint8_t> codes(nrows, opq_ncodebooks);
+        RowMatrix<uint8_t> codes_ref(nrows, opq_ncodebooks);
+        opq_encode_8b_tiled(X.data(), nrows, opq_ncols, opq_ncodebooks,
+            centroids.data(), rot, codes.data());
+        pq_encode_8b(X_rot.data(), nrows, opq_ncols, opq_ncodebooks,
+            centroids.data(), codes_ref.data());
+        // rounding differences in the rotated data can flip near-ties
+        auto nmismatches = (codes.array() != codes_ref.array()).count();
+        REQUIRE(nmismatches <= nrows * opq_ncodebooks / 100);
+
+        int nqueries = 5;
+        ColMatrix<float> luts(256 * opq_ncodebooks, nqueries);
+        ColMatrix<float> luts_ref(256 * opq_ncodebooks, nqueries);
+        opq_lut_8b_tiled(X.data(), nqueries, opq_ncols, opq_ncodebooks,
+            centroids.data(), rot, luts.data());
+        pq_lut_8b(X_rot.data(), nqueries, opq_ncols, opq_ncodebooks,
+            centroids.data(), luts_ref.data());
+        REQUIRE(luts.isApprox(luts_ref, 1e-4));
+    };
+    check_rotation(dense, &R);
+    check_rotation(block_diag, &R_blocks);
+    check_rotation(hadamard, nullptr);
+}
+
+TEST_CASE("hadamard_rotation_mixing", "[mcq][opq]") {
+    // odd, 2 * odd, and a large D with a small power of 2 factor
+    for (int D : {33, 30, 960}) {
+        CAPTURE(D);
+        HadamardRotation rot(D);
+        RowMatrix<float> I = RowMatrix<float>::Identity(D, D);
+        RowMatrix<float> mat(D, D);
+        rot.apply(I.data(), D, mat.data());
+        RowMatrix<float> eye = mat * mat.transpose();
+        REQUIRE(eye.isIdentity(1e-4));
+
+        // each unit vector's energy should end up spread across most
+        // coordinates, not stay on one or two
+        for (int i = 0; i < D; i++) {
+            CAPTURE(i);
+            auto sq = mat.row(i).array().square();
+            REQUIRE(sq.maxCoeff() <= .5f);
+            REQUIRE((sq > 1e-6f).count() >= D / 2);
+        }
+    }
+}
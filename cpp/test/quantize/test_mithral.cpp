@@ -12,13 +12,17 @@
     #include "test/external/catch.hpp"
     #include "src/utils/debug_utils.hpp"
     #include "src/utils/memory.hpp"
+    #include "src/quantize/encoded_lstsq.hpp"
     #include "src/quantize/mithral_v1.hpp"
+    #include "src/utils/scan_telemetry.hpp"
     #include "test/testing_utils/testing_utils.hpp"
 #else
     #include "catch.hpp"
     #include "debug_utils.hpp"
     #include "memory.hpp"
+    #include "encoded_lstsq.hpp"
     #include "mithral_v1.hpp"
+    #include "scan_telemetry.hpp"
     #include "testing_utils.hpp"
 #endif
 
@@ -338,3 +342,206 @@ TEST_CASE("mithral scan tiled", "[mithral][scan]") {
         _test_mithral_scan_tiled(5 * 1024, 12, 3);
     }
 }
+
+// rounding average of n (a power of 2) values, as a tree of pairwise
+// averages, which is how the scan combines codebooks
+static int _mithral_avg_tree(const int* vals, int n) {
+    if (n == 1) { return vals[0]; }
+    auto a = _mithral_avg_tree(vals, n / 2);
+    auto b = _mithral_avg_tree(vals + n / 2, n / 2);
+    return (a + b + 1) / 2;
+}
+
+// what mithral_scan() computes for one output: codebooks are averaged in
+// groups of 16, and if there's more than one group, the group averages are
+// summed (as int8s) into int16s
+static void _mithral_scan_ref(const uint8_t* codes, int64_t nblocks,
+    int ncodebooks, const uint8_t* lut, uint8_t* out)
+{
+    int nbytes = ncodebooks / 2;
+    int group_nbytes = std::min(ncodebooks, 16) / 2;
+    int vals[64];
+    for (int64_t b = 0; b < nblocks; b++) {
+        auto block = codes + b * nbytes * 32;
+        for (int r = 0; r < 32; r++) {
+            for (int j = 0; j < nbytes; j++) {
+                auto code = block[32 * j + r];
+                int lo = lut[32 * j + (code & 0x0F)];
+                int hi = lut[32 * j + 16 + (code >> 4)];
+                vals[j] = (lo + hi + 1) / 2;
+            }
+            if (group_nbytes == nbytes) {
+                out[b * 32 + r] = _mithral_avg_tree(vals, nbytes);
+                continue;
+            }
+            int16_t total = 0;
+            for (int g = 0; g < nbytes; g += group_nbytes) {
+                total += (int8_t)_mithral_avg_tree(vals + g, group_nbytes);
+            }
+            ((int16_t*)out)[b * 32 + r] = total;
+        }
+    }
+}
+
+TEST_CASE("mithral scan orders", "[mithral][scan]") {
+    static constexpr int lut_sz = 16;
+    // 700 blocks is several chunks of codes and, with 64 codebooks, several
+    // panels; 40 outputs' luts with 64 codebooks is several lut blocks
+    for (int ncodebooks : {2, 8, 16, 32, 64}) {
+        for (int64_t nblocks : {1, 7, 700}) {
+            for (int noutputs : {1, 3, 40}) {
+                auto nrows = nblocks * 32;
+                int out_elem_sz = ncodebooks > 16 ? 2 : 1;
+                ColMatrix<uint8_t> codes(nrows, ncodebooks / 2);
+                codes.setRandom();
+                ColMatrix<uint8_t> luts(ncodebooks * lut_sz, noutputs);
+                luts.setRandom();
+                luts = luts.array() / 2;  // so the int8 group sums are exact
+                ColMatrix<uint8_t> ans(nrows * out_elem_sz, noutputs);
+                for (int m = 0; m < noutputs; m++) {
+                    _mithral_scan_ref(codes.data(), nblocks, ncodebooks,
+                        luts.col(m).data(), ans.col(m).data());
+                }
+                for (auto order : {MithralScanOrder::Auto,
+                                   MithralScanOrder::CodesStationary,
+                                   MithralScanOrder::OutputStationary,
+                                   MithralScanOrder::Tiled2D}) {
+                    ColMatrix<uint8_t> out(nrows * out_elem_sz, noutputs);
+                    out.setZero();
+                    mithral_scan(codes.data(), nblocks, ncodebooks, noutputs,
+                                 luts.data(), out.data(), order);
+                    CAPTURE(ncodebooks);
+                    CAPTURE(nblocks);
+                    CAPTURE(noutputs);
+                    CAPTURE(mithral_scan_order_name(order));
+                    REQUIRE(out == ans);
+                }
+            }
+        }
+    }
+    // tiling only pays off once the luts don't fit in L2
+    REQUIRE(mithral_scan_order_for(8, 16, 4) ==
+            MithralScanOrder::CodesStationary);
+    REQUIRE(mithral_scan_order_for(32 * 1024, 64, 100) ==
+            MithralScanOrder::CodesStationary);
+    REQUIRE(mithral_scan_order_for(32 * 1024, 64, 1024) ==
+            MithralScanOrder::Tiled2D);
+}
+
+TEST_CASE("mithral scan telemetry", "[mithral][scan][telemetry]") {
+    static constexpr int ncodebooks = 16;
+    static constexpr int64_t nblocks = 5;
+    static constexpr int64_t nrows = nblocks * 32;
+    static constexpr int noutputs = 3;
+    ColMatrix<uint8_t> codes(nrows, ncodebooks / 2);
+    codes.setRandom();
+    ColMatrix<uint8_t> luts(ncodebooks * 16, noutputs);
+    luts.setRandom();
+    luts = luts.array() / 2;
+    // averages of entries at the top of the lut range stay there
+    luts.col(1).setConstant(255);
+    ColMatrix<uint8_t> out(nrows, noutputs);
+
+    scan_telemetry::reset();
+    mithral_scan(codes.data(), nblocks, ncodebooks, noutputs, luts.data(),
+                 out.data(), MithralScanOrder::Auto);
+    auto counts = scan_telemetry::query_counts();
+    if (kScanTelemetry) {
+        REQUIRE(counts.nrows == nrows * noutputs);
+        REQUIRE(counts.nclipped == nrows);
+    } else {
+        REQUIRE(counts.nrows == 0);
+    }
+    scan_telemetry::reset();
+}
+
+TEST_CASE("mithral lut dense parallel", "[mithral][lut]") {
+    static constexpr int lut_sz = 16;
+    for (int nrows : {1, 7, 50, 1000}) {
+        for (int ncols : {16, 100, 300}) {  // 300 spans two blocks of cols
+            for (int ncodebooks : {2, 8, 16}) {
+                RowMatrix<float> Q(nrows, ncols); Q.setRandom();
+                RowMatrix<float> centroids(ncodebooks * ncols, lut_sz);
+                centroids.setRandom();
+                RowMatrix<float> luts_f32(nrows, ncodebooks * lut_sz);
+                RowMatrix<uint8_t> luts(nrows, ncodebooks * lut_sz);
+                float offset_sum, scale;
+                mithral_lut_dense(Q.data(), nrows, ncols, ncodebooks,
+                    centroids.data(), offset_sum, scale, luts_f32.data(),
+                    luts.data());
+                for (int nthreads : {1, 3}) {
+                    CAPTURE(nrows);
+                    CAPTURE(ncols);
+                    CAPTURE(ncodebooks);
+                    CAPTURE(nthreads);
+                    RowMatrix<float> luts_f32_par(nrows, ncodebooks * lut_sz);
+                    RowMatrix<uint8_t> luts_par(nrows, ncodebooks * lut_sz);
+                    float offset_sum_par, scale_par;
+                    mithral_lut_dense_parallel(Q.data(), nrows, ncols,
+                        ncodebooks, centroids.data(), offset_sum_par,
+                        scale_par, luts_f32_par.data(), luts_par.data(),
+                        nthreads);
+                    REQUIRE(luts_f32_par.isApprox(luts_f32, 1e-5f));
+                    REQUIRE(scale_par == scale);
+                    REQUIRE(offset_sum_par == Approx(offset_sum).epsilon(1e-4));
+                    // sums in a different order can round to adjacent ints
+                    auto diffs = (luts_par.cast<int>() -
+                                  luts.cast<int>()).cwiseAbs();
+                    REQUIRE(diffs.maxCoeff() <= 1);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("encoded lstsq", "[mithral][lstsq]") {
+    static constexpr int K = 16;
+    static constexpr int M = 5;
+    for (int64_t N : {1, 37, 3000, 20 * 1000}) {
+        for (int ncodebooks : {1, 2, 7}) {
+            int D = ncodebooks * K;
+            ColMatrix<uint8_t> codes(N, ncodebooks);
+            codes.setRandom();
+            codes = codes.array() / 16;
+            RowMatrix<float> Y(N, M);
+            Y.setRandom();
+
+            // dense one-hot design matrix, as in _densify_X_enc
+            RowMatrix<float> X(N, D);
+            X.setZero();
+            for (int64_t n = 0; n < N; n++) {
+                for (int c = 0; c < ncodebooks; c++) {
+                    X(n, c * K + codes(n, c)) = 1;
+                }
+            }
+            RowMatrix<float> XtX_ref = X.transpose() * X;
+            RowMatrix<float> XtY_ref = X.transpose() * Y;
+
+            for (int nthreads : {1, 3}) {
+                CAPTURE(N);
+                CAPTURE(ncodebooks);
+                CAPTURE(nthreads);
+                RowMatrix<int32_t> XtX(D, D);
+                encoded_xtx(codes.data(), N, ncodebooks, XtX.data(), nthreads);
+                REQUIRE(XtX.cast<float>() == XtX_ref);
+
+                RowMatrix<float> XtY(D, M);
+                encoded_xty(codes.data(), N, ncodebooks, Y.data(), M,
+                    XtY.data(), nthreads);
+                REQUIRE((XtY - XtY_ref).cwiseAbs().maxCoeff() < 1e-3);
+
+                float lamda = 2;
+                RowMatrix<float> W(D, M);
+                encoded_lstsq(codes.data(), N, ncodebooks, Y.data(), M,
+                    W.data(), lamda, nthreads);
+                RowMatrix<double> A = XtX_ref.cast<double>();
+                A.diagonal().array() += lamda;
+                RowMatrix<double> W_ref = A.ldlt().solve(
+                    XtY_ref.cast<double>());
+                auto scale = std::max(1., W_ref.cwiseAbs().maxCoeff());
+                REQUIRE((W.cast<double>() - W_ref).cwiseAbs().maxCoeff()
+                    < 1e-4 * scale);
+            }
+        }
+    }
+}
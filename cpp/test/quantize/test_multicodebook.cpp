@@ -1,7 +1,11 @@
+#include <algorithm>
+#include <random>
+
 
 
 #ifdef BLAZE
     #include "test/external/catch.hpp"
+    #include "src/quantize/hamming_index.hpp"
     #include "src/quantize/multi_codebook.hpp"
     #include "src/external/eigen/Eigen/Dense"
     #include "src/utils/eigen_utils.hpp"
@@ -11,6 +15,7 @@
     #include "test/testing_utils/testing_utils.hpp"
 #else
     #include "catch.hpp"
+    #include "hamming_index.hpp"
     #include "multi_codebook.hpp"
     #include "Dense"
     #include "eigen_utils.hpp"
@@ -216,3 +221,103 @@ TEST_CASE("popcnt", "[mcq][popcount]") {
 
 
 
+
+// rows are noisy copies of a few centers, so that near neighbors are
+// much nearer than random codes and multi-index hashing has work to skip
+template<int NBytes>
+void _test_hamming_index(int nsubstrings) {
+    static constexpr int nwords = NBytes / 8;
+    static constexpr int nrows = 20 * 1000 + 3;
+    static constexpr int ncenters = 50;
+    static constexpr int nqueries = 10;
+    std::mt19937_64 rng(123);
+    RowMatrix<uint64_t> centers(ncenters, nwords);
+    for (int i = 0; i < centers.size(); i++) { centers.data()[i] = rng(); }
+    auto noisy_copy = [&](const uint64_t* center, uint64_t* out) {
+        for (int j = 0; j < nwords; j++) { out[j] = center[j]; }
+        auto nflips = rng() % (2 * nwords + 4);
+        for (size_t f = 0; f < nflips; f++) {
+            auto bit = rng() % (64 * nwords);
+            out[bit / 64] ^= uint64_t(1) << (bit % 64);
+        }
+    };
+    RowMatrix<uint64_t> codes(nrows, nwords);
+    for (int i = 0; i < nrows; i++) {
+        noisy_copy(centers.row(rng() % ncenters).data(), codes.row(i).data());
+    }
+    auto codes_u8 = reinterpret_cast<const uint8_t*>(codes.data());
+    HammingIndex<NBytes> index(codes_u8, nrows, nsubstrings);
+    int total_nbits = 0;
+    for (int j = 0; j < index.nsubstrings(); j++) {
+        total_nbits += index.substring_nbits(j);
+    }
+    REQUIRE(total_nbits == 8 * NBytes);
+
+    RowVector<uint64_t> q(nwords);
+    std::vector<std::pair<int, int64_t> > expected;
+    for (int qi = 0; qi < nqueries; qi++) {
+        // near a center, except for one random query
+        if (qi == 0) {
+            for (int j = 0; j < nwords; j++) { q(j) = rng(); }
+        } else {
+            noisy_copy(centers.row(qi).data(), q.data());
+        }
+        auto q_u8 = reinterpret_cast<const uint8_t*>(q.data());
+        expected.clear();
+        for (int i = 0; i < nrows; i++) {
+            int dist = 0;
+            for (int j = 0; j < nwords; j++) {
+                dist += __builtin_popcountll(codes(i, j) ^ q(j));
+            }
+            expected.emplace_back(dist, i);
+        }
+        std::sort(expected.begin(), expected.end());
+
+        for (auto strategy : {HammingSearchStrategy::Auto,
+                HammingSearchStrategy::MultiIndex, HammingSearchStrategy::Scan})
+        {
+            CAPTURE(NBytes);
+            CAPTURE(index.nsubstrings());
+            CAPTURE(qi);
+            CAPTURE(hamming_search_strategy_name(strategy));
+            // far from everything, so probing alone would take ages
+            if (qi == 0 && strategy == HammingSearchStrategy::MultiIndex) {
+                continue;
+            }
+            for (int k : {1, 10, 100}) {
+                CAPTURE(k);
+                HammingSearchStrategy used;
+                auto res = index.knn(q_u8, k, strategy, &used);
+                REQUIRE(used != HammingSearchStrategy::Auto);
+                if (strategy != HammingSearchStrategy::Auto) {
+                    REQUIRE(used == strategy);
+                }
+                REQUIRE(res.idxs.size() == size_t(k));
+                for (int i = 0; i < k; i++) {
+                    REQUIRE(res.idxs[i] == expected[i].second);
+                    REQUIRE(res.dists[i] == expected[i].first);
+                }
+            }
+            for (int radius : {0, 3, 8 * NBytes / 8}) {
+                CAPTURE(radius);
+                auto res = index.radius_search(q_u8, radius, strategy);
+                size_t nexpected = 0;
+                while (nexpected < expected.size() &&
+                       expected[nexpected].first <= radius) { nexpected++; }
+                REQUIRE(res.idxs.size() == nexpected);
+                for (size_t i = 0; i < nexpected; i++) {
+                    REQUIRE(res.idxs[i] == expected[i].second);
+                    REQUIRE(res.dists[i] == expected[i].first);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("hamming index", "[mcq][popcount][hamming]") {
+    _test_hamming_index<8>(-1);
+    _test_hamming_index<8>(2);   // 32-bit substrings, so hashed tables
+    _test_hamming_index<8>(3);   // uneven substring lengths
+    _test_hamming_index<16>(-1);
+    _test_hamming_index<32>(-1);
+}
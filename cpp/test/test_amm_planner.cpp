@@ -0,0 +1,133 @@
+//
+//  test_amm_planner.cpp
+//  Bolt
+//
+
+#include <cstdio>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/amm_planner.hpp"
+    #include "test/external/catch.hpp"
+#else
+    #include "amm_planner.hpp"
+    #include "catch.hpp"
+#endif
+
+namespace {
+
+// a fresh file from mkstemp that's removed when this goes out of scope,
+// so that concurrent test runs don't write over each other's files
+class TempFile {
+public:
+    explicit TempFile(const char* prefix) {
+        auto path = std::string("/tmp/") + prefix + "_XXXXXX";
+        std::vector<char> buff(path.begin(), path.end());
+        buff.push_back('\0');
+        int fd = mkstemp(buff.data());
+        REQUIRE(fd >= 0);
+        close(fd);
+        _path = buff.data();
+    }
+    ~TempFile() { std::remove(_path.c_str()); }
+    const std::string& str() const { return _path; }
+private:
+    std::string _path;
+};
+
+// cost model fit to exact timings from known coefficients
+AmmCostModel _make_synthetic_cost_model() {
+    AmmCostModel model;
+    std::vector<std::array<int, 3> > shapes {
+        {{1, 512, 10}}, {{64, 512, 10}}, {{10000, 512, 10}},
+        {{1000, 320, 128}}, {{4096, 256, 512}}, {{49284, 27, 2}}};
+    for (const auto& s : shapes) {
+        int N = s[0], D = s[1], M = s[2];
+        model.add_sample(AmmVariant{AmmMethod::ExactGemm, 0}, N, D, M,
+            .01 + 1e-8 * N * D * M);
+        for (int c : {8, 16, 32}) {
+            model.add_sample(AmmVariant{AmmMethod::Mithral, c}, N, D, M,
+                .05 + 1e-7 * N * c + 2e-8 * M * D + 1e-10 * N * M * c);
+        }
+        for (int d : {8, 32}) {
+            model.add_sample(AmmVariant{AmmMethod::Osnap, d}, N, D, M,
+                .02 + 3e-9 * N * D + 1e-8 * N * d * M);
+        }
+    }
+    model.fit();
+    return model;
+}
+
+} // anon namespace
+
+TEST_CASE("amm planner cost model", "[amm][planner]") {
+    auto model = _make_synthetic_cost_model();
+    auto gemm = AmmVariant{AmmMethod::ExactGemm, 0};
+    auto mithral = AmmVariant{AmmMethod::Mithral, 16};
+    auto osnap = AmmVariant{AmmMethod::Osnap, 16};
+
+    // recovers the coefficients, and so interpolates to new shapes / params
+    int N = 5000, D = 400, M = 50;
+    CHECK(model.predict_ms(gemm, N, D, M) ==
+        Approx(.01 + 1e-8 * N * D * M).epsilon(1e-4));
+    CHECK(model.predict_ms(mithral, N, D, M) == Approx(
+        .05 + 1e-7 * N * 16 + 2e-8 * M * D + 1e-10 * N * M * 16).epsilon(1e-4));
+    CHECK(model.predict_ms(osnap, N, D, M) ==
+        Approx(.02 + 3e-9 * N * D + 1e-8 * N * 16 * M).epsilon(1e-4));
+    CHECK(model.predict_ms(AmmVariant{AmmMethod::Bolt, 16}, N, D, M) ==
+        kAmmUnknown);
+
+    SECTION("save / load roundtrip") {
+        TempFile tmp("bolt_test_amm_cost_model");
+        REQUIRE(model.save(tmp.str()));
+        AmmCostModel loaded;
+        REQUIRE(loaded.load(tmp.str()));
+        CHECK(loaded.predict_ms(mithral, N, D, M) ==
+            Approx(model.predict_ms(mithral, N, D, M)));
+    }
+}
+
+TEST_CASE("amm planner respects error budget", "[amm][planner]") {
+    auto model = _make_synthetic_cost_model();
+    AmmPlanner planner(model);
+    planner.add_variant(AmmVariant{AmmMethod::Mithral, 16}, .1);
+    planner.add_variant(AmmVariant{AmmMethod::Mithral, 32}, .05);
+    planner.add_variant(AmmVariant{AmmMethod::Osnap, 32});  // err = .25
+    planner.add_variant(AmmVariant{AmmMethod::Bolt, 16}, .01);  // no timings
+
+    // big enough that the approximate methods win when allowed
+    int N = 100000, D = 512, M = 100;
+    CHECK(planner.plan(N, D, M, 0).variant.method == AmmMethod::ExactGemm);
+    auto p = planner.plan(N, D, M, .07);
+    CHECK(p.variant.method == AmmMethod::Mithral);
+    CHECK(p.variant.param == 32);
+    CHECK(p.expected_rel_err <= .07);
+    p = planner.plan(N, D, M, .5);
+    CHECK(p.predicted_ms <= planner.plan(N, D, M, .07).predicted_ms);
+
+    // uncalibrated methods are never preferred
+    for (const auto& cand : planner.candidates(N, D, M, 1.)) {
+        if (cand.variant.method == AmmMethod::Bolt) {
+            CHECK(cand.predicted_ms == kAmmUnknown);
+        }
+    }
+
+    // run() dispatches to the executor for the chosen method
+    std::array<AmmExecutor, kNumAmmMethods> executors;
+    AmmVariant ran{AmmMethod::ExactGemm, -1};
+    for (auto& e : executors) {
+        e = [&ran](const AmmVariant& v) { ran = v; };
+    }
+    AmmPlan plan;
+    REQUIRE(planner.run(N, D, M, .07, executors, false, &plan) >= 0);
+    CHECK(ran.method == AmmMethod::Mithral);
+    CHECK(ran.param == 32);
+
+    // and falls back to a method it can run if the best one has no executor
+    executors[static_cast<int>(AmmMethod::Mithral)] = nullptr;
+    REQUIRE(planner.run(N, D, M, .07, executors, false, &plan) >= 0);
+    CHECK(ran.method == AmmMethod::ExactGemm);
+}
@@ -13,12 +13,14 @@
     #include "test/external/catch.hpp"
     #include "src/utils/debug_utils.hpp"
     #include "src/utils/eigen_utils.hpp"
+    #include "src/utils/sgemm.hpp"
     #include "test/testing_utils/testing_utils.hpp"
 #else
     #include "avx_utils.hpp"
     #include "catch.hpp"
     #include "debug_utils.hpp"
     #include "eigen_utils.hpp"
+    #include "sgemm.hpp"
     #include "testing_utils.hpp"
 #endif
 
@@ -159,3 +161,138 @@ TEST_CASE("sgemm colmajor", "[utils]") {
     }
 }
 
+TEST_CASE("sgemm packed", "[utils][sgemm]") {
+    // shapes spanning partial micro-tiles and multiple cache blocks
+    std::vector<int> Ns {1, 5, 6, 7, 130, 259};
+    std::vector<int> Ds {1, 3, 256, 300};
+    std::vector<int> Ms {1, 10, 16, 17, 1030};
+    for (auto N : Ns) {
+        for (auto D : Ds) {
+            for (auto M : Ms) {
+                CAPTURE(N);
+                CAPTURE(D);
+                CAPTURE(M);
+                RowMatrix<float> A(N, D); A.setRandom();
+                RowMatrix<float> B(D, M); B.setRandom();
+                RowMatrix<float> C0(N, M); C0.setRandom();
+                RowMatrix<float> ans = A * B;
+                auto tol = 1e-5f * sqrtf(D);
+
+                RowMatrix<float> out(N, M);
+                sgemm_rowmajor(A.data(), B.data(), N, D, M, out.data());
+                REQUIRE(out.isApprox(ans, tol));
+
+                ColMatrix<float> A_c = A, B_c = B, out_c(N, M);
+                sgemm_colmajor_packed(A_c.data(), B_c.data(), N, D, M,
+                                      out_c.data());
+                REQUIRE(out_c.isApprox(ans, tol));
+
+                // transposed and strided operands; A^T is stored row-major,
+                // and C is the left block of a wider matrix
+                RowMatrix<float> At = A.transpose();
+                RowMatrix<float> C_wide(N, M + 3);
+                C_wide.leftCols(M) = C0;
+                for (int nthreads : {1, 3}) {
+                    sgemm(At.data(), B_c.data(), C_wide.data(), N, D, M,
+                          1, N, 1, D, M + 3, 1, true, nthreads);
+                    RowMatrix<float> expected = C0 + ans;
+                    REQUIRE(C_wide.leftCols(M).isApprox(expected, tol));
+                    C0 = expected;
+                }
+            }
+        }
+    }
+    // splitting over threads doesn't change any sums
+    RowMatrix<float> A(1000, 64); A.setRandom();
+    RowMatrix<float> B(64, 700); B.setRandom();
+    RowMatrix<float> out1(1000, 700), out4(1000, 700);
+    sgemm_rowmajor(A.data(), B.data(), 1000, 64, 700, out1.data(), false, 1);
+    sgemm_rowmajor(A.data(), B.data(), 1000, 64, 700, out4.data(), false, 4);
+    REQUIRE(out1 == out4);
+    // D = 0 zeroes the output
+    sgemm_rowmajor(A.data(), B.data(), 1000, 0, 700, out1.data());
+    REQUIRE(out1.isZero());
+}
+
+template<class Backend, int D>
+void _test_xor_popcount_rows() {
+    static constexpr int N = 100 + 3;  // not a multiple of any vector width
+    RowMatrix<uint64_t> A(N, D); A.setRandom();
+    RowVector<uint64_t> q(D); q.setRandom();
+    A.row(5) = q;  // distance 0
+    A.row(7) = q.unaryExpr([](uint64_t x) { return ~x; });  // all differ
+    std::vector<uint16_t> dists(N), same(N);
+    xor_popcount_rows<Backend, D>(A.data(), q.data(), N, dists.data());
+    xor_popcount_rows<Backend, D, true>(A.data(), q.data(), N, same.data());
+    for (int i = 0; i < N; i++) {
+        int ans = 0;
+        for (int j = 0; j < D; j++) {
+            ans += __builtin_popcountll(A(i, j) ^ q(j));
+        }
+        CAPTURE(D);
+        CAPTURE(i);
+        REQUIRE(dists[i] == ans);
+        REQUIRE(same[i] == 64 * D - ans);
+    }
+    REQUIRE(dists[5] == 0);
+    REQUIRE(dists[7] == 64 * D);
+}
+
+template<class Backend>
+void _test_popcount_backend() {
+    _test_xor_popcount_rows<Backend, 1>();
+    _test_xor_popcount_rows<Backend, 2>();
+    _test_xor_popcount_rows<Backend, 4>();
+    _test_xor_popcount_rows<Backend, 8>();
+    _test_xor_popcount_rows<Backend, 16>();
+    _test_xor_popcount_rows<Backend, 32>();
+    _test_xor_popcount_rows<Backend, 128>();
+    // long enough for whole blocks of vectors, plus a ragged tail
+    for (int nwords : {1, 3, 8, 63, 64, 200, 517}) {
+        std::vector<uint64_t> a(nwords), b(nwords);
+        uint64_t ans = 0;
+        for (int j = 0; j < nwords; j++) {
+            a[j] = 0x9E3779B97F4A7C15ull * (j + 1);
+            b[j] = a[j] ^ (~0ull >> (j % 64));
+            ans += 64 - (j % 64);
+        }
+        CAPTURE(nwords);
+        REQUIRE(xor_popcount<Backend>(a.data(), b.data(), nwords) == ans);
+    }
+}
+
+TEST_CASE("popcount backends", "[utils][popcount]") {
+    SECTION("scalar") { _test_popcount_backend<PopcntScalar>(); }
+    SECTION("avx2") { _test_popcount_backend<PopcntAvx2>(); }
+    SECTION("harley-seal") { _test_popcount_backend<PopcntHarleySeal>(); }
+#ifdef __AVX512VPOPCNTDQ__
+    SECTION("avx512") { _test_popcount_backend<PopcntAvx512>(); }
+#endif
+}
+
+TEST_CASE("bgemm", "[utils][popcount]") {
+    // enough rows for several L1-sized chunks
+    static constexpr int N = 3 * 1024 + 5;
+    static constexpr int M = 3;
+    for (int D : {1, 2, 3, 4, 5, 8, 16, 32, 40}) {
+        RowMatrix<uint64_t> A(N, D); A.setRandom();
+        ColMatrix<uint64_t> B(D, M); B.setRandom();
+        ColMatrix<uint16_t> out(N, M);
+        bgemm(A.data(), B.data(), N, D, M, out.data());
+        ColMatrix<uint16_t> out_scalar(N, M);
+        _bgemm<1, 1>(A.data(), B.data(), N, D, M, out_scalar.data());
+        for (int m = 0; m < M; m++) {
+            for (int i = 0; i < N; i++) {
+                int nsame = 0;
+                for (int j = 0; j < D; j++) {
+                    nsame += 64 - __builtin_popcountll(A(i, j) ^ B(j, m));
+                }
+                CAPTURE(D);
+                CAPTURE(i);
+                CAPTURE(m);
+                REQUIRE(out(i, m) == nsame);
+                REQUIRE(out_scalar(i, m) == nsame);
+            }
+        }
+    }
+}
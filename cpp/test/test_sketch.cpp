@@ -0,0 +1,254 @@
+//
+//  test_sketch.cpp
+//  Bolt
+//
+
+#include <vector>
+
+#ifdef BLAZE
+    #include "src/sketch.hpp"
+    #include "src/utils/hadamard.hpp"
+    #include "test/external/catch.hpp"
+    #include "src/utils/eigen_utils.hpp"
+#else
+    #include "sketch.hpp"
+    #include "hadamard.hpp"
+    #include "catch.hpp"
+    #include "eigen_utils.hpp"
+#endif
+
+namespace {
+
+// Sylvester construction of the unnormalized n x n Hadamard matrix
+RowMatrix<float> _hadamard_matrix(int n) {
+    RowMatrix<float> H(1, 1);
+    H(0, 0) = 1;
+    for (int sz = 1; sz < n; sz *= 2) {
+        RowMatrix<float> H2(2 * sz, 2 * sz);
+        H2 << H, H, H, -H;
+        H = H2;
+    }
+    return H;
+}
+
+// mean over rows of ||sketch(x)||^2 / ||x||^2
+template<class SketchT>
+double _mean_sq_norm_ratio(const SketchT& sketch, int N, int D, int d) {
+    ColMatrix<float> A(N, D);
+    A.setRandom();
+    ColMatrix<float> out(N, d);
+    sketch(A, out);
+    auto ratios = out.rowwise().squaredNorm().array() /
+        A.rowwise().squaredNorm().array();
+    return ratios.mean();
+}
+
+} // anon namespace
+
+TEST_CASE("fwht", "[hadamard][sketch]") {
+    for (int n : {1, 2, 4, 8, 16, 32, 64, 128, 512}) {
+        RowVector<float> x(n);
+        x.setRandom();
+        RowVector<float> ans = x * _hadamard_matrix(n);
+        fwht(x.data(), n);
+        CAPTURE(n);
+        REQUIRE(x.isApprox(ans, 1e-5f));
+    }
+    // long enough that the last stages mix L1-sized blocks
+    for (int n : {8 * 1024, 64 * 1024}) {
+        std::vector<float> x(n), ans(n);
+        for (int i = 0; i < n; i++) { x[i] = ans[i] = (i % 13) - 6.f; }
+        _fwht_scalar(ans.data(), n);
+        fwht(x.data(), n);
+        for (int i = 0; i < n; i++) {
+            CAPTURE(n);
+            CAPTURE(i);
+            REQUIRE(x[i] == ans[i]);
+        }
+    }
+}
+
+TEST_CASE("fwht_cols", "[hadamard][sketch]") {
+    for (int n : {1, 2, 4, 16, 64, 2048}) {
+        for (int ncols : {1, 8, 37, 40, 64, 200}) {
+            RowMatrix<float> X(n, ncols);
+            X.setRandom();
+            // transforming columns is transforming rows of the transpose
+            RowMatrix<float> ans = X.transpose();
+            fwht_rows(ans.data(), ncols, n);
+            fwht_cols(X.data(), n, ncols);
+            CAPTURE(n);
+            CAPTURE(ncols);
+            REQUIRE(X.isApprox(ans.transpose(), 1e-5f));
+        }
+    }
+}
+
+TEST_CASE("srht and fastjl sketches", "[hadamard][sketch]") {
+    static constexpr int N = 1000;
+    SECTION("srht without subsampling is a rotation") {
+        for (int D : {8, 27, 100}) {
+            SrhtSketch sketch(D, static_cast<int>(next_pow2(D)));
+            ColMatrix<float> A(N, D);
+            A.setRandom();
+            ColMatrix<float> out(N, sketch.D_pad);
+            sketch(A, out);
+            CAPTURE(D);
+            // inner products, not just norms, are preserved
+            ColMatrix<float> gram = A * A.transpose();
+            ColMatrix<float> sketch_gram = out * out.transpose();
+            REQUIRE(sketch_gram.isApprox(gram, 1e-4f));
+        }
+    }
+    SECTION("norms preserved in expectation") {
+        for (int D : {27, 100, 512}) {
+            for (int d : {16, 64}) {
+                if (d > next_pow2(D)) { continue; }
+                CAPTURE(D);
+                CAPTURE(d);
+                auto srht = _mean_sq_norm_ratio(SrhtSketch(D, d), N, D, d);
+                REQUIRE(std::abs(srht - 1) < .1);
+                // noisier, since every row shares one draw of the
+                // gaussian projection
+                auto fastjl = _mean_sq_norm_ratio(FastJlSketch(D, d), N, D, d);
+                REQUIRE(std::abs(fastjl - 1) < .2);
+            }
+        }
+    }
+}
+
+TEST_CASE("osnap sketch", "[osnap][sketch]") {
+    static constexpr int N = 1000 + 19;  // not a multiple of the tile size
+    for (int D : {27, 100}) {
+        for (int d : {8, 17}) {
+            for (int nsketches : {1, 2, 4}) {
+                CAPTURE(D);
+                CAPTURE(d);
+                CAPTURE(nsketches);
+                OsnapSketch sketch(D, d, nsketches);
+                float scale = 1.f / sqrtf(nsketches);
+
+                // sketch j only writes to its own range of output dims
+                int start_idx = 0;
+                for (int j = 0; j < nsketches; j++) {
+                    int len = d / nsketches + (j < d % nsketches);
+                    for (int i = 0; i < D; i++) {
+                        REQUIRE(sketch.sketch_idxs(i, j) >= start_idx);
+                        REQUIRE(sketch.sketch_idxs(i, j) < start_idx + len);
+                    }
+                    start_idx += len;
+                }
+
+                ColMatrix<float> A(N, D);
+                A.setRandom();
+                ColMatrix<float> ans = ColMatrix<float>::Zero(N, d);
+                osnap_sketch(A, sketch.sketch_idxs, sketch.sketch_signs, ans);
+                if (nsketches == 1) { ans *= scale; }
+                for (int nthreads : {1, 3}) {
+                    ColMatrix<float> out(N, d);
+                    sketch(A, out, false, nthreads);
+                    REQUIRE(out.isApprox(ans, 1e-5f));
+                }
+
+                // transposed input; rows of A are what get combined
+                ColMatrix<float> At = A.transpose();
+                ColMatrix<float> out_t(d, N);
+                sketch(At, out_t, true);
+                REQUIRE(out_t.isApprox(ans.transpose(), 1e-5f));
+
+                // sparse input
+                ColMatrix<float> A_sparse = A;
+                for (int i = 0; i < A.size(); i++) {
+                    if (i % 5 != 0) { A_sparse.data()[i] = 0; }
+                }
+                ColMatrix<float> ans_sparse = ColMatrix<float>::Zero(N, d);
+                osnap_sketch(A_sparse, sketch.sketch_idxs, sketch.sketch_signs,
+                             ans_sparse);
+                if (nsketches == 1) { ans_sparse *= scale; }
+                Eigen::SparseMatrix<float, Eigen::RowMajor> A_csr =
+                    A_sparse.sparseView();
+                RowMatrix<float> out_sparse(N, d);
+                sketch(A_csr, out_sparse, 2);
+                REQUIRE(out_sparse.isApprox(ans_sparse, 1e-5f));
+            }
+        }
+    }
+}
+
+TEST_CASE("frequent directions", "[fd][sketch]") {
+    static constexpr int N = 1000;
+    static constexpr int D = 40;
+    static constexpr int ell = 10;
+    RowMatrix<float> A(N, D);
+    A.setRandom();
+    A.col(3) *= 10;  // a dominant direction
+
+    // add rows in uneven batches
+    auto sketch_of = [&](const RowMatrix<float>& X, int ell, bool background,
+                         double* bound) {
+        FrequentDirections fd(D, ell, background);
+        int64_t i = 0;
+        for (int64_t batch_sz = 1; i < X.rows(); batch_sz = batch_sz * 2 + 1) {
+            auto n = std::min(batch_sz, X.rows() - i);
+            fd.add_rows(X.row(i).data(), n);
+            i += n;
+        }
+        REQUIRE(fd.nrows() == X.rows());
+        *bound = fd.error_bound();
+        return fd.sketch();
+    };
+
+    double bound, bound_fg;
+    RowMatrix<float> B = sketch_of(A, ell, true, &bound);
+    RowMatrix<float> B_fg = sketch_of(A, ell, false, &bound_fg);
+    REQUIRE(B.rows() == ell);
+    REQUIRE(B.isApprox(B_fg));
+    REQUIRE(bound == Approx(bound_fg));
+
+    // AᵀA - BᵀB is PSD with spectral norm within the bounds
+    Eigen::MatrixXd A_d = A.cast<double>();
+    Eigen::MatrixXd B_d = B.cast<double>();
+    Eigen::MatrixXd diff = A_d.transpose() * A_d - B_d.transpose() * B_d;
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(diff);
+    auto frob_sq = A_d.squaredNorm();
+    REQUIRE(eig.eigenvalues().minCoeff() > -1e-4 * frob_sq);
+    REQUIRE(eig.eigenvalues().maxCoeff() <= bound * (1 + 1e-4));
+    REQUIRE(bound <= frob_sq / ell);
+
+    // exact if the rank is less than ell
+    RowMatrix<float> low_rank = RowMatrix<float>::Random(N, 5) *
+        RowMatrix<float>::Random(5, D);
+    RowMatrix<float> B_low = sketch_of(low_rank, ell, true, &bound);
+    RowMatrix<float> gram = low_rank.transpose() * low_rank;
+    RowMatrix<float> sketch_gram = B_low.transpose() * B_low;
+    REQUIRE(sketch_gram.isApprox(gram, 1e-3f));
+}
+
+TEST_CASE("fd amm", "[fd][sketch]") {
+    static constexpr int N = 500;
+    static constexpr int DX = 30;
+    static constexpr int DY = 20;
+    RowMatrix<float> X(N, DX);
+    X.setRandom();
+    RowMatrix<float> Y = X.leftCols(DY) + .5 * RowMatrix<float>::Random(N, DY);
+    RowMatrix<float> XtY = X.transpose() * Y;
+
+    double prev_err = std::numeric_limits<double>::max();
+    for (int ell : {4, 16, 64}) {
+        CAPTURE(ell);
+        FdAmm amm(DX, DY, ell);
+        for (int i = 0; i < N; i += 100) {
+            amm.add_rows(X.row(i).data(), Y.row(i).data(), 100);
+        }
+        RowMatrix<float> approx = amm.product();
+        REQUIRE(approx.rows() == DX);
+        REQUIRE(approx.cols() == DY);
+        Eigen::JacobiSVD<Eigen::MatrixXd> svd((XtY - approx).cast<double>());
+        auto err = svd.singularValues()(0);
+        REQUIRE(err <= amm.error_bound() * (1 + 1e-4) + 1e-3);
+        REQUIRE(err < prev_err);
+        prev_err = err;
+    }
+    // ell > DX + DY, so nothing was ever shrunk away
+    REQUIRE(prev_err < 1e-3 * XtY.norm());
+}
@@ -19,11 +19,13 @@
     #include "test/external/catch.hpp"
     #include "src/utils/eigen_utils.hpp"
     #include "src/utils/memory.hpp"
+    #include "src/utils/perf_counters.hpp"
     #include "src/utils/timing_utils.hpp" // for profiling
 #else
     #include "catch.hpp"
     #include "eigen_utils.hpp"
     #include "memory.hpp"
+    #include "perf_counters.hpp"
     #include "timing_utils.hpp" // for profiling
 #endif
 
@@ -73,6 +75,7 @@ static inline void print_dist_stats(const std::string& name, int64_t N,
         for (int __i = 0; __i < NTRIALS; __i++) {                       \
             double __t = 0;                                             \
             {                                                           \
+                PERF_COUNTERS_SCOPE(NAME);                              \
                 EasyTimer _(__t);                                       \
                 (EXPR);                                                 \
             }                                                           \
@@ -95,6 +98,7 @@ static inline void print_dist_stats(const std::string& name, int64_t N,
             for (int __i = 0; __i < NTRIALS; __i++) {                   \
                 double __t = 0;                                         \
                 {                                                       \
+                    PERF_COUNTERS_SCOPE(NAME);                          \
                     EasyTimer _(__t);                                   \
                     (EXPR);                                             \
                 }                                                       \
@@ -140,11 +144,14 @@ static inline void print_dist_stats(const std::string& name, int64_t N,
             double __t_min = std::numeric_limits<double>::max();        \
             for (int __i = 0; __i < NTRIALS; __i++) {                   \
                 double __t = 0;                                         \
-                auto t0 = timeNow();                                    \
-                for (int i = 0; i < NUM_LOOP_ITERS; i++) {              \
-                    (EXPR);                                             \
+                {                                                       \
+                    PERF_COUNTERS_SCOPE(NAME);                          \
+                    auto t0 = timeNow();                                \
+                    for (int i = 0; i < NUM_LOOP_ITERS; i++) {          \
+                        (EXPR);                                         \
+                    }                                                   \
+                    __t = durationUs(t0, timeNow());                    \
                 }                                                       \
-                __t = durationUs(t0, timeNow());                        \
                 prevent_optimizing_away_dists(DISTS_PTR, NUM_DISTS);    \
                 __t_min = __t < __t_min ? __t : __t_min;                \
             }                                                           \
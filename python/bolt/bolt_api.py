@@ -560,6 +560,17 @@ class Encoder(object):
         elif self.reduction == Reductions.SQUARED_EUCLIDEAN:
             return self._encoder_.knn_l2(self._preproc(q), k)
 
+    def radius(self, q, threshold):
+        """indices of rows within threshold of q; i.e., rows whose squared
+        distance is at most threshold, or whose dot product is at least
+        threshold, depending on the reduction"""
+        if self.reduction == Reductions.DOT_PRODUCT:
+            return self._encoder_.radius_mips(self._preproc(q), threshold)
+        elif self.reduction == Reductions.SQUARED_EUCLIDEAN:
+            return self._encoder_.radius_l2(self._preproc(q), threshold)
+        else:
+            self._bad_reduction()
+
     def _bad_reduction(self):
         raise ValueError("Unreconized reduction '{}'!".format(self.reduction))
 